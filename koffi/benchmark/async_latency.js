@@ -0,0 +1,294 @@
+#!/usr/bin/env node
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+const { spawnSync } = require('child_process');
+const fs = require('fs');
+
+const PERCENTILES = [0.5, 0.99, 0.999];
+
+main();
+
+async function main() {
+    let config = {
+        pools: [0, 2, 8],
+        max_calls: [64, 256],
+        concurrency: [1, 16, 64, 256],
+        duration: 50,
+        mode: 'spin',
+        threads: null,
+        time: 2,
+        json: null,
+        run: null
+    };
+
+    try {
+        for (let i = 2; i < process.argv.length; i++) {
+            let arg = process.argv[i];
+            let value = null;
+
+            if (arg[0] == '-' && arg.includes('=')) {
+                let offset = arg.indexOf('=');
+
+                value = arg.substr(offset + 1);
+                arg = arg.substr(0, offset);
+            }
+
+            let get_value = () => {
+                if (value == null) {
+                    if (i + 1 >= process.argv.length)
+                        throw new Error(`Missing value for ${arg}`);
+                    value = process.argv[++i];
+                }
+                return value;
+            };
+
+            if (arg == '--help') {
+                print_usage();
+                return;
+            } else if (arg == '--pools') {
+                config.pools = parse_list(arg, get_value());
+            } else if (arg == '--max_calls') {
+                config.max_calls = parse_list(arg, get_value());
+            } else if (arg == '--concurrency') {
+                config.concurrency = parse_list(arg, get_value());
+            } else if (arg == '--duration') {
+                config.duration = parse_number(arg, get_value());
+            } else if (arg == '--mode') {
+                config.mode = get_value();
+                if (config.mode != 'spin' && config.mode != 'sleep')
+                    throw new Error(`Unexpected value '${config.mode}' for ${arg}`);
+            } else if (arg == '--threads') {
+                config.threads = parse_number(arg, get_value());
+            } else if (arg == '--time') {
+                config.time = parse_number(arg, get_value());
+            } else if (arg == '--json') {
+                config.json = get_value();
+            } else if (arg == '--run') {
+                config.run = parse_list(arg, get_value());
+                if (config.run.length != 3)
+                    throw new Error(`Expected pools,max_calls,concurrency for ${arg}`);
+            } else {
+                throw new Error(`Unexpected argument '${arg}'`);
+            }
+        }
+
+        if (config.run != null) {
+            let result = await run(config);
+            console.log(JSON.stringify(result));
+        } else {
+            benchmark(config);
+        }
+    } catch (err) {
+        console.error(err);
+        process.exit(1);
+    }
+}
+
+function print_usage() {
+    let help = `Usage: node async_latency.js [options]
+
+Options:
+    --pools <list>               Values of resident_async_pools to test (default: 0,2,8)
+    --max_calls <list>           Values of max_async_calls to test (default: 64,256)
+    --concurrency <list>         Number of calls in flight (default: 1,16,64,256)
+
+    --duration <us>              Duration of each native call (default: 50)
+    --mode <mode>                Wait by spinning (spin) or sleeping (sleep) (default: spin)
+    --threads <count>            Size of the libuv thread pool (default: libuv default)
+
+    --time <sec>                 Run each configuration for this time (default: 2)
+    --json <file>                Save results to JSON file
+
+Latency is measured from the async call to the execution of its callback.
+Combinations where concurrency is above max_async_calls are skipped.`;
+
+    console.log(help);
+}
+
+function parse_number(arg, value) {
+    let number = parseFloat(value);
+
+    if (Number.isNaN(number))
+        throw new Error(`Invalid value for ${arg}`);
+    if (number < 0)
+        throw new Error(`Value for ${arg} must be positive`);
+
+    return number;
+}
+
+function parse_list(arg, value) {
+    return value.split(',').map(part => parse_number(arg, part.trim()));
+}
+
+function benchmark(config) {
+    let env = Object.assign({}, process.env);
+    if (config.threads != null)
+        env.UV_THREADPOOL_SIZE = String(config.threads);
+
+    let results = {
+        date: (new Date).toISOString(),
+        node: process.version,
+        platform: process.platform,
+        arch: process.arch,
+        duration: config.duration,
+        mode: config.mode,
+        threads: config.threads,
+        runs: []
+    };
+
+    console.log(`Async calls of ${config.duration} µs (${config.mode})`);
+    console.log('');
+    console.log('Pools | Max calls | Concurrency | Calls/sec  | p50         | p99         | p999        | Max RSS');
+    console.log('----- | --------- | ----------- | ---------- | ----------- | ----------- | ----------- | --------');
+
+    for (let pools of config.pools) {
+        for (let max_calls of config.max_calls) {
+            if (max_calls < pools)
+                continue;
+
+            for (let concurrency of config.concurrency) {
+                if (concurrency > max_calls)
+                    continue;
+
+                let args = [
+                    __filename,
+                    '--run', [pools, max_calls, concurrency].join(','),
+                    '--duration', String(config.duration),
+                    '--mode', config.mode,
+                    '--time', String(config.time)
+                ];
+                let proc = spawnSync(process.execPath, args, { env: env });
+
+                if (proc.status == null)
+                    throw new Error(proc.error);
+                if (proc.status !== 0)
+                    throw new Error(proc.stderr);
+
+                let result = JSON.parse(proc.stdout);
+                results.runs.push(result);
+
+                let percentiles = PERCENTILES.map(p => format_time(result.latency[p]).padEnd(11, ' '));
+
+                console.log(`${String(pools).padEnd(5, ' ')} | ${String(max_calls).padEnd(9, ' ')} | ${String(concurrency).padEnd(11, ' ')} | ` +
+                            `${String(Math.round(result.throughput)).padEnd(10, ' ')} | ${percentiles.join(' | ')} | ` +
+                            `${(result.max_rss / 1024).toFixed(1)} MiB`);
+            }
+        }
+    }
+
+    console.log('');
+
+    if (config.json != null) {
+        let json = JSON.stringify(results, null, 4);
+        fs.writeFileSync(config.json, json);
+    }
+}
+
+function format_time(time) {
+    if (time >= 1000) {
+        return (time / 1000).toFixed(2) + ' ms';
+    } else {
+        return time.toFixed(1) + ' µs';
+    }
+}
+
+async function run(config) {
+    const koffi = require('./build/koffi.node');
+
+    let [pools, max_calls, concurrency] = config.run;
+
+    koffi.config({
+        resident_async_pools: pools,
+        max_async_calls: max_calls
+    });
+
+    let lib = koffi.load(__dirname + '/build/misc' + koffi.extension);
+    let wait = lib.func(config.mode == 'sleep' ? 'void SleepFor(int us)' : 'void SpinFor(int us)');
+
+    let perf = await drive(wait, config.duration, concurrency, config.time * 1000);
+
+    let latencies = Float64Array.from(perf.latencies).sort();
+    let usage = process.resourceUsage();
+
+    let result = {
+        pools: pools,
+        max_calls: max_calls,
+        concurrency: concurrency,
+        iterations: perf.iterations,
+        time: Math.round(perf.time),
+        throughput: perf.iterations / (perf.time / 1000),
+        latency: {},
+        histogram: {},
+        max_rss: usage.maxRSS
+    };
+
+    for (let p of PERCENTILES) {
+        let idx = Math.min(Math.floor(p * latencies.length), latencies.length - 1);
+        result.latency[p] = latencies[idx];
+    }
+    result.latency.max = latencies[latencies.length - 1];
+
+    // Power-of-two buckets, in microseconds
+    for (let latency of latencies) {
+        let bucket = 2 ** Math.max(0, Math.ceil(Math.log2(latency)));
+        result.histogram[bucket] = (result.histogram[bucket] || 0) + 1;
+    }
+
+    return result;
+}
+
+// Keep concurrency calls in flight until the time is up, and record
+// the latency of each call in microseconds
+function drive(wait, duration, concurrency, time) {
+    return new Promise((resolve, reject) => {
+        let start = performance.now();
+        let iterations = 0;
+        let pending = 0;
+        let latencies = [];
+        let failed = false;
+
+        let next = () => {
+            let enqueue = performance.now();
+
+            pending++;
+
+            wait.async(duration, (err, res) => {
+                let now = performance.now();
+
+                pending--;
+
+                if (failed)
+                    return;
+                if (err != null) {
+                    failed = true;
+                    reject(err);
+                    return;
+                }
+
+                latencies.push((now - enqueue) * 1000);
+                iterations++;
+
+                if (now - start < time) {
+                    next();
+                } else if (!pending) {
+                    resolve({ iterations: iterations, time: now - start, latencies: latencies });
+                }
+            });
+        };
+
+        for (let i = 0; i < concurrency; i++)
+            next();
+    });
+}
@@ -18,28 +18,213 @@ const fs = require('fs');
 const path = require('path');
 const minimatch = require('minimatch');
 
+// Cases implemented by micro_koffi.js and micro_napi.js (passed as first argument)
+const MICRO_CASES = [
+    'struct_small',
+    'struct_hfa',
+    'struct_large',
+    'struct_return',
+    'out_param',
+    'string_utf8',
+    'string_utf16',
+    'pointer',
+    'array',
+    'typed_array',
+    'callback_transient',
+    'callback_registered',
+    'variadic',
+    'async'
+];
+
+// Cases implemented by callbacks_koffi.js and callbacks_napi.js
+const CALLBACK_CASES = [
+    { key: 'qsort', unit: 'ms' },
+    { key: 'loop', unit: 'us' },
+    { key: 'struct', unit: 'us' }
+];
+
+// Cases implemented by sqlite_koffi.js, sqlite_koffi_async.js and sqlite_napi.js
+const SQLITE_CASES = ['insert', 'select'];
+
+// Additional columns, based on the extra values reported by the sqlite tests
+const SQLITE_COLUMNS = [
+    { title: 'Rows/sec', value: test => String(Math.round(test.iterations / (test.time / 1000))) },
+    { title: 'GC runs/100k rows', value: test => (test.extra.gc / test.iterations * 100000).toFixed(1) },
+    { title: 'Allocations/row', value: test => test.extra.allocations.toFixed(2) }
+];
+
+const BENCHMARKS = [
+    { name: 'rand', group: 'rand', args: [], ref: 'rand_napi', unit: 'ns' },
+    { name: 'atoi', group: 'atoi', args: [], ref: 'atoi_napi', unit: 'ns' },
+    { name: 'raylib', group: 'raylib', args: [], ref: 'raylib_node_raylib', unit: 'us' },
+    ...MICRO_CASES.map(key => ({ name: 'micro.' + key, group: 'micro', args: [key], ref: 'micro_napi', unit: 'ns' })),
+    ...CALLBACK_CASES.map(c => ({ name: 'callbacks.' + c.key, group: 'callbacks', args: [c.key], ref: 'callbacks_napi', unit: c.unit })),
+    ...SQLITE_CASES.map(key => ({ name: 'sqlite.' + key, group: 'sqlite', args: [key], ref: 'sqlite_napi', unit: 'ns', columns: SQLITE_COLUMNS }))
+];
+
 main();
 
 function main() {
+    let config = {
+        select: [],
+        time: null,
+        json: null,
+        compare: null,
+        threshold: 10
+    };
+
     try {
-        let select = process.argv.slice(2);
-        benchmark(select);
+        for (let i = 2; i < process.argv.length; i++) {
+            let arg = process.argv[i];
+            let value = null;
+
+            if (arg[0] == '-' && arg.includes('=')) {
+                let offset = arg.indexOf('=');
+
+                value = arg.substr(offset + 1);
+                arg = arg.substr(0, offset);
+            }
+
+            let get_value = () => {
+                if (value == null) {
+                    if (i + 1 >= process.argv.length)
+                        throw new Error(`Missing value for ${arg}`);
+                    value = process.argv[++i];
+                }
+                return value;
+            };
+
+            if (arg == '--help') {
+                print_usage();
+                return;
+            } else if (arg == '--time') {
+                config.time = parse_number(arg, get_value());
+            } else if (arg == '--json') {
+                config.json = get_value();
+            } else if (arg == '--compare') {
+                config.compare = get_value();
+            } else if (arg == '--threshold') {
+                config.threshold = parse_number(arg, get_value());
+            } else if (arg[0] == '-') {
+                throw new Error(`Unexpected argument '${arg}'`);
+            } else {
+                config.select.push(arg);
+            }
+        }
+
+        let regressions = benchmark(config);
+
+        if (regressions.length) {
+            console.log(`Performance regressions (threshold = ${config.threshold}%):`);
+            for (let regression of regressions)
+                console.log(`  - ${regression}`);
+
+            process.exit(2);
+        }
     } catch (err) {
         console.error(err);
         process.exit(1);
     }
 }
 
-function benchmark(select) {
-    if (!select.length || select.includes('rand'))
-        format(run('rand', 'rand_napi'), 'ns');
-    if (!select.length || select.includes('atoi'))
-        format(run('atoi', 'atoi_napi'), 'ns');
-    if (!select.length || select.includes('raylib'))
-        format(run('raylib', 'raylib_node_raylib'), 'us');
+function print_usage() {
+    let help = `Usage: node benchmark.js [options] [benchmark...]
+
+Benchmarks: ${BENCHMARKS.map(bench => bench.name).join(', ')}
+            Use a group name (e.g. micro, callbacks, sqlite) to run all the benchmarks in this group
+
+Options:
+    --time <sec>                 Run each test for this time (default: 5)
+
+    --json <file>                Save results to JSON file
+    --compare <file>             Compare results to baseline JSON file
+    --threshold <percent>        Report slowdowns above this value as regressions (default: 10)
+
+Regressions are detected by comparing the performance relative to the reference
+implementation, and they make the process exit with code 2.`;
+
+    console.log(help);
+}
+
+function parse_number(arg, value) {
+    let number = parseFloat(value);
+
+    if (Number.isNaN(number))
+        throw new Error(`Invalid value for ${arg}`);
+    if (number < 0)
+        throw new Error(`Value for ${arg} must be positive`);
+
+    return number;
+}
+
+function benchmark(config) {
+    let baseline = null;
+    let results = {
+        date: (new Date).toISOString(),
+        node: process.version,
+        platform: process.platform,
+        arch: process.arch,
+        benchmarks: {}
+    };
+    let regressions = [];
+
+    if (config.compare != null) {
+        let json = fs.readFileSync(config.compare, { encoding: 'utf-8' });
+        baseline = JSON.parse(json).benchmarks;
+    }
+
+    for (let bench of BENCHMARKS) {
+        if (config.select.length && !config.select.includes(bench.name) &&
+                                    !config.select.includes(bench.group))
+            continue;
+
+        let args = bench.args.slice();
+        if (config.time != null)
+            args.push(config.time);
+
+        let tests = run(bench.group, args, bench.ref);
+        let previous = (baseline != null) ? baseline[bench.name] : null;
+
+        if (previous != null) {
+            for (let test of tests) {
+                let prev = previous.tests[test.name];
+
+                if (prev == null || test.name == bench.ref)
+                    continue;
+
+                test.change = Math.round((prev.ratio / test.ratio - 1) * 100);
+
+                if (test.change > config.threshold)
+                    regressions.push(`${bench.name}: ${test.name} is ${test.change}% slower`);
+            }
+        }
+
+        console.log(bench.name);
+        format(tests, bench, previous != null);
+
+        results.benchmarks[bench.name] = {
+            ref: bench.ref,
+            unit: bench.unit,
+            tests: tests.reduce((obj, test) => {
+                obj[test.name] = Object.assign({
+                    iterations: test.iterations,
+                    time: test.time,
+                    ratio: test.ratio
+                }, test.extra);
+                return obj;
+            }, {})
+        };
+    }
+
+    if (config.json != null) {
+        let json = JSON.stringify(results, null, 4);
+        fs.writeFileSync(config.json, json);
+    }
+
+    return regressions;
 }
 
-function run(name, ref) {
+function run(name, args, ref) {
     let tests = [];
     {
         let entries = fs.readdirSync(__dirname);
@@ -65,7 +250,7 @@ function run(name, ref) {
         throw new Error('Failed to find reference test');
 
     for (let test of tests) {
-        let proc = spawnSync(process.execPath, [test.filename]);
+        let proc = spawnSync(process.execPath, [test.filename, ...args.map(arg => String(arg))]);
 
         if (proc.status == null)
             throw new Error(proc.error);
@@ -76,6 +261,11 @@ function run(name, ref) {
 
         test.iterations = perf.iterations;
         test.time = perf.time;
+
+        // Some tests report additional values (such as GC runs)
+        test.extra = Object.assign({}, perf);
+        delete test.extra.iterations;
+        delete test.extra.time;
     }
 
     for (let test of tests) {
@@ -93,26 +283,36 @@ function run(name, ref) {
     return tests;
 }
 
-function format(tests, unit) {
-    let len0 = tests.reduce((acc, test) => Math.max(acc, test.name.length), 0);
+function format(tests, bench, compare) {
+    let columns = [
+        { title: 'Benchmark', value: test => test.name },
+        { title: 'Iteration time', value: test => format_time(test.time / test.iterations, bench.unit) },
+        { title: 'Relative performance', value: test => 'x' + test.ratio.toFixed(test.ratio < 0.01 ? 3 : 2) },
+        { title: 'Overhead', value: test => (typeof test.overhead == 'number') ? format_percent(test.overhead) : test.overhead },
+        ...(bench.columns || [])
+    ];
+    if (compare)
+        columns.push({ title: 'Change', value: test => (typeof test.change == 'number') ? format_percent(test.change) : '' });
 
-    console.log(`${'Benchmark'.padEnd(len0, ' ')} | Iteration time | Relative performance | Overhead`);
-    console.log(`${'-'.padEnd(len0, '-')} | -------------- | -------------------- | --------`);
-    for (let test of tests) {
-        let time = format_time(test.time / test.iterations, unit);
-        let ratio = test.ratio.toFixed(test.ratio < 0.01 ? 3 : 2);
-        let overhead = (typeof test.overhead == 'number') ? `${test.overhead >= 0 ? '+' : ''}${test.overhead}%` : test.overhead;
+    let rows = tests.map(test => columns.map(col => col.value(test)));
+    let widths = columns.map((col, idx) => rows.reduce((acc, row) => Math.max(acc, row[idx].length), col.title.length));
 
-        console.log(`${test.name.padEnd(len0, ' ')} | ${('' + time).padEnd(14, ' ')} | x${('' + ratio).padEnd(19, ' ')} | ${overhead}`);
-    }
+    console.log(columns.map((col, idx) => col.title.padEnd(widths[idx], ' ')).join(' | ').trimEnd());
+    console.log(widths.map(width => '-'.padEnd(width, '-')).join(' | '));
+    for (let row of rows)
+        console.log(row.map((value, idx) => value.padEnd(widths[idx], ' ')).join(' | ').trimEnd());
 
     console.log('');
 }
 
+function format_percent(value) {
+    return `${value >= 0 ? '+' : ''}${value}%`;
+}
+
 function format_time(time, unit) {
     switch (unit) {
         case 'ms': { return (time * 1).toFixed(1) + ' ms'; } break;
         case 'us': { return (time * 1000).toFixed(1) + ' µs'; } break;
-        case 'ns': { return (time * 10000000).toFixed(0) + ' ns'; } break;
+        case 'ns': { return (time * 1000000).toFixed(0) + ' ns'; } break;
     }
 }
@@ -0,0 +1,63 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#include <stdlib.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+    #define EXPORT __declspec(dllexport)
+#else
+    #define EXPORT __attribute__((visibility("default")))
+#endif
+
+// Keep in sync with callbacks_napi.cc and callbacks_koffi.js
+
+typedef struct Vec2 {
+    double x;
+    double y;
+} Vec2;
+
+// Benchmarks are single-threaded, no need for anything fancy
+static int (*sort_func)(int a, int b);
+
+static int CompareInts(const void *ptr1, const void *ptr2)
+{
+    return sort_func(*(const int *)ptr1, *(const int *)ptr2);
+}
+
+// The comparator gets the values directly, because Koffi cannot dereference
+// the pointers given to a JS callback.
+EXPORT void SortInts(int *values, size_t len, int (*func)(int a, int b))
+{
+    sort_func = func;
+    qsort(values, len, sizeof(*values), CompareInts);
+}
+
+EXPORT int RepeatCallback(int (*func)(int), int count)
+{
+    int sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += func(i);
+    }
+    return sum;
+}
+
+EXPORT double ApplyVec2(double (*func)(Vec2 v), int count)
+{
+    double sum = 0.0;
+    for (int i = 0; i < count; i++) {
+        Vec2 v = { (double)i, (double)(i * 2) };
+        sum += func(v);
+    }
+    return sum;
+}
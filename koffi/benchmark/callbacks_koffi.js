@@ -0,0 +1,104 @@
+#!/usr/bin/env node
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+const koffi = require('./build/koffi.node');
+
+const Vec2 = koffi.struct('Vec2', {
+    x: 'double',
+    y: 'double'
+});
+
+const SortCallback = koffi.callback('int SortCallback(int a, int b)');
+const IntCallback = koffi.callback('int IntCallback(int value)');
+const Vec2Callback = koffi.callback('double Vec2Callback(Vec2 v)');
+
+// Keep in sync with callbacks_napi.js
+const CASES = {
+    qsort: lib => {
+        const SortInts = lib.func('void SortInts(_Inout_ int *values, size_t len, SortCallback *func)');
+
+        let values = make_values(1000000);
+        let copy = new Int32Array(values.length);
+
+        return () => {
+            copy.set(values);
+            SortInts(copy, copy.length, (a, b) => a - b);
+            return copy[0];
+        };
+    },
+
+    loop: lib => {
+        const RepeatCallback = lib.func('int RepeatCallback(IntCallback *func, int count)');
+
+        let func = koffi.register(value => value + 1, koffi.pointer(IntCallback));
+        return () => RepeatCallback(func, 1000);
+    },
+
+    struct: lib => {
+        const ApplyVec2 = lib.func('double ApplyVec2(Vec2Callback *func, int count)');
+        return () => ApplyVec2(v => v.x + v.y, 1000);
+    }
+};
+
+let sum = 0;
+
+main();
+
+function main() {
+    if (process.argv.length < 3)
+        throw new Error('Missing benchmark case');
+
+    let name = process.argv[2];
+    let time = 5000;
+
+    if (process.argv.length >= 4) {
+        time = parseFloat(process.argv[3]) * 1000;
+        if (Number.isNaN(time))
+            throw new Error('Not a valid number');
+        if (time < 0)
+            throw new Error('Time must be positive');
+    }
+
+    let prepare = CASES[name];
+    if (prepare == null)
+        throw new Error(`Unknown benchmark case '${name}'`);
+
+    let lib = koffi.load(__dirname + '/build/callbacks' + koffi.extension);
+    let func = prepare(lib);
+
+    let start = performance.now();
+    let iterations = 0;
+
+    do {
+        sum += func();
+        iterations++;
+    } while (performance.now() - start < time);
+
+    time = performance.now() - start;
+    console.log(JSON.stringify({ iterations: iterations, time: Math.round(time) }));
+}
+
+// Same pseudo-random sequence in every implementation
+function make_values(len) {
+    let values = new Int32Array(len);
+    let seed = 42;
+
+    for (let i = 0; i < len; i++) {
+        seed = (Math.imul(seed, 1103515245) + 12345) & 0x7FFFFFFF;
+        values[i] = seed;
+    }
+
+    return values;
+}
@@ -0,0 +1,211 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#include "vendor/libcc/libcc.hh"
+#include <napi.h>
+
+// Implemented in callbacks.c, which is built as a separate shared library
+extern "C" {
+    struct Vec2 {
+        double x;
+        double y;
+    };
+
+    void SortInts(int *values, size_t len, int (*func)(int a, int b));
+    int RepeatCallback(int (*func)(int), int count);
+    double ApplyVec2(double (*func)(Vec2 v), int count);
+}
+
+namespace RG {
+
+template <typename T, typename... Args>
+void ThrowError(Napi::Env env, const char *msg, Args... args)
+{
+    char buf[1024];
+    Fmt(buf, msg, args...);
+
+    auto err = T::New(env, buf);
+    err.ThrowAsJavaScriptException();
+}
+
+// Transient callbacks: the JS function is only valid while the C function runs
+static RG_THREAD_LOCAL napi_env transient_env;
+static RG_THREAD_LOCAL napi_value transient_func;
+
+// Registered callback: kept alive by a reference, until UnregisterCallback()
+static napi_env registered_env;
+static napi_ref registered_ref;
+
+static int RelayCompare(int a, int b)
+{
+    Napi::Env env(transient_env);
+    Napi::Function func(transient_env, transient_func);
+
+    Napi::Value ret = func.Call({ Napi::Number::New(env, a), Napi::Number::New(env, b) });
+    return ret.As<Napi::Number>().Int32Value();
+}
+
+static int RelayRegistered(int value)
+{
+    Napi::Env env(registered_env);
+
+    napi_value func;
+    napi_get_reference_value(env, registered_ref, &func);
+
+    Napi::Value ret = Napi::Function(env, func).Call({ Napi::Number::New(env, value) });
+    return ret.As<Napi::Number>().Int32Value();
+}
+
+static double RelayVec2(::Vec2 v)
+{
+    Napi::Env env(transient_env);
+    Napi::Function func(transient_env, transient_func);
+
+    Napi::Object obj = Napi::Object::New(env);
+
+    obj.Set("x", Napi::Number::New(env, v.x));
+    obj.Set("y", Napi::Number::New(env, v.y));
+
+    Napi::Value ret = func.Call({ obj });
+    return ret.As<Napi::Number>().DoubleValue();
+}
+
+static Napi::Value RunSortInts(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (RG_UNLIKELY(info.Length() < 2)) {
+        ThrowError<Napi::TypeError>(env, "Expected 2 arguments, got %1", info.Length());
+        return env.Null();
+    }
+    if (RG_UNLIKELY(!info[0].IsTypedArray() ||
+                    info[0].As<Napi::TypedArray>().TypedArrayType() != napi_int32_array)) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for values, expected Int32Array");
+        return env.Null();
+    }
+    if (RG_UNLIKELY(!info[1].IsFunction())) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for func, expected function");
+        return env.Null();
+    }
+
+    Napi::Int32Array values = info[0].As<Napi::Int32Array>();
+
+    transient_env = env;
+    transient_func = info[1];
+
+    SortInts(values.Data(), values.ElementLength(), RelayCompare);
+
+    return env.Undefined();
+}
+
+static Napi::Value RunRegisterCallback(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (RG_UNLIKELY(info.Length() < 1)) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
+        return env.Null();
+    }
+    if (RG_UNLIKELY(!info[0].IsFunction())) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for func, expected function");
+        return env.Null();
+    }
+    if (RG_UNLIKELY(registered_ref)) {
+        ThrowError<Napi::Error>(env, "Callback is already registered");
+        return env.Null();
+    }
+
+    registered_env = env;
+    napi_create_reference(env, info[0], 1, &registered_ref);
+
+    return env.Undefined();
+}
+
+static Napi::Value RunUnregisterCallback(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (registered_ref) {
+        napi_delete_reference(env, registered_ref);
+        registered_ref = nullptr;
+    }
+
+    return env.Undefined();
+}
+
+static Napi::Value RunRepeatRegistered(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (RG_UNLIKELY(info.Length() < 1)) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
+        return env.Null();
+    }
+    if (RG_UNLIKELY(!info[0].IsNumber())) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for count, expected number");
+        return env.Null();
+    }
+    if (RG_UNLIKELY(!registered_ref)) {
+        ThrowError<Napi::Error>(env, "No callback is registered");
+        return env.Null();
+    }
+
+    int count = info[0].As<Napi::Number>().Int32Value();
+    int ret = RepeatCallback(RelayRegistered, count);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunApplyVec2(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (RG_UNLIKELY(info.Length() < 2)) {
+        ThrowError<Napi::TypeError>(env, "Expected 2 arguments, got %1", info.Length());
+        return env.Null();
+    }
+    if (RG_UNLIKELY(!info[0].IsFunction())) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for func, expected function");
+        return env.Null();
+    }
+    if (RG_UNLIKELY(!info[1].IsNumber())) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for count, expected number");
+        return env.Null();
+    }
+
+    int count = info[1].As<Napi::Number>().Int32Value();
+
+    transient_env = env;
+    transient_func = info[0];
+
+    double ret = ApplyVec2(RelayVec2, count);
+
+    return Napi::Number::New(env, ret);
+}
+
+}
+
+static Napi::Object InitModule(Napi::Env env, Napi::Object exports)
+{
+    using namespace RG;
+
+    exports.Set("sortInts", Napi::Function::New(env, RunSortInts));
+    exports.Set("registerCallback", Napi::Function::New(env, RunRegisterCallback));
+    exports.Set("unregisterCallback", Napi::Function::New(env, RunUnregisterCallback));
+    exports.Set("repeatRegistered", Napi::Function::New(env, RunRepeatRegistered));
+    exports.Set("applyVec2", Napi::Function::New(env, RunApplyVec2));
+
+    return exports;
+}
+
+NODE_API_MODULE(koffi, InitModule);
@@ -0,0 +1,225 @@
+#!/usr/bin/env node
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+const { spawnSync } = require('child_process');
+const fs = require('fs');
+
+// Same cases as the micro benchmarks, see benchmark.js
+const CASES = [
+    'struct_small',
+    'struct_hfa',
+    'struct_large',
+    'struct_return',
+    'out_param',
+    'string_utf8',
+    'string_utf16',
+    'pointer',
+    'array',
+    'typed_array',
+    'callback_transient',
+    'callback_registered',
+    'variadic',
+    'async'
+];
+
+const COUNTERS = {
+    // Hardware counters, fast but needs a PMU (real or virtualized)
+    perf: {
+        command: (args, output) => ['perf', 'stat', '-x', ',', '-o', output, '-e', 'instructions:u', '--', ...args],
+        parse: text => {
+            let line = text.split('\n').find(line => line.includes('instructions'));
+            if (line == null)
+                return null;
+
+            let value = parseInt(line.split(',')[0], 10);
+            return Number.isNaN(value) ? null : value;
+        }
+    },
+
+    // Instrumentation with Valgrind, slow but exact and available on emulated machines
+    lackey: {
+        command: (args, output) => ['valgrind', '--tool=lackey', '--basic-counts=yes', `--log-file=${output}`, ...args],
+        parse: text => {
+            let m = text.match(/guest instrs:\s+([0-9,]+)/);
+            return (m != null) ? parseInt(m[1].replaceAll(',', ''), 10) : null;
+        }
+    }
+};
+
+main();
+
+function main() {
+    let config = {
+        counter: 'perf',
+        iterations: 20000,
+        cases: CASES,
+        napi: false,
+        json: null
+    };
+
+    try {
+        for (let i = 2; i < process.argv.length; i++) {
+            let arg = process.argv[i];
+            let value = null;
+
+            if (arg[0] == '-' && arg.includes('=')) {
+                let offset = arg.indexOf('=');
+
+                value = arg.substr(offset + 1);
+                arg = arg.substr(0, offset);
+            }
+
+            let get_value = () => {
+                if (value == null) {
+                    if (i + 1 >= process.argv.length)
+                        throw new Error(`Missing value for ${arg}`);
+                    value = process.argv[++i];
+                }
+                return value;
+            };
+
+            if (arg == '--help') {
+                print_usage();
+                return;
+            } else if (arg == '--counter') {
+                config.counter = get_value();
+                if (!COUNTERS.hasOwnProperty(config.counter))
+                    throw new Error(`Unexpected value '${config.counter}' for ${arg}`);
+            } else if (arg == '--iterations') {
+                config.iterations = parseInt(get_value(), 10);
+                if (Number.isNaN(config.iterations) || config.iterations <= 0)
+                    throw new Error(`Invalid value for ${arg}`);
+            } else if (arg == '--napi') {
+                config.napi = true;
+            } else if (arg == '--json') {
+                config.json = get_value();
+            } else if (arg[0] == '-') {
+                throw new Error(`Unexpected argument '${arg}'`);
+            } else {
+                if (config.cases === CASES)
+                    config.cases = [];
+                if (!CASES.includes(arg))
+                    throw new Error(`Unknown case '${arg}'`);
+
+                config.cases.push(arg);
+            }
+        }
+
+        count(config);
+    } catch (err) {
+        console.error(err);
+        process.exit(1);
+    }
+}
+
+function print_usage() {
+    let help = `Usage: node instructions.js [options] [cases...]
+
+Options:
+    --counter <counter>          Use perf (hardware counters) or lackey (Valgrind)
+                                 (default: perf)
+    --iterations <count>         Number of calls for each case (default: 20000)
+    --napi                       Count the N-API reference implementation too
+
+    --json <file>                Save results to JSON file (use - for standard output)
+
+Each case runs twice, without calls and with the given number of calls, and the
+difference is divided by the number of calls to get the count per call.`;
+
+    console.log(help);
+}
+
+function count(config) {
+    let counter = COUNTERS[config.counter];
+    let quiet = (config.json == '-');
+
+    let implementations = ['koffi'];
+    if (config.napi)
+        implementations.push('napi');
+
+    let results = {
+        date: (new Date).toISOString(),
+        node: process.version,
+        platform: process.platform,
+        arch: process.arch,
+        counter: config.counter,
+        iterations: config.iterations,
+        cases: {}
+    };
+
+    if (!quiet) {
+        console.log(`Instructions per call (${config.counter}, ${config.iterations} calls)`);
+        console.log('');
+        console.log('Case                 | ' + implementations.map(impl => impl.padEnd(10, ' ')).join(' | '));
+        console.log('-------------------- | ' + implementations.map(impl => '----------').join(' | '));
+    }
+
+    for (let name of config.cases) {
+        let counts = {};
+
+        for (let impl of implementations) {
+            let filename = `${__dirname}/micro_${impl}.js`;
+
+            let base = run(counter, [process.execPath, filename, name, '0', '0']);
+            let total = run(counter, [process.execPath, filename, name, '0', String(config.iterations)]);
+
+            counts[impl] = Math.max(total - base, 0) / config.iterations;
+        }
+
+        results.cases[name] = counts;
+
+        if (!quiet) {
+            let values = implementations.map(impl => String(Math.round(counts[impl])).padEnd(10, ' '));
+            console.log(`${name.padEnd(20, ' ')} | ${values.join(' | ')}`);
+        }
+    }
+
+    if (!quiet)
+        console.log('');
+
+    if (config.json != null) {
+        let json = JSON.stringify(results, null, 4);
+
+        if (quiet) {
+            console.log(json);
+        } else {
+            fs.writeFileSync(config.json, json);
+        }
+    }
+}
+
+function run(counter, args) {
+    let output = `${__dirname}/build/instructions_${process.pid}.txt`;
+    let cmd = counter.command(args, output);
+
+    try {
+        let proc = spawnSync(cmd[0], cmd.slice(1));
+
+        if (proc.status == null)
+            throw new Error(proc.error);
+        if (proc.status !== 0)
+            throw new Error(proc.stderr);
+
+        let text = fs.readFileSync(output, { encoding: 'utf-8' });
+        let value = counter.parse(text);
+
+        if (value == null)
+            throw new Error(`Failed to get instruction count from ${cmd[0]}:\n${text}`);
+
+        return value;
+    } finally {
+        fs.rmSync(output, { force: true });
+    }
+}
@@ -0,0 +1,142 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+
+#ifdef _WIN32
+    #define EXPORT __declspec(dllexport)
+#else
+    #define EXPORT __attribute__((visibility("default")))
+#endif
+
+// Keep in sync with micro_napi.cc and micro_koffi.js
+
+typedef struct SmallStruct {
+    int32_t a;
+    int32_t b;
+    int32_t c;
+} SmallStruct;
+
+typedef struct HfaStruct {
+    float x;
+    float y;
+    float z;
+    float w;
+} HfaStruct;
+
+typedef struct LargeStruct {
+    int64_t values[16];
+} LargeStruct;
+
+typedef struct Counter {
+    int value;
+} Counter;
+
+EXPORT int SumSmall(SmallStruct s)
+{
+    return s.a + s.b + s.c;
+}
+
+EXPORT float SumHfa(HfaStruct s)
+{
+    return s.x + s.y + s.z + s.w;
+}
+
+EXPORT int64_t SumLarge(LargeStruct s)
+{
+    int64_t sum = 0;
+    for (int i = 0; i < 16; i++) {
+        sum += s.values[i];
+    }
+    return sum;
+}
+
+EXPORT SmallStruct MakeSmall(int a, int b, int c)
+{
+    SmallStruct s = { a, b, c };
+    return s;
+}
+
+EXPORT void DivMod(int a, int b, int *out_quot, int *out_rem)
+{
+    *out_quot = a / b;
+    *out_rem = a % b;
+}
+
+EXPORT size_t Length8(const char *str)
+{
+    return strlen(str);
+}
+
+EXPORT size_t Length16(const uint16_t *str)
+{
+    size_t len = 0;
+    while (str[len]) {
+        len++;
+    }
+    return len;
+}
+
+EXPORT Counter *CreateCounter(int value)
+{
+    Counter *counter = (Counter *)malloc(sizeof(Counter));
+    counter->value = value;
+    return counter;
+}
+
+EXPORT int IncrementCounter(Counter *counter)
+{
+    return ++counter->value;
+}
+
+EXPORT void DeleteCounter(Counter *counter)
+{
+    free(counter);
+}
+
+EXPORT int SumInts(const int *values, int len)
+{
+    int sum = 0;
+    for (int i = 0; i < len; i++) {
+        sum += values[i];
+    }
+    return sum;
+}
+
+EXPORT int CallIntCallback(int (*func)(int), int value)
+{
+    return func(value);
+}
+
+EXPORT int SumVariadic(int count, ...)
+{
+    va_list ap;
+    va_start(ap, count);
+
+    int sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += va_arg(ap, int);
+    }
+
+    va_end(ap);
+
+    return sum;
+}
+
+EXPORT int AddInts(int a, int b)
+{
+    return a + b;
+}
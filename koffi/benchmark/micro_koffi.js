@@ -0,0 +1,248 @@
+#!/usr/bin/env node
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+const koffi = require('./build/koffi.node');
+
+const SmallStruct = koffi.struct('SmallStruct', {
+    a: 'int32_t',
+    b: 'int32_t',
+    c: 'int32_t'
+});
+
+const HfaStruct = koffi.struct('HfaStruct', {
+    x: 'float',
+    y: 'float',
+    z: 'float',
+    w: 'float'
+});
+
+const LargeStruct = koffi.struct('LargeStruct', {
+    values: koffi.array('int64_t', 16)
+});
+
+const Counter = koffi.opaque('Counter');
+
+const IntCallback = koffi.callback('int IntCallback(int value)');
+
+// Keep in sync with micro_napi.js
+const CASES = {
+    struct_small: lib => {
+        const SumSmall = lib.func('int SumSmall(SmallStruct s)');
+
+        let s = { a: 1, b: 2, c: 3 };
+        return i => SumSmall(s);
+    },
+
+    struct_hfa: lib => {
+        const SumHfa = lib.func('float SumHfa(HfaStruct s)');
+
+        let s = { x: 1, y: 2, z: 3, w: 4 };
+        return i => SumHfa(s);
+    },
+
+    struct_large: lib => {
+        const SumLarge = lib.func('int64_t SumLarge(LargeStruct s)');
+
+        let s = { values: Array.from(Array(16).keys()) };
+        return i => SumLarge(s);
+    },
+
+    struct_return: lib => {
+        const MakeSmall = lib.func('SmallStruct MakeSmall(int a, int b, int c)');
+        return i => MakeSmall(i, 2, 3).a;
+    },
+
+    out_param: lib => {
+        const DivMod = lib.func('void DivMod(int a, int b, _Out_ int *out_quot, _Out_ int *out_rem)');
+
+        let quot = [null];
+        let rem = [null];
+
+        return i => {
+            DivMod(i, 7, quot, rem);
+            return quot[0] + rem[0];
+        };
+    },
+
+    string_utf8: lib => {
+        const Length8 = lib.func('size_t Length8(const char *str)');
+
+        let str = 'The quick brown fox jumps over the lazy dog';
+        return i => Length8(str);
+    },
+
+    string_utf16: lib => {
+        const Length16 = lib.func('size_t Length16(const char16_t *str)');
+
+        let str = 'The quick brown fox jumps over the lazy dog';
+        return i => Length16(str);
+    },
+
+    pointer: lib => {
+        const CreateCounter = lib.func('Counter *CreateCounter(int value)');
+        const IncrementCounter = lib.func('int IncrementCounter(Counter *counter)');
+
+        let counter = CreateCounter(0);
+        return i => IncrementCounter(counter);
+    },
+
+    array: lib => {
+        const SumInts = lib.func('int SumInts(const int *values, int len)');
+
+        let values = Array.from(Array(64).keys());
+        return i => SumInts(values, values.length);
+    },
+
+    typed_array: lib => {
+        const SumInts = lib.func('int SumInts(const int *values, int len)');
+
+        let values = Int32Array.from(Array(64).keys());
+        return i => SumInts(values, values.length);
+    },
+
+    callback_transient: lib => {
+        const CallIntCallback = lib.func('int CallIntCallback(IntCallback *func, int value)');
+
+        let func = value => value + 1;
+        return i => CallIntCallback(func, i);
+    },
+
+    callback_registered: lib => {
+        const CallIntCallback = lib.func('int CallIntCallback(IntCallback *func, int value)');
+
+        let func = koffi.register(value => value + 1, koffi.pointer(IntCallback));
+        return i => CallIntCallback(func, i);
+    },
+
+    variadic: lib => {
+        const SumVariadic = lib.func('int SumVariadic(int count, ...)');
+        return i => SumVariadic(4, 'int', 1, 'int', 2, 'int', 3, 'int', i);
+    },
+
+    async: lib => {
+        const AddInts = lib.func('int AddInts(int a, int b)');
+
+        return {
+            concurrency: 32,
+            run: (i, callback) => AddInts.async(i, 1, callback)
+        };
+    }
+};
+
+let sum = 0;
+
+main();
+
+async function main() {
+    if (process.argv.length < 3)
+        throw new Error('Missing benchmark case');
+
+    let name = process.argv[2];
+    let time = 5000;
+    let count = null;
+
+    if (process.argv.length >= 4) {
+        time = parseFloat(process.argv[3]) * 1000;
+        if (Number.isNaN(time))
+            throw new Error('Not a valid number');
+        if (time < 0)
+            throw new Error('Time must be positive');
+    }
+
+    // Run a fixed number of iterations instead, used to count instructions (see instructions.js)
+    if (process.argv.length >= 5) {
+        count = parseInt(process.argv[4], 10);
+        if (Number.isNaN(count) || count < 0)
+            throw new Error('Iteration count must be a positive integer');
+    }
+
+    let prepare = CASES[name];
+    if (prepare == null)
+        throw new Error(`Unknown benchmark case '${name}'`);
+
+    let lib = koffi.load(__dirname + '/build/micro' + koffi.extension);
+    let bench = prepare(lib);
+
+    let perf = (typeof bench == 'function') ? run_sync(bench, time, count) : await run_async(bench, time, count);
+    console.log(JSON.stringify(perf));
+}
+
+function run_sync(func, time, count) {
+    let start = performance.now();
+    let iterations = 0;
+
+    if (count != null) {
+        for (let i = 0; i < count; i++)
+            sum += func(i);
+
+        time = performance.now() - start;
+        return { iterations: count, time: Math.round(time) };
+    }
+
+    while (performance.now() - start < time) {
+        for (let i = 0; i < 100000; i++)
+            sum += func(i);
+
+        iterations += 100000;
+    }
+
+    time = performance.now() - start;
+    return { iterations: iterations, time: Math.round(time) };
+}
+
+// Keep bench.concurrency calls in flight until the time is up (or until count calls are made)
+function run_async(bench, time, count) {
+    return new Promise((resolve, reject) => {
+        let start = performance.now();
+        let iterations = 0;
+        let started = 0;
+        let pending = 0;
+        let failed = false;
+
+        let more = () => (count != null) ? (started < count) : (performance.now() - start < time);
+
+        let next = () => {
+            pending++;
+            started++;
+
+            bench.run(iterations + pending, (err, res) => {
+                pending--;
+
+                if (failed)
+                    return;
+                if (err != null) {
+                    failed = true;
+                    reject(err);
+                    return;
+                }
+
+                sum += res;
+                iterations++;
+
+                if (more()) {
+                    next();
+                } else if (!pending) {
+                    resolve({ iterations: iterations, time: Math.round(performance.now() - start) });
+                }
+            });
+        };
+
+        for (let i = 0; i < bench.concurrency && more(); i++)
+            next();
+
+        if (!pending)
+            resolve({ iterations: 0, time: 0 });
+    });
+}
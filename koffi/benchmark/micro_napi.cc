@@ -0,0 +1,557 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#include "vendor/libcc/libcc.hh"
+#include <napi.h>
+
+// Implemented in micro.c, which is built as a separate shared library
+extern "C" {
+    struct SmallStruct {
+        int32_t a;
+        int32_t b;
+        int32_t c;
+    };
+
+    struct HfaStruct {
+        float x;
+        float y;
+        float z;
+        float w;
+    };
+
+    struct LargeStruct {
+        int64_t values[16];
+    };
+
+    struct Counter;
+
+    int SumSmall(SmallStruct s);
+    float SumHfa(HfaStruct s);
+    int64_t SumLarge(LargeStruct s);
+    SmallStruct MakeSmall(int a, int b, int c);
+    void DivMod(int a, int b, int *out_quot, int *out_rem);
+    size_t Length8(const char *str);
+    size_t Length16(const uint16_t *str);
+    Counter *CreateCounter(int value);
+    int IncrementCounter(Counter *counter);
+    void DeleteCounter(Counter *counter);
+    int SumInts(const int *values, int len);
+    int CallIntCallback(int (*func)(int), int value);
+    int SumVariadic(int count, ...);
+    int AddInts(int a, int b);
+}
+
+namespace RG {
+
+template <typename T, typename... Args>
+void ThrowError(Napi::Env env, const char *msg, Args... args)
+{
+    char buf[1024];
+    Fmt(buf, msg, args...);
+
+    auto err = T::New(env, buf);
+    err.ThrowAsJavaScriptException();
+}
+
+static bool CheckArguments(const Napi::CallbackInfo &info, Size expected)
+{
+    Napi::Env env = info.Env();
+
+    if (RG_UNLIKELY(info.Length() < (size_t)expected)) {
+        ThrowError<Napi::TypeError>(env, "Expected %1 arguments, got %2", expected, info.Length());
+        return false;
+    }
+
+    return true;
+}
+
+static bool GetInt(Napi::Value value, const char *name, int *out_value)
+{
+    if (RG_UNLIKELY(!value.IsNumber())) {
+        ThrowError<Napi::TypeError>(value.Env(), "Unexpected type for %1, expected number", name);
+        return false;
+    }
+
+    *out_value = value.As<Napi::Number>().Int32Value();
+    return true;
+}
+
+static bool GetObject(Napi::Value value, const char *name, Napi::Object *out_obj)
+{
+    if (RG_UNLIKELY(!value.IsObject())) {
+        ThrowError<Napi::TypeError>(value.Env(), "Unexpected type for %1, expected object", name);
+        return false;
+    }
+
+    *out_obj = value.As<Napi::Object>();
+    return true;
+}
+
+static Napi::Value RunSumSmall(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    Napi::Object obj;
+    SmallStruct s;
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (!GetObject(info[0], "s", &obj))
+        return env.Null();
+    if (!GetInt(obj.Get("a"), "s.a", &s.a) || !GetInt(obj.Get("b"), "s.b", &s.b) ||
+            !GetInt(obj.Get("c"), "s.c", &s.c))
+        return env.Null();
+
+    int ret = SumSmall(s);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunSumHfa(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    Napi::Object obj;
+    HfaStruct s;
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (!GetObject(info[0], "s", &obj))
+        return env.Null();
+
+    s.x = obj.Get("x").As<Napi::Number>().FloatValue();
+    s.y = obj.Get("y").As<Napi::Number>().FloatValue();
+    s.z = obj.Get("z").As<Napi::Number>().FloatValue();
+    s.w = obj.Get("w").As<Napi::Number>().FloatValue();
+
+    float ret = SumHfa(s);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunSumLarge(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    Napi::Object obj;
+    LargeStruct s;
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (!GetObject(info[0], "s", &obj))
+        return env.Null();
+
+    Napi::Value values = obj.Get("values");
+
+    if (RG_UNLIKELY(!values.IsArray() || values.As<Napi::Array>().Length() != RG_LEN(s.values))) {
+        ThrowError<Napi::TypeError>(env, "Unexpected value for s.values, expected array of %1 numbers", RG_LEN(s.values));
+        return env.Null();
+    }
+
+    Napi::Array array = values.As<Napi::Array>();
+
+    for (uint32_t i = 0; i < RG_LEN(s.values); i++) {
+        s.values[i] = array.Get(i).As<Napi::Number>().Int64Value();
+    }
+
+    int64_t ret = SumLarge(s);
+
+    return Napi::Number::New(env, (double)ret);
+}
+
+static Napi::Value RunMakeSmall(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    int a, b, c;
+
+    if (!CheckArguments(info, 3))
+        return env.Null();
+    if (!GetInt(info[0], "a", &a) || !GetInt(info[1], "b", &b) || !GetInt(info[2], "c", &c))
+        return env.Null();
+
+    SmallStruct s = MakeSmall(a, b, c);
+
+    Napi::Object obj = Napi::Object::New(env);
+
+    obj.Set("a", Napi::Number::New(env, s.a));
+    obj.Set("b", Napi::Number::New(env, s.b));
+    obj.Set("c", Napi::Number::New(env, s.c));
+
+    return obj;
+}
+
+// Outputs are written to the first element of the two arrays, like Koffi does for out parameters
+static Napi::Value RunDivMod(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    int a, b;
+
+    if (!CheckArguments(info, 4))
+        return env.Null();
+    if (!GetInt(info[0], "a", &a) || !GetInt(info[1], "b", &b))
+        return env.Null();
+    if (RG_UNLIKELY(!info[2].IsArray() || !info[3].IsArray())) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for outputs, expected array");
+        return env.Null();
+    }
+
+    int quot, rem;
+    DivMod(a, b, &quot, &rem);
+
+    info[2].As<Napi::Array>().Set((uint32_t)0, Napi::Number::New(env, quot));
+    info[3].As<Napi::Array>().Set((uint32_t)0, Napi::Number::New(env, rem));
+
+    return env.Undefined();
+}
+
+static Napi::Value RunLength8(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+
+    char str[1024];
+    {
+        napi_status status = napi_get_value_string_utf8(env, info[0], str, RG_SIZE(str), nullptr);
+
+        if (RG_UNLIKELY(status != napi_ok)) {
+            ThrowError<Napi::TypeError>(env, "Unexpected value for str, expected string");
+            return env.Null();
+        }
+    }
+
+    size_t len = Length8(str);
+
+    return Napi::Number::New(env, (double)len);
+}
+
+static Napi::Value RunLength16(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+
+    char16_t str[1024];
+    {
+        napi_status status = napi_get_value_string_utf16(env, info[0], str, RG_LEN(str), nullptr);
+
+        if (RG_UNLIKELY(status != napi_ok)) {
+            ThrowError<Napi::TypeError>(env, "Unexpected value for str, expected string");
+            return env.Null();
+        }
+    }
+
+    size_t len = Length16((const uint16_t *)str);
+
+    return Napi::Number::New(env, (double)len);
+}
+
+static Napi::Value RunCreateCounter(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    int value;
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (!GetInt(info[0], "value", &value))
+        return env.Null();
+
+    Counter *counter = CreateCounter(value);
+
+    return Napi::External<Counter>::New(env, counter);
+}
+
+static bool GetCounter(Napi::Value value, Counter **out_counter)
+{
+    if (RG_UNLIKELY(!value.IsExternal())) {
+        ThrowError<Napi::TypeError>(value.Env(), "Unexpected type for counter, expected external");
+        return false;
+    }
+
+    *out_counter = value.As<Napi::External<Counter>>().Data();
+    return true;
+}
+
+static Napi::Value RunIncrementCounter(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    Counter *counter;
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (!GetCounter(info[0], &counter))
+        return env.Null();
+
+    int ret = IncrementCounter(counter);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunDeleteCounter(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    Counter *counter;
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (!GetCounter(info[0], &counter))
+        return env.Null();
+
+    DeleteCounter(counter);
+
+    return env.Undefined();
+}
+
+static Napi::Value RunSumArray(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (RG_UNLIKELY(!info[0].IsArray())) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for values, expected array");
+        return env.Null();
+    }
+
+    Napi::Array array = info[0].As<Napi::Array>();
+
+    int values[256];
+    int len = (int)std::min(array.Length(), (uint32_t)RG_LEN(values));
+
+    for (int i = 0; i < len; i++) {
+        values[i] = array.Get(i).As<Napi::Number>().Int32Value();
+    }
+
+    int ret = SumInts(values, len);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunSumTypedArray(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (RG_UNLIKELY(!info[0].IsTypedArray() ||
+                    info[0].As<Napi::TypedArray>().TypedArrayType() != napi_int32_array)) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for values, expected Int32Array");
+        return env.Null();
+    }
+
+    Napi::Int32Array array = info[0].As<Napi::Int32Array>();
+
+    int ret = SumInts(array.Data(), (int)array.ElementLength());
+
+    return Napi::Number::New(env, ret);
+}
+
+// Transient callback: the JS function is only valid while CallIntCallback runs
+static RG_THREAD_LOCAL napi_env transient_env;
+static RG_THREAD_LOCAL napi_value transient_func;
+
+// Registered callback: kept alive by a reference, until UnregisterCallback()
+static napi_env registered_env;
+static napi_ref registered_ref;
+
+static int RelayCallback(napi_env env, napi_value func, int value)
+{
+    Napi::Function callback(env, func);
+
+    Napi::Value ret = callback.Call({ Napi::Number::New(env, value) });
+    return ret.As<Napi::Number>().Int32Value();
+}
+
+static int RelayTransient(int value)
+{
+    return RelayCallback(transient_env, transient_func, value);
+}
+
+static int RelayRegistered(int value)
+{
+    napi_value func;
+    napi_get_reference_value(registered_env, registered_ref, &func);
+
+    return RelayCallback(registered_env, func, value);
+}
+
+static Napi::Value RunCallTransient(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    int value;
+
+    if (!CheckArguments(info, 2))
+        return env.Null();
+    if (RG_UNLIKELY(!info[0].IsFunction())) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for func, expected function");
+        return env.Null();
+    }
+    if (!GetInt(info[1], "value", &value))
+        return env.Null();
+
+    transient_env = env;
+    transient_func = info[0];
+
+    int ret = CallIntCallback(RelayTransient, value);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunRegisterCallback(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (RG_UNLIKELY(!info[0].IsFunction())) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for func, expected function");
+        return env.Null();
+    }
+    if (RG_UNLIKELY(registered_ref)) {
+        ThrowError<Napi::Error>(env, "Callback is already registered");
+        return env.Null();
+    }
+
+    registered_env = env;
+    napi_create_reference(env, info[0], 1, &registered_ref);
+
+    return env.Undefined();
+}
+
+static Napi::Value RunUnregisterCallback(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    if (registered_ref) {
+        napi_delete_reference(env, registered_ref);
+        registered_ref = nullptr;
+    }
+
+    return env.Undefined();
+}
+
+static Napi::Value RunCallRegistered(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    int value;
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (!GetInt(info[0], "value", &value))
+        return env.Null();
+    if (RG_UNLIKELY(!registered_ref)) {
+        ThrowError<Napi::Error>(env, "No callback is registered");
+        return env.Null();
+    }
+
+    int ret = CallIntCallback(RelayRegistered, value);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunSumVariadic(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    int a, b, c, d;
+
+    if (!CheckArguments(info, 4))
+        return env.Null();
+    if (!GetInt(info[0], "a", &a) || !GetInt(info[1], "b", &b) ||
+            !GetInt(info[2], "c", &c) || !GetInt(info[3], "d", &d))
+        return env.Null();
+
+    int ret = SumVariadic(4, a, b, c, d);
+
+    return Napi::Number::New(env, ret);
+}
+
+class AddWorker: public Napi::AsyncWorker {
+    int a;
+    int b;
+    int ret = 0;
+
+public:
+    AddWorker(Napi::Function &callback, int a, int b)
+        : Napi::AsyncWorker(callback), a(a), b(b) {}
+
+    void Execute() override { ret = AddInts(a, b); }
+
+    void OnOK() override
+    {
+        Napi::Env env = Env();
+        Callback().Call({ env.Null(), Napi::Number::New(env, ret) });
+    }
+};
+
+static Napi::Value RunAddAsync(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    int a, b;
+
+    if (!CheckArguments(info, 3))
+        return env.Null();
+    if (!GetInt(info[0], "a", &a) || !GetInt(info[1], "b", &b))
+        return env.Null();
+    if (RG_UNLIKELY(!info[2].IsFunction())) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for callback, expected function");
+        return env.Null();
+    }
+
+    Napi::Function callback = info[2].As<Napi::Function>();
+
+    AddWorker *worker = new AddWorker(callback, a, b);
+    worker->Queue();
+
+    return env.Undefined();
+}
+
+}
+
+static Napi::Object InitModule(Napi::Env env, Napi::Object exports)
+{
+    using namespace RG;
+
+    exports.Set("sumSmall", Napi::Function::New(env, RunSumSmall));
+    exports.Set("sumHfa", Napi::Function::New(env, RunSumHfa));
+    exports.Set("sumLarge", Napi::Function::New(env, RunSumLarge));
+    exports.Set("makeSmall", Napi::Function::New(env, RunMakeSmall));
+    exports.Set("divMod", Napi::Function::New(env, RunDivMod));
+    exports.Set("length8", Napi::Function::New(env, RunLength8));
+    exports.Set("length16", Napi::Function::New(env, RunLength16));
+    exports.Set("createCounter", Napi::Function::New(env, RunCreateCounter));
+    exports.Set("incrementCounter", Napi::Function::New(env, RunIncrementCounter));
+    exports.Set("deleteCounter", Napi::Function::New(env, RunDeleteCounter));
+    exports.Set("sumArray", Napi::Function::New(env, RunSumArray));
+    exports.Set("sumTypedArray", Napi::Function::New(env, RunSumTypedArray));
+    exports.Set("callTransient", Napi::Function::New(env, RunCallTransient));
+    exports.Set("registerCallback", Napi::Function::New(env, RunRegisterCallback));
+    exports.Set("unregisterCallback", Napi::Function::New(env, RunUnregisterCallback));
+    exports.Set("callRegistered", Napi::Function::New(env, RunCallRegistered));
+    exports.Set("sumVariadic", Napi::Function::New(env, RunSumVariadic));
+    exports.Set("addAsync", Napi::Function::New(env, RunAddAsync));
+
+    return exports;
+}
+
+NODE_API_MODULE(koffi, InitModule);
@@ -0,0 +1,199 @@
+#!/usr/bin/env node
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+const micro = require('./build/micro_napi.node');
+
+// Keep in sync with micro_koffi.js
+const CASES = {
+    struct_small: () => {
+        let s = { a: 1, b: 2, c: 3 };
+        return i => micro.sumSmall(s);
+    },
+
+    struct_hfa: () => {
+        let s = { x: 1, y: 2, z: 3, w: 4 };
+        return i => micro.sumHfa(s);
+    },
+
+    struct_large: () => {
+        let s = { values: Array.from(Array(16).keys()) };
+        return i => micro.sumLarge(s);
+    },
+
+    struct_return: () => {
+        return i => micro.makeSmall(i, 2, 3).a;
+    },
+
+    out_param: () => {
+        let quot = [null];
+        let rem = [null];
+
+        return i => {
+            micro.divMod(i, 7, quot, rem);
+            return quot[0] + rem[0];
+        };
+    },
+
+    string_utf8: () => {
+        let str = 'The quick brown fox jumps over the lazy dog';
+        return i => micro.length8(str);
+    },
+
+    string_utf16: () => {
+        let str = 'The quick brown fox jumps over the lazy dog';
+        return i => micro.length16(str);
+    },
+
+    pointer: () => {
+        let counter = micro.createCounter(0);
+        return i => micro.incrementCounter(counter);
+    },
+
+    array: () => {
+        let values = Array.from(Array(64).keys());
+        return i => micro.sumArray(values);
+    },
+
+    typed_array: () => {
+        let values = Int32Array.from(Array(64).keys());
+        return i => micro.sumTypedArray(values);
+    },
+
+    callback_transient: () => {
+        let func = value => value + 1;
+        return i => micro.callTransient(func, i);
+    },
+
+    callback_registered: () => {
+        micro.registerCallback(value => value + 1);
+        return i => micro.callRegistered(i);
+    },
+
+    variadic: () => {
+        return i => micro.sumVariadic(1, 2, 3, i);
+    },
+
+    async: () => {
+        return {
+            concurrency: 32,
+            run: (i, callback) => micro.addAsync(i, 1, callback)
+        };
+    }
+};
+
+let sum = 0;
+
+main();
+
+async function main() {
+    if (process.argv.length < 3)
+        throw new Error('Missing benchmark case');
+
+    let name = process.argv[2];
+    let time = 5000;
+    let count = null;
+
+    if (process.argv.length >= 4) {
+        time = parseFloat(process.argv[3]) * 1000;
+        if (Number.isNaN(time))
+            throw new Error('Not a valid number');
+        if (time < 0)
+            throw new Error('Time must be positive');
+    }
+
+    // Run a fixed number of iterations instead, used to count instructions (see instructions.js)
+    if (process.argv.length >= 5) {
+        count = parseInt(process.argv[4], 10);
+        if (Number.isNaN(count) || count < 0)
+            throw new Error('Iteration count must be a positive integer');
+    }
+
+    let prepare = CASES[name];
+    if (prepare == null)
+        throw new Error(`Unknown benchmark case '${name}'`);
+
+    let bench = prepare();
+
+    let perf = (typeof bench == 'function') ? run_sync(bench, time, count) : await run_async(bench, time, count);
+    console.log(JSON.stringify(perf));
+}
+
+function run_sync(func, time, count) {
+    let start = performance.now();
+    let iterations = 0;
+
+    if (count != null) {
+        for (let i = 0; i < count; i++)
+            sum += func(i);
+
+        time = performance.now() - start;
+        return { iterations: count, time: Math.round(time) };
+    }
+
+    while (performance.now() - start < time) {
+        for (let i = 0; i < 100000; i++)
+            sum += func(i);
+
+        iterations += 100000;
+    }
+
+    time = performance.now() - start;
+    return { iterations: iterations, time: Math.round(time) };
+}
+
+// Keep bench.concurrency calls in flight until the time is up (or until count calls are made)
+function run_async(bench, time, count) {
+    return new Promise((resolve, reject) => {
+        let start = performance.now();
+        let iterations = 0;
+        let started = 0;
+        let pending = 0;
+        let failed = false;
+
+        let more = () => (count != null) ? (started < count) : (performance.now() - start < time);
+
+        let next = () => {
+            pending++;
+            started++;
+
+            bench.run(iterations + pending, (err, res) => {
+                pending--;
+
+                if (failed)
+                    return;
+                if (err != null) {
+                    failed = true;
+                    reject(err);
+                    return;
+                }
+
+                sum += res;
+                iterations++;
+
+                if (more()) {
+                    next();
+                } else if (!pending) {
+                    resolve({ iterations: iterations, time: Math.round(performance.now() - start) });
+                }
+            });
+        };
+
+        for (let i = 0; i < bench.concurrency && more(); i++)
+            next();
+
+        if (!pending)
+            resolve({ iterations: 0, time: 0 });
+    });
+}
@@ -20,7 +20,20 @@ main();
 
 function main() {
     let filename = path.join(__dirname, 'build/raylib_cc' + (process.platform == 'win32' ? '.exe' : ''));
-    let proc = spawnSync(filename, process.argv.slice(2), { stdio: 'inherit' });
+    let args = [];
+
+    // Like other tests, we take the time in seconds but raylib_cc wants milliseconds
+    if (process.argv.length >= 3) {
+        let time = parseFloat(process.argv[2]) * 1000;
+        if (Number.isNaN(time))
+            throw new Error('Not a valid number');
+        if (time < 0)
+            throw new Error('Time must be positive');
+
+        args.push(String(Math.round(time)));
+    }
+
+    let proc = spawnSync(filename, args, { stdio: 'inherit' });
 
     if (proc.status == null) {
         console.error(proc.error);
@@ -0,0 +1,171 @@
+#!/usr/bin/env node
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+const koffi = require('./build/koffi.node');
+const fs = require('fs');
+const path = require('path');
+
+main();
+
+function main() {
+    let config = {
+        record: null,
+        bindings: null,
+        json: null
+    };
+
+    try {
+        for (let i = 2; i < process.argv.length; i++) {
+            let arg = process.argv[i];
+            let value = null;
+
+            if (arg[0] == '-' && arg.includes('=')) {
+                let offset = arg.indexOf('=');
+
+                value = arg.substr(offset + 1);
+                arg = arg.substr(0, offset);
+            }
+
+            let get_value = () => {
+                if (value == null) {
+                    if (i + 1 >= process.argv.length)
+                        throw new Error(`Missing value for ${arg}`);
+                    value = process.argv[++i];
+                }
+                return value;
+            };
+
+            if (arg == '--help') {
+                print_usage();
+                return;
+            } else if (arg == '--bindings') {
+                config.bindings = get_value();
+            } else if (arg == '--json') {
+                config.json = get_value();
+            } else if (arg[0] == '-') {
+                throw new Error(`Unexpected argument '${arg}'`);
+            } else {
+                if (config.record != null)
+                    throw new Error('Only one call record can be replayed at a time');
+                config.record = arg;
+            }
+        }
+
+        if (config.record == null)
+            throw new Error('Missing call record');
+
+        replay(config);
+    } catch (err) {
+        console.error(err);
+        process.exit(1);
+    }
+}
+
+function print_usage() {
+    let help = `Usage: node replay.js <record> [options]
+
+Options:
+    --bindings <module>          Replay through the JS functions exported by
+                                 this module, to measure marshalling overhead
+
+    --json <file>                Save results to JSON file (use - for standard output)
+
+Calls are recorded with koffi.record(filename) or with the KOFFI_RECORD environment
+variable. The bindings module must use the same build of Koffi as this tool.`;
+
+    console.log(help);
+}
+
+function replay(config) {
+    let quiet = (config.json == '-');
+
+    let native = koffi.replay(config.record);
+    let js = null;
+
+    if (config.bindings != null) {
+        let functions = require(path.resolve(config.bindings));
+        js = koffi.replay(config.record, functions);
+    }
+
+    let results = {
+        date: (new Date).toISOString(),
+        node: process.version,
+        platform: process.platform,
+        arch: process.arch,
+        record: config.record,
+        native: native,
+        js: js
+    };
+
+    if (!quiet) {
+        console.log(`Replayed ${native.replayed} of ${native.calls} calls (${native.skipped} skipped, ${native.mismatches} mismatches)`);
+        if (js != null)
+            console.log(`Replayed ${js.replayed} of ${js.calls} calls through JS (${js.skipped} skipped, ${js.errors} errors)`);
+        console.log('');
+
+        let names = native.functions.map(func => func.name).filter((name, idx, names) => names.indexOf(name) == idx);
+
+        console.log('Function                       | Calls      | Native     | JS         | Overhead');
+        console.log('------------------------------ | ---------- | ---------- | ---------- | ----------');
+
+        for (let name of names) {
+            let a = sum_functions(native, name);
+            let b = (js != null) ? sum_functions(js, name) : null;
+
+            let values = [
+                String(a.calls),
+                format_time(a),
+                (b != null) ? format_time(b) : '-',
+                (b != null && a.calls && b.calls) ? format_ns(b.time / b.calls - a.time / a.calls) : '-'
+            ];
+
+            console.log(`${name.padEnd(30, ' ')} | ${values.map(value => value.padEnd(10, ' ')).join(' | ')}`);
+        }
+
+        console.log('');
+        console.log(`Native: ${format_time(native)} per call`);
+        if (js != null)
+            console.log(`JS: ${format_time(js)} per call`);
+    }
+
+    if (config.json != null) {
+        let json = JSON.stringify(results, null, 4);
+
+        if (quiet) {
+            console.log(json);
+        } else {
+            fs.writeFileSync(config.json, json);
+        }
+    }
+}
+
+// Functions with the same name can appear more than once (variadic calls, redefinitions)
+function sum_functions(result, name) {
+    let functions = result.functions.filter(func => func.name == name);
+
+    return {
+        calls: functions.reduce((acc, func) => acc + func.calls, 0),
+        time: functions.reduce((acc, func) => acc + func.time, 0)
+    };
+}
+
+function format_time(result) {
+    let calls = (result.replayed != null) ? result.replayed : result.calls;
+    return calls ? format_ns(result.time / calls) : '-';
+}
+
+function format_ns(ns) {
+    return `${Math.round(ns)} ns`;
+}
@@ -0,0 +1,214 @@
+#!/usr/bin/env node
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+const koffi = require('./build/koffi.node');
+const { PerformanceObserver } = require('perf_hooks');
+
+const sqlite3 = koffi.opaque('sqlite3');
+const sqlite3_stmt = koffi.opaque('sqlite3_stmt');
+
+const SQLITE_OPEN_READWRITE = 0x2;
+const SQLITE_OPEN_CREATE = 0x4;
+const SQLITE_ROW = 100;
+const SQLITE_DONE = 101;
+const SQLITE_TRANSIENT = -1;
+
+const BATCH_SIZE = 1000;
+const SELECT_ROWS = 100000;
+
+let sqlite3_open_v2;
+let sqlite3_close_v2;
+let sqlite3_exec;
+let sqlite3_prepare_v2;
+let sqlite3_finalize;
+let sqlite3_reset;
+let sqlite3_bind_text;
+let sqlite3_bind_int;
+let sqlite3_step;
+let sqlite3_column_int;
+let sqlite3_column_text;
+
+// Keep in sync with sqlite_koffi.js and sqlite_napi.js
+const CASES = {
+    insert: async db => {
+        let next = 0;
+
+        return async () => {
+            await insert_rows(db, next, BATCH_SIZE);
+            next += BATCH_SIZE;
+
+            return BATCH_SIZE;
+        };
+    },
+
+    select: async db => {
+        await insert_rows(db, 0, SELECT_ROWS);
+
+        let offset = 0;
+
+        return async () => {
+            let rows = await select_rows(db, offset, BATCH_SIZE);
+            offset = (offset + rows) % SELECT_ROWS;
+
+            return rows;
+        };
+    }
+};
+
+let sum = 0;
+
+main();
+
+async function main() {
+    if (process.argv.length < 3)
+        throw new Error('Missing benchmark case');
+
+    let name = process.argv[2];
+    let time = 5000;
+
+    if (process.argv.length >= 4) {
+        time = parseFloat(process.argv[3]) * 1000;
+        if (Number.isNaN(time))
+            throw new Error('Not a valid number');
+        if (time < 0)
+            throw new Error('Time must be positive');
+    }
+
+    let prepare = CASES[name];
+    if (prepare == null)
+        throw new Error(`Unknown benchmark case '${name}'`);
+
+    let lib = koffi.load(__dirname + '/build/sqlite3' + koffi.extension);
+
+    sqlite3_open_v2 = lib.func('int sqlite3_open_v2(const char *filename, _Out_ sqlite3 **db, int flags, const char *vfs)');
+    sqlite3_close_v2 = lib.func('int sqlite3_close_v2(sqlite3 *db)');
+    sqlite3_exec = lib.func('int sqlite3_exec(sqlite3 *db, const char *sql, void *cb, void *udata, void *err)');
+    sqlite3_prepare_v2 = lib.func('int sqlite3_prepare_v2(sqlite3 *db, const char *sql, int len, _Out_ sqlite3_stmt **stmt, void *tail)');
+    sqlite3_finalize = lib.func('int sqlite3_finalize(sqlite3_stmt *stmt)');
+    sqlite3_reset = lib.func('int sqlite3_reset(sqlite3_stmt *stmt)');
+    sqlite3_bind_int = lib.func('int sqlite3_bind_int(sqlite3_stmt *stmt, int idx, int value)');
+    sqlite3_step = lib.func('int sqlite3_step(sqlite3_stmt *stmt)');
+    sqlite3_column_int = lib.func('int sqlite3_column_int(sqlite3_stmt *stmt, int col)');
+    sqlite3_column_text = lib.func('const char *sqlite3_column_text(sqlite3_stmt *stmt, int col)');
+
+    // Only sqlite3_step() is called asynchronously, other calls don't do any real work
+    // The destructor is declared as an integer, so that we can pass SQLITE_TRANSIENT (-1)
+    sqlite3_bind_text = lib.func('int sqlite3_bind_text(sqlite3_stmt *stmt, int idx, const char *str, int len, intptr_t destructor)');
+
+    let db = open_database(':memory:');
+    let func = await prepare(db);
+
+    // Count heap allocations made by Koffi (when the call memory is not enough) on a separate batch,
+    // because call statistics make each call a little slower
+    koffi.stats(true);
+    let allocations = await func();
+    allocations = koffi.stats(false).functions.reduce((acc, func) => acc + func.heap_fallbacks, 0) / allocations;
+
+    let gc = 0;
+    let observer = new PerformanceObserver(list => { gc += list.getEntries().length; });
+    observer.observe({ entryTypes: ['gc'] });
+
+    let start = performance.now();
+    let iterations = 0;
+
+    while (performance.now() - start < time)
+        iterations += await func();
+
+    time = performance.now() - start;
+
+    sqlite3_close_v2(db);
+
+    // GC entries are created asynchronously, and may not have been delivered yet
+    setImmediate(() => {
+        gc += observer.takeRecords().length;
+        observer.disconnect();
+
+        console.log(JSON.stringify({ iterations: iterations, time: Math.round(time), gc: gc, allocations: allocations }));
+    });
+}
+
+function open_database(filename) {
+    let ptr = [null];
+
+    if (sqlite3_open_v2(filename, ptr, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, null) != 0)
+        throw new Error('Failed to open database');
+    let db = ptr[0];
+
+    if (sqlite3_exec(db, 'CREATE TABLE foo (id INTEGER PRIMARY KEY, bar TEXT, value INT);', null, null, null) != 0)
+        throw new Error('Failed to create table');
+
+    return db;
+}
+
+async function insert_rows(db, start, count) {
+    let ptr = [null];
+
+    if (sqlite3_exec(db, 'BEGIN', null, null, null) != 0)
+        throw new Error('Failed to start transaction');
+    if (sqlite3_prepare_v2(db, 'INSERT INTO foo (bar, value) VALUES (?1, ?2)', -1, ptr, null) != 0)
+        throw new Error('Failed to prepare insert statement');
+    let stmt = ptr[0];
+
+    for (let i = start; i < start + count; i++) {
+        sqlite3_reset(stmt);
+
+        sqlite3_bind_text(stmt, 1, `Row ${i}`, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 2, i % 7);
+
+        if (await step(stmt) != SQLITE_DONE)
+            throw new Error('Failed to insert row');
+    }
+
+    sqlite3_finalize(stmt);
+    if (sqlite3_exec(db, 'COMMIT', null, null, null) != 0)
+        throw new Error('Failed to commit transaction');
+}
+
+async function select_rows(db, offset, count) {
+    let ptr = [null];
+
+    if (sqlite3_prepare_v2(db, 'SELECT id, bar, value FROM foo WHERE id > ?1 ORDER BY id LIMIT ?2', -1, ptr, null) != 0)
+        throw new Error('Failed to prepare select statement');
+    let stmt = ptr[0];
+
+    sqlite3_bind_int(stmt, 1, offset);
+    sqlite3_bind_int(stmt, 2, count);
+
+    let rows = 0;
+
+    while (await step(stmt) == SQLITE_ROW) {
+        sum += sqlite3_column_int(stmt, 0);
+        sum += sqlite3_column_text(stmt, 1).length;
+        sum += sqlite3_column_int(stmt, 2);
+
+        rows++;
+    }
+
+    sqlite3_finalize(stmt);
+
+    return rows;
+}
+
+function step(stmt) {
+    return new Promise((resolve, reject) => {
+        sqlite3_step.async(stmt, (err, ret) => {
+            if (err != null) {
+                reject(err);
+            } else {
+                resolve(ret);
+            }
+        });
+    });
+}
@@ -0,0 +1,343 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#include "vendor/libcc/libcc.hh"
+#include "vendor/sqlite3/sqlite3.h"
+#include <napi.h>
+
+namespace RG {
+
+// Heap allocations made by this module, reported by allocations()
+static int64_t allocations = 0;
+
+template <typename T, typename... Args>
+void ThrowError(Napi::Env env, const char *msg, Args... args)
+{
+    char buf[1024];
+    Fmt(buf, msg, args...);
+
+    auto err = T::New(env, buf);
+    err.ThrowAsJavaScriptException();
+}
+
+static bool CheckArguments(const Napi::CallbackInfo &info, Size expected)
+{
+    Napi::Env env = info.Env();
+
+    if (RG_UNLIKELY(info.Length() < (size_t)expected)) {
+        ThrowError<Napi::TypeError>(env, "Expected %1 arguments, got %2", expected, info.Length());
+        return false;
+    }
+
+    return true;
+}
+
+template <typename T>
+static bool GetHandle(Napi::Value value, const char *name, T **out_ptr)
+{
+    if (RG_UNLIKELY(!value.IsExternal())) {
+        ThrowError<Napi::TypeError>(value.Env(), "Unexpected type for %1, expected external", name);
+        return false;
+    }
+
+    *out_ptr = value.As<Napi::External<T>>().Data();
+    return true;
+}
+
+static bool GetInt(Napi::Value value, const char *name, int *out_value)
+{
+    if (RG_UNLIKELY(!value.IsNumber())) {
+        ThrowError<Napi::TypeError>(value.Env(), "Unexpected type for %1, expected number", name);
+        return false;
+    }
+
+    *out_value = value.As<Napi::Number>().Int32Value();
+    return true;
+}
+
+// Small strings are copied to buf, bigger ones are allocated and must be released with free()
+static const char *GetString(Napi::Value value, const char *name, Span<char> buf)
+{
+    Napi::Env env = value.Env();
+
+    if (RG_UNLIKELY(!value.IsString())) {
+        ThrowError<Napi::TypeError>(env, "Unexpected type for %1, expected string", name);
+        return nullptr;
+    }
+
+    size_t len = 0;
+    napi_get_value_string_utf8(env, value, buf.ptr, (size_t)buf.len, &len);
+
+    if ((Size)len >= buf.len - 1) {
+        napi_get_value_string_utf8(env, value, nullptr, 0, &len);
+
+        char *ptr = (char *)malloc(len + 1);
+        RG_CRITICAL(ptr, "Failed to allocate memory for string");
+        allocations++;
+
+        napi_get_value_string_utf8(env, value, ptr, len + 1, &len);
+
+        return ptr;
+    }
+
+    return buf.ptr;
+}
+
+static Napi::Value RunOpen(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    char buf[512];
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+
+    const char *filename = GetString(info[0], "filename", buf);
+    if (!filename)
+        return env.Null();
+    RG_DEFER { if (filename != buf) free((void *)filename); };
+
+    sqlite3 *db;
+    if (sqlite3_open_v2(filename, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK) {
+        ThrowError<Napi::Error>(env, "Failed to open database: %1", sqlite3_errmsg(db));
+        sqlite3_close_v2(db);
+        return env.Null();
+    }
+
+    return Napi::External<sqlite3>::New(env, db);
+}
+
+static Napi::Value RunClose(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    sqlite3 *db;
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (!GetHandle(info[0], "db", &db))
+        return env.Null();
+
+    int ret = sqlite3_close_v2(db);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunExec(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    sqlite3 *db;
+    char buf[512];
+
+    if (!CheckArguments(info, 2))
+        return env.Null();
+    if (!GetHandle(info[0], "db", &db))
+        return env.Null();
+
+    const char *sql = GetString(info[1], "sql", buf);
+    if (!sql)
+        return env.Null();
+    RG_DEFER { if (sql != buf) free((void *)sql); };
+
+    int ret = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunPrepare(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    sqlite3 *db;
+    char buf[512];
+
+    if (!CheckArguments(info, 2))
+        return env.Null();
+    if (!GetHandle(info[0], "db", &db))
+        return env.Null();
+
+    const char *sql = GetString(info[1], "sql", buf);
+    if (!sql)
+        return env.Null();
+    RG_DEFER { if (sql != buf) free((void *)sql); };
+
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        ThrowError<Napi::Error>(env, "Failed to prepare statement: %1", sqlite3_errmsg(db));
+        return env.Null();
+    }
+
+    return Napi::External<sqlite3_stmt>::New(env, stmt);
+}
+
+static Napi::Value RunFinalize(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    sqlite3_stmt *stmt;
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (!GetHandle(info[0], "stmt", &stmt))
+        return env.Null();
+
+    int ret = sqlite3_finalize(stmt);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunReset(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    sqlite3_stmt *stmt;
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (!GetHandle(info[0], "stmt", &stmt))
+        return env.Null();
+
+    int ret = sqlite3_reset(stmt);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunBindText(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    sqlite3_stmt *stmt;
+    int idx;
+    char buf[512];
+
+    if (!CheckArguments(info, 3))
+        return env.Null();
+    if (!GetHandle(info[0], "stmt", &stmt))
+        return env.Null();
+    if (!GetInt(info[1], "idx", &idx))
+        return env.Null();
+
+    const char *str = GetString(info[2], "str", buf);
+    if (!str)
+        return env.Null();
+    RG_DEFER { if (str != buf) free((void *)str); };
+
+    int ret = sqlite3_bind_text(stmt, idx, str, -1, SQLITE_TRANSIENT);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunBindInt(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    sqlite3_stmt *stmt;
+    int idx;
+    int value;
+
+    if (!CheckArguments(info, 3))
+        return env.Null();
+    if (!GetHandle(info[0], "stmt", &stmt))
+        return env.Null();
+    if (!GetInt(info[1], "idx", &idx) || !GetInt(info[2], "value", &value))
+        return env.Null();
+
+    int ret = sqlite3_bind_int(stmt, idx, value);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunStep(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    sqlite3_stmt *stmt;
+
+    if (!CheckArguments(info, 1))
+        return env.Null();
+    if (!GetHandle(info[0], "stmt", &stmt))
+        return env.Null();
+
+    int ret = sqlite3_step(stmt);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunColumnInt(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    sqlite3_stmt *stmt;
+    int col;
+
+    if (!CheckArguments(info, 2))
+        return env.Null();
+    if (!GetHandle(info[0], "stmt", &stmt))
+        return env.Null();
+    if (!GetInt(info[1], "col", &col))
+        return env.Null();
+
+    int ret = sqlite3_column_int(stmt, col);
+
+    return Napi::Number::New(env, ret);
+}
+
+static Napi::Value RunColumnText(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    sqlite3_stmt *stmt;
+    int col;
+
+    if (!CheckArguments(info, 2))
+        return env.Null();
+    if (!GetHandle(info[0], "stmt", &stmt))
+        return env.Null();
+    if (!GetInt(info[1], "col", &col))
+        return env.Null();
+
+    const char *str = (const char *)sqlite3_column_text(stmt, col);
+
+    return str ? Napi::String::New(env, str) : env.Null();
+}
+
+static Napi::Value GetAllocations(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    return Napi::Number::New(env, (double)allocations);
+}
+
+}
+
+static Napi::Object InitModule(Napi::Env env, Napi::Object exports)
+{
+    using namespace RG;
+
+    exports.Set("open", Napi::Function::New(env, RunOpen));
+    exports.Set("close", Napi::Function::New(env, RunClose));
+    exports.Set("exec", Napi::Function::New(env, RunExec));
+    exports.Set("prepare", Napi::Function::New(env, RunPrepare));
+    exports.Set("finalize", Napi::Function::New(env, RunFinalize));
+    exports.Set("reset", Napi::Function::New(env, RunReset));
+    exports.Set("bindText", Napi::Function::New(env, RunBindText));
+    exports.Set("bindInt", Napi::Function::New(env, RunBindInt));
+    exports.Set("step", Napi::Function::New(env, RunStep));
+    exports.Set("columnInt", Napi::Function::New(env, RunColumnInt));
+    exports.Set("columnText", Napi::Function::New(env, RunColumnText));
+    exports.Set("allocations", Napi::Function::New(env, GetAllocations));
+
+    return exports;
+}
+
+NODE_API_MODULE(koffi, InitModule);
@@ -0,0 +1,154 @@
+#!/usr/bin/env node
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+const sqlite = require('./build/sqlite_napi.node');
+const { PerformanceObserver } = require('perf_hooks');
+
+const SQLITE_ROW = 100;
+const SQLITE_DONE = 101;
+
+const BATCH_SIZE = 1000;
+const SELECT_ROWS = 100000;
+
+// Keep in sync with sqlite_koffi.js and sqlite_koffi_async.js
+const CASES = {
+    insert: db => {
+        let next = 0;
+
+        return () => {
+            insert_rows(db, next, BATCH_SIZE);
+            next += BATCH_SIZE;
+
+            return BATCH_SIZE;
+        };
+    },
+
+    select: db => {
+        insert_rows(db, 0, SELECT_ROWS);
+
+        let offset = 0;
+
+        return () => {
+            let rows = select_rows(db, offset, BATCH_SIZE);
+            offset = (offset + rows) % SELECT_ROWS;
+
+            return rows;
+        };
+    }
+};
+
+let sum = 0;
+
+main();
+
+function main() {
+    if (process.argv.length < 3)
+        throw new Error('Missing benchmark case');
+
+    let name = process.argv[2];
+    let time = 5000;
+
+    if (process.argv.length >= 4) {
+        time = parseFloat(process.argv[3]) * 1000;
+        if (Number.isNaN(time))
+            throw new Error('Not a valid number');
+        if (time < 0)
+            throw new Error('Time must be positive');
+    }
+
+    let prepare = CASES[name];
+    if (prepare == null)
+        throw new Error(`Unknown benchmark case '${name}'`);
+
+    let db = open_database(':memory:');
+    let func = prepare(db);
+
+    // Count heap allocations made by the addon (for big strings) on a separate batch, like the Koffi tests
+    let allocations = sqlite.allocations();
+    let rows = func();
+    allocations = (sqlite.allocations() - allocations) / rows;
+
+    let gc = 0;
+    let observer = new PerformanceObserver(list => { gc += list.getEntries().length; });
+    observer.observe({ entryTypes: ['gc'] });
+
+    let start = performance.now();
+    let iterations = 0;
+
+    while (performance.now() - start < time)
+        iterations += func();
+
+    time = performance.now() - start;
+
+    sqlite.close(db);
+
+    // GC entries are created asynchronously, and may not have been delivered yet
+    setImmediate(() => {
+        gc += observer.takeRecords().length;
+        observer.disconnect();
+
+        console.log(JSON.stringify({ iterations: iterations, time: Math.round(time), gc: gc, allocations: allocations }));
+    });
+}
+
+function open_database(filename) {
+    let db = sqlite.open(filename);
+
+    if (sqlite.exec(db, 'CREATE TABLE foo (id INTEGER PRIMARY KEY, bar TEXT, value INT);') != 0)
+        throw new Error('Failed to create table');
+
+    return db;
+}
+
+function insert_rows(db, start, count) {
+    if (sqlite.exec(db, 'BEGIN') != 0)
+        throw new Error('Failed to start transaction');
+    let stmt = sqlite.prepare(db, 'INSERT INTO foo (bar, value) VALUES (?1, ?2)');
+
+    for (let i = start; i < start + count; i++) {
+        sqlite.reset(stmt);
+
+        sqlite.bindText(stmt, 1, `Row ${i}`);
+        sqlite.bindInt(stmt, 2, i % 7);
+
+        if (sqlite.step(stmt) != SQLITE_DONE)
+            throw new Error('Failed to insert row');
+    }
+
+    sqlite.finalize(stmt);
+    if (sqlite.exec(db, 'COMMIT') != 0)
+        throw new Error('Failed to commit transaction');
+}
+
+function select_rows(db, offset, count) {
+    let stmt = sqlite.prepare(db, 'SELECT id, bar, value FROM foo WHERE id > ?1 ORDER BY id LIMIT ?2');
+
+    sqlite.bindInt(stmt, 1, offset);
+    sqlite.bindInt(stmt, 2, count);
+
+    let rows = 0;
+
+    while (sqlite.step(stmt) == SQLITE_ROW) {
+        sum += sqlite.columnInt(stmt, 0);
+        sum += sqlite.columnText(stmt, 1).length;
+        sum += sqlite.columnInt(stmt, 2);
+
+        rows++;
+    }
+
+    sqlite.finalize(stmt);
+
+    return rows;
+}
@@ -37,6 +37,10 @@ let ignore = new Set;
 
 let qemu_prefix = null;
 
+let bench_counter = 'lackey';
+let bench_iterations = 20000;
+let bench_compare = null;
+
 // Main
 
 main();
@@ -59,6 +63,7 @@ async function main() {
         switch (process.argv[2]) {
             case 'pack': { command = pack; } break;
             case 'test': { command = test; } break;
+            case 'bench': { command = bench; } break;
             case 'start': { command = start; } break;
             case 'stop': { command = stop; } break;
             case 'info': { command = info; } break;
@@ -93,8 +98,24 @@ async function main() {
             if (arg == '--help') {
                 print_usage();
                 return;
-            } else if ((command == test || command == start) && arg == '--no-accel') {
+            } else if ((command == test || command == bench || command == start) && arg == '--no-accel') {
                 accelerate = false;
+            } else if (command == bench && arg == '--counter') {
+                if (value == null)
+                    throw new Error(`Missing value for ${arg}`);
+                if (value != 'lackey' && value != 'perf')
+                    throw new Error(`Unexpected value '${value}' for ${arg}`);
+
+                bench_counter = value;
+            } else if (command == bench && arg == '--iterations') {
+                bench_iterations = parseInt(value, 10);
+                if (Number.isNaN(bench_iterations) || bench_iterations <= 0)
+                    throw new Error(`Invalid value for ${arg}`);
+            } else if (command == bench && arg == '--compare') {
+                if (value == null)
+                    throw new Error(`Missing value for ${arg}`);
+
+                bench_compare = value;
             } else if (arg[0] == '-') {
                 throw new Error(`Unexpected argument '${arg}'`);
             } else {
@@ -198,6 +219,7 @@ function print_usage() {
 
 Commands:
     test                         Run the machines and perform the tests (default)
+    bench                        Count instructions per call for each micro benchmark
     pack                         Use machines to package prebuilt Koffi binaries
 
     start                        Start the machines but don't run anythingh
@@ -209,6 +231,13 @@ Commands:
 
 Options:
         --no-accel               Disable QEMU acceleration
+
+Bench options:
+        --counter <counter>      Count with lackey (Valgrind) or perf (default: lackey)
+        --iterations <count>     Number of calls for each case (default: 20000)
+        --compare <commit>       Compare results to those of another commit
+
+Bench results are saved in qemu/benchmarks/<commit>.json.
 `;
 
     console.log(help);
@@ -558,6 +587,129 @@ async function test() {
     return success;
 }
 
+async function bench() {
+    let success = true;
+
+    // Results are stored per commit, uncommitted changes get a separate file
+    let commit = spawnSync('git', ['rev-parse', 'HEAD'], { cwd: root_dir, encoding: 'utf-8' }).stdout.trim();
+    if (!commit)
+        throw new Error('Failed to get current commit hash');
+    if (spawnSync('git', ['diff', '--quiet', 'HEAD'], { cwd: root_dir }).status !== 0)
+        commit += '-dirty';
+
+    let results_filename = `benchmarks/${commit}.json`;
+    let results = {
+        commit: commit,
+        counter: bench_counter,
+        iterations: bench_iterations,
+        machines: {}
+    };
+    if (fs.existsSync(results_filename)) {
+        let json = fs.readFileSync(results_filename, { encoding: 'utf-8' });
+        let previous = JSON.parse(json);
+
+        if (previous.counter == bench_counter && previous.iterations == bench_iterations)
+            results.machines = previous.machines;
+    }
+
+    let reference = null;
+    if (bench_compare != null) {
+        let filename = `benchmarks/${bench_compare}.json`;
+        if (!fs.existsSync(filename))
+            throw new Error(`Cannot find results for commit '${bench_compare}'`);
+
+        let json = fs.readFileSync(filename, { encoding: 'utf-8' });
+        reference = JSON.parse(json);
+
+        if (reference.counter != bench_counter)
+            throw new Error(`Results for commit '${bench_compare}' were made with ${reference.counter}`);
+    }
+
+    // Instruction counters (perf, Valgrind) are only used on Linux machines
+    for (let machine of machines) {
+        if (machine.platform != 'linux') {
+            log(machine, 'Unsupported platform', chalk.bold.gray('[ignore]'));
+            ignore.add(machine);
+        }
+    }
+
+    success &= await start(false);
+    success &= await copy(machine => Object.values(machine.tests).map(test => test.directory));
+
+    console.log('>> Count instructions...');
+    await Promise.all(machines.map(async machine => {
+        if (ignore.has(machine))
+            return;
+
+        await Promise.all(Object.keys(machine.tests).map(async suite => {
+            let test = machine.tests[suite];
+            let cwd = test.directory + '/koffi';
+
+            // Build the benchmarks with the same options as the tests
+            let commands = Object.values(test.build).map(cmd => cmd.replace(/-d test\b/, '-d benchmark'));
+            commands.push(`node benchmark/instructions.js --counter ${bench_counter} --iterations ${bench_iterations} --json -`);
+
+            let ret;
+            for (let cmd of commands) {
+                ret = await exec_remote(machine, cmd, cwd);
+                if (ret.code != 0)
+                    break;
+            }
+
+            if (ret.code != 0) {
+                log(machine, `${suite} > Bench`, chalk.bold.red('[error]'));
+
+                if (ret.stderr) {
+                    console.error('');
+
+                    let align = log.align + 9;
+                    let str = ' '.repeat(align) + 'Standard error:\n' +
+                              chalk.yellow(ret.stderr.replace(/^/gm, ' '.repeat(align + 4))) + '\n';
+                    console.error(str);
+                }
+
+                success = false;
+                return;
+            }
+
+            let counts = JSON.parse(ret.stdout);
+
+            if (results.machines[machine.key] == null)
+                results.machines[machine.key] = {};
+            results.machines[machine.key][suite] = counts;
+
+            for (let name in counts.cases) {
+                let value = counts.cases[name].koffi;
+                let status = `[${Math.round(value)}]`;
+
+                let previous = reference?.machines?.[machine.key]?.[suite]?.cases?.[name]?.koffi;
+
+                if (previous != null && previous > 0) {
+                    let delta = (value - previous) / previous * 100;
+                    let str = `[${Math.round(value)}, ${delta >= 0 ? '+' : ''}${delta.toFixed(1)}%]`;
+
+                    status = (delta > 0) ? chalk.bold.yellow(str) : chalk.bold.green(str);
+                } else {
+                    status = chalk.bold.green(status);
+                }
+
+                log(machine, `${suite} > ${name}`, status);
+            }
+        }));
+    }));
+
+    if (machines.some(machine => machine.started))
+        success &= await stop(false);
+
+    fs.mkdirSync('benchmarks', { recursive: true });
+    fs.writeFileSync(results_filename, JSON.stringify(results, null, 4));
+
+    console.log('');
+    console.log(`>> Results saved to qemu/${results_filename}`);
+
+    return success;
+}
+
 async function stop(all = true) {
     let success = true;
 
@@ -123,7 +123,7 @@ bool AnalyseFunction(Napi::Env, InstanceData *, FunctionInfo *func)
     return true;
 }
 
-bool CallData::Prepare(const Napi::CallbackInfo &info)
+bool CallData::Prepare(const napi_value *argv)
 {
     uint64_t *args_ptr = nullptr;
 
@@ -161,7 +161,7 @@ bool CallData::Prepare(const Napi::CallbackInfo &info)
         const ParameterInfo &param = func->parameters[i];
         RG_ASSERT(param.directions >= 1 && param.directions <= 3);
 
-        Napi::Value value = info[param.offset];
+        Napi::Value value(env, argv[param.offset]);
 
         switch (param.type->primitive) {
             case PrimitiveKind::Void: { RG_UNREACHABLE(); } break;
@@ -763,7 +763,11 @@ void *GetTrampoline(Size idx, const FunctionInfo *proto)
 
 extern "C" void RelayCallback(Size idx, uint8_t *own_sp, uint8_t *caller_sp, BackRegisters *out_reg)
 {
-    exec_call->Relay(idx, own_sp, caller_sp, out_reg);
+    if (RG_LIKELY(!IsTracing())) {
+        exec_call->Relay(idx, own_sp, caller_sp, out_reg);
+    } else {
+        exec_call->RelayAndTrace(idx, own_sp, caller_sp, out_reg);
+    }
 }
 
 }
@@ -0,0 +1,1126 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#include "vendor/libcc/libcc.hh"
+#include "cache.hh"
+#include "call.hh"
+#include "ffi.hh"
+#include "parser.hh"
+#include "util.hh"
+
+namespace RG {
+
+// Bump this each time the layout of the file, or of the structs dumped in it, changes
+static const uint32_t CacheVersion = 2;
+static const uint8_t CacheMagic[8] = { 'K', 'O', 'F', 'F', 'I', 'B', 'C', 0 };
+
+static const uint32_t NoIndex = UINT32_MAX;
+
+enum class CacheKind: uint8_t {
+    External, // Existing type, referenced by name
+    Pointer, // Made with MakePointerType()
+    Array, // Made with MakeArrayType()
+    Record,
+    Opaque,
+    Prototype,
+    Callback,
+    Disposable
+};
+
+struct CacheMember {
+    Span<const char> name;
+    uint32_t type;
+    int32_t offset;
+};
+
+struct CacheType {
+    CacheKind kind;
+    Span<const char> name;
+
+    PrimitiveKind primitive;
+    int32_t size;
+    int32_t align;
+
+    uint32_t ref; // Pointer, Array, Disposable, Prototype and Callback (index of prototype)
+    int32_t len; // Array only
+    TypeInfo::ArrayHint hint; // Array only
+    Size members_offset; // Record only
+    Size members_len;
+};
+
+// ABI-specific parts of ParameterInfo and FunctionInfo are not stored, AnalyseFunction()
+// computes them again when the bindings are loaded
+struct CacheParameter {
+    uint32_t type;
+    int8_t directions;
+};
+
+struct CacheFunction {
+    Span<const char> name;
+
+    CallConvention convention;
+    Size parameters_offset; // First one is the return value
+    Size parameters_len;
+    bool variadic;
+};
+
+struct CacheRegistration {
+    Span<const char> name;
+    uint32_t type;
+};
+
+class CacheWriter {
+    InstanceData *instance;
+    Size first_type;
+
+    HashMap<const void *, uint32_t> types_map;
+    HeapArray<const TypeInfo *> types;
+    HashMap<const void *, uint32_t> protos_map;
+    HeapArray<const FunctionInfo *> protos;
+
+    bool valid = true;
+
+public:
+    CacheWriter(InstanceData *instance, Size first_type) : instance(instance), first_type(first_type) {}
+
+    bool Write(const LibraryHolder *lib, Span<const char> source, const HeaderDeclarations &decls,
+               HeapArray<uint8_t> *out_buf);
+
+private:
+    uint32_t MapType(const TypeInfo *type);
+    uint32_t MapPrototype(const FunctionInfo *proto);
+
+    bool IsOwned(const TypeInfo *type) const;
+
+    void WriteType(const TypeInfo *type, HeapArray<uint8_t> *out_buf);
+    void WriteFunction(const FunctionInfo *func, HeapArray<uint8_t> *out_buf);
+};
+
+class CacheReader {
+    Span<const uint8_t> buf;
+    Size offset = 0;
+
+public:
+    bool valid = true;
+
+    HeapArray<CacheType> types;
+    HeapArray<CacheMember> members;
+    HeapArray<CacheFunction> protos;
+    HeapArray<CacheFunction> funcs;
+    HeapArray<CacheParameter> parameters;
+    HeapArray<CacheRegistration> registrations;
+    HeapArray<HeaderConstant> constants;
+    HeapArray<Span<const char>> constant_names;
+
+    CacheReader(Span<const uint8_t> buf) : buf(buf) {}
+
+    bool Read(const LibraryHolder *lib, Span<const char> source);
+
+    template <typename T>
+    T ReadValue()
+    {
+        T value = {};
+
+        if (RG_UNLIKELY(buf.len - offset < RG_SIZE(T))) {
+            valid = false;
+            return value;
+        }
+
+        memcpy((void *)&value, buf.ptr + offset, RG_SIZE(T));
+        offset += RG_SIZE(T);
+
+        return value;
+    }
+
+private:
+    Span<const char> ReadString();
+    uint32_t ReadIndex(Size max);
+
+    static bool IsDerived(const CacheType &type)
+    {
+        return type.kind == CacheKind::Pointer || type.kind == CacheKind::Array ||
+               (type.kind == CacheKind::Disposable && type.ref != NoIndex);
+    }
+    void ReadFunction(CacheFunction *out_func);
+
+    // Only valid once derived types are known to be free of cycles
+    PrimitiveKind GetPrimitive(uint32_t idx) const;
+    bool IsStructOfNumbers(uint32_t idx) const;
+    int64_t GetSize(uint32_t idx) const;
+
+    bool CheckTypes() const;
+    bool CheckFunction(const CacheFunction &func, bool proto) const;
+};
+
+template <typename T>
+static void WriteValue(HeapArray<uint8_t> *out_buf, T value)
+{
+    out_buf->Append(MakeSpan((const uint8_t *)&value, RG_SIZE(T)));
+}
+
+static void WriteString(HeapArray<uint8_t> *out_buf, Span<const char> str)
+{
+    WriteValue(out_buf, (uint32_t)str.len);
+    out_buf->Append(str.As<const uint8_t>());
+}
+
+static void WriteHeader(HeapArray<uint8_t> *out_buf, const LibraryHolder *lib, Span<const char> source)
+{
+    out_buf->Append(MakeSpan(CacheMagic, RG_SIZE(CacheMagic)));
+    WriteValue(out_buf, CacheVersion);
+    WriteString(out_buf, AbiName);
+
+    WriteValue(out_buf, lib->mtime);
+    WriteValue(out_buf, lib->size);
+
+    WriteValue(out_buf, (int64_t)source.len);
+    WriteValue(out_buf, HashTraits<const char *>::Hash(source));
+}
+
+bool CacheWriter::Write(const LibraryHolder *lib, Span<const char> source, const HeaderDeclarations &decls,
+                        HeapArray<uint8_t> *out_buf)
+{
+    HeapArray<uint8_t> types_buf;
+    HeapArray<uint8_t> protos_buf;
+    HeapArray<uint8_t> decls_buf;
+
+    WriteValue(&decls_buf, (uint32_t)decls.types.len);
+    for (const char *name: decls.types) {
+        const TypeInfo *type = instance->types_map.FindValue(name, nullptr);
+        RG_ASSERT(type);
+
+        WriteString(&decls_buf, name);
+        WriteValue(&decls_buf, MapType(type));
+    }
+
+    WriteValue(&decls_buf, (uint32_t)decls.constants.len);
+    for (const HeaderConstant &constant: decls.constants) {
+        WriteString(&decls_buf, constant.name);
+        WriteValue(&decls_buf, constant.value);
+    }
+
+    WriteValue(&decls_buf, (uint32_t)decls.funcs.len);
+    for (const FunctionInfo *func: decls.funcs) {
+        WriteFunction(func, &decls_buf);
+    }
+
+    // Types and prototypes reference each other, keep going until everything is written
+    for (Size i = 0, j = 0; i < types.len || j < protos.len;) {
+        if (i < types.len) {
+            WriteType(types[i++], &types_buf);
+        } else {
+            WriteFunction(protos[j++], &protos_buf);
+        }
+    }
+
+    if (!valid)
+        return false;
+
+    WriteHeader(out_buf, lib, source);
+    WriteValue(out_buf, (uint32_t)types.len);
+    out_buf->Append(types_buf);
+    WriteValue(out_buf, (uint32_t)protos.len);
+    out_buf->Append(protos_buf);
+    out_buf->Append(decls_buf);
+
+    return true;
+}
+
+uint32_t CacheWriter::MapType(const TypeInfo *type)
+{
+    std::pair<uint32_t *, bool> ret = types_map.TrySet(type, (uint32_t)types.len);
+
+    if (ret.second) {
+        types.Append(type);
+    }
+
+    return *ret.first;
+}
+
+uint32_t CacheWriter::MapPrototype(const FunctionInfo *proto)
+{
+    std::pair<uint32_t *, bool> ret = protos_map.TrySet(proto, (uint32_t)protos.len);
+
+    if (ret.second) {
+        protos.Append(proto);
+    }
+
+    return *ret.first;
+}
+
+bool CacheWriter::IsOwned(const TypeInfo *type) const
+{
+    return type->id >= first_type;
+}
+
+void CacheWriter::WriteType(const TypeInfo *type, HeapArray<uint8_t> *out_buf)
+{
+    if (!IsOwned(type)) {
+        // Types such as those made by koffi.disposable() cannot be rebuilt from the name
+        if (instance->types_map.FindValue(type->name, nullptr) != type) {
+            valid = false;
+            return;
+        }
+
+        WriteValue(out_buf, CacheKind::External);
+        WriteString(out_buf, type->name);
+        WriteValue(out_buf, type->primitive);
+        WriteValue(out_buf, type->size);
+        WriteValue(out_buf, type->align);
+
+        return;
+    }
+
+    if (type->dispose) {
+        bool pointer = (type->primitive == PrimitiveKind::Pointer ||
+                        type->primitive == PrimitiveKind::String ||
+                        type->primitive == PrimitiveKind::String16);
+
+        if (!pointer || !type->dispose_ref.IsEmpty()) {
+            valid = false;
+            return;
+        }
+
+        WriteValue(out_buf, CacheKind::Disposable);
+        WriteValue(out_buf, type->primitive);
+        WriteValue(out_buf, type->size);
+        WriteValue(out_buf, type->align);
+        WriteValue(out_buf, type->ref.type ? MapType(type->ref.type) : NoIndex);
+
+        return;
+    }
+
+    switch (type->primitive) {
+        case PrimitiveKind::Pointer: {
+            WriteValue(out_buf, CacheKind::Pointer);
+            WriteValue(out_buf, MapType(type->ref.type));
+        } break;
+
+        case PrimitiveKind::Array: {
+            WriteValue(out_buf, CacheKind::Array);
+            WriteValue(out_buf, MapType(type->ref.type));
+            WriteValue(out_buf, type->size / type->ref.type->size);
+            WriteValue(out_buf, type->hint);
+        } break;
+
+        case PrimitiveKind::Record: {
+            if (!type->construct.IsEmpty()) {
+                valid = false;
+                return;
+            }
+
+            WriteValue(out_buf, CacheKind::Record);
+            WriteString(out_buf, type->name);
+            WriteValue(out_buf, type->size);
+            WriteValue(out_buf, type->align);
+
+            WriteValue(out_buf, (uint32_t)type->members.len);
+            for (const RecordMember &member: type->members) {
+                WriteString(out_buf, member.name);
+                WriteValue(out_buf, MapType(member.type));
+                WriteValue(out_buf, member.offset);
+            }
+        } break;
+
+        case PrimitiveKind::Void: {
+            WriteValue(out_buf, CacheKind::Opaque);
+            WriteString(out_buf, type->name);
+        } break;
+
+        case PrimitiveKind::Prototype: {
+            WriteValue(out_buf, CacheKind::Prototype);
+            WriteString(out_buf, type->name);
+            WriteValue(out_buf, MapPrototype(type->ref.proto));
+        } break;
+
+        case PrimitiveKind::Callback: {
+            if (EndsWith(type->name, "*")) {
+                // Pointer to prototype, made by MakePointerType()
+                Span<const char> name = TrimStr(MakeSpan(type->name, strlen(type->name) - 1));
+                const TypeInfo *proto = instance->types_map.FindValue(name, nullptr);
+
+                if (!proto || proto->primitive != PrimitiveKind::Prototype) {
+                    valid = false;
+                    return;
+                }
+
+                WriteValue(out_buf, CacheKind::Pointer);
+                WriteValue(out_buf, MapType(proto));
+            } else {
+                WriteValue(out_buf, CacheKind::Callback);
+                WriteString(out_buf, type->name);
+                WriteValue(out_buf, MapPrototype(type->ref.proto));
+            }
+        } break;
+
+        default: {
+            // Headers do not create anything else
+            valid = false;
+        } break;
+    }
+}
+
+void CacheWriter::WriteFunction(const FunctionInfo *func, HeapArray<uint8_t> *out_buf)
+{
+    WriteString(out_buf, func->name);
+    WriteValue(out_buf, func->convention);
+
+    WriteValue(out_buf, (uint32_t)func->parameters.len);
+    for (Size i = -1; i < func->parameters.len; i++) {
+        const ParameterInfo &param = (i >= 0) ? func->parameters[i] : func->ret;
+
+        WriteValue(out_buf, MapType(param.type));
+        WriteValue(out_buf, (int8_t)param.directions);
+    }
+
+    WriteValue(out_buf, func->variadic);
+}
+
+bool CacheReader::Read(const LibraryHolder *lib, Span<const char> source)
+{
+    // Check header
+    {
+        Span<const uint8_t> magic = buf.Take(0, std::min(buf.len, (Size)RG_SIZE(CacheMagic)));
+
+        if (magic != MakeSpan(CacheMagic, RG_SIZE(CacheMagic)))
+            return false;
+        offset += RG_SIZE(CacheMagic);
+
+        if (ReadValue<uint32_t>() != CacheVersion)
+            return false;
+        if (ReadString() != AbiName)
+            return false;
+
+        if (ReadValue<int64_t>() != lib->mtime)
+            return false;
+        if (ReadValue<int64_t>() != lib->size)
+            return false;
+
+        if (ReadValue<int64_t>() != source.len)
+            return false;
+        if (ReadValue<uint64_t>() != HashTraits<const char *>::Hash(source))
+            return false;
+    }
+
+    uint32_t types_len = ReadValue<uint32_t>();
+    if (!valid || types_len > (uint32_t)(buf.len - offset))
+        return false;
+
+    for (uint32_t i = 0; valid && i < types_len; i++) {
+        CacheType *type = types.AppendDefault();
+
+        type->kind = ReadValue<CacheKind>();
+        type->ref = NoIndex;
+
+        switch (type->kind) {
+            case CacheKind::External: {
+                type->name = ReadString();
+                type->primitive = ReadValue<PrimitiveKind>();
+                type->size = ReadValue<int32_t>();
+                type->align = ReadValue<int32_t>();
+            } break;
+
+            case CacheKind::Pointer: {
+                type->ref = ReadIndex(types_len);
+            } break;
+
+            case CacheKind::Array: {
+                type->ref = ReadIndex(types_len);
+                type->len = ReadValue<int32_t>();
+                type->hint = ReadValue<TypeInfo::ArrayHint>();
+
+                valid &= (type->len > 0);
+            } break;
+
+            case CacheKind::Record: {
+                type->name = ReadString();
+                type->size = ReadValue<int32_t>();
+                type->align = ReadValue<int32_t>();
+
+                uint32_t len = ReadValue<uint32_t>();
+                if (!valid || len > (uint32_t)(buf.len - offset))
+                    return false;
+
+                type->members_offset = members.len;
+                type->members_len = (Size)len;
+
+                for (uint32_t j = 0; j < len; j++) {
+                    CacheMember *member = members.AppendDefault();
+
+                    member->name = ReadString();
+                    member->type = ReadIndex(types_len);
+                    member->offset = ReadValue<int32_t>();
+                }
+            } break;
+
+            case CacheKind::Opaque: {
+                type->name = ReadString();
+            } break;
+
+            case CacheKind::Prototype:
+            case CacheKind::Callback: {
+                type->name = ReadString();
+                type->ref = ReadValue<uint32_t>();
+            } break;
+
+            case CacheKind::Disposable: {
+                type->primitive = ReadValue<PrimitiveKind>();
+                type->size = ReadValue<int32_t>();
+                type->align = ReadValue<int32_t>();
+                type->ref = ReadValue<uint32_t>();
+
+                valid &= (type->ref == NoIndex || type->ref < types_len);
+            } break;
+
+            default: { valid = false; } break;
+        }
+    }
+    if (!valid)
+        return false;
+
+    // Derived types must not form cycles
+    for (Size i = 0; i < types.len; i++) {
+        Size idx = i;
+
+        for (Size steps = 0; IsDerived(types[idx]); steps++) {
+            if (steps >= types.len)
+                return false;
+
+            idx = types[idx].ref;
+        }
+    }
+
+    uint32_t protos_len = ReadValue<uint32_t>();
+    if (!valid || protos_len > (uint32_t)(buf.len - offset))
+        return false;
+
+    for (uint32_t i = 0; valid && i < protos_len; i++) {
+        CacheFunction *proto = protos.AppendDefault();
+        ReadFunction(proto);
+    }
+    for (const CacheType &type: types) {
+        if (type.kind == CacheKind::Prototype || type.kind == CacheKind::Callback) {
+            valid &= (type.ref < protos_len);
+        }
+    }
+    if (!valid)
+        return false;
+
+    uint32_t registrations_len = ReadValue<uint32_t>();
+    if (!valid || registrations_len > (uint32_t)(buf.len - offset))
+        return false;
+
+    for (uint32_t i = 0; valid && i < registrations_len; i++) {
+        CacheRegistration *registration = registrations.AppendDefault();
+
+        registration->name = ReadString();
+        registration->type = ReadIndex(types_len);
+    }
+
+    uint32_t constants_len = ReadValue<uint32_t>();
+    if (!valid || constants_len > (uint32_t)(buf.len - offset))
+        return false;
+
+    for (uint32_t i = 0; valid && i < constants_len; i++) {
+        constant_names.Append(ReadString());
+
+        HeaderConstant constant = { nullptr, ReadValue<int64_t>() };
+        constants.Append(constant);
+    }
+
+    uint32_t funcs_len = ReadValue<uint32_t>();
+    if (!valid || funcs_len > (uint32_t)(buf.len - offset))
+        return false;
+
+    for (uint32_t i = 0; valid && i < funcs_len; i++) {
+        CacheFunction *func = funcs.AppendDefault();
+        ReadFunction(func);
+    }
+    for (const CacheParameter &param: parameters) {
+        valid &= (param.type < types_len);
+    }
+
+    valid &= (offset == buf.len);
+    if (!valid)
+        return false;
+
+    // The file may be corrupt (or planted), check everything that native calls rely on
+    if (!CheckTypes())
+        return false;
+    for (const CacheFunction &proto: protos) {
+        if (!CheckFunction(proto, true))
+            return false;
+    }
+    for (const CacheFunction &func: funcs) {
+        if (!CheckFunction(func, false))
+            return false;
+    }
+
+    return true;
+}
+
+Span<const char> CacheReader::ReadString()
+{
+    uint32_t len = ReadValue<uint32_t>();
+
+    if (RG_UNLIKELY(!valid || len > (uint32_t)(buf.len - offset))) {
+        valid = false;
+        return {};
+    }
+
+    Span<const char> str = MakeSpan((const char *)buf.ptr + offset, (Size)len);
+    offset += (Size)len;
+
+    return str;
+}
+
+uint32_t CacheReader::ReadIndex(Size max)
+{
+    uint32_t idx = ReadValue<uint32_t>();
+    valid &= ((Size)idx < max);
+
+    return idx;
+}
+
+void CacheReader::ReadFunction(CacheFunction *out_func)
+{
+    out_func->name = ReadString();
+    out_func->convention = ReadValue<CallConvention>();
+
+    uint32_t len = ReadValue<uint32_t>();
+    if (!valid || len > MaxParameters) {
+        valid = false;
+        return;
+    }
+
+    out_func->parameters_offset = parameters.len;
+    out_func->parameters_len = (Size)len;
+
+    for (Size i = -1; i < (Size)len; i++) {
+        CacheParameter *param = parameters.AppendDefault();
+
+        param->type = ReadValue<uint32_t>();
+        param->directions = ReadValue<int8_t>();
+    }
+
+    out_func->variadic = ReadValue<bool>();
+}
+
+PrimitiveKind CacheReader::GetPrimitive(uint32_t idx) const
+{
+    const CacheType &type = types[idx];
+
+    switch (type.kind) {
+        case CacheKind::External:
+        case CacheKind::Disposable: return type.primitive;
+        case CacheKind::Pointer: {
+            // Same as MakePointerType()
+            bool proto = (types[type.ref].kind == CacheKind::Prototype);
+            return proto ? PrimitiveKind::Callback : PrimitiveKind::Pointer;
+        } break;
+        case CacheKind::Array: return PrimitiveKind::Array;
+        case CacheKind::Record: return PrimitiveKind::Record;
+        case CacheKind::Opaque: return PrimitiveKind::Void;
+        case CacheKind::Prototype: return PrimitiveKind::Prototype;
+        case CacheKind::Callback: return PrimitiveKind::Callback;
+    }
+
+    RG_UNREACHABLE();
+}
+
+// Same as CanUseStructOfArrays()
+bool CacheReader::IsStructOfNumbers(uint32_t idx) const
+{
+    const CacheType &type = types[idx];
+
+    if (type.kind != CacheKind::Record)
+        return false;
+    if (!type.members_len)
+        return false;
+
+    for (Size i = 0; i < type.members_len; i++) {
+        const CacheMember &member = members[type.members_offset + i];
+
+        switch (GetPrimitive(member.type)) {
+            case PrimitiveKind::Int8:
+            case PrimitiveKind::UInt8:
+            case PrimitiveKind::Int16:
+            case PrimitiveKind::UInt16:
+            case PrimitiveKind::Int32:
+            case PrimitiveKind::UInt32:
+            case PrimitiveKind::Float32:
+            case PrimitiveKind::Float64: {} break;
+
+            default: return false;
+        }
+    }
+
+    return true;
+}
+
+int64_t CacheReader::GetSize(uint32_t idx) const
+{
+    const CacheType &type = types[idx];
+
+    switch (type.kind) {
+        case CacheKind::External:
+        case CacheKind::Record:
+        case CacheKind::Disposable: return type.size;
+        case CacheKind::Pointer:
+        case CacheKind::Callback: return RG_SIZE(void *);
+        case CacheKind::Array: {
+            int64_t elem_size = GetSize(type.ref);
+
+            // Stop before it can overflow
+            if (elem_size <= 0 || type.len > INT32_MAX / elem_size)
+                return -1;
+
+            return type.len * elem_size;
+        } break;
+        case CacheKind::Opaque:
+        case CacheKind::Prototype: return 0;
+    }
+
+    RG_UNREACHABLE();
+}
+
+static bool IsStorable(PrimitiveKind primitive)
+{
+    return primitive != PrimitiveKind::Void && primitive != PrimitiveKind::Prototype;
+}
+
+bool CacheReader::CheckTypes() const
+{
+    for (Size i = 0; i < types.len; i++) {
+        const CacheType &type = types[i];
+
+        switch (type.kind) {
+            case CacheKind::External:
+            case CacheKind::Opaque:
+            case CacheKind::Pointer:
+            case CacheKind::Prototype:
+            case CacheKind::Callback: {} break;
+
+            case CacheKind::Array: {
+                if (!IsStorable(GetPrimitive(type.ref)))
+                    return false;
+                if (GetSize((uint32_t)i) <= 0)
+                    return false;
+
+                if ((int)type.hint < 0 || type.hint > TypeInfo::ArrayHint::StructOfArrays)
+                    return false;
+                if (type.hint == TypeInfo::ArrayHint::StructOfArrays && !IsStructOfNumbers(type.ref))
+                    return false;
+            } break;
+
+            case CacheKind::Record: {
+                if (type.size < 0 || type.align < 1 || type.align > 64 || (type.align & (type.align - 1)))
+                    return false;
+
+                for (Size j = 0; j < type.members_len; j++) {
+                    const CacheMember &member = members[type.members_offset + j];
+
+                    if (!IsStorable(GetPrimitive(member.type)))
+                        return false;
+
+                    int64_t size = GetSize(member.type);
+
+                    if (size <= 0 || member.offset < 0 || member.offset > type.size - size)
+                        return false;
+                }
+            } break;
+
+            case CacheKind::Disposable: {
+                if (type.primitive != PrimitiveKind::Pointer &&
+                        type.primitive != PrimitiveKind::String &&
+                        type.primitive != PrimitiveKind::String16)
+                    return false;
+                if (type.primitive == PrimitiveKind::Pointer && type.ref == NoIndex)
+                    return false;
+                if (type.size != RG_SIZE(void *) || type.align != alignof(void *))
+                    return false;
+            } break;
+        }
+    }
+
+    return true;
+}
+
+// Same rules as the prototype parser, so that AnalyseFunction() cannot fail
+bool CacheReader::CheckFunction(const CacheFunction &func, bool proto) const
+{
+    if ((int)func.convention < 0 || (int)func.convention >= RG_LEN(CallConventionNames))
+        return false;
+    if (func.variadic && (proto || func.convention != CallConvention::Cdecl))
+        return false;
+    if (func.parameters_len > MaxParameters)
+        return false;
+#if defined(__i386__) || defined(_M_IX86)
+    if (proto && func.convention != CallConvention::Cdecl && func.convention != CallConvention::Stdcall)
+        return false;
+#endif
+
+    Size out_parameters = 0;
+
+    for (Size i = 0; i <= func.parameters_len; i++) {
+        const CacheParameter &param = parameters[func.parameters_offset + i];
+        const CacheType &type = types[param.type];
+        PrimitiveKind primitive = GetPrimitive(param.type);
+
+        if (primitive == PrimitiveKind::Array || primitive == PrimitiveKind::Prototype)
+            return false;
+
+        if (!i) {
+            // Return value, see CanReturnType()
+            if (primitive == PrimitiveKind::Void && (type.kind != CacheKind::External || type.name != "void"))
+                return false;
+        } else {
+            if (primitive == PrimitiveKind::Void)
+                return false;
+            if (param.directions < 1 || param.directions > 3)
+                return false;
+            if ((param.directions & 2) && primitive != PrimitiveKind::Pointer)
+                return false;
+
+            out_parameters += !!(param.directions & 2);
+        }
+    }
+
+    if (out_parameters >= MaxOutParameters)
+        return false;
+
+    return true;
+}
+
+class CacheBuilder {
+    Napi::Env env;
+    InstanceData *instance;
+    const CacheReader *reader;
+
+    HeapArray<const TypeInfo *> types;
+    HeapArray<FunctionInfo *> protos;
+
+public:
+    CacheBuilder(Napi::Env env, InstanceData *instance, const CacheReader *reader)
+        : env(env), instance(instance), reader(reader)
+    {
+        types.AppendDefault(reader->types.len);
+        protos.AppendDefault(reader->protos.len);
+    }
+
+    const TypeInfo *BuildType(uint32_t idx);
+    void BuildFunction(const CacheFunction &src, FunctionInfo *func);
+
+private:
+    const char *DuplicateName(Span<const char> name)
+        { return InternString(instance, name); }
+
+    FunctionInfo *BuildPrototype(uint32_t idx);
+};
+
+const TypeInfo *CacheBuilder::BuildType(uint32_t idx)
+{
+    if (types[idx])
+        return types[idx];
+
+    const CacheType &src = reader->types[idx];
+
+    switch (src.kind) {
+        case CacheKind::External: {
+            types[idx] = instance->types_map.FindValue(src.name, nullptr);
+            RG_ASSERT(types[idx]);
+        } break;
+
+        case CacheKind::Pointer: {
+            const TypeInfo *ref = BuildType(src.ref);
+            types[idx] = MakePointerType(instance, ref);
+        } break;
+
+        case CacheKind::Array: {
+            const TypeInfo *ref = BuildType(src.ref);
+            types[idx] = MakeArrayType(instance, ref, src.len, src.hint);
+        } break;
+
+        case CacheKind::Record: {
+            TypeInfo *type = AllocateType(instance);
+            types[idx] = type;
+
+            type->name = DuplicateName(src.name);
+            type->primitive = PrimitiveKind::Record;
+            type->size = src.size;
+            type->align = src.align;
+
+            for (Size i = 0; i < src.members_len; i++) {
+                const CacheMember &member = reader->members[src.members_offset + i];
+                RecordMember *dest = type->members.AppendDefault();
+
+                dest->name = DuplicateName(member.name);
+                dest->type = BuildType(member.type);
+                dest->offset = member.offset;
+            }
+        } break;
+
+        case CacheKind::Opaque: {
+            TypeInfo *type = AllocateType(instance);
+            types[idx] = type;
+
+            type->name = DuplicateName(src.name);
+            type->primitive = PrimitiveKind::Void;
+        } break;
+
+        case CacheKind::Prototype:
+        case CacheKind::Callback: {
+            TypeInfo *type = AllocateType(instance);
+            types[idx] = type;
+
+            type->primitive = (src.kind == CacheKind::Callback) ? PrimitiveKind::Callback : PrimitiveKind::Prototype;
+            type->align = alignof(void *);
+            type->size = RG_SIZE(void *);
+            type->ref.proto = BuildPrototype(src.ref);
+            type->name = type->ref.proto->name;
+        } break;
+
+        case CacheKind::Disposable: {
+            TypeInfo *type = AllocateType(instance);
+            types[idx] = type;
+
+            type->name = "<anonymous>";
+            type->primitive = src.primitive;
+            type->size = src.size;
+            type->align = src.align;
+            type->ref.type = (src.ref != NoIndex) ? BuildType(src.ref) : nullptr;
+            if (type->ref.type) {
+                type->ref.type->pointee = true;
+            }
+            type->dispose = [](Napi::Env, const TypeInfo *, const void *ptr) { free((void *)ptr); };
+        } break;
+    }
+
+    return types[idx];
+}
+
+FunctionInfo *CacheBuilder::BuildPrototype(uint32_t idx)
+{
+    if (!protos[idx]) {
+        FunctionInfo *proto = instance->callbacks.AppendDefault();
+        protos[idx] = proto;
+
+        BuildFunction(reader->protos[idx], proto);
+
+        // The reader checked everything that could make it fail
+        if (!AnalyseFunction(env, instance, proto))
+            RG_UNREACHABLE();
+    }
+
+    return protos[idx];
+}
+
+void CacheBuilder::BuildFunction(const CacheFunction &src, FunctionInfo *func)
+{
+    func->name = DuplicateName(src.name);
+    func->convention = src.convention;
+
+    for (Size i = 0; i <= src.parameters_len; i++) {
+        const CacheParameter &param = reader->parameters[src.parameters_offset + i];
+        ParameterInfo *dest = i ? func->parameters.AppendDefault() : &func->ret;
+
+        dest->type = BuildType(param.type);
+
+        if (i) {
+            dest->directions = param.directions;
+            dest->offset = (int8_t)(i - 1);
+
+            func->out_parameters += !!(param.directions & 2);
+        }
+    }
+
+    func->variadic = src.variadic;
+}
+
+// Parsed headers are kept in memory for the whole process, so that each worker thread
+// binding the same library can rebuild its types without parsing the header again.
+// Live TypeInfo objects cannot be shared, they hold per-isolate references (defn, construct).
+// Only lib.declare() goes through here, lib.func() and koffi.struct() results stay per-isolate.
+struct SharedBinding {
+    mutable std::atomic_int refcount {1};
+
+    const void *module;
+    uint64_t hash;
+    HeapArray<uint8_t> buf;
+
+    const SharedBinding *Ref() const
+    {
+        refcount++;
+        return this;
+    }
+
+    void Unref() const
+    {
+        if (!--refcount) {
+            delete this;
+        }
+    }
+};
+
+static const Size MaxSharedBindings = 32;
+
+static std::mutex shared_mutex;
+static HeapArray<const SharedBinding *> shared_bindings;
+
+static const SharedBinding *FindSharedBinding(const LibraryHolder *lib, Span<const char> source)
+{
+    std::lock_guard<std::mutex> lock(shared_mutex);
+
+    uint64_t hash = HashTraits<const char *>::Hash(source);
+
+    for (const SharedBinding *binding: shared_bindings) {
+        if (binding->module == lib->module && binding->hash == hash)
+            return binding->Ref();
+    }
+
+    return nullptr;
+}
+
+static void PublishSharedBinding(const LibraryHolder *lib, Span<const char> source, HeapArray<uint8_t> *buf)
+{
+    std::lock_guard<std::mutex> lock(shared_mutex);
+
+    SharedBinding *binding = new SharedBinding();
+
+    binding->module = lib->module;
+    binding->hash = HashTraits<const char *>::Hash(source);
+    std::swap(binding->buf, *buf);
+
+    for (Size i = 0; i < shared_bindings.len; i++) {
+        const SharedBinding *it = shared_bindings[i];
+
+        if (it->module == binding->module && it->hash == binding->hash) {
+            shared_bindings[i] = binding;
+            it->Unref();
+
+            return;
+        }
+    }
+
+    if (shared_bindings.len >= MaxSharedBindings) {
+        // Drop the oldest one
+        shared_bindings[0]->Unref();
+        memmove_safe(shared_bindings.ptr, shared_bindings.ptr + 1, (shared_bindings.len - 1) * RG_SIZE(*shared_bindings.ptr));
+        shared_bindings.RemoveLast(1);
+    }
+    shared_bindings.Append(binding);
+}
+
+static bool BuildBindings(Napi::Env env, InstanceData *instance, Span<const uint8_t> buf, const LibraryHolder *lib,
+                          Span<const char> source, HeaderDeclarations *out_decls)
+{
+    CacheReader reader(buf);
+    if (!reader.Read(lib, source))
+        return false;
+
+    // Make sure nothing can fail once we start to create types
+    for (const CacheType &type: reader.types) {
+        if (type.kind == CacheKind::External) {
+            const TypeInfo *existing = instance->types_map.FindValue(type.name, nullptr);
+
+            if (!existing || existing->primitive != type.primitive ||
+                             existing->size != type.size ||
+                             existing->align != type.align)
+                return false;
+        }
+    }
+    for (const CacheRegistration &registration: reader.registrations) {
+        if (instance->types_map.Find(registration.name))
+            return false;
+    }
+
+    CacheBuilder builder(env, instance, &reader);
+
+    for (const CacheRegistration &registration: reader.registrations) {
+        const char *name = InternString(instance, registration.name);
+        const TypeInfo *type = builder.BuildType(registration.type);
+
+        // Names can repeat, for example with "typedef struct Foo Foo"
+        instance->types_map.TrySet(name, type);
+        out_decls->types.Append(name);
+    }
+
+    for (Size i = 0; i < reader.constants.len; i++) {
+        const char *name = InternString(instance, reader.constant_names[i]);
+        out_decls->constants.Append({ name, reader.constants[i].value });
+    }
+
+    for (const CacheFunction &src: reader.funcs) {
+        FunctionInfo *func = new FunctionInfo();
+        out_decls->funcs.Append(func);
+
+        builder.BuildFunction(src, func);
+    }
+
+    return true;
+}
+
+bool LoadBindingCache(Napi::Env env, InstanceData *instance, const char *filename, const LibraryHolder *lib,
+                      Span<const char> source, HeaderDeclarations *out_decls)
+{
+    // Try process-wide bindings first
+    {
+        const SharedBinding *binding = FindSharedBinding(lib, source);
+
+        if (binding) {
+            RG_DEFER { binding->Unref(); };
+
+            if (BuildBindings(env, instance, binding->buf, lib, source, out_decls)) {
+                instance->shared_headers++;
+                return true;
+            }
+        }
+    }
+
+    if (!filename || lib->mtime < 0)
+        return false;
+    if (!TestFile(filename, FileType::File))
+        return false;
+
+    HeapArray<uint8_t> buf;
+    if (ReadFile(filename, Mebibytes(64), &buf) < 0)
+        return false;
+
+    if (!BuildBindings(env, instance, buf, lib, source, out_decls))
+        return false;
+
+    PublishSharedBinding(lib, source, &buf);
+
+    return true;
+}
+
+bool SaveBindingCache(InstanceData *instance, const char *filename, const LibraryHolder *lib,
+                      Span<const char> source, Size first_type, const HeaderDeclarations &decls)
+{
+    CacheWriter writer(instance, first_type);
+    HeapArray<uint8_t> buf;
+
+    if (!writer.Write(lib, source, decls, &buf))
+        return false;
+
+    bool success = true;
+
+    if (filename && lib->mtime >= 0) {
+        success = WriteFile(buf, filename, (int)StreamWriterFlag::Atomic);
+    }
+    PublishSharedBinding(lib, source, &buf);
+
+    return success;
+}
+
+}
@@ -0,0 +1,36 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#pragma once
+
+#include "vendor/libcc/libcc.hh"
+
+#include <napi.h>
+
+namespace RG {
+
+struct InstanceData;
+struct LibraryHolder;
+struct HeaderDeclarations;
+
+// Bindings are looked up in memory first (shared by all threads), then in filename if not null.
+// Returns false if the cache is missing, stale or unusable, nothing is registered in this case.
+bool LoadBindingCache(Napi::Env env, InstanceData *instance, const char *filename, const LibraryHolder *lib,
+                      Span<const char> source, HeaderDeclarations *out_decls);
+
+// Types allocated with an id >= first_type belong to the header, anything older is referenced by name.
+// The bindings are always shared with other threads, and written to filename if not null.
+bool SaveBindingCache(InstanceData *instance, const char *filename, const LibraryHolder *lib,
+                      Span<const char> source, Size first_type, const HeaderDeclarations &decls);
+
+}
@@ -36,6 +36,13 @@ CallData::~CallData()
     for (const OutArgument &out: out_arguments) {
         napi_delete_reference(env, out.ref);
     }
+    for (napi_ref ref: retained_buffers) {
+        napi_delete_reference(env, ref);
+    }
+
+    for (const BorrowedBlock &block: borrowed_blocks) {
+        instance->heap_cache.Return(block.ptr, block.cls, instance->heap_cache_size);
+    }
 
     mem->stack = old_stack_mem;
     mem->heap = old_heap_mem;
@@ -48,6 +55,24 @@ CallData::~CallData()
     }
 }
 
+uint8_t *CallData::AllocBig(Size size)
+{
+    heap_fallbacks++;
+
+    int cls = std::max(MinHeapClass, 64 - CountLeadingZeros((uint64_t)(size - 1)));
+
+    if (cls <= MaxHeapClass && borrowed_blocks.Available()) {
+        void *ptr = instance->heap_cache.Borrow(cls);
+
+        if (RG_LIKELY(ptr)) {
+            borrowed_blocks.Append({ ptr, cls });
+            return (uint8_t *)ptr;
+        }
+    }
+
+    return (uint8_t *)AllocateRaw(&call_alloc, size);
+}
+
 bool CallData::PushString(Napi::Value value, const char **out_str)
 {
     if (value.IsString()) {
@@ -70,7 +95,7 @@ bool CallData::PushString(Napi::Value value, const char **out_str)
             status = napi_get_value_string_utf8(env, value, nullptr, 0, &len);
             RG_ASSERT(status == napi_ok);
 
-            buf = AllocateSpan<char>(&call_alloc, (Size)len + 1);
+            buf = MakeSpan((char *)AllocBig((Size)len + 1), (Size)len + 1);
 
             status = napi_get_value_string_utf8(env, value, buf.ptr, (size_t)buf.len, &len);
             RG_ASSERT(status == napi_ok);
@@ -81,6 +106,9 @@ bool CallData::PushString(Napi::Value value, const char **out_str)
     } else if (IsNullOrUndefined(value)) {
         *out_str = nullptr;
         return true;
+    } else if (CheckValueTag(instance, value, &EncodedStringMarker)) {
+        *out_str = value.As<Napi::External<char>>().Data();
+        return true;
     } else {
         ThrowError<Napi::TypeError>(env, "Unexpected %1 value, expected string", GetValueType(instance, value));
         return false;
@@ -109,7 +137,7 @@ bool CallData::PushString16(Napi::Value value, const char16_t **out_str16)
             status = napi_get_value_string_utf16(env, value, nullptr, 0, &len);
             RG_ASSERT(status == napi_ok);
 
-            buf = AllocateSpan<char16_t>(&call_alloc, ((Size)len + 1) * 2);
+            buf = MakeSpan((char16_t *)AllocBig(((Size)len + 1) * 2), (Size)len + 1);
 
             status = napi_get_value_string_utf16(env, value, buf.ptr, (size_t)buf.len, &len);
             RG_ASSERT(status == napi_ok);
@@ -120,17 +148,62 @@ bool CallData::PushString16(Napi::Value value, const char16_t **out_str16)
     } else if (IsNullOrUndefined(value)) {
         *out_str16 = nullptr;
         return true;
+    } else if (CheckValueTag(instance, value, &EncodedString16Marker)) {
+        *out_str16 = value.As<Napi::External<char16_t>>().Data();
+        return true;
     } else {
         ThrowError<Napi::TypeError>(env, "Unexpected %1 value, expected string", GetValueType(instance, value));
         return false;
     }
 }
 
-bool CallData::PushObject(Napi::Object obj, const TypeInfo *type, uint8_t *origin, int16_t realign)
+static FrozenObject *UnwrapFrozenObject(InstanceData *instance, Napi::Object obj)
+{
+    if (!CheckValueTag(instance, obj, &FrozenMarker))
+        return nullptr;
+
+    void *ptr = nullptr;
+    napi_status status = napi_unwrap(obj.Env(), obj, &ptr);
+    RG_ASSERT(status == napi_ok);
+
+    return (FrozenObject *)ptr;
+}
+
+bool CallData::PushObject(Napi::Object obj, const TypeInfo *type, uint8_t *origin, int32_t realign)
 {
     RG_ASSERT(IsObject(obj));
     RG_ASSERT(type->primitive == PrimitiveKind::Record);
 
+    FrozenObject *frozen = nullptr;
+
+    // Skip the lookup entirely until koffi.freeze() gets used
+    if (RG_UNLIKELY(instance->frozen_objects)) {
+        frozen = UnwrapFrozenObject(instance, obj);
+
+        if (frozen) {
+            for (const FrozenObject::Encoding &encoding: frozen->encodings) {
+                if (encoding.type == type) {
+                    if (realign) {
+                        // Arrays and nested records are spread element by element when realigned,
+                        // only flat records can be moved member by member
+                        if (!IsFlatRecord(type))
+                            break;
+
+                        // Encoded bytes use the struct layout, move each member to its slot
+                        for (Size i = 0; i < type->members.len; i++) {
+                            const RecordMember &member = type->members[i];
+                            memcpy(origin + i * realign, encoding.bytes.ptr + member.offset, (size_t)member.type->size);
+                        }
+                    } else {
+                        memcpy(origin, encoding.bytes.ptr, (size_t)type->size);
+                    }
+
+                    return true;
+                }
+            }
+        }
+    }
+
     for (Size i = 0; i < type->members.len; i++) {
         const RecordMember &member = type->members[i];
         Napi::Value value = obj.Get(member.name);
@@ -328,6 +401,12 @@ bool CallData::PushObject(Napi::Object obj, const TypeInfo *type, uint8_t *origi
                 } else if (value.IsString() && !realign) {
                     if (!PushStringArray(value, member.type, dest))
                         return false;
+                } else if (member.type->hint == TypeInfo::ArrayHint::StructOfArrays && IsObject(value) && !realign) {
+                    Napi::Object obj2 = value.As<Napi::Object>();
+                    Size len = (Size)member.type->size / member.type->ref.type->size;
+
+                    if (!PushStructOfArrays(obj2, len, member.type->ref.type, dest))
+                        return false;
                 } else {
                     ThrowError<Napi::TypeError>(env, "Unexpected %1 value, expected array", GetValueType(instance, value));
                     return false;
@@ -377,10 +456,18 @@ bool CallData::PushObject(Napi::Object obj, const TypeInfo *type, uint8_t *origi
         }
     }
 
+    if (frozen && !realign && frozen->encodings.Available() && CanCacheEncoding(type)) {
+        FrozenObject::Encoding *encoding = frozen->encodings.AppendDefault();
+
+        encoding->type = type;
+        encoding->bytes.Append(MakeSpan(origin, type->size));
+        type->pins++;
+    }
+
     return true;
 }
 
-bool CallData::PushNormalArray(Napi::Array array, Size len, const TypeInfo *ref, uint8_t *origin, int16_t realign)
+bool CallData::PushNormalArray(Napi::Array array, Size len, const TypeInfo *ref, uint8_t *origin, int32_t realign)
 {
     RG_ASSERT(array.IsArray());
 
@@ -396,7 +483,7 @@ bool CallData::PushNormalArray(Napi::Array array, Size len, const TypeInfo *ref,
             for (Size i = 0; i < len; i++) { \
                 Napi::Value value = array[(uint32_t)i]; \
                  \
-                int16_t align = std::max(ref->align, realign); \
+                int32_t align = std::max(ref->align, realign); \
                  \
                 offset = AlignLen(offset, align); \
                 uint8_t *dest = origin + offset; \
@@ -543,7 +630,7 @@ bool CallData::PushNormalArray(Napi::Array array, Size len, const TypeInfo *ref,
             for (Size i = 0; i < len; i++) {
                 Napi::Value value = array[(uint32_t)i];
 
-                int16_t align = std::max(ref->align, realign);
+                int32_t align = std::max(ref->align, realign);
                 offset = AlignLen(offset, align);
 
                 uint8_t *dest = origin + offset;
@@ -563,6 +650,12 @@ bool CallData::PushNormalArray(Napi::Array array, Size len, const TypeInfo *ref,
                 } else if (value.IsString() && !realign) {
                     if (!PushStringArray(value, ref, dest))
                         return false;
+                } else if (ref->hint == TypeInfo::ArrayHint::StructOfArrays && IsObject(value) && !realign) {
+                    Napi::Object obj2 = value.As<Napi::Object>();
+                    Size len2 = (Size)ref->size / ref->ref.type->size;
+
+                    if (!PushStructOfArrays(obj2, len2, ref->ref.type, dest))
+                        return false;
                 } else {
                     ThrowError<Napi::TypeError>(env, "Unexpected %1 value, expected array", GetValueType(instance, value));
                     return false;
@@ -587,7 +680,7 @@ bool CallData::PushNormalArray(Napi::Array array, Size len, const TypeInfo *ref,
             for (Size i = 0; i < len; i++) {
                 Napi::Value value = array[(uint32_t)i];
 
-                int16_t align = std::max(ref->align, realign);
+                int32_t align = std::max(ref->align, realign);
                 offset = AlignLen(offset, align);
 
                 uint8_t *dest = origin + offset;
@@ -624,7 +717,7 @@ bool CallData::PushNormalArray(Napi::Array array, Size len, const TypeInfo *ref,
     return true;
 }
 
-bool CallData::PushTypedArray(Napi::TypedArray array, Size len, const TypeInfo *ref, uint8_t *origin, int16_t realign)
+bool CallData::PushTypedArray(Napi::TypedArray array, Size len, const TypeInfo *ref, uint8_t *origin, int32_t realign)
 {
     RG_ASSERT(array.IsTypedArray());
 
@@ -691,6 +784,84 @@ bool CallData::PushStringArray(Napi::Value obj, const TypeInfo *type, uint8_t *o
     return true;
 }
 
+// Records made of scalar members can be passed as one TypedArray per member (struct of
+// arrays), detect this by looking at the first member. Returns -1 for plain objects.
+static Size GetStructOfArraysLength(Napi::Object obj, const TypeInfo *type)
+{
+    RG_ASSERT(CanUseStructOfArrays(type));
+
+    const RecordMember &first = type->members[0];
+    Napi::Value value = obj.Get(first.name);
+
+    if (!value.IsTypedArray())
+        return -1;
+
+    Napi::TypedArray array = value.As<Napi::TypedArray>();
+    return (Size)array.ElementLength();
+}
+
+// Keep the element size known at compile time, so that the compiler can turn these
+// strided copies into plain loads and stores (and vectorize them when possible).
+template <typename T>
+static void ScatterMember(uint8_t *dest, Size stride, const uint8_t *src, Size len)
+{
+    for (Size i = 0; i < len; i++) {
+        memcpy(dest + i * stride, src + i * RG_SIZE(T), RG_SIZE(T));
+    }
+}
+
+template <typename T>
+static void GatherMember(uint8_t *dest, const uint8_t *src, Size stride, Size len)
+{
+    for (Size i = 0; i < len; i++) {
+        memcpy(dest + i * RG_SIZE(T), src + i * stride, RG_SIZE(T));
+    }
+}
+
+bool CallData::PushStructOfArrays(Napi::Object obj, Size len, const TypeInfo *type, uint8_t *origin)
+{
+    RG_ASSERT(type->primitive == PrimitiveKind::Record);
+
+    for (const RecordMember &member: type->members) {
+        Napi::Value value = obj.Get(member.name);
+        int array_type = GetTypedArrayType(member.type);
+
+        if (RG_UNLIKELY(array_type < 0)) {
+            ThrowError<Napi::TypeError>(env, "Cannot use struct of arrays for %1 (member '%2' is not a number)", type->name, member.name);
+            return false;
+        }
+        if (RG_UNLIKELY(!value.IsTypedArray())) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for member '%2', expected TypedArray", GetValueType(instance, value), member.name);
+            return false;
+        }
+
+        Napi::TypedArray array = value.As<Napi::TypedArray>();
+
+        if (RG_UNLIKELY(array.TypedArrayType() != array_type)) {
+            ThrowError<Napi::TypeError>(env, "Cannot use %1 value for member '%2' (%3)", GetValueType(instance, array), member.name, member.type->name);
+            return false;
+        }
+        if (RG_UNLIKELY(array.ElementLength() != (size_t)len)) {
+            ThrowError<Napi::Error>(env, "Expected array of length %1 for member '%2', got %3", len, member.name, array.ElementLength());
+            return false;
+        }
+
+        const uint8_t *src = (const uint8_t *)array.ArrayBuffer().Data() + array.ByteOffset();
+        uint8_t *dest = origin + member.offset;
+
+        switch (member.type->size) {
+            case 1: { ScatterMember<uint8_t>(dest, type->size, src, len); } break;
+            case 2: { ScatterMember<uint16_t>(dest, type->size, src, len); } break;
+            case 4: { ScatterMember<uint32_t>(dest, type->size, src, len); } break;
+            case 8: { ScatterMember<uint64_t>(dest, type->size, src, len); } break;
+
+            default: { RG_UNREACHABLE(); } break;
+        }
+    }
+
+    return true;
+}
+
 bool CallData::PushPointer(Napi::Value value, const TypeInfo *type, int directions, void **out_ptr)
 {
     if (CheckValueTag(instance, value, &CastMarker)) {
@@ -757,10 +928,84 @@ bool CallData::PushPointer(Napi::Value value, const TypeInfo *type, int directio
 
                     memset(ptr, 0, size);
                 }
+            } else if (CheckValueTag(instance, value, &OutBufferMarker)) {
+                OutBuffer *buf = nullptr;
+
+                napi_status status = napi_unwrap(env, value, (void **)&buf);
+                RG_ASSERT(status == napi_ok);
+
+                // Arrays can be passed to pointers of their element type
+                const TypeInfo *ref = buf->type;
+                if (ref->primitive == PrimitiveKind::Array && ref != type->ref.type) {
+                    ref = ref->ref.type;
+                }
+
+                if (RG_UNLIKELY(ref != type->ref.type && type->ref.type != instance->void_type)) {
+                    ThrowError<Napi::TypeError>(env, "Cannot use %1 output buffer for %2 value", buf->type->name, type->name);
+                    return false;
+                }
+
+                // The native function may change it, decode it again on next read
+                buf->dirty = true;
+
+                if (retain_buffers) {
+                    napi_ref ref;
+
+                    napi_status status = napi_create_reference(env, value, 1, &ref);
+                    RG_ASSERT(status == napi_ok);
+
+                    retained_buffers.Append(ref);
+                }
+
+                *out_ptr = buf->ptr;
+                return true;
             } else if (RG_LIKELY(type->ref.type->primitive == PrimitiveKind::Record)) {
                 Napi::Object obj = value.As<Napi::Object>();
                 RG_ASSERT(IsObject(value));
 
+                // Skip the lookup entirely until koffi.soa() gets used
+                if (RG_UNLIKELY(instance->soa_objects) && CheckValueTag(instance, obj, &StructOfArraysMarker)) {
+                    const TypeInfo *record = type->ref.type;
+
+                    if (RG_UNLIKELY(!CanUseStructOfArrays(record))) {
+                        ThrowError<Napi::TypeError>(env, "Cannot use struct of arrays for %1 (members must be numbers)", record->name);
+                        return false;
+                    }
+
+                    Size soa_len = GetStructOfArraysLength(obj, record);
+
+                    if (RG_UNLIKELY(soa_len < 0)) {
+                        Napi::Value first = obj.Get(record->members[0].name);
+                        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for member '%2', expected TypedArray", GetValueType(instance, first), record->members[0].name);
+                        return false;
+                    }
+
+                    Size size = soa_len * type->ref.type->size;
+
+                    ptr = AllocHeap(size, 16);
+
+                    if (directions & 1) {
+                        if (!PushStructOfArrays(obj, soa_len, type->ref.type, ptr))
+                            return false;
+                    } else {
+                        memset(ptr, 0, size);
+                    }
+
+                    if (directions & 2) {
+                        OutArgument *out = out_arguments.AppendDefault();
+
+                        napi_status status = napi_create_reference(env, value, 1, &out->ref);
+                        RG_ASSERT(status == napi_ok);
+
+                        out->ptr = ptr;
+                        out->type = type->ref.type;
+                        out->soa_len = soa_len;
+                    }
+
+                    *out_ptr = ptr;
+                    return true;
+                }
+
                 ptr = AllocHeap(type->ref.type->size, 16);
 
                 if (directions & 1) {
@@ -769,6 +1014,35 @@ bool CallData::PushPointer(Napi::Value value, const TypeInfo *type, int directio
                 } else {
                     memset(ptr, 0, type->size);
                 }
+            } else if (type->ref.type->hint == TypeInfo::ArrayHint::StructOfArrays &&
+                       type->ref.type->primitive == PrimitiveKind::Array) {
+                Napi::Object obj = value.As<Napi::Object>();
+
+                const TypeInfo *record = type->ref.type->ref.type;
+                Size len = (Size)type->ref.type->size / record->size;
+
+                ptr = AllocHeap(type->ref.type->size, 16);
+
+                if (directions & 1) {
+                    if (!PushStructOfArrays(obj, len, record, ptr))
+                        return false;
+                } else {
+                    memset(ptr, 0, type->ref.type->size);
+                }
+
+                if (directions & 2) {
+                    OutArgument *out = out_arguments.AppendDefault();
+
+                    napi_status status = napi_create_reference(env, value, 1, &out->ref);
+                    RG_ASSERT(status == napi_ok);
+
+                    out->ptr = ptr;
+                    out->type = record;
+                    out->soa_len = len;
+                }
+
+                *out_ptr = ptr;
+                return true;
             } else {
                 goto unexpected;
             }
@@ -811,15 +1085,18 @@ void CallData::PopOutArguments()
         Napi::Value value = GetReferenceValue(env, out.ref);
         RG_ASSERT(!value.IsEmpty());
 
-        if (value.IsArray()) {
+        if (out.soa_len >= 0) {
+            Napi::Object obj(env, value);
+            DecodeStructOfArrays(obj, out.ptr, out.type, out.soa_len);
+        } else if (value.IsArray()) {
             Napi::Array array(env, value);
-            PopNormalArray(array, out.ptr, out.type);
+            DecodeNormalArray(array, out.ptr, out.type);
         } else if (value.IsTypedArray()) {
             Napi::TypedArray array(env, value);
-            PopTypedArray(array, out.ptr, out.type);
+            DecodeTypedArray(array, out.ptr, out.type);
         } else {
             Napi::Object obj(env, value);
-            PopObject(obj, out.ptr, out.type);
+            DecodeObject(obj, out.ptr, out.type);
         }
 
         if (out.type->dispose) {
@@ -828,6 +1105,15 @@ void CallData::PopOutArguments()
     }
 }
 
+void CallData::RelayAndTrace(Size idx, uint8_t *own_sp, uint8_t *caller_sp, BackRegisters *out_reg)
+{
+    const FunctionInfo *proto = instance->trampolines[idx].proto;
+
+    int64_t start = GetCallClock();
+    Relay(idx, own_sp, caller_sp, out_reg);
+    RecordTrace(TraceKind::Callback, proto->name, start, GetCallClock());
+}
+
 void *CallData::ReserveTrampoline(const FunctionInfo *proto, Napi::Function func)
 {
     if (RG_UNLIKELY(instance->temp_trampolines >= MaxTrampolines)) {
@@ -851,7 +1137,142 @@ void *CallData::ReserveTrampoline(const FunctionInfo *proto, Napi::Function func
     return ptr;
 }
 
-void CallData::PopObject(Napi::Object obj, const uint8_t *origin, const TypeInfo *type, int16_t realign)
+static inline Napi::Value DecodeValue(Napi::Env env, InstanceData *instance, const uint8_t *src,
+                                      const TypeInfo *type, int32_t realign)
+{
+    switch (type->primitive) {
+        case PrimitiveKind::Void: { RG_UNREACHABLE(); } break;
+
+        case PrimitiveKind::Bool: {
+            bool b = *(bool *)src;
+            return Napi::Boolean::New(env, b);
+        } break;
+        case PrimitiveKind::Int8: {
+            double d = (double)*(int8_t *)src;
+            return Napi::Number::New(env, d);
+        } break;
+        case PrimitiveKind::UInt8: {
+            double d = (double)*(uint8_t *)src;
+            return Napi::Number::New(env, d);
+        } break;
+        case PrimitiveKind::Int16: {
+            double d = (double)*(int16_t *)src;
+            return Napi::Number::New(env, d);
+        } break;
+        case PrimitiveKind::Int16S: {
+            int16_t v = *(int16_t *)src;
+            double d = (double)ReverseBytes(v);
+
+            return Napi::Number::New(env, d);
+        } break;
+        case PrimitiveKind::UInt16: {
+            double d = (double)*(uint16_t *)src;
+            return Napi::Number::New(env, d);
+        } break;
+        case PrimitiveKind::UInt16S: {
+            uint16_t v = *(uint16_t *)src;
+            double d = (double)ReverseBytes(v);
+
+            return Napi::Number::New(env, d);
+        } break;
+        case PrimitiveKind::Int32: {
+            double d = (double)*(int32_t *)src;
+            return Napi::Number::New(env, d);
+        } break;
+        case PrimitiveKind::Int32S: {
+            int32_t v = *(int32_t *)src;
+            double d = (double)ReverseBytes(v);
+
+            return Napi::Number::New(env, d);
+        } break;
+        case PrimitiveKind::UInt32: {
+            double d = (double)*(uint32_t *)src;
+            return Napi::Number::New(env, d);
+        } break;
+        case PrimitiveKind::UInt32S: {
+            uint32_t v = *(uint32_t *)src;
+            double d = (double)ReverseBytes(v);
+
+            return Napi::Number::New(env, d);
+        } break;
+        case PrimitiveKind::Int64: {
+            int64_t v = *(int64_t *)src;
+            return NewBigInt(env, v);
+        } break;
+        case PrimitiveKind::Int64S: {
+            int64_t v = ReverseBytes(*(int64_t *)src);
+            return NewBigInt(env, v);
+        } break;
+        case PrimitiveKind::UInt64: {
+            uint64_t v = *(uint64_t *)src;
+            return NewBigInt(env, v);
+        } break;
+        case PrimitiveKind::UInt64S: {
+            uint64_t v = ReverseBytes(*(uint64_t *)src);
+            return NewBigInt(env, v);
+        } break;
+        case PrimitiveKind::String: {
+            const char *str = *(const char **)src;
+            Napi::Value value = str ? Napi::String::New(env, str) : env.Null();
+
+            if (type->dispose) {
+                type->dispose(env, type, str);
+            }
+
+            return value;
+        } break;
+        case PrimitiveKind::String16: {
+            const char16_t *str16 = *(const char16_t **)src;
+            Napi::Value value = str16 ? Napi::String::New(env, str16) : env.Null();
+
+            if (type->dispose) {
+                type->dispose(env, type, str16);
+            }
+
+            return value;
+        } break;
+        case PrimitiveKind::Pointer:
+        case PrimitiveKind::Callback: {
+            void *ptr2 = *(void **)src;
+            Napi::Value value = env.Null();
+
+            if (ptr2) {
+                Napi::External<void> external = Napi::External<void>::New(env, ptr2);
+                SetValueTag(instance, external, type->ref.marker);
+
+                value = external;
+            }
+
+            if (type->dispose) {
+                type->dispose(env, type, ptr2);
+            }
+
+            return value;
+        } break;
+        case PrimitiveKind::Record: {
+            Napi::Object obj = DecodeObject(env, src, type, realign);
+            return obj;
+        } break;
+        case PrimitiveKind::Array: {
+            Napi::Value value = DecodeArray(env, src, type, realign);
+            return value;
+        } break;
+        case PrimitiveKind::Float32: {
+            float f = *(float *)src;
+            return Napi::Number::New(env, (double)f);
+        } break;
+        case PrimitiveKind::Float64: {
+            double d = *(double *)src;
+            return Napi::Number::New(env, d);
+        } break;
+
+        case PrimitiveKind::Prototype: { RG_UNREACHABLE(); } break;
+    }
+
+    RG_UNREACHABLE();
+}
+
+void DecodeObject(Napi::Object obj, const uint8_t *origin, const TypeInfo *type, int32_t realign)
 {
     Napi::Env env = obj.Env();
     InstanceData *instance = env.GetInstanceData<InstanceData>();
@@ -864,139 +1285,211 @@ void CallData::PopObject(Napi::Object obj, const uint8_t *origin, const TypeInfo
         Size offset = realign ? (i * realign) : member.offset;
         const uint8_t *src = origin + offset;
 
-        switch (member.type->primitive) {
-            case PrimitiveKind::Void: { RG_UNREACHABLE(); } break;
+        Napi::Value value = DecodeValue(env, instance, src, member.type, realign);
+        obj.Set(member.name, value);
+    }
+}
 
-            case PrimitiveKind::Bool: {
-                bool b = *(bool *)src;
-                obj.Set(member.name, Napi::Boolean::New(env, b));
-            } break;
-            case PrimitiveKind::Int8: {
-                double d = (double)*(int8_t *)src;
-                obj.Set(member.name, Napi::Number::New(env, d));
-            } break;
-            case PrimitiveKind::UInt8: {
-                double d = (double)*(uint8_t *)src;
-                obj.Set(member.name, Napi::Number::New(env, d));
-            } break;
-            case PrimitiveKind::Int16: {
-                double d = (double)*(int16_t *)src;
-                obj.Set(member.name, Napi::Number::New(env, d));
-            } break;
-            case PrimitiveKind::Int16S: {
-                int16_t v = *(int16_t *)src;
-                double d = (double)ReverseBytes(v);
+// Lazy objects keep a copy of the native struct, and each member is only decoded on first
+// access. The decoded value is then stored as an own property, which shadows the accessor.
+// The copy lives in an ArrayBuffer, so that number array members (such as big sample
+// buffers) can be exposed as TypedArray views without copying them again.
+static const int LazyObjectMarker = 0xDEADBEEF;
 
-                obj.Set(member.name, Napi::Number::New(env, d));
-            } break;
-            case PrimitiveKind::UInt16: {
-                double d = (double)*(uint16_t *)src;
-                obj.Set(member.name, Napi::Number::New(env, d));
-            } break;
-            case PrimitiveKind::UInt16S: {
-                uint16_t v = *(uint16_t *)src;
-                double d = (double)ReverseBytes(v);
+static napi_ref UnwrapLazyObject(InstanceData *instance, Napi::Object obj)
+{
+    if (!CheckValueTag(instance, obj, &LazyObjectMarker))
+        return nullptr;
 
-                obj.Set(member.name, Napi::Number::New(env, d));
-            } break;
-            case PrimitiveKind::Int32: {
-                double d = (double)*(int32_t *)src;
-                obj.Set(member.name, Napi::Number::New(env, d));
-            } break;
-            case PrimitiveKind::Int32S: {
-                int32_t v = *(int32_t *)src;
-                double d = (double)ReverseBytes(v);
+    void *ref = nullptr;
+    napi_status status = napi_unwrap(obj.Env(), obj, &ref);
+    RG_ASSERT(status == napi_ok);
 
-                obj.Set(member.name, Napi::Number::New(env, d));
-            } break;
-            case PrimitiveKind::UInt32: {
-                double d = (double)*(uint32_t *)src;
-                obj.Set(member.name, Napi::Number::New(env, d));
-            } break;
-            case PrimitiveKind::UInt32S: {
-                uint32_t v = *(uint32_t *)src;
-                double d = (double)ReverseBytes(v);
+    return (napi_ref)ref;
+}
 
-                obj.Set(member.name, Napi::Number::New(env, d));
-            } break;
-            case PrimitiveKind::Int64: {
-                int64_t v = *(int64_t *)src;
-                obj.Set(member.name, NewBigInt(env, v));
-            } break;
-            case PrimitiveKind::Int64S: {
-                int64_t v = ReverseBytes(*(int64_t *)src);
-                obj.Set(member.name, NewBigInt(env, v));
-            } break;
-            case PrimitiveKind::UInt64: {
-                uint64_t v = *(uint64_t *)src;
-                obj.Set(member.name, NewBigInt(env, v));
-            } break;
-            case PrimitiveKind::UInt64S: {
-                uint64_t v = ReverseBytes(*(uint64_t *)src);
-                obj.Set(member.name, NewBigInt(env, v));
-            } break;
-            case PrimitiveKind::String: {
-                const char *str = *(const char **)src;
-                obj.Set(member.name, str ? Napi::String::New(env, str) : env.Null());
+static Napi::Value MapLazyArray(Napi::Env env, Napi::ArrayBuffer buffer, const RecordMember *member)
+{
+    const TypeInfo *type = member->type;
 
-                if (member.type->dispose) {
-                    member.type->dispose(env, member.type, str);
-                }
-            } break;
-            case PrimitiveKind::String16: {
-                const char16_t *str16 = *(const char16_t **)src;
-                obj.Set(member.name, str16 ? Napi::String::New(env, str16) : env.Null());
+    if (type->primitive != PrimitiveKind::Array)
+        return Napi::Value();
+    if (type->hint != TypeInfo::ArrayHint::TypedArray)
+        return Napi::Value();
 
-                if (member.type->dispose) {
-                    member.type->dispose(env, member.type, str16);
-                }
-            } break;
-            case PrimitiveKind::Pointer:
-            case PrimitiveKind::Callback: {
-                void *ptr2 = *(void **)src;
+    const TypeInfo *ref = type->ref.type;
+    int array_type = GetTypedArrayType(ref);
 
-                if (ptr2) {
-                    Napi::External<void> external = Napi::External<void>::New(env, ptr2);
-                    SetValueTag(instance, external, member.type->ref.marker);
+    if (array_type < 0)
+        return Napi::Value();
+    if (member->offset % ref->size)
+        return Napi::Value();
 
-                    obj.Set(member.name, external);
-                } else {
-                    obj.Set(member.name, env.Null());
-                }
+    Size len = (Size)type->size / ref->size;
 
-                if (member.type->dispose) {
-                    member.type->dispose(env, member.type, ptr2);
-                }
-            } break;
-            case PrimitiveKind::Record: {
-                Napi::Object obj2 = PopObject(src, member.type, realign);
-                obj.Set(member.name, obj2);
-            } break;
-            case PrimitiveKind::Array: {
-                Napi::Value value = PopArray(src, member.type, realign);
-                obj.Set(member.name, value);
-            } break;
-            case PrimitiveKind::Float32: {
-                float f = *(float *)src;
-                obj.Set(member.name, Napi::Number::New(env, (double)f));
-            } break;
-            case PrimitiveKind::Float64: {
-                double d = *(double *)src;
-                obj.Set(member.name, Napi::Number::New(env, d));
-            } break;
+    napi_value array;
+    napi_status status = napi_create_typedarray(env, (napi_typedarray_type)array_type, (size_t)len,
+                                                buffer, (size_t)member->offset, &array);
+    RG_ASSERT(status == napi_ok);
 
-            case PrimitiveKind::Prototype: { RG_UNREACHABLE(); } break;
-        }
+    return Napi::Value(env, array);
+}
+
+static void CacheLazyMember(Napi::Env env, Napi::Object obj, const RecordMember *member, Napi::Value value)
+{
+    napi_property_descriptor desc = {};
+
+    desc.utf8name = member->name;
+    desc.value = value;
+    desc.attributes = napi_default_jsproperty;
+
+    napi_status status = napi_define_properties(env, obj, 1, &desc);
+    RG_ASSERT(status == napi_ok);
+}
+
+static napi_value GetLazyMember(napi_env env, napi_callback_info cbinfo)
+{
+    Napi::CallbackInfo info(env, cbinfo);
+    InstanceData *instance = info.Env().GetInstanceData<InstanceData>();
+
+    const RecordMember *member = (const RecordMember *)info.Data();
+    Napi::Object self = info.This().As<Napi::Object>();
+
+    napi_ref ref = UnwrapLazyObject(instance, self);
+    if (!ref)
+        return info.Env().Undefined();
+
+    napi_value buffer;
+    napi_status status = napi_get_reference_value(env, ref, &buffer);
+    RG_ASSERT(status == napi_ok);
+
+    Napi::ArrayBuffer copy(env, buffer);
+    const uint8_t *ptr = (const uint8_t *)copy.Data();
+
+    Napi::Value value = MapLazyArray(info.Env(), copy, member);
+    if (value.IsEmpty()) {
+        value = DecodeValue(info.Env(), instance, ptr + member->offset, member->type, 0);
     }
+    CacheLazyMember(info.Env(), self, member, value);
+
+    return value;
 }
 
-Napi::Object CallData::PopObject(const uint8_t *origin, const TypeInfo *type, int16_t realign)
+static napi_value SetLazyMember(napi_env env, napi_callback_info cbinfo)
 {
+    Napi::CallbackInfo info(env, cbinfo);
+
+    const RecordMember *member = (const RecordMember *)info.Data();
+    Napi::Object self = info.This().As<Napi::Object>();
+
+    CacheLazyMember(info.Env(), self, member, info[0]);
+
+    return info.Env().Undefined();
+}
+
+// Own properties only exist for members that were accessed, so JSON.stringify() would miss
+// most of them without this.
+static napi_value ConvertLazyToJSON(napi_env env, napi_callback_info cbinfo)
+{
+    Napi::CallbackInfo info(env, cbinfo);
+
+    const TypeInfo *type = (const TypeInfo *)info.Data();
+    Napi::Object self = info.This().As<Napi::Object>();
+
+    Napi::Object obj = Napi::Object::New(info.Env());
+
+    for (const RecordMember &member: type->members) {
+        Napi::Value value = self.Get(member.name);
+        obj.Set(member.name, value);
+    }
+
+    return obj;
+}
+
+Napi::Function CreateLazyConstructor(Napi::Env env, const TypeInfo *type)
+{
+    RG_ASSERT(type->primitive == PrimitiveKind::Record);
+
+    HeapArray<napi_property_descriptor> descriptors;
+
+    for (const RecordMember &member: type->members) {
+        napi_property_descriptor *desc = descriptors.AppendDefault();
+
+        desc->utf8name = member.name;
+        desc->getter = GetLazyMember;
+        desc->setter = SetLazyMember;
+        desc->attributes = (napi_property_attributes)(napi_enumerable | napi_configurable);
+        desc->data = (void *)&member;
+    }
+
+    // Members take precedence over the helper method
+    bool shadowed = false;
+    for (const RecordMember &member: type->members) {
+        shadowed |= TestStr(member.name, "toJSON");
+    }
+
+    if (!shadowed) {
+        napi_property_descriptor *desc = descriptors.AppendDefault();
+
+        desc->utf8name = "toJSON";
+        desc->method = ConvertLazyToJSON;
+        desc->attributes = napi_configurable;
+        desc->data = (void *)type;
+    }
+
+    const auto construct = [](napi_env env, napi_callback_info cbinfo) {
+        napi_value self = nullptr;
+        napi_get_cb_info(env, cbinfo, nullptr, nullptr, &self, nullptr);
+        return self;
+    };
+
+    napi_value ctor;
+    napi_status status = napi_define_class(env, type->name, NAPI_AUTO_LENGTH, construct, nullptr,
+                                           (size_t)descriptors.len, descriptors.ptr, &ctor);
+    RG_ASSERT(status == napi_ok);
+
+    return Napi::Function(env, ctor);
+}
+
+static Napi::Object DecodeLazyObject(Napi::Env env, const uint8_t *origin, const TypeInfo *type)
+{
+    Napi::Object obj = type->construct.New({});
+
+    Napi::ArrayBuffer copy = Napi::ArrayBuffer::New(env, (size_t)type->size);
+    memcpy(copy.Data(), origin, (size_t)type->size);
+
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+    SetValueTag(instance, obj, &LazyObjectMarker);
+
+    napi_ref ref;
+    napi_status status = napi_create_reference(env, copy, 1, &ref);
+    RG_ASSERT(status == napi_ok);
+
+    status = napi_wrap(env, obj, (void *)ref, [](napi_env env, void *ref, void *) {
+        napi_delete_reference(env, (napi_ref)ref);
+    }, nullptr, nullptr);
+    RG_ASSERT(status == napi_ok);
+
+    return obj;
+}
+
+Napi::Object DecodeObject(Napi::Env env, const uint8_t *origin, const TypeInfo *type, int32_t realign)
+{
+    // Realigned records (such as HFA registers) do not match the struct layout, decode them now
+    if (!type->construct.IsEmpty() && !realign)
+        return DecodeLazyObject(env, origin, type);
+
     Napi::Object obj = Napi::Object::New(env);
-    PopObject(obj, origin, type, realign);
+    DecodeObject(obj, origin, type, realign);
     return obj;
 }
 
+Napi::Value DecodeAny(Napi::Env env, const uint8_t *origin, const TypeInfo *type)
+{
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+    return DecodeValue(env, instance, origin, type, 0);
+}
+
 static Size WideStringLength(const char16_t *str16, Size max)
 {
     Size len = 0;
@@ -1008,17 +1501,20 @@ static Size WideStringLength(const char16_t *str16, Size max)
     return len;
 }
 
-void CallData::PopNormalArray(Napi::Array array, const uint8_t *origin, const TypeInfo *ref, int16_t realign)
+void DecodeNormalArray(Napi::Array array, const uint8_t *origin, const TypeInfo *ref, int32_t realign)
 {
     RG_ASSERT(array.IsArray());
 
+    Napi::Env env = array.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
     Size offset = 0;
     uint32_t len = array.Length();
 
 #define POP_ARRAY(SetCode) \
         do { \
             for (uint32_t i = 0; i < len; i++) { \
-                int16_t align = std::max(realign, ref->align); \
+                int32_t align = std::max(realign, ref->align); \
                 offset = AlignLen(offset, align); \
                  \
                 const uint8_t *src = origin + offset; \
@@ -1128,13 +1624,13 @@ void CallData::PopNormalArray(Napi::Array array, const uint8_t *origin, const Ty
         } break;
         case PrimitiveKind::Record: {
             POP_ARRAY({
-                Napi::Object obj = PopObject(src, ref, realign);
+                Napi::Object obj = DecodeObject(env, src, ref, realign);
                 array.Set(i, obj);
             });
         } break;
         case PrimitiveKind::Array: {
             POP_ARRAY({
-                Napi::Value value = PopArray(src, ref, realign);
+                Napi::Value value = DecodeArray(env, src, ref, realign);
                 array.Set(i, value);
             });
         } break;
@@ -1149,9 +1645,11 @@ void CallData::PopNormalArray(Napi::Array array, const uint8_t *origin, const Ty
 #undef POP_ARRAY
 }
 
-void CallData::PopTypedArray(Napi::TypedArray array, const uint8_t *origin, const TypeInfo *ref, int16_t realign)
+void DecodeTypedArray(Napi::TypedArray array, const uint8_t *origin, const TypeInfo *ref, int32_t realign)
 {
     RG_ASSERT(array.IsTypedArray());
+
+    InstanceData *instance = array.Env().GetInstanceData<InstanceData>();
     RG_ASSERT(GetTypedArrayType(ref) == array.TypedArrayType() ||
               ref == instance->void_type);
 
@@ -1197,10 +1695,12 @@ void CallData::PopTypedArray(Napi::TypedArray array, const uint8_t *origin, cons
 #undef SWAP
 }
 
-Napi::Value CallData::PopArray(const uint8_t *origin, const TypeInfo *type, int16_t realign)
+Napi::Value DecodeArray(Napi::Env env, const uint8_t *origin, const TypeInfo *type, int32_t realign)
 {
     RG_ASSERT(type->primitive == PrimitiveKind::Array);
 
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
     uint32_t len = type->size / type->ref.type->size;
     Size offset = 0;
 
@@ -1209,7 +1709,7 @@ Napi::Value CallData::PopArray(const uint8_t *origin, const TypeInfo *type, int1
             Napi::Array array = Napi::Array::New(env); \
              \
             for (uint32_t i = 0; i < len; i++) { \
-                int16_t align = std::max(realign, type->ref.type->align); \
+                int32_t align = std::max(realign, type->ref.type->align); \
                 offset = AlignLen(offset, align); \
                  \
                 const uint8_t *src = origin + offset; \
@@ -1230,7 +1730,7 @@ Napi::Value CallData::PopArray(const uint8_t *origin, const TypeInfo *type, int1
                 }); \
             } else { \
                 Napi::TypedArrayType array = Napi::TypedArrayType::New(env, len); \
-                PopTypedArray(array, origin, type->ref.type, realign); \
+                DecodeTypedArray(array, origin, type->ref.type, realign); \
                  \
                 return array; \
             } \
@@ -1245,7 +1745,7 @@ Napi::Value CallData::PopArray(const uint8_t *origin, const TypeInfo *type, int1
                 }); \
             } else { \
                 Napi::TypedArrayType array = Napi::TypedArrayType::New(env, len); \
-                PopTypedArray(array, origin, type->ref.type, realign); \
+                DecodeTypedArray(array, origin, type->ref.type, realign); \
                  \
                 return array; \
             } \
@@ -1346,14 +1846,17 @@ Napi::Value CallData::PopArray(const uint8_t *origin, const TypeInfo *type, int1
             });
         } break;
         case PrimitiveKind::Record: {
+            if (type->hint == TypeInfo::ArrayHint::StructOfArrays && !realign)
+                return DecodeStructOfArrays(env, origin, type->ref.type, len);
+
             POP_ARRAY({
-                Napi::Object obj = PopObject(src, type->ref.type, realign);
+                Napi::Object obj = DecodeObject(env, src, type->ref.type, realign);
                 array.Set(i, obj);
             });
         } break;
         case PrimitiveKind::Array: {
             POP_ARRAY({
-                Napi::Value value = PopArray(src, type->ref.type, realign);
+                Napi::Value value = DecodeArray(env, src, type->ref.type, realign);
                 array.Set(i, value);
             });
         } break;
@@ -1370,6 +1873,62 @@ Napi::Value CallData::PopArray(const uint8_t *origin, const TypeInfo *type, int1
     RG_UNREACHABLE();
 }
 
+static void GatherMembers(uint8_t *dest, const uint8_t *src, int32_t size, Size stride, Size len)
+{
+    switch (size) {
+        case 1: { GatherMember<uint8_t>(dest, src, stride, len); } break;
+        case 2: { GatherMember<uint16_t>(dest, src, stride, len); } break;
+        case 4: { GatherMember<uint32_t>(dest, src, stride, len); } break;
+        case 8: { GatherMember<uint64_t>(dest, src, stride, len); } break;
+
+        default: { RG_UNREACHABLE(); } break;
+    }
+}
+
+Napi::Object DecodeStructOfArrays(Napi::Env env, const uint8_t *origin, const TypeInfo *type, Size len)
+{
+    RG_ASSERT(CanUseStructOfArrays(type));
+
+    Napi::Object obj = Napi::Object::New(env);
+
+    for (const RecordMember &member: type->members) {
+        napi_typedarray_type array_type = (napi_typedarray_type)GetTypedArrayType(member.type);
+        Napi::ArrayBuffer buffer = Napi::ArrayBuffer::New(env, (size_t)(len * member.type->size));
+
+        napi_value array;
+        napi_status status = napi_create_typedarray(env, array_type, (size_t)len, buffer, 0, &array);
+        RG_ASSERT(status == napi_ok);
+
+        GatherMembers((uint8_t *)buffer.Data(), origin + member.offset, member.type->size, type->size, len);
+
+        obj.Set(member.name, array);
+    }
+
+    return obj;
+}
+
+void DecodeStructOfArrays(Napi::Object obj, const uint8_t *origin, const TypeInfo *type, Size len)
+{
+    RG_ASSERT(type->primitive == PrimitiveKind::Record);
+
+    // Members were validated by PushStructOfArrays(), or the call would not have happened.
+    // But the object may have been changed in between (by a callback), so check again.
+    for (const RecordMember &member: type->members) {
+        Napi::Value value = obj.Get(member.name);
+
+        if (!value.IsTypedArray())
+            continue;
+
+        Napi::TypedArray array = value.As<Napi::TypedArray>();
+
+        if (array.TypedArrayType() != GetTypedArrayType(member.type) || array.ElementLength() != (size_t)len)
+            continue;
+
+        uint8_t *dest = (uint8_t *)array.ArrayBuffer().Data() + array.ByteOffset();
+        GatherMembers(dest, origin + member.offset, member.type->size, type->size, len);
+    }
+}
+
 void CallData::DumpForward() const
 {
     PrintLn(stderr, "%!..+---- %1 (%2) ----%!0", func->name, CallConventionNames[(int)func->convention]);
@@ -1383,11 +1942,33 @@ void CallData::DumpForward() const
     }
     PrintLn(stderr, "Return: %1 (%2)", func->ret.type->name, FmtMemSize(func->ret.type->size));
 
-    Span<const uint8_t> stack = MakeSpan(mem->stack.end(), old_stack_mem.end() - mem->stack.end());
-    Span<const uint8_t> heap = MakeSpan(old_heap_mem.ptr, mem->heap.ptr - old_heap_mem.ptr);
+    DumpMemory("Stack", GetStackMemory());
+    DumpMemory("Heap", GetHeapMemory());
+}
+
+bool CallData::Restore(Size stack_len, Size heap_len, Size heap_misalign, Span<uint8_t> *out_stack, Span<uint8_t> *out_heap)
+{
+    uint8_t *stack;
+    if (RG_UNLIKELY(!AllocStack(stack_len, 16, &stack)))
+        return false;
+
+    // Keep the same alignment as the recorded heap, in case something depends on it
+    uint8_t *heap = AlignUp(mem->heap.ptr, 16) + heap_misalign;
+    Size delta = heap_len + (heap - mem->heap.ptr);
 
-    DumpMemory("Stack", stack);
-    DumpMemory("Heap", heap);
+    if (RG_UNLIKELY(delta > mem->heap.len)) {
+        ThrowError<Napi::Error>(env, "FFI call is taking up too much memory");
+        return false;
+    }
+
+    mem->heap.ptr += delta;
+    mem->heap.len -= delta;
+
+    new_sp = stack;
+
+    *out_stack = MakeSpan(stack, stack_len);
+    *out_heap = MakeSpan(heap, heap_len);
+    return true;
 }
 
 }
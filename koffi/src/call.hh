@@ -15,6 +15,7 @@
 
 #include "vendor/libcc/libcc.hh"
 #include "ffi.hh"
+#include "trace.hh"
 #include "util.hh"
 
 #include <napi.h>
@@ -23,6 +24,17 @@ namespace RG {
 
 bool AnalyseFunction(Napi::Env env, InstanceData *instance, FunctionInfo *func);
 
+void DecodeObject(Napi::Object obj, const uint8_t *origin, const TypeInfo *type, int32_t realign = 0);
+Napi::Object DecodeObject(Napi::Env env, const uint8_t *origin, const TypeInfo *type, int32_t realign = 0);
+void DecodeNormalArray(Napi::Array array, const uint8_t *origin, const TypeInfo *ref, int32_t realign = 0);
+void DecodeTypedArray(Napi::TypedArray array, const uint8_t *origin, const TypeInfo *ref, int32_t realign = 0);
+Napi::Value DecodeArray(Napi::Env env, const uint8_t *origin, const TypeInfo *type, int32_t realign = 0);
+Napi::Value DecodeAny(Napi::Env env, const uint8_t *origin, const TypeInfo *type);
+Napi::Object DecodeStructOfArrays(Napi::Env env, const uint8_t *origin, const TypeInfo *type, Size len);
+void DecodeStructOfArrays(Napi::Object obj, const uint8_t *origin, const TypeInfo *type, Size len);
+
+Napi::Function CreateLazyConstructor(Napi::Env env, const TypeInfo *type);
+
 struct BackRegisters;
 
 // I'm not sure why the alignas(8), because alignof(CallData) is 8 without it.
@@ -32,6 +44,7 @@ class alignas(8) CallData {
         napi_ref ref;
         const uint8_t *ptr;
         const TypeInfo *type;
+        Size soa_len = -1;
     };
 
     Napi::Env env;
@@ -43,9 +56,21 @@ class alignas(8) CallData {
     Span<uint8_t> old_heap_mem;
 
     int16_t used_trampolines = 0;
+    int16_t heap_fallbacks = 0;
+
+    // Blocks borrowed from the instance heap cache, other fallbacks go to call_alloc
+    struct BorrowedBlock {
+        void *ptr;
+        int cls;
+    };
+    LocalArray<BorrowedBlock, 16> borrowed_blocks;
 
     LocalArray<OutArgument, MaxOutParameters> out_arguments;
 
+    // Asynchronous calls keep output buffers alive until they complete
+    bool retain_buffers = false;
+    HeapArray<napi_ref> retained_buffers;
+
     uint8_t *new_sp;
     uint8_t *old_sp;
 
@@ -81,35 +106,51 @@ public:
     #define INLINE_IF_UNITY
 #endif
 
-    INLINE_IF_UNITY bool Prepare(const Napi::CallbackInfo &info);
+    INLINE_IF_UNITY bool Prepare(const napi_value *argv);
     INLINE_IF_UNITY void Execute();
     INLINE_IF_UNITY Napi::Value Complete();
 
 #undef INLINE_IF_UNITY
 
     void Relay(Size idx, uint8_t *own_sp, uint8_t *caller_sp, BackRegisters *out_reg);
+    void RelayAndTrace(Size idx, uint8_t *own_sp, uint8_t *caller_sp, BackRegisters *out_reg);
+
+    // Used to encode bound arguments ahead of time
+    bool EncodeObject(Napi::Object obj, const TypeInfo *type, uint8_t *origin) { return PushObject(obj, type, origin); }
 
     void DumpForward() const;
 
+    void RetainBuffers() { retain_buffers = true; }
+
+    // Used by call statistics and tracing
+    int GetUsedTrampolines() const { return used_trampolines; }
+    int GetHeapFallbacks() const { return heap_fallbacks; }
+    Size GetUsedMemory() const { return (old_stack_mem.len - mem->stack.len) + (old_heap_mem.len - mem->heap.len); }
+
+    // Used by koffi.record() and koffi.replay(), the arguments start at the beginning of the stack span
+    Span<const uint8_t> GetStackMemory() const { return MakeSpan(mem->stack.end(), old_stack_mem.end() - mem->stack.end()); }
+    Span<const uint8_t> GetHeapMemory() const { return MakeSpan(old_heap_mem.ptr, mem->heap.ptr - old_heap_mem.ptr); }
+    Span<const uint8_t> GetResult() const { return MakeSpan(result.buf, RG_SIZE(result.buf)); }
+    bool Restore(Size stack_len, Size heap_len, Size heap_misalign, Span<uint8_t> *out_stack, Span<uint8_t> *out_heap);
+
 private:
     template <typename T>
     bool AllocStack(Size size, Size align, T **out_ptr);
     template <typename T = uint8_t>
     T *AllocHeap(Size size, Size align);
+    uint8_t *AllocBig(Size size);
 
     bool PushString(Napi::Value value, const char **out_str);
     bool PushString16(Napi::Value value, const char16_t **out_str16);
-    bool PushObject(Napi::Object obj, const TypeInfo *type, uint8_t *origin, int16_t realign = 0);
-    bool PushNormalArray(Napi::Array array, Size len, const TypeInfo *ref, uint8_t *origin, int16_t realign = 0);
-    bool PushTypedArray(Napi::TypedArray array, Size len, const TypeInfo *ref, uint8_t *origin, int16_t realign = 0);
+    bool PushObject(Napi::Object obj, const TypeInfo *type, uint8_t *origin, int32_t realign = 0);
+    bool PushNormalArray(Napi::Array array, Size len, const TypeInfo *ref, uint8_t *origin, int32_t realign = 0);
+    bool PushTypedArray(Napi::TypedArray array, Size len, const TypeInfo *ref, uint8_t *origin, int32_t realign = 0);
     bool PushStringArray(Napi::Value value, const TypeInfo *type, uint8_t *origin);
     bool PushPointer(Napi::Value value, const TypeInfo *type, int directions, void **out_ptr);
+    bool PushStructOfArrays(Napi::Object obj, Size len, const TypeInfo *type, uint8_t *origin);
 
-    void PopObject(Napi::Object obj, const uint8_t *origin, const TypeInfo *type, int16_t realign = 0);
-    Napi::Object PopObject(const uint8_t *origin, const TypeInfo *type, int16_t realign = 0);
-    void PopNormalArray(Napi::Array array, const uint8_t *origin, const TypeInfo *ref, int16_t realign = 0);
-    void PopTypedArray(Napi::TypedArray array, const uint8_t *origin, const TypeInfo *ref, int16_t realign = 0);
-    Napi::Value PopArray(const uint8_t *origin, const TypeInfo *type, int16_t realign = 0);
+    Napi::Object PopObject(const uint8_t *origin, const TypeInfo *type, int32_t realign = 0)
+        { return DecodeObject(env, origin, type, realign); }
 
     void PopOutArguments();
 
@@ -155,15 +196,13 @@ inline T *CallData::AllocHeap(Size size, Size align)
 
         return ptr;
     } else {
+        ptr = AllocBig(size + align);
+        ptr = AlignUp(ptr, align);
+
 #ifdef RG_DEBUG
-        int flags = (int)Allocator::Flag::Zero;
-#else
-        int flags = 0;
+        memset(ptr, 0, (size_t)size);
 #endif
 
-        ptr = (uint8_t *)AllocateRaw(&call_alloc, size + align, flags);
-        ptr = AlignUp(ptr, align);
-
         return ptr;
     }
 }
@@ -14,7 +14,10 @@
 #include "vendor/libcc/libcc.hh"
 #include "ffi.hh"
 #include "call.hh"
+#include "cache.hh"
 #include "parser.hh"
+#include "record.hh"
+#include "trace.hh"
 #include "util.hh"
 
 #ifdef _WIN32
@@ -43,12 +46,14 @@ namespace RG {
 // Value does not matter, the tag system uses memory addresses
 const int TypeInfoMarker = 0xDEADBEEF;
 const int CastMarker = 0xDEADBEEF;
+const int FrozenMarker = 0xDEADBEEF;
+const int EncodedStringMarker = 0xDEADBEEF;
+const int EncodedString16Marker = 0xDEADBEEF;
+const int OutBufferMarker = 0xDEADBEEF;
+const int StructOfArraysMarker = 0xDEADBEEF;
 
-static bool ChangeMemorySize(const char *name, Napi::Value value, Size *out_size)
+static bool ChangeMemorySize(const char *name, Napi::Value value, Size min, Size max, Size *out_size)
 {
-    const Size MinSize = Kibibytes(1);
-    const Size MaxSize = Mebibytes(16);
-
     Napi::Env env = value.Env();
 
     if (!value.IsNumber()) {
@@ -60,8 +65,8 @@ static bool ChangeMemorySize(const char *name, Napi::Value value, Size *out_size
 
     int64_t size = value.As<Napi::Number>().Int64Value();
 
-    if (size < MinSize || size > MaxSize) {
-        ThrowError<Napi::Error>(env, "Setting '%1' must be between %2 and %3", name, FmtMemSize(MinSize), FmtMemSize(MaxSize));
+    if (size < min || size > max) {
+        ThrowError<Napi::Error>(env, "Setting '%1' must be between %2 and %3", name, FmtMemSize(min), FmtMemSize(max));
         return false;
     }
 
@@ -69,6 +74,11 @@ static bool ChangeMemorySize(const char *name, Napi::Value value, Size *out_size
     return true;
 }
 
+static bool ChangeMemorySize(const char *name, Napi::Value value, Size *out_size)
+{
+    return ChangeMemorySize(name, value, Kibibytes(1), Mebibytes(16), out_size);
+}
+
 static bool ChangeAsyncLimit(const char *name, Napi::Value value, int max, int *out_limit)
 {
     Napi::Env env = value.Env();
@@ -111,6 +121,7 @@ static Napi::Value GetSetConfig(const Napi::CallbackInfo &info)
         Size sync_heap_size = instance->sync_heap_size;
         Size async_stack_size = instance->async_stack_size;
         Size async_heap_size = instance->async_heap_size;
+        Size heap_cache_size = instance->heap_cache_size;
         int resident_async_pools = instance->resident_async_pools;
         int max_async_calls = resident_async_pools + instance->max_temporaries;
 
@@ -133,6 +144,9 @@ static Napi::Value GetSetConfig(const Napi::CallbackInfo &info)
             } else if (key == "async_heap_size") {
                 if (!ChangeMemorySize(key.c_str(), value, &async_heap_size))
                     return env.Null();
+            } else if (key == "heap_cache_size") {
+                if (!ChangeMemorySize(key.c_str(), value, 0, Mebibytes(256), &heap_cache_size))
+                    return env.Null();
             } else if (key == "resident_async_pools") {
                 if (!ChangeAsyncLimit(key.c_str(), value, RG_LEN(instance->memories.data) - 1, &resident_async_pools))
                     return env.Null();
@@ -154,6 +168,7 @@ static Napi::Value GetSetConfig(const Napi::CallbackInfo &info)
         instance->sync_heap_size = sync_heap_size;
         instance->async_stack_size = async_stack_size;
         instance->async_heap_size = async_heap_size;
+        instance->heap_cache_size = heap_cache_size;
         instance->resident_async_pools = resident_async_pools;
         instance->max_temporaries = max_async_calls - resident_async_pools;
     }
@@ -164,12 +179,135 @@ static Napi::Value GetSetConfig(const Napi::CallbackInfo &info)
     obj.Set("sync_heap_size", instance->sync_heap_size);
     obj.Set("async_stack_size", instance->async_stack_size);
     obj.Set("async_heap_size", instance->async_heap_size);
+    obj.Set("heap_cache_size", instance->heap_cache_size);
     obj.Set("resident_async_pools", instance->resident_async_pools);
     obj.Set("max_async_calls", instance->resident_async_pools + instance->max_temporaries);
 
     return obj;
 }
 
+static Napi::Value GetStats(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+    if (info.Length() >= 1) {
+        if (!info[0].IsBoolean()) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for enable, expected boolean", GetValueType(instance, info[0]));
+            return env.Null();
+        }
+
+        bool enable = info[0].As<Napi::Boolean>();
+
+        // Start again from scratch, but keep the slots because functions point to them
+        if (enable) {
+            for (FunctionStats &stats: instance->call_stats) {
+                const char *name = stats.name;
+
+                stats = {};
+                stats.name = name;
+            }
+        }
+
+        instance->collect_stats = enable;
+    }
+
+    Napi::Object obj = Napi::Object::New(env);
+
+    obj.Set("types", instance->types.len - instance->free_types.len - instance->retired_types);
+    obj.Set("named_types", instance->types_map.table.count);
+    obj.Set("prototypes", instance->callbacks.len);
+    obj.Set("reclaimed_types", instance->reclaimed_types);
+    obj.Set("parsed_headers", instance->parsed_headers);
+    obj.Set("shared_headers", instance->shared_headers);
+    obj.Set("strings", instance->str_interned.table.count);
+    obj.Set("owned_pointers", instance->owned_pointers.table.count);
+    obj.Set("owned_memory", instance->owned_memory);
+    obj.Set("heap_cache", instance->heap_cache.size);
+    obj.Set("heap_cache_hits", (double)instance->heap_cache.hits);
+    obj.Set("heap_cache_misses", (double)instance->heap_cache.misses);
+
+    Napi::Array functions = Napi::Array::New(env);
+
+    for (const FunctionStats &stats: instance->call_stats) {
+        if (!stats.sync_calls && !stats.async_calls)
+            continue;
+
+        Napi::Object func = Napi::Object::New(env);
+
+        func.Set("name", stats.name);
+        func.Set("sync_calls", (double)stats.sync_calls);
+        func.Set("async_calls", (double)stats.async_calls);
+        func.Set("prepare_time", (double)stats.prepare_time);
+        func.Set("execute_time", (double)stats.execute_time);
+        func.Set("complete_time", (double)stats.complete_time);
+        func.Set("heap_fallbacks", (double)stats.heap_fallbacks);
+        func.Set("trampolines", (double)stats.trampolines);
+
+        functions.Set(functions.Length(), func);
+    }
+
+    obj.Set("functions", functions);
+
+    return obj;
+}
+
+static Napi::Value ControlTrace(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+    if (info.Length() >= 1) {
+        if (!info[0].IsBoolean()) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for enable, expected boolean", GetValueType(instance, info[0]));
+            return env.Null();
+        }
+
+        bool enable = info[0].As<Napi::Boolean>();
+
+        if (enable) {
+            StartTrace();
+            return env.Undefined();
+        }
+
+        StopTrace();
+    }
+
+    HeapArray<char> json;
+    DumpTrace(&json);
+
+    return Napi::String::New(env, json.ptr, (size_t)json.len);
+}
+
+static Napi::Value ControlRecord(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+    if (info.Length() >= 1 && !IsNullOrUndefined(info[0])) {
+        if (!info[0].IsString()) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for filename, expected string", GetValueType(instance, info[0]));
+            return env.Null();
+        }
+
+        std::string filename = info[0].As<Napi::String>();
+
+        if (!StartRecord(filename.c_str())) {
+            ThrowError<Napi::Error>(env, "Failed to open '%1' for recording", filename.c_str());
+            return env.Null();
+        }
+
+        return env.Undefined();
+    }
+
+    if (!StopRecord()) {
+        ThrowError<Napi::Error>(env, "Failed to complete call record");
+        return env.Null();
+    }
+
+    return env.Undefined();
+}
+
 static inline bool CheckAlignment(int64_t align)
 {
     bool valid = (align > 0) && (align <= 8 && !(align & (align - 1)));
@@ -197,14 +335,14 @@ static Napi::Value CreateStructType(const Napi::CallbackInfo &info, bool pad)
         return env.Null();
     }
 
-    TypeInfo *type = instance->types.AppendDefault();
-    RG_DEFER_N(err_guard) { instance->types.RemoveLast(1); };
+    TypeInfo *type = AllocateType(instance);
+    RG_DEFER_N(err_guard) { ReleaseType(instance, type); };
 
     std::string name = named ? info[0].As<Napi::String>() : std::string("<anonymous>");
     Napi::Object obj = info[named].As<Napi::Object>();
     Napi::Array keys = obj.GetPropertyNames();
 
-    type->name = DuplicateString(name.c_str(), &instance->str_alloc).ptr;
+    type->name = InternString(instance, name.c_str());
 
     type->primitive = PrimitiveKind::Record;
     type->align = 1;
@@ -216,9 +354,9 @@ static Napi::Value CreateStructType(const Napi::CallbackInfo &info, bool pad)
 
         std::string key = ((Napi::Value)keys[i]).As<Napi::String>();
         Napi::Value value = obj[key];
-        int16_t align = 0;
+        int32_t align = 0;
 
-        member.name = DuplicateString(key.c_str(), &instance->str_alloc).ptr;
+        member.name = InternString(instance, key.c_str());
 
         if (value.IsArray()) {
             Napi::Array array = value.As<Napi::Array>();
@@ -236,7 +374,7 @@ static Napi::Value CreateStructType(const Napi::CallbackInfo &info, bool pad)
             }
 
             value = array[1u];
-            align = (int16_t)align64;
+            align = (int32_t)align64;
         }
  
         member.type = ResolveType(value);
@@ -250,9 +388,17 @@ static Napi::Value CreateStructType(const Napi::CallbackInfo &info, bool pad)
         if (!align) {
             align = pad ? member.type->align : 1;
         }
-        member.offset = (int16_t)AlignLen(type->size, align);
+        int64_t offset = AlignLen((int64_t)type->size, align);
+        int64_t size = offset + member.type->size;
+
+        if (size > INT32_MAX) {
+            ThrowError<Napi::Error>(env, "Struct '%1' is too big (max = %2)", type->name, FmtMemSize(INT32_MAX));
+            return env.Null();
+        }
+
+        member.offset = (int32_t)offset;
 
-        type->size = (int16_t)(member.offset + member.type->size);
+        type->size = (int32_t)size;
         type->align = std::max(type->align, align);
 
         if (!members.TrySet(member.name).second) {
@@ -268,7 +414,11 @@ static Napi::Value CreateStructType(const Napi::CallbackInfo &info, bool pad)
         return env.Null();
     }
 
-    type->size = (int16_t)AlignLen(type->size, type->align);
+    if (AlignLen((int64_t)type->size, type->align) > INT32_MAX) {
+        ThrowError<Napi::Error>(env, "Struct '%1' is too big (max = %2)", type->name, FmtMemSize(INT32_MAX));
+        return env.Null();
+    }
+    type->size = (int32_t)AlignLen(type->size, type->align);
 
     // If the insert succeeds, we cannot fail anymore
     if (named && !instance->types_map.TrySet(type->name, type).second) {
@@ -277,8 +427,7 @@ static Napi::Value CreateStructType(const Napi::CallbackInfo &info, bool pad)
     }
     err_guard.Disable();
 
-    Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, type);
-    SetValueTag(instance, external, &TypeInfoMarker);
+    Napi::External<TypeInfo> external = WrapType(env, instance, type);
 
     return external;
 }
@@ -307,10 +456,10 @@ static Napi::Value CreateOpaqueType(const Napi::CallbackInfo &info)
 
     std::string name = named ? info[0].As<Napi::String>() : std::string("<anonymous>");
 
-    TypeInfo *type = instance->types.AppendDefault();
-    RG_DEFER_N(err_guard) { instance->types.RemoveLast(1); };
+    TypeInfo *type = AllocateType(instance);
+    RG_DEFER_N(err_guard) { ReleaseType(instance, type); };
 
-    type->name = DuplicateString(name.c_str(), &instance->str_alloc).ptr;
+    type->name = InternString(instance, name.c_str());
 
     type->primitive = PrimitiveKind::Void;
     type->size = 0;
@@ -323,8 +472,7 @@ static Napi::Value CreateOpaqueType(const Napi::CallbackInfo &info)
     }
     err_guard.Disable();
 
-    Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, type);
-    SetValueTag(instance, external, &TypeInfoMarker);
+    Napi::External<TypeInfo> external = WrapType(env, instance, type);
 
     return external;
 }
@@ -377,11 +525,10 @@ static Napi::Value CreatePointerType(const Napi::CallbackInfo &info)
     RG_ASSERT(type);
 
     if (named) {
-        TypeInfo *copy = instance->types.AppendDefault();
-        RG_DEFER_N(err_guard) { instance->types.RemoveLast(1); };
+        TypeInfo *copy = CopyType(instance, type);
+        RG_DEFER_N(err_guard) { ReleaseType(instance, copy); };
 
-        memcpy((void *)copy, type, RG_SIZE(*type));
-        copy->name = DuplicateString(name.c_str(), &instance->str_alloc).ptr;
+        copy->name = InternString(instance, name.c_str());
 
         // If the insert succeeds, we cannot fail anymore
         if (!instance->types_map.TrySet(copy->name, copy).second) {
@@ -393,8 +540,7 @@ static Napi::Value CreatePointerType(const Napi::CallbackInfo &info)
         type = copy;
     }
 
-    Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, (TypeInfo *)type);
-    SetValueTag(instance, external, &TypeInfoMarker);
+    Napi::External<TypeInfo> external = WrapType(env, instance, type);
 
     return external;
 }
@@ -423,8 +569,7 @@ static Napi::Value EncodePointerDirection(const Napi::CallbackInfo &info, int di
     // We need to lose the const for Napi::External to work
     TypeInfo *marked = (TypeInfo *)((uint8_t *)type + directions - 1);
 
-    Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, marked);
-    SetValueTag(instance, external, &TypeInfoMarker);
+    Napi::External<TypeInfo> external = WrapType(env, instance, marked);
 
     return external;
 }
@@ -506,12 +651,10 @@ static Napi::Value CreateDisposableType(const Napi::CallbackInfo &info)
         dispose = [](Napi::Env, const TypeInfo *, const void *ptr) { free((void *)ptr); };
     }
 
-    TypeInfo *type = instance->types.AppendDefault();
-    RG_DEFER_N(err_guard) { instance->types.RemoveLast(1); };
+    TypeInfo *type = CopyType(instance, src);
+    RG_DEFER_N(err_guard) { ReleaseType(instance, type); };
 
-    memcpy((void *)type, (const void *)src, RG_SIZE(*src));
-    type->name = DuplicateString(name.c_str(), &instance->str_alloc).ptr;
-    type->members.allocator = GetNullAllocator();
+    type->name = InternString(instance, name.c_str());
     type->dispose = dispose;
     type->dispose_ref = Napi::Persistent(dispose_func);
 
@@ -522,13 +665,30 @@ static Napi::Value CreateDisposableType(const Napi::CallbackInfo &info)
     }
     err_guard.Disable();
 
-    Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, type);
-    SetValueTag(instance, external, &TypeInfoMarker);
+    Napi::External<TypeInfo> external = WrapType(env, instance, type);
 
     return external;
 }
 
-static Napi::Value CallFree(const Napi::CallbackInfo &info)
+static bool HasDisposableMembers(const TypeInfo *type)
+{
+    for (const RecordMember &member: type->members) {
+        const TypeInfo *type2 = member.type;
+
+        while (type2->primitive == PrimitiveKind::Array) {
+            type2 = type2->ref.type;
+        }
+
+        if (type2->dispose)
+            return true;
+        if (type2->primitive == PrimitiveKind::Record && HasDisposableMembers(type2))
+            return true;
+    }
+
+    return false;
+}
+
+static Napi::Value CreateLazyType(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
     InstanceData *instance = env.GetInstanceData<InstanceData>();
@@ -537,692 +697,1894 @@ static Napi::Value CallFree(const Napi::CallbackInfo &info)
         ThrowError<Napi::TypeError>(env, "Expected 1 or 2 arguments, got %1", info.Length());
         return env.Null();
     }
-    if (!info[0].IsExternal() || CheckValueTag(instance, info[0], &TypeInfoMarker)) {
-        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for ptr, expected external", GetValueType(instance, info[0]));
+
+    bool named = (info.Length() >= 2);
+
+    if (named && !info[0].IsString()) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for name, expected string", GetValueType(instance, info[0]));
         return env.Null();
     }
 
-    Napi::External<void> external = info[0].As<Napi::External<void>>();
-    void *ptr = external.Data();
+    std::string name = named ? info[0].As<Napi::String>() : std::string("<anonymous>");
 
-    free(ptr);
+    const TypeInfo *src = ResolveType(info[named]);
+    if (!src)
+        return env.Null();
+    if (src->primitive != PrimitiveKind::Record) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 type, expected struct type", src->name);
+        return env.Null();
+    }
+    if (HasDisposableMembers(src)) {
+        ThrowError<Napi::TypeError>(env, "Cannot use lazy decoding for '%1' because it contains disposable members", src->name);
+        return env.Null();
+    }
 
-    return env.Undefined();
+    TypeInfo *type = AllocateType(instance);
+    RG_DEFER_N(err_guard) { ReleaseType(instance, type); };
+
+    type->name = InternString(instance, name.c_str());
+    type->primitive = src->primitive;
+    type->size = src->size;
+    type->align = src->align;
+    type->members.Append(src->members);
+    type->construct = Napi::Persistent(CreateLazyConstructor(env, type));
+
+    // If the insert succeeds, we cannot fail anymore
+    if (named && !instance->types_map.TrySet(type->name, type).second) {
+        ThrowError<Napi::Error>(env, "Duplicate type name '%1'", type->name);
+        return env.Null();
+    }
+    err_guard.Disable();
+
+    Napi::External<TypeInfo> external = WrapType(env, instance, type);
+
+    return external;
 }
 
-static Napi::Value CreateArrayType(const Napi::CallbackInfo &info)
+static Napi::Value CallFree(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
     InstanceData *instance = env.GetInstanceData<InstanceData>();
 
-    if (info.Length() < 2) {
-        ThrowError<Napi::TypeError>(env, "Expected 2 arguments, got %1", info.Length());
+    if (info.Length() < 1) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 or 2 arguments, got %1", info.Length());
         return env.Null();
     }
-    if (!info[1].IsNumber()) {
-        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for length, expected integer", GetValueType(instance, info[1]));
+    if (!info[0].IsExternal() || CheckValueTag(instance, info[0], &TypeInfoMarker)) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for ptr, expected external", GetValueType(instance, info[0]));
         return env.Null();
     }
 
-    const TypeInfo *ref = ResolveType(info[0]);
-    int64_t len = (uint16_t)info[1].As<Napi::Number>().Int64Value();
+    Napi::External<void> external = info[0].As<Napi::External<void>>();
+    void *ptr = external.Data();
 
-    if (!ref)
-        return env.Null();
-    if (len <= 0) {
-        ThrowError<Napi::TypeError>(env, "Array length must be positive and non-zero");
+    if (RG_UNLIKELY(instance->owned_pointers.Find(ptr))) {
+        ThrowError<Napi::Error>(env, "Cannot free owned pointer, the garbage collector will dispose of it");
         return env.Null();
     }
-    if (len > INT16_MAX / ref->size) {
-        ThrowError<Napi::TypeError>(env, "Array length is too high (max = %1)", INT16_MAX / ref->size);
+    if (RG_UNLIKELY(instance->managed_pointers.Find(ptr))) {
+        ThrowError<Napi::Error>(env, "Cannot free memory managed by Koffi (arena or output buffer)");
         return env.Null();
     }
 
-    TypeInfo::ArrayHint hint;
-    if (info.Length() >= 3 && !IsNullOrUndefined(info[2])) {
-        if (!info[2].IsString()) {
-            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for hint, expected string", GetValueType(instance, info[2]));
-            return env.Null();
-        }
+    free(ptr);
 
-        std::string to = info[2].As<Napi::String>();
+    return env.Undefined();
+}
 
-        if (to == "typed") {
-            hint = TypeInfo::ArrayHint::TypedArray;
-        } else if (to == "array") {
-            hint = TypeInfo::ArrayHint::Array;
-        } else if (to == "string") {
-            if (ref->primitive != PrimitiveKind::Int8 && ref->primitive != PrimitiveKind::Int16) {
-                ThrowError<Napi::Error>(env, "Array hint 'string' can only be used with 8 and 16-bit signed integer types");
-                return env.Null();
-            }
+struct OwnedPointer {
+    void *ptr;
+    Size size;
+    Napi::FunctionReference dispose;
+};
 
-            hint = TypeInfo::ArrayHint::String;
-        } else {
-            ThrowError<Napi::Error>(env, "Array conversion hint must be 'typed', 'array' or 'string'");
-            return env.Null();
-        }
-    } else if (TestStr(ref->name, "char") || TestStr(ref->name, "char16") ||
-                                             TestStr(ref->name, "char16_t")) {
-        hint = TypeInfo::ArrayHint::String;
-    } else {
-        hint = TypeInfo::ArrayHint::TypedArray;
+static void ForgetOwnedPointer(napi_env env, InstanceData *instance, OwnedPointer *owned)
+{
+    instance->owned_pointers.Remove(owned->ptr);
+    instance->owned_memory -= owned->size;
+
+    if (owned->size) {
+        int64_t total;
+        napi_adjust_external_memory(env, -(int64_t)owned->size, &total);
     }
+}
 
-    TypeInfo *type = instance->types.AppendDefault();
+static void RunDisposals(napi_env env, InstanceData *instance)
+{
+    HeapArray<OwnedPointer *> disposals;
+    std::swap(disposals, instance->pending_disposals);
 
-    type->name = Fmt(&instance->str_alloc, "%1[%2]", ref->name, len).ptr;
+    Napi::Env env2 = Napi::Env(env);
+    Napi::HandleScope scope(env2);
 
-    type->primitive = PrimitiveKind::Array;
-    type->align = ref->align;
-    type->size = (int16_t)(len * ref->size);
-    type->ref.type = ref;
-    type->hint = hint;
+    Napi::Value error;
 
-    Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, type);
-    SetValueTag(instance, external, &TypeInfoMarker);
+    for (OwnedPointer *owned: disposals) {
+        RG_DEFER { delete owned; };
 
-    return external;
-}
+        ForgetOwnedPointer(env, instance, owned);
 
-static bool ParseClassicFunction(Napi::Env env, Napi::String name, Napi::Value ret,
-                                 Napi::Array parameters, FunctionInfo *func)
-{
-    InstanceData *instance = env.GetInstanceData<InstanceData>();
+        if (instance->exiting)
+            continue;
 
-#ifdef _WIN32
-    if (!name.IsString() && !name.IsNumber()) {
-        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for name, expected string or integer", GetValueType(instance, name));
-        return false;
-    }
-#else
-    if (!name.IsString()) {
-        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for name, expected string", GetValueType(instance, name));
-        return false;
-    }
-#endif
+        Napi::External<void> external = Napi::External<void>::New(env2, owned->ptr);
+        SetValueTag(instance, external, instance->void_type);
 
-    func->name = DuplicateString(name.ToString().Utf8Value().c_str(), &instance->str_alloc).ptr;
+        Napi::Value self = env2.Null();
+        napi_value args[] = {
+            external
+        };
 
-    func->ret.type = ResolveType(ret);
-    if (!func->ret.type)
-        return false;
-    if (!CanReturnType(func->ret.type)) {
-        ThrowError<Napi::TypeError>(env, "You are not allowed to directly return %1 values (maybe try %1 *)", func->ret.type->name);
-        return false;
+        owned->dispose.Call(self, RG_LEN(args), args);
+
+        // Keep going, other pointers still need to be disposed of
+        if (env2.IsExceptionPending()) {
+            Napi::Error err = env2.GetAndClearPendingException();
+
+            if (error.IsEmpty()) {
+                error = err.Value();
+            }
+        }
     }
 
-    if (!parameters.IsArray()) {
-        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for parameters of '%2', expected an array", GetValueType(instance, parameters), func->name);
-        return false;
+    if (!error.IsEmpty()) {
+        napi_fatal_exception(env, error);
     }
+}
 
-    uint32_t parameters_len = parameters.Length();
+static void QueueDisposals(napi_env env, InstanceData *instance)
+{
+    if (instance->dispose_work)
+        return;
 
-    if (parameters_len) {
-        Napi::String str = ((Napi::Value)parameters[parameters_len - 1]).As<Napi::String>();
+    // Run JS dispose functions from the event loop, it is not safe to do it from GC finalizers
+    const auto execute = [](napi_env, void *) {};
+    const auto complete = [](napi_env env, napi_status, void *udata) {
+        InstanceData *instance = (InstanceData *)udata;
 
-        if (str.IsString() && str.Utf8Value() == "...") {
-            func->variadic = true;
-            parameters_len--;
-        }
-    }
+        napi_delete_async_work(env, instance->dispose_work);
+        instance->dispose_work = nullptr;
 
-    for (uint32_t j = 0; j < parameters_len; j++) {
-        ParameterInfo param = {};
+        RunDisposals(env, instance);
+    };
 
-        param.type = ResolveType(parameters[j], &param.directions);
-        if (!param.type)
-            return false;
-        if (!CanPassType(param.type)) {
-            ThrowError<Napi::TypeError>(env, "Type %1 cannot be used as a parameter (maybe try %1 *)", param.type->name);
-            return false;
-        }
+    napi_value name = Napi::String::New(env, "koffi.dispose");
 
-        if (func->parameters.len >= MaxParameters) {
-            ThrowError<Napi::TypeError>(env, "Functions cannot have more than %1 parameters", MaxParameters);
-            return false;
-        }
-        if ((param.directions & 2) && ++func->out_parameters >= MaxOutParameters) {
-            ThrowError<Napi::TypeError>(env, "Functions cannot have more than out %1 parameters", MaxOutParameters);
-            return false;
-        }
+    // If this fails, the next finalizer will try again
+    if (napi_create_async_work(env, nullptr, name, execute, complete, instance, &instance->dispose_work) != napi_ok)
+        return;
+    if (napi_queue_async_work(env, instance->dispose_work) != napi_ok) {
+        napi_delete_async_work(env, instance->dispose_work);
+        instance->dispose_work = nullptr;
+    }
+}
 
-        param.offset = (int8_t)j;
+static void DisposeOwnedPointer(napi_env env, void *data, void *)
+{
+    InstanceData *instance = nullptr;
+    napi_get_instance_data(env, (void **)&instance);
 
-        func->parameters.Append(param);
-    }
+    OwnedPointer *owned = (OwnedPointer *)data;
 
-    return true;
+    if (owned->dispose.IsEmpty()) {
+        ForgetOwnedPointer(env, instance, owned);
+
+        free(owned->ptr);
+        delete owned;
+    } else if (instance->exiting) {
+        // The JS dispose function cannot run anymore
+        ForgetOwnedPointer(env, instance, owned);
+        delete owned;
+    } else {
+        // The pointer stays owned until dispose has run
+        instance->pending_disposals.Append(owned);
+        QueueDisposals(env, instance);
+    }
 }
 
-static Napi::Value CreateCallbackType(const Napi::CallbackInfo &info)
+static Napi::Value OwnPointer(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
     InstanceData *instance = env.GetInstanceData<InstanceData>();
 
-    FunctionInfo *func = instance->callbacks.AppendDefault();
-    RG_DEFER_N(err_guard) { instance->callbacks.RemoveLast(1); };
+    if (info.Length() < 1) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 to 3 arguments, got %1", info.Length());
+        return env.Null();
+    }
+    if (!info[0].IsExternal() || CheckValueTag(instance, info[0], &TypeInfoMarker) ||
+                                 CheckValueTag(instance, info[0], &CastMarker)) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for ptr, expected external", GetValueType(instance, info[0]));
+        return env.Null();
+    }
 
-    if (info.Length() >= 3) {
-        if (!ParseClassicFunction(env, info[0u].As<Napi::String>(), info[1u], info[2u].As<Napi::Array>(), func))
-            return env.Null();
-    } else if (info.Length() >= 1) {
-        if (!info[0].IsString()) {
-            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for prototype, expected string", GetValueType(instance, info[0]));
+    Napi::External<void> external = info[0].As<Napi::External<void>>();
+    void *ptr = external.Data();
+
+    Napi::Function dispose;
+    if (info.Length() >= 2 && !IsNullOrUndefined(info[1])) {
+        if (!info[1].IsFunction()) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for dispose, expected function", GetValueType(instance, info[1]));
             return env.Null();
         }
 
-        std::string proto = info[0u].As<Napi::String>();
-        if (!ParsePrototype(env, proto.c_str(), func))
-            return env.Null();
-    } else {
-        ThrowError<Napi::TypeError>(env, "Expected 1 or 3 arguments, got %1", info.Length());
-        return env.Null();
+        dispose = info[1].As<Napi::Function>();
     }
 
-    if (func->variadic) {
-        LogError("Variadic callbacks are not supported");
-        return env.Null();
+    int64_t size = 0;
+    if (info.Length() >= 3 && !IsNullOrUndefined(info[2])) {
+        if (!info[2].IsNumber()) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for size, expected number", GetValueType(instance, info[2]));
+            return env.Null();
+        }
+
+        size = info[2].As<Napi::Number>().Int64Value();
+
+        if (size < 0) {
+            ThrowError<Napi::Error>(env, "Size must be positive");
+            return env.Null();
+        }
     }
 
-    if (!AnalyseFunction(env, instance, func))
+    if (!ptr) {
+        ThrowError<Napi::Error>(env, "Cannot own NULL pointer");
         return env.Null();
-
-    // We cannot fail after this check
-    if (instance->types_map.Find(func->name)) {
-        ThrowError<Napi::Error>(env, "Duplicate type name '%1'", func->name);
+    }
+    if (instance->owned_pointers.Find(ptr)) {
+        ThrowError<Napi::Error>(env, "Pointer is already owned by another value");
+        return env.Null();
+    }
+    if (instance->managed_pointers.Find(ptr)) {
+        ThrowError<Napi::Error>(env, "Cannot own memory managed by Koffi (arena or output buffer)");
         return env.Null();
     }
-    err_guard.Disable();
 
-    TypeInfo *type = instance->types.AppendDefault();
+    OwnedPointer *owned = new OwnedPointer;
 
-    type->name = func->name;
+    owned->ptr = ptr;
+    owned->size = (Size)size;
+    if (!dispose.IsEmpty()) {
+        owned->dispose = Napi::Persistent(dispose);
+    }
 
-    type->primitive = PrimitiveKind::Prototype;
-    type->align = alignof(void *);
-    type->size = RG_SIZE(void *);
-    type->ref.proto = func;
+    napi_status status = napi_add_finalizer(env, external, owned, DisposeOwnedPointer, nullptr, nullptr);
+    if (RG_UNLIKELY(status != napi_ok)) {
+        delete owned;
 
-    instance->types_map.Set(type->name, type);
+        ThrowError<Napi::Error>(env, "Failed to attach finalizer to pointer");
+        return env.Null();
+    }
 
-    Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, type);
-    SetValueTag(instance, external, &TypeInfoMarker);
+    instance->owned_pointers.Set(ptr);
+    instance->owned_memory += owned->size;
+
+    // Let V8 know about the native memory, so that it collects owned pointers soon enough
+    if (size) {
+        int64_t total;
+        napi_adjust_external_memory(env, size, &total);
+    }
 
     return external;
 }
 
-static Napi::Value CreateTypeAlias(const Napi::CallbackInfo &info)
+// Arena blocks get reused after a reset, so the same address can be handed out more than once
+static void RegisterManagedPointer(InstanceData *instance, const void *ptr)
+{
+    int *refcount = instance->managed_pointers.TrySetDefault(ptr).first;
+    (*refcount)++;
+}
+
+static void ReleaseManagedPointer(InstanceData *instance, const void *ptr)
+{
+    int *refcount = instance->managed_pointers.Find(ptr);
+    RG_ASSERT(refcount);
+
+    if (!--(*refcount)) {
+        instance->managed_pointers.Remove(ptr);
+    }
+}
+
+static Napi::Value AllocateFromArena(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
     InstanceData *instance = env.GetInstanceData<InstanceData>();
+    ArenaHolder *arena = (ArenaHolder *)info.Data();
 
-    if (info.Length() < 2) {
-        ThrowError<Napi::TypeError>(env, "Expected 2 arguments, got %1", info.Length());
-        return env.Null();
-    }
-    if (!info[0].IsString()) {
-        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for name, expected string", GetValueType(instance, info[0]));
+    if (info.Length() < 1) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 or 2 arguments, got %1", info.Length());
         return env.Null();
     }
 
-    std::string name = info[0].As<Napi::String>();
-    const char *alias = DuplicateString(name.c_str(), &instance->str_alloc).ptr;
-
-    const TypeInfo *type = ResolveType(info[1]);
+    const TypeInfo *type = ResolveType(info[0]);
     if (!type)
         return env.Null();
 
-    std::pair<const TypeInfo **, bool> ret = instance->types_map.TrySet(alias, type);
+    int64_t count = 1;
+    if (info.Length() >= 2 && !IsNullOrUndefined(info[1])) {
+        if (!info[1].IsNumber()) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for count, expected number", GetValueType(instance, info[1]));
+            return env.Null();
+        }
 
-    if (!ret.second) {
-        ThrowError<Napi::Error>(env, "Type name '%1' already exists", alias);
+        count = info[1].As<Napi::Number>().Int64Value();
+    }
+
+    if (!type->size) {
+        ThrowError<Napi::TypeError>(env, "Cannot allocate memory for zero-sized type %1", type->name);
+        return env.Null();
+    }
+    if (count < 1 || count > MaxArenaSize / type->size) {
+        ThrowError<Napi::Error>(env, "Count must be between 1 and %1", MaxArenaSize / type->size);
         return env.Null();
     }
 
-    Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, (TypeInfo *)type);
-    SetValueTag(instance, external, &TypeInfoMarker);
+    uint8_t *ptr = arena->Allocate(type->size * (Size)count, type->align);
+
+    // The memory must outlive the arena object, and the tag below refers to the type
+    Napi::External<void> external = Napi::External<void>::New(env, ptr, [](Napi::Env env, void *ptr, ArenaHolder *arena) {
+        InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+        ReleaseManagedPointer(instance, ptr);
+        arena->Unref();
+    }, arena->Ref());
+    RegisterManagedPointer(instance, ptr);
+    napi_status status = napi_add_finalizer(env, external, (void *)type, [](napi_env env, void *udata, void *) {
+        InstanceData *instance = Napi::Env(env).GetInstanceData<InstanceData>();
+        UnpinType(env, instance, (const TypeInfo *)udata);
+    }, nullptr, nullptr);
+    RG_ASSERT(status == napi_ok);
+    type->pins++;
+
+    // Tag the value with the element type, to pass it to type pointers directly
+    SetValueTag(instance, external, type);
 
     return external;
 }
 
-static Napi::Value GetTypeSize(const Napi::CallbackInfo &info)
+static Napi::Value ResetArena(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
+    ArenaHolder *arena = (ArenaHolder *)info.Data();
 
-    if (info.Length() < 1) {
-        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
-        return env.Null();
-    }
-
-    const TypeInfo *type = ResolveType(info[0]);
-    if (!type)
-        return env.Null();
+    arena->Reset();
 
-    return Napi::Number::New(env, type->size);
+    return env.Undefined();
 }
 
-static Napi::Value GetTypeAlign(const Napi::CallbackInfo &info)
+static Napi::Value GetArenaUsage(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
+    ArenaHolder *arena = (ArenaHolder *)info.Data();
 
-    if (info.Length() < 1) {
-        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
-        return env.Null();
-    }
+    Napi::Object obj = Napi::Object::New(env);
 
-    const TypeInfo *type = ResolveType(info[0]);
-    if (!type)
-        return env.Null();
+    obj.Set("size", arena->block.len);
+    obj.Set("used", arena->used + arena->overflow_size);
 
-    return Napi::Number::New(env, type->align);
+    return obj;
 }
 
-static Napi::Value GetResolvedType(const Napi::CallbackInfo &info)
+static Napi::Value CreateArena(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
     InstanceData *instance = env.GetInstanceData<InstanceData>();
 
-    if (info.Length() < 1) {
-        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
-        return env.Null();
-    }
+    int64_t size = DefaultArenaSize;
+    if (info.Length() >= 1 && !IsNullOrUndefined(info[0])) {
+        if (!info[0].IsNumber()) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for size, expected number", GetValueType(instance, info[0]));
+            return env.Null();
+        }
 
-    const TypeInfo *type = ResolveType(info[0]);
-    if (!type)
-        return env.Null();
+        size = info[0].As<Napi::Number>().Int64Value();
 
-    Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, (TypeInfo *)type);
-    SetValueTag(instance, external, &TypeInfoMarker);
+        if (size < 1 || size > MaxArenaSize) {
+            ThrowError<Napi::Error>(env, "Arena size must be between 1 and %1", FmtMemSize(MaxArenaSize));
+            return env.Null();
+        }
+    }
 
-    return external;
-}
+    ArenaHolder *arena = new ArenaHolder((Size)size);
+    RG_DEFER { arena->Unref(); };
 
-static Napi::Value GetTypeDefinition(const Napi::CallbackInfo &info)
-{
-    Napi::Env env = info.Env();
-    InstanceData *instance = env.GetInstanceData<InstanceData>();
+    Napi::Object obj = Napi::Object::New(env);
 
-    if (info.Length() < 1) {
-        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
-        return env.Null();
-    }
+#define ADD_METHOD(Name, Func) \
+        do { \
+            Napi::Function func = Napi::Function::New(env, (Func), (Name), (void *)arena->Ref()); \
+            func.AddFinalizer([](Napi::Env, ArenaHolder *arena) { arena->Unref(); }, arena); \
+            obj.Set((Name), func); \
+        } while (false)
 
-    const TypeInfo *type = ResolveType(info[0]);
-    if (!type)
-        return env.Null();
+    ADD_METHOD("alloc", AllocateFromArena);
+    ADD_METHOD("reset", ResetArena);
+    ADD_METHOD("usage", GetArenaUsage);
 
-    if (type->defn.IsEmpty()) {
-        Napi::Object defn = Napi::Object::New(env);
+#undef ADD_METHOD
 
-        defn.Set("name", Napi::String::New(env, type->name));
-        defn.Set("primitive", PrimitiveKindNames[(int)type->primitive]);
-        defn.Set("size", Napi::Number::New(env, (double)type->size));
-        defn.Set("alignment", Napi::Number::New(env, (double)type->align));
+    return obj;
+}
 
-        switch (type->primitive) {
-            case PrimitiveKind::Void:
-            case PrimitiveKind::Bool:
-            case PrimitiveKind::Int8:
-            case PrimitiveKind::UInt8:
-            case PrimitiveKind::Int16:
-            case PrimitiveKind::Int16S:
-            case PrimitiveKind::UInt16:
-            case PrimitiveKind::UInt16S:
-            case PrimitiveKind::Int32:
-            case PrimitiveKind::Int32S:
-            case PrimitiveKind::UInt32:
-            case PrimitiveKind::UInt32S:
-            case PrimitiveKind::Int64:
-            case PrimitiveKind::Int64S:
-            case PrimitiveKind::UInt64:
-            case PrimitiveKind::UInt64S:
-            case PrimitiveKind::String:
-            case PrimitiveKind::String16:
-            case PrimitiveKind::Float32:
-            case PrimitiveKind::Float64:
-            case PrimitiveKind::Prototype:
-            case PrimitiveKind::Callback: {} break;
+static napi_value GetOutBufferValue(napi_env env, napi_callback_info cbinfo)
+{
+    Napi::CallbackInfo info(env, cbinfo);
+    OutBuffer *buf = (OutBuffer *)info.Data();
 
-            case PrimitiveKind::Array: {
-                uint32_t len = type->size / type->ref.type->size;
-                defn.Set("length", Napi::Number::New(env, (double)len));
-            } [[fallthrough]];
-            case PrimitiveKind::Pointer: {
-                Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, (TypeInfo *)type->ref.type);
-                SetValueTag(instance, external, &TypeInfoMarker);
+    if (buf->cache) {
+        napi_value cached;
 
-                defn.Set("ref", external);
-            } break;
-            case PrimitiveKind::Record: {
-                Napi::Object members = Napi::Object::New(env);
+        napi_status status = napi_get_reference_value(env, buf->cache, &cached);
+        RG_ASSERT(status == napi_ok);
 
-                for (const RecordMember &member: type->members) {
-                    Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, (TypeInfo *)member.type);
-                    SetValueTag(instance, external, &TypeInfoMarker);
+        if (!buf->dirty)
+            return cached;
 
-                    members.Set(member.name, external);
-                }
+        // Update plain objects in place, so the program can keep using the same one
+        if (buf->type->primitive == PrimitiveKind::Record && buf->type->construct.IsEmpty()) {
+            Napi::Object obj(env, cached);
+            DecodeObject(obj, buf->ptr, buf->type);
 
-                defn.Set("members", members);
-            } break;
+            buf->dirty = false;
+            return obj;
         }
 
-        defn.Freeze();
-        type->defn.Reset(defn, 1);
+        napi_delete_reference(env, buf->cache);
+        buf->cache = nullptr;
     }
 
-    return type->defn.Value();
+    Napi::Value value = DecodeAny(info.Env(), buf->ptr, buf->type);
+
+    napi_status status = napi_create_reference(env, value, 1, &buf->cache);
+    RG_ASSERT(status == napi_ok);
+    buf->dirty = false;
+
+    return value;
 }
 
-static InstanceMemory *AllocateMemory(InstanceData *instance, Size stack_size, Size heap_size)
+static Napi::Value CreateOutBuffer(const Napi::CallbackInfo &info)
 {
-    for (Size i = 1; i < instance->memories.len; i++) {
-        InstanceMemory *mem = instance->memories[i];
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
 
-        if (!mem->depth)
-            return mem;
+    if (info.Length() < 1) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
+        return env.Null();
     }
 
-    if (RG_UNLIKELY(instance->temporaries >= instance->max_temporaries))
-        return nullptr;
+    const TypeInfo *type = ResolveType(info[0]);
+    if (!type)
+        return env.Null();
 
-    InstanceMemory *mem = new InstanceMemory();
+    if (!type->size) {
+        ThrowError<Napi::TypeError>(env, "Cannot allocate memory for zero-sized type %1", type->name);
+        return env.Null();
+    }
+    if (type->primitive == PrimitiveKind::Prototype) {
+        ThrowError<Napi::TypeError>(env, "Cannot use function type %1 for output buffer", type->name);
+        return env.Null();
+    }
 
-    mem->stack.len = stack_size;
-#if defined(_WIN32)
-    mem->stack.ptr = (uint8_t *)VirtualAlloc(nullptr, mem->stack.len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-#elif defined(__APPLE__)
-    mem->stack.ptr = (uint8_t *)mmap(nullptr, mem->stack.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-#else
-    mem->stack.ptr = (uint8_t *)mmap(nullptr, mem->stack.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_STACK, -1, 0);
-#endif
-    RG_CRITICAL(mem->stack.ptr, "Failed to allocate %1 of memory", mem->stack.len);
+    OutBuffer *buf = new OutBuffer;
 
-#ifdef __OpenBSD__
-    // Make sure the SP points inside the MAP_STACK area, or (void) functions may crash on OpenBSD i386
-    mem->stack.len -= 16;
-#endif
+    buf->type = type;
+    buf->ptr = (uint8_t *)AllocateRaw(nullptr, type->size, (int)Allocator::Flag::Zero);
+    type->pins++;
+    RegisterManagedPointer(instance, buf->ptr);
 
-    mem->heap.len = heap_size;
-#ifdef _WIN32
-    mem->heap.ptr = (uint8_t *)VirtualAlloc(nullptr, mem->heap.len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-#else
-    mem->heap.ptr = (uint8_t *)mmap(nullptr, mem->heap.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-#endif
-    RG_CRITICAL(mem->heap.ptr, "Failed to allocate %1 of memory", mem->heap.len);
+    Napi::Object obj = Napi::Object::New(env);
 
-    mem->depth = 0;
+    // Not enumerable, to avoid decoding the value when the object is inspected
+    napi_property_descriptor desc = {};
 
-    if (instance->memories.len <= instance->resident_async_pools) {
-        instance->memories.Append(mem);
-        mem->temporary = false;
-    } else {
-        instance->temporaries++;
-        mem->temporary = true;
-    }
+    desc.utf8name = "value";
+    desc.getter = GetOutBufferValue;
+    desc.attributes = napi_default;
+    desc.data = buf;
 
-    return mem;
+    napi_status status = napi_define_properties(env, obj, 1, &desc);
+    RG_ASSERT(status == napi_ok);
+
+    SetValueTag(instance, obj, &OutBufferMarker);
+
+    status = napi_wrap(env, obj, buf, [](napi_env env, void *udata, void *) {
+        InstanceData *instance = Napi::Env(env).GetInstanceData<InstanceData>();
+        OutBuffer *buf = (OutBuffer *)udata;
+
+        if (buf->cache) {
+            napi_delete_reference(env, buf->cache);
+        }
+        ReleaseManagedPointer(instance, buf->ptr);
+        ReleaseRaw(nullptr, buf->ptr, buf->type->size);
+        UnpinType(env, instance, buf->type);
+
+        delete buf;
+    }, nullptr, nullptr);
+    RG_ASSERT(status == napi_ok);
+
+    return obj;
 }
 
-static Napi::Value TranslateNormalCall(const Napi::CallbackInfo &info)
+static Napi::Value CreateArrayType(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
     InstanceData *instance = env.GetInstanceData<InstanceData>();
-    FunctionInfo *func = (FunctionInfo *)info.Data();
 
-    if (RG_UNLIKELY(info.Length() < (uint32_t)func->parameters.len)) {
-        ThrowError<Napi::TypeError>(env, "Expected %1 arguments, got %2", func->parameters.len, info.Length());
+    if (info.Length() < 2) {
+        ThrowError<Napi::TypeError>(env, "Expected 2 arguments, got %1", info.Length());
+        return env.Null();
+    }
+    if (!info[1].IsNumber()) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for length, expected integer", GetValueType(instance, info[1]));
         return env.Null();
     }
 
-    InstanceMemory *mem = instance->memories[0];
-    CallData call(env, instance, func, mem);
+    const TypeInfo *ref = ResolveType(info[0]);
+    int64_t len = info[1].As<Napi::Number>().Int64Value();
 
-    if (!RG_UNLIKELY(call.Prepare(info)))
+    if (!ref)
+        return env.Null();
+    if (len <= 0) {
+        ThrowError<Napi::TypeError>(env, "Array length must be positive and non-zero");
+        return env.Null();
+    }
+    if (len > INT32_MAX / ref->size) {
+        ThrowError<Napi::TypeError>(env, "Array length is too high (max = %1)", INT32_MAX / ref->size);
         return env.Null();
-
-    if (instance->debug) {
-        call.DumpForward();
     }
-    call.Execute();
-
-    return call.Complete();
-}
 
-static Napi::Value TranslateVariadicCall(const Napi::CallbackInfo &info)
-{
-    Napi::Env env = info.Env();
-    InstanceData *instance = env.GetInstanceData<InstanceData>();
+    const TypeInfo *type;
+    if (info.Length() >= 3 && !IsNullOrUndefined(info[2])) {
+        TypeInfo::ArrayHint hint;
 
-    FunctionInfo func;
-    memcpy((void *)&func, info.Data(), RG_SIZE(FunctionInfo));
-    func.lib = nullptr;
+        if (!info[2].IsString()) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for hint, expected string", GetValueType(instance, info[2]));
+            return env.Null();
+        }
 
-    // This makes variadic calls non-reentrant
-    RG_DEFER_C(len = func.parameters.len) {
-        func.parameters.RemoveFrom(len);
-        func.parameters.Leak();
-    };
+        std::string to = info[2].As<Napi::String>();
 
-    if (RG_UNLIKELY(info.Length() < (uint32_t)func.parameters.len)) {
-        ThrowError<Napi::TypeError>(env, "Expected %1 arguments or more, got %2", func.parameters.len, info.Length());
-        return env.Null();
+        if (to == "typed") {
+            hint = TypeInfo::ArrayHint::TypedArray;
+        } else if (to == "array") {
+            hint = TypeInfo::ArrayHint::Array;
+        } else if (to == "string") {
+            if (ref->primitive != PrimitiveKind::Int8 && ref->primitive != PrimitiveKind::Int16) {
+                ThrowError<Napi::Error>(env, "Array hint 'string' can only be used with 8 and 16-bit signed integer types");
+                return env.Null();
+            }
+
+            hint = TypeInfo::ArrayHint::String;
+        } else if (to == "soa") {
+            if (!CanUseStructOfArrays(ref)) {
+                ThrowError<Napi::Error>(env, "Array hint 'soa' can only be used with structs made of number members");
+                return env.Null();
+            }
+
+            hint = TypeInfo::ArrayHint::StructOfArrays;
+        } else {
+            ThrowError<Napi::Error>(env, "Array conversion hint must be 'typed', 'array', 'string' or 'soa'");
+            return env.Null();
+        }
+
+        type = MakeArrayType(instance, ref, len, hint);
+    } else {
+        type = MakeArrayType(instance, ref, len);
     }
-    if (RG_UNLIKELY((info.Length() - func.parameters.len) % 2)) {
-        ThrowError<Napi::Error>(env, "Missing value argument for variadic call");
-        return env.Null();
+
+    Napi::External<TypeInfo> external = WrapType(env, instance, type);
+
+    return external;
+}
+
+static bool ParseClassicFunction(Napi::Env env, Napi::String name, Napi::Value ret,
+                                 Napi::Array parameters, FunctionInfo *func)
+{
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+#ifdef _WIN32
+    if (!name.IsString() && !name.IsNumber()) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for name, expected string or integer", GetValueType(instance, name));
+        return false;
+    }
+#else
+    if (!name.IsString()) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for name, expected string", GetValueType(instance, name));
+        return false;
     }
+#endif
 
-    for (Size i = func.parameters.len; i < (Size)info.Length(); i += 2) {
+    func->name = InternString(instance, name.ToString().Utf8Value().c_str());
+
+    func->ret.type = ResolveType(ret);
+    if (!func->ret.type)
+        return false;
+    if (!CanReturnType(func->ret.type)) {
+        ThrowError<Napi::TypeError>(env, "You are not allowed to directly return %1 values (maybe try %1 *)", func->ret.type->name);
+        return false;
+    }
+
+    if (!parameters.IsArray()) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for parameters of '%2', expected an array", GetValueType(instance, parameters), func->name);
+        return false;
+    }
+
+    uint32_t parameters_len = parameters.Length();
+
+    if (parameters_len) {
+        Napi::String str = ((Napi::Value)parameters[parameters_len - 1]).As<Napi::String>();
+
+        if (str.IsString() && str.Utf8Value() == "...") {
+            func->variadic = true;
+            parameters_len--;
+        }
+    }
+
+    for (uint32_t j = 0; j < parameters_len; j++) {
         ParameterInfo param = {};
 
-        param.type = ResolveType(info[i], &param.directions);
-        if (RG_UNLIKELY(!param.type))
-            return env.Null();
-        if (RG_UNLIKELY(!CanPassType(param.type))) {
+        param.type = ResolveType(parameters[j], &param.directions);
+        if (!param.type)
+            return false;
+        if (!CanPassType(param.type)) {
             ThrowError<Napi::TypeError>(env, "Type %1 cannot be used as a parameter (maybe try %1 *)", param.type->name);
-            return env.Null();
+            return false;
         }
 
-        if (RG_UNLIKELY(func.parameters.len >= MaxParameters)) {
+        if (func->parameters.len >= MaxParameters) {
             ThrowError<Napi::TypeError>(env, "Functions cannot have more than %1 parameters", MaxParameters);
-            return env.Null();
+            return false;
         }
-        if (RG_UNLIKELY((param.directions & 2) && ++func.out_parameters >= MaxOutParameters)) {
+        if ((param.directions & 2) && ++func->out_parameters >= MaxOutParameters) {
             ThrowError<Napi::TypeError>(env, "Functions cannot have more than out %1 parameters", MaxOutParameters);
+            return false;
+        }
+
+        param.offset = (int8_t)j;
+
+        func->parameters.Append(param);
+    }
+
+    return true;
+}
+
+static Napi::Value CreateCallbackType(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+    FunctionInfo *func = instance->callbacks.AppendDefault();
+    RG_DEFER_N(err_guard) { instance->callbacks.RemoveLast(1); };
+
+    if (info.Length() >= 3) {
+        if (!ParseClassicFunction(env, info[0u].As<Napi::String>(), info[1u], info[2u].As<Napi::Array>(), func))
+            return env.Null();
+    } else if (info.Length() >= 1) {
+        if (!info[0].IsString()) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for prototype, expected string", GetValueType(instance, info[0]));
             return env.Null();
         }
 
-        param.variadic = true;
-        param.offset = (int8_t)(i + 1);
+        std::string proto = info[0u].As<Napi::String>();
+        if (!ParsePrototype(env, proto.c_str(), func))
+            return env.Null();
+    } else {
+        ThrowError<Napi::TypeError>(env, "Expected 1 or 3 arguments, got %1", info.Length());
+        return env.Null();
+    }
 
-        func.parameters.Append(param);
+    if (func->variadic) {
+        LogError("Variadic callbacks are not supported");
+        return env.Null();
     }
 
-    if (RG_UNLIKELY(!AnalyseFunction(env, instance, &func)))
+    if (!AnalyseFunction(env, instance, func))
         return env.Null();
 
-    InstanceMemory *mem = instance->memories[0];
-    CallData call(env, instance, &func, mem);
+    // We cannot fail after this check
+    if (instance->types_map.Find(func->name)) {
+        ThrowError<Napi::Error>(env, "Duplicate type name '%1'", func->name);
+        return env.Null();
+    }
+    err_guard.Disable();
+
+    TypeInfo *type = AllocateType(instance);
+
+    type->name = func->name;
+
+    type->primitive = PrimitiveKind::Prototype;
+    type->align = alignof(void *);
+    type->size = RG_SIZE(void *);
+    type->ref.proto = func;
+
+    instance->types_map.Set(type->name, type);
+
+    Napi::External<TypeInfo> external = WrapType(env, instance, type);
+
+    return external;
+}
+
+static Napi::Value CreateTypeAlias(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
 
-    if (!RG_UNLIKELY(call.Prepare(info)))
+    if (info.Length() < 2) {
+        ThrowError<Napi::TypeError>(env, "Expected 2 arguments, got %1", info.Length());
+        return env.Null();
+    }
+    if (!info[0].IsString()) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for name, expected string", GetValueType(instance, info[0]));
         return env.Null();
+    }
 
-    if (instance->debug) {
-        call.DumpForward();
+    std::string name = info[0].As<Napi::String>();
+    const char *alias = InternString(instance, name.c_str());
+
+    const TypeInfo *type = ResolveType(info[1]);
+    if (!type)
+        return env.Null();
+
+    std::pair<const TypeInfo **, bool> ret = instance->types_map.TrySet(alias, type);
+
+    if (!ret.second) {
+        ThrowError<Napi::Error>(env, "Type name '%1' already exists", alias);
+        return env.Null();
     }
-    call.Execute();
 
-    return call.Complete();
+    Napi::External<TypeInfo> external = WrapType(env, instance, type);
+
+    return external;
 }
 
-class AsyncCall: public Napi::AsyncWorker {
-    Napi::Env env;
-    const FunctionInfo *func;
+static Napi::Value GetTypeSize(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
 
-    CallData call;
-    bool prepared = false;
+    if (info.Length() < 1) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
+        return env.Null();
+    }
 
-public:
-    AsyncCall(Napi::Env env, InstanceData *instance, const FunctionInfo *func,
-              InstanceMemory *mem, Napi::Function &callback)
-        : Napi::AsyncWorker(callback), env(env), func(func->Ref()),
-          call(env, instance, func, mem) {}
-    ~AsyncCall() { func->Unref(); }
+    const TypeInfo *type = ResolveType(info[0]);
+    if (!type)
+        return env.Null();
 
-    bool Prepare(const Napi::CallbackInfo &info) {
-        prepared = call.Prepare(info);
+    return Napi::Number::New(env, type->size);
+}
 
-        if (!prepared) {
-            Napi::Error err = env.GetAndClearPendingException();
-            SetError(err.Message());
-        }
+static Napi::Value GetTypeAlign(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
 
-        return prepared;
+    if (info.Length() < 1) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
+        return env.Null();
     }
-    void DumpForward() { call.DumpForward(); }
 
-    void Execute() override;
-    void OnOK() override;
-};
+    const TypeInfo *type = ResolveType(info[0]);
+    if (!type)
+        return env.Null();
+
+    return Napi::Number::New(env, type->align);
+}
+
+static Napi::Value GetResolvedType(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+    if (info.Length() < 1) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
+        return env.Null();
+    }
+
+    const TypeInfo *type = ResolveType(info[0]);
+    if (!type)
+        return env.Null();
+
+    Napi::External<TypeInfo> external = WrapType(env, instance, type);
+
+    return external;
+}
+
+static Napi::Value GetTypeDefinition(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+    if (info.Length() < 1) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
+        return env.Null();
+    }
+
+    const TypeInfo *type = ResolveType(info[0]);
+    if (!type)
+        return env.Null();
+
+    if (type->defn.IsEmpty()) {
+        Napi::Object defn = Napi::Object::New(env);
+
+        defn.Set("name", Napi::String::New(env, type->name));
+        defn.Set("primitive", PrimitiveKindNames[(int)type->primitive]);
+        defn.Set("size", Napi::Number::New(env, (double)type->size));
+        defn.Set("alignment", Napi::Number::New(env, (double)type->align));
+
+        switch (type->primitive) {
+            case PrimitiveKind::Void:
+            case PrimitiveKind::Bool:
+            case PrimitiveKind::Int8:
+            case PrimitiveKind::UInt8:
+            case PrimitiveKind::Int16:
+            case PrimitiveKind::Int16S:
+            case PrimitiveKind::UInt16:
+            case PrimitiveKind::UInt16S:
+            case PrimitiveKind::Int32:
+            case PrimitiveKind::Int32S:
+            case PrimitiveKind::UInt32:
+            case PrimitiveKind::UInt32S:
+            case PrimitiveKind::Int64:
+            case PrimitiveKind::Int64S:
+            case PrimitiveKind::UInt64:
+            case PrimitiveKind::UInt64S:
+            case PrimitiveKind::String:
+            case PrimitiveKind::String16:
+            case PrimitiveKind::Float32:
+            case PrimitiveKind::Float64:
+            case PrimitiveKind::Prototype:
+            case PrimitiveKind::Callback: {} break;
+
+            case PrimitiveKind::Array: {
+                uint32_t len = type->size / type->ref.type->size;
+                defn.Set("length", Napi::Number::New(env, (double)len));
+            } [[fallthrough]];
+            case PrimitiveKind::Pointer: {
+                Napi::External<TypeInfo> external = WrapType(env, instance, type->ref.type);
+
+                defn.Set("ref", external);
+            } break;
+            case PrimitiveKind::Record: {
+                Napi::Object members = Napi::Object::New(env);
+
+                for (const RecordMember &member: type->members) {
+                    Napi::External<TypeInfo> external = WrapType(env, instance, member.type);
+
+                    members.Set(member.name, external);
+                }
+
+                defn.Set("members", members);
+            } break;
+        }
+
+        defn.Freeze();
+        type->defn.Reset(defn, 1);
+    }
+
+    return type->defn.Value();
+}
+
+static InstanceMemory *AllocateMemory(InstanceData *instance, Size stack_size, Size heap_size)
+{
+    for (Size i = 1; i < instance->memories.len; i++) {
+        InstanceMemory *mem = instance->memories[i];
+
+        if (!mem->depth)
+            return mem;
+    }
+
+    if (RG_UNLIKELY(instance->temporaries >= instance->max_temporaries))
+        return nullptr;
+
+    InstanceMemory *mem = new InstanceMemory();
+
+    mem->stack.len = stack_size;
+#if defined(_WIN32)
+    mem->stack.ptr = (uint8_t *)VirtualAlloc(nullptr, mem->stack.len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#elif defined(__APPLE__)
+    mem->stack.ptr = (uint8_t *)mmap(nullptr, mem->stack.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+#else
+    mem->stack.ptr = (uint8_t *)mmap(nullptr, mem->stack.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_STACK, -1, 0);
+#endif
+    RG_CRITICAL(mem->stack.ptr, "Failed to allocate %1 of memory", mem->stack.len);
+
+#ifdef __OpenBSD__
+    // Make sure the SP points inside the MAP_STACK area, or (void) functions may crash on OpenBSD i386
+    mem->stack.len -= 16;
+#endif
+
+    mem->heap.len = heap_size;
+#ifdef _WIN32
+    mem->heap.ptr = (uint8_t *)VirtualAlloc(nullptr, mem->heap.len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    mem->heap.ptr = (uint8_t *)mmap(nullptr, mem->heap.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+#endif
+    RG_CRITICAL(mem->heap.ptr, "Failed to allocate %1 of memory", mem->heap.len);
+
+    mem->depth = 0;
+
+    if (instance->memories.len <= instance->resident_async_pools) {
+        instance->memories.Append(mem);
+        mem->temporary = false;
+    } else {
+        instance->temporaries++;
+        mem->temporary = true;
+    }
+
+    return mem;
+}
+
+static bool ResolveFunctionSymbol(Napi::Env env, FunctionInfo *func)
+{
+    const LibraryHolder *lib = func->lib;
+
+#ifdef _WIN32
+    if (func->decorated_name) {
+        func->func = (void *)GetProcAddress((HMODULE)lib->module, func->decorated_name);
+    }
+    if (!func->func) {
+        func->func = (void *)GetProcAddress((HMODULE)lib->module, func->name);
+    }
+#else
+    if (func->decorated_name) {
+        func->func = dlsym(lib->module, func->decorated_name);
+    }
+    if (!func->func) {
+        func->func = dlsym(lib->module, func->name);
+    }
+#endif
+    if (!func->func) {
+        ThrowError<Napi::Error>(env, "Cannot find function '%1' in shared library", func->name);
+        return false;
+    }
+
+    return true;
+}
+
+// Same as PerformNormalCall(), but each step is measured for koffi.stats() and/or koffi.trace(),
+// and the call is captured when koffi.record() is running
+static Napi::Value PerformMeasuredCall(Napi::Env env, InstanceData *instance, const FunctionInfo *func, const napi_value *argv)
+{
+    FunctionStats *stats = instance->collect_stats ? GetFunctionStats(instance, func) : nullptr;
+    bool trace = IsTracing();
+
+    InstanceMemory *mem = instance->memories[0];
+    CallData call(env, instance, func, mem);
+
+    RG_DEFER {
+        if (stats) {
+            stats->heap_fallbacks += call.GetHeapFallbacks();
+            stats->trampolines += call.GetUsedTrampolines();
+        }
+    };
+
+    int64_t start = GetCallClock();
+    bool prepared = call.Prepare(argv);
+    int64_t prepare_end = GetCallClock();
+
+    if (stats) {
+        stats->sync_calls++;
+        stats->prepare_time += prepare_end - start;
+    }
+
+    if (!RG_UNLIKELY(prepared))
+        return env.Null();
+
+    if (instance->debug) {
+        call.DumpForward();
+    }
+
+    Size used = call.GetUsedMemory();
+
+    CallRecord record;
+    bool recording = IsRecording();
+
+    if (recording) {
+        record.Begin(env, instance, func, call, argv, false);
+    }
+
+    int64_t execute_start = GetCallClock();
+    call.Execute();
+    int64_t execute_end = GetCallClock();
+
+    Napi::Value ret = call.Complete();
+    int64_t end = GetCallClock();
+
+    if (stats) {
+        stats->execute_time += execute_end - execute_start;
+        stats->complete_time += end - execute_end;
+    }
+    if (trace) {
+        RecordTrace(TraceKind::Call, func->name, start, end, used);
+    }
+    if (recording && !env.IsExceptionPending()) {
+        record.End(instance, call, ret, argv);
+    }
+
+    return ret;
+}
+
+static Napi::Value PerformNormalCall(Napi::Env env, InstanceData *instance, const FunctionInfo *func, const napi_value *argv)
+{
+    // Functions from lazy libraries are resolved on first call
+    if (RG_UNLIKELY(!func->func) && !ResolveFunctionSymbol(env, (FunctionInfo *)func))
+        return env.Null();
+
+    if (RG_UNLIKELY(instance->collect_stats || IsTracing() || IsRecording()))
+        return PerformMeasuredCall(env, instance, func, argv);
+
+    InstanceMemory *mem = instance->memories[0];
+    CallData call(env, instance, func, mem);
+
+    if (!RG_UNLIKELY(call.Prepare(argv)))
+        return env.Null();
+
+    if (instance->debug) {
+        call.DumpForward();
+    }
+    call.Execute();
+
+    return call.Complete();
+}
+
+static Napi::Value TranslateNormalCall(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+    FunctionInfo *func = (FunctionInfo *)info.Data();
+
+    if (RG_UNLIKELY(info.Length() < (uint32_t)func->parameters.len)) {
+        ThrowError<Napi::TypeError>(env, "Expected %1 arguments, got %2", func->parameters.len, info.Length());
+        return env.Null();
+    }
+
+    napi_value argv[MaxParameters];
+    for (Size i = 0; i < func->parameters.len; i++) {
+        argv[i] = info[i];
+    }
+
+    return PerformNormalCall(env, instance, func, argv);
+}
+
+static Napi::Value TranslateVariadicCall(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+    // Resolve lazy symbol once, before making the temporary copy
+    if (RG_UNLIKELY(!((FunctionInfo *)info.Data())->func) && !ResolveFunctionSymbol(env, (FunctionInfo *)info.Data()))
+        return env.Null();
+
+    // Make sure statistics go to the real function, not to the temporary copy
+    if (RG_UNLIKELY(instance->collect_stats)) {
+        GetFunctionStats(instance, (const FunctionInfo *)info.Data());
+    }
+
+    FunctionInfo func;
+    memcpy((void *)&func, info.Data(), RG_SIZE(FunctionInfo));
+    func.lib = nullptr;
+    func.pinned = nullptr;
+
+    // This makes variadic calls non-reentrant
+    RG_DEFER_C(len = func.parameters.len) {
+        func.parameters.RemoveFrom(len);
+        func.parameters.Leak();
+    };
+
+    if (RG_UNLIKELY(info.Length() < (uint32_t)func.parameters.len)) {
+        ThrowError<Napi::TypeError>(env, "Expected %1 arguments or more, got %2", func.parameters.len, info.Length());
+        return env.Null();
+    }
+    if (RG_UNLIKELY((info.Length() - func.parameters.len) % 2)) {
+        ThrowError<Napi::Error>(env, "Missing value argument for variadic call");
+        return env.Null();
+    }
+
+    for (Size i = func.parameters.len; i < (Size)info.Length(); i += 2) {
+        ParameterInfo param = {};
+
+        param.type = ResolveType(info[i], &param.directions);
+        if (RG_UNLIKELY(!param.type))
+            return env.Null();
+        if (RG_UNLIKELY(!CanPassType(param.type))) {
+            ThrowError<Napi::TypeError>(env, "Type %1 cannot be used as a parameter (maybe try %1 *)", param.type->name);
+            return env.Null();
+        }
+
+        if (RG_UNLIKELY(func.parameters.len >= MaxParameters)) {
+            ThrowError<Napi::TypeError>(env, "Functions cannot have more than %1 parameters", MaxParameters);
+            return env.Null();
+        }
+        if (RG_UNLIKELY((param.directions & 2) && ++func.out_parameters >= MaxOutParameters)) {
+            ThrowError<Napi::TypeError>(env, "Functions cannot have more than out %1 parameters", MaxOutParameters);
+            return env.Null();
+        }
+
+        param.variadic = true;
+        param.offset = (int8_t)(i + 1);
+
+        func.parameters.Append(param);
+    }
+
+    if (RG_UNLIKELY(!AnalyseFunction(env, instance, &func)))
+        return env.Null();
+
+    // Each variadic parameter uses two arguments (type and value)
+    napi_value argv[MaxParameters * 2];
+    for (Size i = 0; i < (Size)info.Length(); i++) {
+        argv[i] = info[i];
+    }
+
+    return PerformNormalCall(env, instance, &func, argv);
+}
+
+struct BoundFunction {
+    int refcount = 1;
+
+    const FunctionInfo *func;
+
+    // N-API does not support references to primitive values
+    Size count = 0;
+    Napi::Reference<Napi::Array> values;
+
+    BlockAllocator str_alloc;
+
+    ~BoundFunction() { func->Unref(); }
+    void Unref() { if (!--refcount) delete this; }
+};
+
+class AsyncCall: public Napi::AsyncWorker {
+    Napi::Env env;
+    InstanceData *instance;
+    const FunctionInfo *func;
+
+    CallData call;
+    bool prepared = false;
+
+    // Set with koffi.stats() and/or koffi.trace()
+    bool measure = false;
+    FunctionStats *stats = nullptr;
+    bool trace = false;
+    int64_t queued = 0;
+    int64_t execute_start = 0;
+    int64_t execute_end = 0;
+
+    // Set with koffi.record()
+    CallRecord *record = nullptr;
+
+    // Bound strings point into the memory of the bound function
+    BoundFunction *bound = nullptr;
+
+public:
+    AsyncCall(Napi::Env env, InstanceData *instance, const FunctionInfo *func,
+              InstanceMemory *mem, Napi::Function &callback)
+        : Napi::AsyncWorker(callback), env(env), instance(instance), func(func->Ref()),
+          call(env, instance, func, mem) { call.RetainBuffers(); }
+    ~AsyncCall();
+
+    void Hold(BoundFunction *bound)
+    {
+        bound->refcount++;
+        this->bound = bound;
+    }
+
+    void Measure(FunctionStats *stats, bool trace)
+    {
+        this->measure = true;
+        this->stats = stats;
+        this->trace = trace;
+    }
+
+    bool Prepare(const napi_value *argv) {
+        if (RG_UNLIKELY(measure)) {
+            int64_t start = GetCallClock();
+            prepared = call.Prepare(argv);
+            queued = GetCallClock();
+
+            if (stats) {
+                stats->prepare_time += queued - start;
+            }
+        } else {
+            prepared = call.Prepare(argv);
+        }
+
+        if (!prepared) {
+            Napi::Error err = env.GetAndClearPendingException();
+            SetError(err.Message());
+        } else if (RG_UNLIKELY(IsRecording())) {
+            record = new CallRecord();
+            record->Begin(env, instance, func, call, argv, true);
+        }
+
+        return prepared;
+    }
+    void DumpForward() { call.DumpForward(); }
+
+    void Execute() override;
+    void OnOK() override;
+};
+
+AsyncCall::~AsyncCall()
+{
+    // Worker threads do not touch the statistics, the destructor runs on the main thread
+    if (RG_UNLIKELY(stats)) {
+        stats->async_calls++;
+        stats->execute_time += execute_end - execute_start;
+        stats->heap_fallbacks += call.GetHeapFallbacks();
+        stats->trampolines += call.GetUsedTrampolines();
+    }
+    if (RG_UNLIKELY(trace) && prepared) {
+        RecordAsyncTrace(func->name, this, queued, execute_start, GetCallClock());
+    }
+
+    delete record;
+    func->Unref();
+
+    if (bound) {
+        bound->Unref();
+    }
+}
+
+void AsyncCall::Execute()
+{
+    if (!prepared)
+        return;
+
+    if (RG_UNLIKELY(measure)) {
+        execute_start = GetCallClock();
+        call.Execute();
+        execute_end = GetCallClock();
+
+        if (trace) {
+            RecordTrace(TraceKind::Execute, func->name, execute_start, execute_end, call.GetUsedMemory());
+        }
+    } else {
+        call.Execute();
+    }
+}
+
+void AsyncCall::OnOK()
+{
+    RG_ASSERT(prepared);
+
+    Napi::FunctionReference &callback = Callback();
+
+    int64_t start = RG_UNLIKELY(measure) ? GetCallClock() : 0;
+
+    Napi::Value self = env.Null();
+    napi_value args[] = {
+        env.Null(),
+        call.Complete()
+    };
+
+    if (RG_UNLIKELY(measure)) {
+        int64_t end = GetCallClock();
+
+        if (stats) {
+            stats->complete_time += end - start;
+        }
+        if (trace) {
+            RecordTrace(TraceKind::Complete, func->name, start, end);
+        }
+    }
+    if (RG_UNLIKELY(record)) {
+        record->End(instance, call, Napi::Value(env, args[1]));
+    }
+
+    callback.Call(self, RG_LEN(args), args);
+}
+
+static Napi::Value PerformAsyncCall(Napi::Env env, InstanceData *instance, const FunctionInfo *func,
+                                    const napi_value *argv, Napi::Function &callback, BoundFunction *bound = nullptr)
+{
+    if (RG_UNLIKELY(!func->func) && !ResolveFunctionSymbol(env, (FunctionInfo *)func))
+        return env.Null();
+
+    InstanceMemory *mem = AllocateMemory(instance, instance->async_stack_size, instance->async_heap_size);
+    if (RG_UNLIKELY(!mem)) {
+        ThrowError<Napi::Error>(env, "Too many asynchronous calls are running");
+        return env.Null();
+    }
+    AsyncCall *async = new AsyncCall(env, instance, func, mem, callback);
+
+    if (bound) {
+        async->Hold(bound);
+    }
+
+    if (RG_UNLIKELY(instance->collect_stats || IsTracing())) {
+        FunctionStats *stats = instance->collect_stats ? GetFunctionStats(instance, func) : nullptr;
+        async->Measure(stats, IsTracing());
+    }
+
+    if (async->Prepare(argv) && instance->debug) {
+        async->DumpForward();
+    }
+    async->Queue();
+
+    return env.Undefined();
+}
+
+static Napi::Value TranslateAsyncCall(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+    FunctionInfo *func = (FunctionInfo *)info.Data();
+
+    if (info.Length() <= (uint32_t)func->parameters.len) {
+        ThrowError<Napi::TypeError>(env, "Expected %1 arguments, got %2", func->parameters.len + 1, info.Length());
+        return env.Null();
+    }
+
+    Napi::Function callback = info[(uint32_t)func->parameters.len].As<Napi::Function>();
+
+    if (!callback.IsFunction()) {
+        ThrowError<Napi::TypeError>(env, "Expected callback function as last argument, got %1", GetValueType(instance, callback));
+        return env.Null();
+    }
+
+    napi_value argv[MaxParameters];
+    for (Size i = 0; i < func->parameters.len; i++) {
+        argv[i] = info[i];
+    }
+
+    return PerformAsyncCall(env, instance, func, argv, callback);
+}
+
+static FrozenObject *WrapFrozenObject(Napi::Env env, InstanceData *instance, Napi::Object obj)
+{
+    FrozenObject *frozen = new FrozenObject;
+
+    napi_status status = napi_wrap(env, obj, frozen, [](napi_env env, void *ptr, void *) {
+        InstanceData *instance = nullptr;
+        napi_get_instance_data(env, (void **)&instance);
+
+        FrozenObject *frozen = (FrozenObject *)ptr;
+
+        for (const FrozenObject::Encoding &encoding: frozen->encodings) {
+            UnpinType(env, instance, encoding.type);
+        }
+
+        instance->frozen_objects--;
+        delete frozen;
+    }, nullptr, nullptr);
+    if (RG_UNLIKELY(status != napi_ok)) {
+        delete frozen;
+
+        ThrowError<Napi::Error>(env, "Cannot freeze object wrapped by another native module");
+        return nullptr;
+    }
+    SetValueTag(instance, obj, &FrozenMarker);
+
+    instance->frozen_objects++;
+
+    return frozen;
+}
+
+// Strings and plain structs are converted once, and the encoded value replaces the JS value.
+// Anything else is kept as is and converted on each call, just like normal arguments.
+static bool EncodeBoundArgument(Napi::Env env, InstanceData *instance, BoundFunction *bound,
+                                const ParameterInfo &param, Napi::Value value, Napi::Value *out_value)
+{
+    const TypeInfo *type = param.type;
+
+    if (param.type->primitive == PrimitiveKind::Pointer && param.directions == 1 && IsObject(value) &&
+            !value.IsTypedArray() && param.type->ref.type->primitive == PrimitiveKind::Record) {
+        type = param.type->ref.type;
+    }
+
+    switch (type->primitive) {
+        case PrimitiveKind::String: {
+            if (!value.IsString())
+                break;
+
+            std::string str = value.As<Napi::String>();
+            const char *copy = DuplicateString(str.c_str(), &bound->str_alloc).ptr;
+
+            Napi::External<char> external = Napi::External<char>::New(env, (char *)copy);
+            SetValueTag(instance, external, &EncodedStringMarker);
+
+            *out_value = external;
+            return true;
+        } break;
+        case PrimitiveKind::String16: {
+            if (!value.IsString())
+                break;
+
+            std::u16string str16 = value.As<Napi::String>();
+            Span<char16_t> copy = AllocateSpan<char16_t>(&bound->str_alloc, (Size)str16.length() + 1);
+            memcpy(copy.ptr, str16.c_str(), (str16.length() + 1) * 2);
+
+            Napi::External<char16_t> external = Napi::External<char16_t>::New(env, copy.ptr);
+            SetValueTag(instance, external, &EncodedString16Marker);
+
+            *out_value = external;
+            return true;
+        } break;
+        case PrimitiveKind::Record: {
+            if (!IsObject(value) || !CanCacheEncoding(type))
+                break;
+
+            // Give the encoded bytes to an empty frozen object, PushObject() will copy them
+            Napi::Object obj = Napi::Object::New(env);
+            FrozenObject *frozen = WrapFrozenObject(env, instance, obj);
+            if (!frozen)
+                return false;
+
+            FrozenObject::Encoding *encoding = frozen->encodings.AppendDefault();
+
+            encoding->type = type;
+            encoding->bytes.AppendDefault(type->size);
+            type->pins++;
+
+            CallData call(env, instance, bound->func, instance->memories[0]);
+            if (!call.EncodeObject(value.As<Napi::Object>(), type, encoding->bytes.ptr))
+                return false;
+
+            *out_value = obj;
+            return true;
+        } break;
+
+        default: {} break;
+    }
+
+    *out_value = value;
+    return true;
+}
+
+static Napi::Value TranslateBoundCall(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+    BoundFunction *bound = (BoundFunction *)info.Data();
+    const FunctionInfo *func = bound->func;
+
+    Size remain = func->parameters.len - bound->count;
+
+    if (RG_UNLIKELY(info.Length() < (uint32_t)remain)) {
+        ThrowError<Napi::TypeError>(env, "Expected %1 arguments, got %2", remain, info.Length());
+        return env.Null();
+    }
+
+    Napi::Array values = bound->values.Value();
+
+    napi_value argv[MaxParameters];
+    for (Size i = 0; i < bound->count; i++) {
+        argv[i] = values.Get((uint32_t)i);
+    }
+    for (Size i = 0; i < remain; i++) {
+        argv[bound->count + i] = info[i];
+    }
+
+    return PerformNormalCall(env, instance, func, argv);
+}
+
+static Napi::Value TranslateBoundAsyncCall(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+    BoundFunction *bound = (BoundFunction *)info.Data();
+    const FunctionInfo *func = bound->func;
+
+    Size remain = func->parameters.len - bound->count;
+
+    if (info.Length() <= (uint32_t)remain) {
+        ThrowError<Napi::TypeError>(env, "Expected %1 arguments, got %2", remain + 1, info.Length());
+        return env.Null();
+    }
+
+    Napi::Function callback = info[(uint32_t)remain].As<Napi::Function>();
+
+    if (!callback.IsFunction()) {
+        ThrowError<Napi::TypeError>(env, "Expected callback function as last argument, got %1", GetValueType(instance, callback));
+        return env.Null();
+    }
+
+    Napi::Array values = bound->values.Value();
+
+    napi_value argv[MaxParameters];
+    for (Size i = 0; i < bound->count; i++) {
+        argv[i] = values.Get((uint32_t)i);
+    }
+    for (Size i = 0; i < remain; i++) {
+        argv[bound->count + i] = info[i];
+    }
+
+    return PerformAsyncCall(env, instance, func, argv, callback, bound);
+}
+
+static Napi::Value BindFunction(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+    const FunctionInfo *func = (const FunctionInfo *)info.Data();
+
+    // The first argument is the this value, which does not mean anything for C functions
+    Size count = std::max((Size)info.Length() - 1, (Size)0);
+
+    if (RG_UNLIKELY(count > func->parameters.len)) {
+        ThrowError<Napi::TypeError>(env, "Cannot bind %1 arguments to function with %2 parameters", count, func->parameters.len);
+        return env.Null();
+    }
+
+    BoundFunction *bound = new BoundFunction;
+    RG_DEFER { bound->Unref(); };
+
+    bound->func = func->Ref();
+
+    Napi::Array values = Napi::Array::New(env, (size_t)count);
+
+    for (Size i = 0; i < count; i++) {
+        const ParameterInfo &param = func->parameters[i];
+
+        Napi::Value value;
+        if (!EncodeBoundArgument(env, instance, bound, param, info[i + 1], &value))
+            return env.Null();
+
+        values.Set((uint32_t)i, value);
+    }
+
+    bound->count = count;
+    bound->values = Napi::Persistent(values);
+
+    Napi::Function wrapper = Napi::Function::New(env, TranslateBoundCall, func->name, (void *)bound);
+    wrapper.AddFinalizer([](Napi::Env, BoundFunction *bound) { bound->Unref(); }, bound);
+    bound->refcount++;
+
+    Napi::Function async = Napi::Function::New(env, TranslateBoundAsyncCall, func->name, (void *)bound);
+    async.AddFinalizer([](Napi::Env, BoundFunction *bound) { bound->Unref(); }, bound);
+    bound->refcount++;
+    wrapper.Set("async", async);
+
+    return wrapper;
+}
+
+static Napi::Value WrapLibraryFunction(Napi::Env env, InstanceData *instance, const LibraryHolder *lib,
+                                       FunctionInfo *func, Napi::Value symbol);
+
+static void CacheCompanion(Napi::Env env, Napi::Object obj, const char *name, Napi::Value value)
+{
+    napi_property_descriptor desc = {};
+
+    desc.utf8name = name;
+    desc.value = value;
+    desc.attributes = napi_default_jsproperty;
+
+    napi_status status = napi_define_properties(env, obj, 1, &desc);
+    RG_ASSERT(status == napi_ok);
+}
+
+static napi_value GetAsyncCompanion(napi_env env, napi_callback_info cbinfo)
+{
+    Napi::CallbackInfo info(env, cbinfo);
+    FunctionInfo *func = (FunctionInfo *)info.Data();
+
+    Napi::Function async = Napi::Function::New(info.Env(), TranslateAsyncCall, func->name, (void *)func->Ref());
+    async.AddFinalizer([](Napi::Env, FunctionInfo *func) { func->Unref(); }, func);
+    CacheCompanion(info.Env(), info.This().As<Napi::Object>(), "async", async);
+
+    return async;
+}
+
+static napi_value SetAsyncCompanion(napi_env env, napi_callback_info cbinfo)
+{
+    Napi::CallbackInfo info(env, cbinfo);
+    CacheCompanion(info.Env(), info.This().As<Napi::Object>(), "async", info[0]);
+
+    return info.Env().Undefined();
+}
+
+static napi_value GetBindCompanion(napi_env env, napi_callback_info cbinfo)
+{
+    Napi::CallbackInfo info(env, cbinfo);
+    FunctionInfo *func = (FunctionInfo *)info.Data();
+
+    Napi::Function bind = Napi::Function::New(info.Env(), BindFunction, "bind", (void *)func->Ref());
+    bind.AddFinalizer([](Napi::Env, FunctionInfo *func) { func->Unref(); }, func);
+    CacheCompanion(info.Env(), info.This().As<Napi::Object>(), "bind", bind);
+
+    return bind;
+}
+
+static napi_value SetBindCompanion(napi_env env, napi_callback_info cbinfo)
+{
+    Napi::CallbackInfo info(env, cbinfo);
+    CacheCompanion(info.Env(), info.This().As<Napi::Object>(), "bind", info[0]);
+
+    return info.Env().Undefined();
+}
+
+static Napi::Value FindLibraryFunction(const Napi::CallbackInfo &info, CallConvention convention)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+    LibraryHolder *lib = (LibraryHolder *)info.Data();
+
+    FunctionInfo *func = new FunctionInfo();
+    RG_DEFER { func->Unref(); };
+
+    func->lib = lib->Ref();
+    func->convention = convention;
+
+    if (info.Length() >= 3) {
+        if (!ParseClassicFunction(env, info[0u].As<Napi::String>(), info[1u], info[2u].As<Napi::Array>(), func))
+            return env.Null();
+    } else if (info.Length() >= 1) {
+        if (!info[0].IsString()) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for prototype, expected string", GetValueType(instance, info[0]));
+            return env.Null();
+        }
+
+        std::string proto = info[0u].As<Napi::String>();
+        if (!ParsePrototype(env, proto.c_str(), func))
+            return env.Null();
+    } else {
+        ThrowError<Napi::TypeError>(env, "Expected 1 or 3 arguments, got %1", info.Length());
+        return env.Null();
+    }
+
+    return WrapLibraryFunction(env, instance, lib, func, info[0]);
+}
+
+// Everything that can fail happens here, before any JS wrapper exists
+static bool PrepareLibraryFunction(Napi::Env env, InstanceData *instance, const LibraryHolder *lib,
+                                   FunctionInfo *func, Napi::Value symbol)
+{
+    if (func->convention != CallConvention::Cdecl && func->variadic) {
+        LogError("Call convention '%1' does not support variadic functions, ignoring",
+                 CallConventionNames[(int)func->convention]);
+        func->convention = CallConvention::Cdecl;
+    }
+
+    if (!AnalyseFunction(env, instance, func))
+        return false;
+    if (func->variadic) {
+        // Minimize reallocations
+        func->parameters.Grow(32);
+    }
+
+#ifdef _WIN32
+    if (!symbol.IsString()) {
+        uint16_t ordinal = (uint16_t)symbol.As<Napi::Number>().Uint32Value();
+
+        func->decorated_name = nullptr;
+        func->func = (void *)GetProcAddress((HMODULE)lib->module, (LPCSTR)(size_t)ordinal);
+
+        if (!func->func) {
+            ThrowError<Napi::Error>(env, "Cannot find function '%1' in shared library", func->name);
+            return false;
+        }
+    }
+#endif
+    if (!func->func && !lib->lazy && !ResolveFunctionSymbol(env, func))
+        return false;
+
+    return true;
+}
+
+static Napi::Function CreateFunctionWrapper(Napi::Env env, FunctionInfo *func)
+{
+    // Keep parameter types alive as long as the function, see CollectTypes()
+    if (!func->pinned) {
+        func->ret.type->pins++;
+        for (const ParameterInfo &param: func->parameters) {
+            param.type->pins++;
+        }
+        func->pinned = env;
+    }
+
+    Napi::Function::Callback call = func->variadic ? TranslateVariadicCall : TranslateNormalCall;
+    Napi::Function wrapper = Napi::Function::New(env, call, func->name, (void *)func->Ref());
+    wrapper.AddFinalizer([](Napi::Env, FunctionInfo *func) { func->Unref(); }, func);
+
+    // Companion functions are only created when accessed, most of them never are
+    if (!func->variadic) {
+        napi_property_descriptor descriptors[] = {
+            { "async", nullptr, nullptr, GetAsyncCompanion, SetAsyncCompanion, nullptr, napi_default_jsproperty, func },
+            { "bind", nullptr, nullptr, GetBindCompanion, SetBindCompanion, nullptr, napi_default_jsproperty, func }
+        };
+
+        napi_status status = napi_define_properties(env, wrapper, RG_LEN(descriptors), descriptors);
+        RG_ASSERT(status == napi_ok);
+    }
+
+    return wrapper;
+}
+
+static Napi::Value WrapLibraryFunction(Napi::Env env, InstanceData *instance, const LibraryHolder *lib,
+                                       FunctionInfo *func, Napi::Value symbol)
+{
+    if (!PrepareLibraryFunction(env, instance, lib, func, symbol))
+        return env.Null();
+
+    return CreateFunctionWrapper(env, func);
+}
 
-void AsyncCall::Execute()
+static Napi::Value DeclareHeader(Napi::Env env, InstanceData *instance, const LibraryHolder *lib,
+                                 Napi::String header, Napi::Value options)
 {
-    if (prepared) {
-        call.Execute();
+    std::string cache;
+    if (!IsNullOrUndefined(options)) {
+        if (!IsObject(options)) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for options, expected object", GetValueType(instance, options));
+            return env.Null();
+        }
+
+        Napi::Value value = options.As<Napi::Object>().Get("cache");
+
+        if (value.IsString()) {
+            cache = value.As<Napi::String>();
+        } else if (!IsNullOrUndefined(value)) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for cache, expected string", GetValueType(instance, value));
+            return env.Null();
+        }
     }
-}
 
-void AsyncCall::OnOK()
-{
-    RG_ASSERT(prepared);
+    std::string str = header;
+    Span<const char> source = MakeSpan(str.c_str(), (Size)str.length());
 
-    Napi::FunctionReference &callback = Callback();
+    HeaderDeclarations decls;
 
-    Napi::Value self = env.Null();
-    napi_value args[] = {
-        env.Null(),
-        call.Complete()
-    };
+    // A failed header must not leave anything behind, or fixing it would hit duplicate names
+    Size first_type = instance->next_type_id;
+    Size first_callback = instance->callbacks.len;
+    RG_DEFER_N(err_guard) { RollbackHeader(instance, decls, first_type, first_callback); };
 
-    callback.Call(self, RG_LEN(args), args);
-}
+    // Other threads may have parsed the same header already
+    const char *cache_filename = !cache.empty() ? cache.c_str() : nullptr;
+    bool cached = LoadBindingCache(env, instance, cache_filename, lib, source, &decls);
 
-static Napi::Value TranslateAsyncCall(const Napi::CallbackInfo &info)
-{
-    Napi::Env env = info.Env();
-    InstanceData *instance = env.GetInstanceData<InstanceData>();
-    FunctionInfo *func = (FunctionInfo *)info.Data();
+    if (!cached) {
+        PrototypeParser parser(env);
 
-    if (info.Length() <= (uint32_t)func->parameters.len) {
-        ThrowError<Napi::TypeError>(env, "Expected %1 arguments, got %2", func->parameters.len + 1, info.Length());
-        return env.Null();
+        if (!parser.ParseHeader(str.c_str(), &decls))
+            return env.Null();
+
+        instance->parsed_headers++;
     }
 
-    Napi::Function callback = info[(uint32_t)func->parameters.len].As<Napi::Function>();
+    for (FunctionInfo *func: decls.funcs) {
+        func->lib = lib->Ref();
 
-    if (!callback.IsFunction()) {
-        ThrowError<Napi::TypeError>(env, "Expected callback function as last argument, got %1", GetValueType(instance, callback));
-        return env.Null();
+        if (!PrepareLibraryFunction(env, instance, lib, func, header))
+            return env.Null();
     }
+    err_guard.Disable();
 
-    InstanceMemory *mem = AllocateMemory(instance, instance->async_stack_size, instance->async_heap_size);
-    if (RG_UNLIKELY(!mem)) {
-        ThrowError<Napi::Error>(env, "Too many asynchronous calls are running");
-        return env.Null();
+    // The cache is only an optimization, ignore failures
+    if (!cached) {
+        SaveBindingCache(instance, cache_filename, lib, source, first_type, decls);
     }
-    AsyncCall *async = new AsyncCall(env, instance, func, mem, callback);
 
-    if (async->Prepare(info) && instance->debug) {
-        async->DumpForward();
+    Napi::Object obj = Napi::Object::New(env);
+
+    for (const HeaderConstant &constant: decls.constants) {
+        obj.Set(constant.name, Napi::Number::New(env, (double)constant.value));
+    }
+    for (FunctionInfo *func: decls.funcs) {
+        Napi::Function wrapper = CreateFunctionWrapper(env, func);
+        obj.Set(func->name, wrapper);
     }
-    async->Queue();
 
-    return env.Undefined();
+    return obj;
 }
 
-static Napi::Value FindLibraryFunction(const Napi::CallbackInfo &info, CallConvention convention)
+static Napi::Value DeclareLibraryFunctions(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
     InstanceData *instance = env.GetInstanceData<InstanceData>();
     LibraryHolder *lib = (LibraryHolder *)info.Data();
 
-    FunctionInfo *func = new FunctionInfo();
-    RG_DEFER { func->Unref(); };
+    if (info.Length() < 1) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
+        return env.Null();
+    }
+    if (info[0].IsString())
+        return DeclareHeader(env, instance, lib, info[0].As<Napi::String>(), info[1]);
+    if (!info[0].IsObject() || IsNullOrUndefined(info[0])) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for prototypes, expected string, object or array", GetValueType(instance, info[0]));
+        return env.Null();
+    }
 
-    func->lib = lib->Ref();
-    func->convention = convention;
+    Napi::Object protos = info[0].As<Napi::Object>();
+    Napi::Array keys = info[0].IsArray() ? Napi::Array() : protos.GetPropertyNames();
+    uint32_t count = info[0].IsArray() ? protos.As<Napi::Array>().Length() : keys.Length();
 
-    if (info.Length() >= 3) {
-        if (!ParseClassicFunction(env, info[0u].As<Napi::String>(), info[1u], info[2u].As<Napi::Array>(), func))
-            return env.Null();
-    } else if (info.Length() >= 1) {
-        if (!info[0].IsString()) {
-            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for prototype, expected string", GetValueType(instance, info[0]));
+    // Read everything first, so that no JS code (such as getters) runs once parsing starts
+    BlockAllocator str_alloc;
+    HeapArray<Napi::Value> names;
+    HeapArray<Napi::Value> values;
+    HeapArray<const char *> strings;
+
+    for (uint32_t i = 0; i < count; i++) {
+        Napi::Value key = info[0].IsArray() ? Napi::Value() : keys.Get(i);
+        Napi::Value value = info[0].IsArray() ? protos.Get(i) : protos.Get(key);
+
+        if (!value.IsString()) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for prototype, expected string", GetValueType(instance, value));
             return env.Null();
         }
 
-        std::string proto = info[0u].As<Napi::String>();
-        if (!ParsePrototype(env, proto.c_str(), func))
-            return env.Null();
-    } else {
-        ThrowError<Napi::TypeError>(env, "Expected 1 or 3 arguments, got %1", info.Length());
-        return env.Null();
+        std::string proto = value.As<Napi::String>();
+
+        names.Append(key);
+        values.Append(value);
+        strings.Append(DuplicateString(proto.c_str(), &str_alloc).ptr);
     }
 
-    if (func->convention != CallConvention::Cdecl && func->variadic) {
-        LogError("Call convention '%1' does not support variadic functions, ignoring",
-                 CallConventionNames[(int)func->convention]);
+    HeapArray<FunctionInfo *> funcs;
+    RG_DEFER {
+        for (FunctionInfo *func: funcs) {
+            func->Unref();
+        }
+    };
+
+    for (uint32_t i = 0; i < count; i++) {
+        FunctionInfo *func = new FunctionInfo();
+        funcs.Append(func);
+
+        func->lib = lib->Ref();
         func->convention = CallConvention::Cdecl;
     }
 
-    if (!AnalyseFunction(env, instance, func))
-        return env.Null();
-    if (func->variadic) {
-        // Minimize reallocations
-        func->parameters.Grow(32);
-    }
+    // Parse all prototypes with the same parser, which shares type lookups
+    {
+        PrototypeParser parser(env);
 
-#ifdef _WIN32
-    if (info[0].IsString()) {
-        if (func->decorated_name) {
-            func->func = (void *)GetProcAddress((HMODULE)lib->module, func->decorated_name);
-        }
-        if (!func->func) {
-            func->func = (void *)GetProcAddress((HMODULE)lib->module, func->name);
-        }
-    } else {
-        uint16_t ordinal = (uint16_t)info[0].As<Napi::Number>().Uint32Value();
+        if (!parser.ParseMany(strings, funcs))
+            return env.Null();
+    }
 
-        func->decorated_name = nullptr;
-        func->func = (void *)GetProcAddress((HMODULE)lib->module, (LPCSTR)(size_t)ordinal);
+    for (uint32_t i = 0; i < count; i++) {
+        if (!PrepareLibraryFunction(env, instance, lib, funcs[i], values[i]))
+            return env.Null();
     }
-#else
-    if (func->decorated_name) {
-        func->func = dlsym(lib->module, func->decorated_name);
+
+    Napi::Object obj = Napi::Object::New(env);
+
+    for (uint32_t i = 0; i < count; i++) {
+        FunctionInfo *func = funcs[i];
+        Napi::Function wrapper = CreateFunctionWrapper(env, func);
+
+        if (info[0].IsArray()) {
+            obj.Set(func->name, wrapper);
+        } else {
+            obj.Set(names[i], wrapper);
+        }
     }
-    if (!func->func) {
-        func->func = dlsym(lib->module, func->name);
+
+    return obj;
+}
+
+static Napi::Value ReplayCalls(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+    if (info.Length() < 1) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 or 2 arguments, got %1", info.Length());
+        return env.Null();
     }
-#endif
-    if (!func->func) {
-        ThrowError<Napi::Error>(env, "Cannot find function '%1' in shared library", func->name);
+    if (!info[0].IsString()) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for filename, expected string", GetValueType(instance, info[0]));
         return env.Null();
     }
 
-    Napi::Function::Callback call = func->variadic ? TranslateVariadicCall : TranslateNormalCall;
-    Napi::Function wrapper = Napi::Function::New(env, call, func->name, (void *)func->Ref());
-    wrapper.AddFinalizer([](Napi::Env, FunctionInfo *func) { func->Unref(); }, func);
+    Napi::Object functions = Napi::Object::New(env);
 
-    if (!func->variadic) {
-        Napi::Function async = Napi::Function::New(env, TranslateAsyncCall, func->name, (void *)func->Ref());
-        async.AddFinalizer([](Napi::Env, FunctionInfo *func) { func->Unref(); }, func);
-        wrapper.Set("async", async);
+    if (info.Length() >= 2 && !IsNullOrUndefined(info[1])) {
+        if (!IsObject(info[1])) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for functions, expected object", GetValueType(instance, info[1]));
+            return env.Null();
+        }
+
+        functions = info[1].As<Napi::Object>();
     }
 
-    return wrapper;
+    std::string filename = info[0].As<Napi::String>();
+
+    if (!instance->memories.len) {
+        AllocateMemory(instance, instance->sync_stack_size, instance->sync_heap_size);
+        RG_ASSERT(instance->memories.len);
+    }
+
+    return ReplayRecord(env, instance, filename.c_str(), functions);
 }
 
 static Napi::Value LoadSharedLibrary(const Napi::CallbackInfo &info)
@@ -1239,6 +2601,17 @@ static Napi::Value LoadSharedLibrary(const Napi::CallbackInfo &info)
         return env.Null();
     }
 
+    bool lazy = false;
+    if (info.Length() >= 2 && !IsNullOrUndefined(info[1])) {
+        if (!IsObject(info[1])) {
+            ThrowError<Napi::TypeError>(env, "Unexpected %1 value for options, expected object", GetValueType(instance, info[1]));
+            return env.Null();
+        }
+
+        Napi::Object options = info[1].As<Napi::Object>();
+        lazy = options.Get("lazy").ToBoolean();
+    }
+
     if (!instance->memories.len) {
         AllocateMemory(instance, instance->sync_stack_size, instance->sync_heap_size);
         RG_ASSERT(instance->memories.len);
@@ -1262,7 +2635,7 @@ static Napi::Value LoadSharedLibrary(const Napi::CallbackInfo &info)
 #else
     if (info[0].IsString()) {
         std::string filename = info[0].As<Napi::String>();
-        module = dlopen(filename.c_str(), RTLD_NOW);
+        module = dlopen(filename.c_str(), lazy ? RTLD_LAZY : RTLD_NOW);
 
         if (!module) {
             const char *msg = dlerror();
@@ -1282,9 +2655,19 @@ static Napi::Value LoadSharedLibrary(const Napi::CallbackInfo &info)
     }
 #endif
 
-    LibraryHolder *lib = new LibraryHolder(module);
+    LibraryHolder *lib = new LibraryHolder(module, lazy);
     RG_DEFER { lib->Unref(); };
 
+    if (info[0].IsString()) {
+        std::string filename = info[0].As<Napi::String>();
+        FileInfo file_info;
+
+        if (StatFile(filename.c_str(), (int)StatFlag::IgnoreMissing | (int)StatFlag::FollowSymlink, &file_info)) {
+            lib->mtime = file_info.mtime;
+            lib->size = file_info.size;
+        }
+    }
+
     Napi::Object obj = Napi::Object::New(env);
 
 #define ADD_CONVENTION(Name, Value) \
@@ -1303,6 +2686,10 @@ static Napi::Value LoadSharedLibrary(const Napi::CallbackInfo &info)
 
 #undef ADD_CONVENTION
 
+    Napi::Function declare = Napi::Function::New(env, DeclareLibraryFunctions, "declare", (void *)lib->Ref());
+    declare.AddFinalizer([](Napi::Env, LibraryHolder *lib) { lib->Unref(); }, lib);
+    obj.Set("declare", declare);
+
     return obj;
 }
 
@@ -1415,16 +2802,59 @@ void LibraryHolder::Unref() const
     }
 }
 
+ArenaHolder::ArenaHolder(Size size)
+    : overflow(size)
+{
+    block = AllocateSpan<uint8_t>(&alloc, size);
+}
+
+uint8_t *ArenaHolder::Allocate(Size size, Size align)
+{
+    uint8_t *ptr = AlignUp(block.ptr + used, align);
+    Size delta = size + (ptr - (block.ptr + used));
+
+    if (RG_LIKELY(delta <= block.len - used)) {
+        used += delta;
+    } else {
+        ptr = (uint8_t *)AllocateRaw(&overflow, size + align);
+        ptr = AlignUp(ptr, align);
+
+        overflow_size += size + align;
+    }
+
+    memset(ptr, 0, (size_t)size);
+
+    return ptr;
+}
+
+void ArenaHolder::Reset()
+{
+    // Grow the block so that the same workload fits next time, up to MaxArenaSize. Anything
+    // beyond that keeps going to the overflow allocator.
+    if (overflow_size) {
+        Size size = std::min(AlignLen(block.len + overflow_size, Kibibytes(4)), MaxArenaSize);
+
+        if (size > block.len) {
+            ReleaseSpan(&alloc, block);
+            block = AllocateSpan<uint8_t>(&alloc, size);
+        }
+
+        overflow.ReleaseAll();
+        overflow_size = 0;
+    }
+
+    used = 0;
+}
 
 static void RegisterPrimitiveType(Napi::Env env, Napi::Object map, std::initializer_list<const char *> names,
-                                  PrimitiveKind primitive, int16_t size, int16_t align, const char *ref = nullptr)
+                                  PrimitiveKind primitive, int32_t size, int32_t align, const char *ref = nullptr)
 {
     RG_ASSERT(names.size() > 0);
     RG_ASSERT(align <= size);
 
     InstanceData *instance = env.GetInstanceData<InstanceData>();
 
-    TypeInfo *type = instance->types.AppendDefault();
+    TypeInfo *type = AllocateType(instance);
 
     type->name = *names.begin();
 
@@ -1439,8 +2869,7 @@ static void RegisterPrimitiveType(Napi::Env env, Napi::Object map, std::initiali
         type->ref.marker = marker;
     }
 
-    Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, type);
-    SetValueTag(instance, external, &TypeInfoMarker);
+    Napi::External<TypeInfo> external = WrapType(env, instance, type);
 
     for (const char *name: names) {
         std::pair<const TypeInfo **, bool> ret = instance->types_map.TrySet(name, type);
@@ -1539,6 +2968,17 @@ static Napi::Object InitBaseTypes(Napi::Env env)
 
 FunctionInfo::~FunctionInfo()
 {
+    // Go through UnpinType(), so that dropped functions trigger type collection too
+    if (pinned) {
+        Napi::Env env(pinned);
+        InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+        UnpinType(env, instance, ret.type);
+        for (const ParameterInfo &param: parameters) {
+            UnpinType(env, instance, param.type);
+        }
+    }
+
     if (lib) {
         lib->Unref();
     }
@@ -1576,11 +3016,87 @@ InstanceMemory::~InstanceMemory()
 #endif
 }
 
+HeapCache::~HeapCache()
+{
+    for (Size i = 0; i < RG_LEN(classes); i++) {
+        Size block_size = (Size)1 << (MinHeapClass + i);
+
+        for (void *ptr: classes[i].blocks) {
+            ReleaseRaw(nullptr, ptr, block_size);
+        }
+    }
+}
+
+void *HeapCache::Borrow(int cls)
+{
+    SizeClass *sc = &classes[cls - MinHeapClass];
+    Size block_size = (Size)1 << cls;
+
+    void *ptr;
+    if (sc->blocks.len) {
+        ptr = sc->blocks.ptr[--sc->blocks.len];
+        size -= block_size;
+        hits++;
+    } else {
+        ptr = AllocateRaw(nullptr, block_size);
+        misses++;
+    }
+
+    sc->used++;
+    sc->peak = std::max(sc->peak, sc->used);
+
+    return ptr;
+}
+
+void HeapCache::Return(void *ptr, int cls, Size max_size)
+{
+    SizeClass *sc = &classes[cls - MinHeapClass];
+    Size block_size = (Size)1 << cls;
+
+    sc->used--;
+
+    if (size + block_size <= max_size) {
+        sc->blocks.Append(ptr);
+        size += block_size;
+    } else {
+        ReleaseRaw(nullptr, ptr, block_size);
+    }
+
+    if (!(++releases % HeapCacheTrimInterval)) {
+        Trim();
+    }
+}
+
+// Drop the blocks that were not needed since the last trim, so that a burst of big calls
+// does not pin memory forever (up to the cache size)
+void HeapCache::Trim()
+{
+    for (Size i = 0; i < RG_LEN(classes); i++) {
+        SizeClass *sc = &classes[i];
+        Size block_size = (Size)1 << (MinHeapClass + i);
+        Size keep = std::max(sc->peak - sc->used, (Size)0);
+
+        for (Size j = keep; j < sc->blocks.len; j++) {
+            ReleaseRaw(nullptr, sc->blocks[j], block_size);
+            size -= block_size;
+        }
+        sc->blocks.RemoveFrom(std::min(keep, sc->blocks.len));
+
+        sc->peak = sc->used;
+    }
+}
+
 InstanceData::~InstanceData()
 {
     for (InstanceMemory *mem: memories) {
         delete mem;
     }
+
+    // The environment is gone, dispose functions cannot run and references cannot be released
+    for (OwnedPointer *owned: pending_disposals) {
+        owned->dispose.SuppressDestruct();
+        delete owned;
+    }
 }
 
 static Napi::Value CastValue(const Napi::CallbackInfo &info)
@@ -1607,17 +3123,107 @@ static Napi::Value CastValue(const Napi::CallbackInfo &info)
 
     cast->ref.Reset(value, 1);
     cast->type = type;
+    type->pins++;
+
+    Napi::External<ValueCast> external = Napi::External<ValueCast>::New(env, cast, [](Napi::Env env, ValueCast *cast) {
+        InstanceData *instance = env.GetInstanceData<InstanceData>();
 
-    Napi::External<ValueCast> external = Napi::External<ValueCast>::New(env, cast, [](Napi::Env, ValueCast *cast) { delete cast; });
+        UnpinType(env, instance, cast->type);
+        delete cast;
+    });
     SetValueTag(instance, external, &CastMarker);
 
     return external;
 }
 
+static bool FreezeDeep(Napi::Env env, Napi::Object obj, int depth)
+{
+    if (RG_UNLIKELY(depth >= 64)) {
+        ThrowError<Napi::Error>(env, "Cannot freeze object with too many nested levels (or cycles)");
+        return false;
+    }
+
+    Napi::Array keys = obj.GetPropertyNames();
+
+    for (uint32_t i = 0; i < keys.Length(); i++) {
+        Napi::Value value = obj.Get(keys.Get(i));
+
+        if (value.IsObject() && !value.IsFunction() && !value.IsExternal()) {
+            if (!FreezeDeep(env, value.As<Napi::Object>(), depth + 1))
+                return false;
+        }
+    }
+
+    // Fails (with a pending exception) for non-empty TypedArrays
+    napi_status status = napi_object_freeze(env, obj);
+    return (status == napi_ok);
+}
+
+static Napi::Value FreezeObject(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+    if (RG_UNLIKELY(info.Length() < 1)) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
+        return env.Null();
+    }
+    if (RG_UNLIKELY(!IsObject(info[0]))) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for object, expected object", GetValueType(instance, info[0]));
+        return env.Null();
+    }
+
+    Napi::Object obj = info[0].As<Napi::Object>();
+
+    if (CheckValueTag(instance, obj, &FrozenMarker))
+        return obj;
+    if (!FreezeDeep(env, obj, 0))
+        return env.Null();
+    if (!WrapFrozenObject(env, instance, obj))
+        return env.Null();
+
+    return obj;
+}
+
+static Napi::Value MarkStructOfArrays(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    InstanceData *instance = env.GetInstanceData<InstanceData>();
+
+    if (RG_UNLIKELY(info.Length() < 1)) {
+        ThrowError<Napi::TypeError>(env, "Expected 1 argument, got %1", info.Length());
+        return env.Null();
+    }
+    if (RG_UNLIKELY(!IsObject(info[0]) || info[0].IsArray() || info[0].IsTypedArray())) {
+        ThrowError<Napi::TypeError>(env, "Unexpected %1 value for object, expected object", GetValueType(instance, info[0]));
+        return env.Null();
+    }
+
+    Napi::Object obj = info[0].As<Napi::Object>();
+
+    if (CheckValueTag(instance, obj, &StructOfArraysMarker))
+        return obj;
+
+    // Objects can only be tagged once (frozen objects, output buffers, etc.)
+    napi_type_tag tag = { instance->tag_lower, (uint64_t)&StructOfArraysMarker };
+    if (napi_type_tag_object(env, obj, &tag) != napi_ok) {
+        ThrowError<Napi::TypeError>(env, "Cannot use this object as a struct of arrays");
+        return env.Null();
+    }
+
+    instance->soa_objects = true;
+
+    return obj;
+}
+
 template <typename Func>
 static void SetExports(Napi::Env env, Func func)
 {
     func("config", Napi::Function::New(env, GetSetConfig));
+    func("stats", Napi::Function::New(env, GetStats));
+    func("trace", Napi::Function::New(env, ControlTrace));
+    func("record", Napi::Function::New(env, ControlRecord));
+    func("replay", Napi::Function::New(env, ReplayCalls));
 
     func("struct", Napi::Function::New(env, CreatePaddedStructType));
     func("pack", Napi::Function::New(env, CreatePackedStructType));
@@ -1639,12 +3245,18 @@ static void SetExports(Napi::Env env, Func func)
     func("inout", Napi::Function::New(env, MarkInOut));
 
     func("disposable", Napi::Function::New(env, CreateDisposableType));
+    func("lazy", Napi::Function::New(env, CreateLazyType));
     func("free", Napi::Function::New(env, CallFree));
+    func("own", Napi::Function::New(env, OwnPointer));
+    func("arena", Napi::Function::New(env, CreateArena));
+    func("outbuf", Napi::Function::New(env, CreateOutBuffer));
 
     func("register", Napi::Function::New(env, RegisterCallback));
     func("unregister", Napi::Function::New(env, UnregisterCallback));
 
     func("as", Napi::Function::New(env, CastValue));
+    func("freeze", Napi::Function::New(env, FreezeObject));
+    func("soa", Napi::Function::New(env, MarkStructOfArrays));
 
 #if defined(_WIN32)
     func("extension", Napi::String::New(env, ".dll"));
@@ -1687,6 +3299,8 @@ static void InitInternal(v8::Local<v8::Object> target, v8::Local<v8::Value>,
     Napi::Env env_cxx(env_napi);
     env->AtExit([](void *udata) {
         napi_env env_napi = (napi_env)udata;
+
+        Napi::Env(env_napi).GetInstanceData<InstanceData>()->exiting = true;
         delete env_napi;
     }, env_napi);
 
@@ -1694,6 +3308,8 @@ static void InitInternal(v8::Local<v8::Object> target, v8::Local<v8::Value>,
     env_cxx.SetInstanceData(instance);
 
     instance->debug = GetDebugFlag("DUMP_CALLS");
+    InitTrace();
+    InitRecord();
     FillRandomSafe(&instance->tag_lower, RG_SIZE(instance->tag_lower));
 
     SetExports(env_napi, [&](const char *name, Napi::Value value) { SetValue(env, target, name, value); });
@@ -1709,7 +3325,12 @@ static Napi::Object InitModule(Napi::Env env, Napi::Object exports)
     InstanceData *instance = new InstanceData();
     env.SetInstanceData(instance);
 
+    // Finalizers that run during shutdown must not queue more work, see QueueCollection()
+    napi_add_env_cleanup_hook(env, [](void *udata) { ((InstanceData *)udata)->exiting = true; }, instance);
+
     instance->debug = GetDebugFlag("DUMP_CALLS");
+    InitTrace();
+    InitRecord();
     FillRandomSafe(&instance->tag_lower, RG_SIZE(instance->tag_lower));
 
     SetExports(env, [&](const char *name, Napi::Value value) { exports.Set(name, value); });
@@ -25,14 +25,29 @@ static const Size DefaultAsyncStackSize = Kibibytes(256);
 static const Size DefaultAsyncHeapSize = Kibibytes(512);
 static const int DefaultResidentAsyncPools = 2;
 static const int DefaultMaxAsyncCalls = 64;
+static const Size DefaultArenaSize = Kibibytes(64);
+static const Size DefaultHeapCacheSize = Mebibytes(8);
 
 static const int MaxAsyncCalls = 256;
 static const Size MaxParameters = 32;
 static const Size MaxOutParameters = 4;
 static const Size MaxTrampolines = 16;
+static const Size MaxResolvedStrings = 4096;
+static const Size CollectTypesThreshold = 64;
+static const Size MaxArenaSize = Mebibytes(1024);
+
+// Big call allocations are recycled in power-of-two size classes (4 kiB to 4 MiB)
+static const int MinHeapClass = 12;
+static const int MaxHeapClass = 22;
+static const Size HeapCacheTrimInterval = 1024;
 
 extern const int TypeInfoMarker;
 extern const int CastMarker;
+extern const int FrozenMarker;
+extern const int EncodedStringMarker;
+extern const int EncodedString16Marker;
+extern const int OutBufferMarker;
+extern const int StructOfArraysMarker;
 
 enum class PrimitiveKind {
     Void,
@@ -99,14 +114,15 @@ struct TypeInfo {
     enum class ArrayHint {
         Array,
         TypedArray,
-        String
+        String,
+        StructOfArrays
     };
 
     const char *name;
 
     PrimitiveKind primitive;
-    int16_t size;
-    int16_t align;
+    int32_t size;
+    int32_t align;
 
     DisposeFunc *dispose;
     Napi::FunctionReference dispose_ref;
@@ -118,29 +134,68 @@ struct TypeInfo {
         const FunctionInfo *proto; // Callback only
     } ref;
     ArrayHint hint; // Array only
+    Napi::FunctionReference construct; // Lazy records only
 
     mutable Napi::ObjectReference defn;
 
+    Size id; // Allocation order, slots are reused
+    mutable int pins; // JS wrappers and other users, see CollectTypes()
+    mutable bool pointee; // Pointers decoded from C are tagged with this type, see ReleaseType()
+
     RG_HASHTABLE_HANDLER(TypeInfo, name);
 };
 
 struct RecordMember {
     const char *name;
     const TypeInfo *type;
-    int16_t offset;
+    int32_t offset;
 };
 
 struct LibraryHolder {
     void *module = nullptr; // HMODULE on Windows
+    bool lazy = false; // Resolve symbols on first call
+    int64_t mtime = -1; // Used to validate binding caches, -1 if unknown
+    int64_t size = -1;
     mutable std::atomic_int refcount {1};
 
-    LibraryHolder(void *module) : module(module) {}
+    LibraryHolder(void *module, bool lazy) : module(module), lazy(lazy) {}
     ~LibraryHolder();
 
     const LibraryHolder *Ref() const;
     void Unref() const;
 };
 
+// Memory handed out by koffi.arena(), released all at once by reset
+struct ArenaHolder {
+    LinkedAllocator alloc;
+    Span<uint8_t> block = {}; // Kept across resets
+    Size used = 0;
+
+    // Allocations that do not fit are served by this one, and the block grows on reset
+    BlockAllocator overflow;
+    Size overflow_size = 0;
+
+    int refcount = 1;
+
+    ArenaHolder(Size size);
+
+    uint8_t *Allocate(Size size, Size align);
+    void Reset();
+
+    ArenaHolder *Ref() { refcount++; return this; }
+    void Unref() { if (!--refcount) delete this; }
+};
+
+// Native storage for koffi.outbuf(), passed to pointer parameters as is. The JS value
+// is only decoded when the program reads it, and records are updated in place.
+struct OutBuffer {
+    const TypeInfo *type;
+    uint8_t *ptr;
+
+    napi_ref cache = nullptr;
+    bool dirty = true;
+};
+
 enum class CallConvention {
     Cdecl,
     Stdcall,
@@ -184,11 +239,52 @@ struct ParameterInfo {
 #endif
 };
 
+// Binding caches and call records depend on the ABI, they cannot move to another one
+#if defined(_M_X64)
+    static const char *const AbiName = "x64_win";
+#elif defined(__x86_64__)
+    static const char *const AbiName = "x64_sysv";
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    static const char *const AbiName = "arm64";
+#elif defined(__arm__)
+    static const char *const AbiName = "arm32";
+#elif defined(__i386__) || defined(_M_IX86)
+    static const char *const AbiName = "x86";
+#elif __riscv_xlen == 64
+    static const char *const AbiName = "riscv64";
+#endif
+
 struct ValueCast {
     Napi::Reference<Napi::Value> ref;
     const TypeInfo *type;
 };
 
+// Wrapped inside objects frozen with koffi.freeze(), to reuse encoded bytes
+struct FrozenObject {
+    struct Encoding {
+        const TypeInfo *type;
+        HeapArray<uint8_t> bytes;
+    };
+
+    LocalArray<Encoding, 4> encodings;
+};
+
+// Filled while call statistics are enabled, see koffi.stats()
+struct FunctionStats {
+    const char *name;
+
+    int64_t sync_calls;
+    int64_t async_calls;
+
+    // Nanoseconds spent in each step
+    int64_t prepare_time;
+    int64_t execute_time;
+    int64_t complete_time;
+
+    int64_t heap_fallbacks;
+    int64_t trampolines;
+};
+
 // Also used for callbacks, even though many members are not used in this case
 struct FunctionInfo {
     mutable std::atomic_int refcount {1};
@@ -214,12 +310,37 @@ struct FunctionInfo {
     bool forward_fp;
 #endif
 
+    napi_env pinned = nullptr; // Parameter types are pinned while the function lives, see UnpinType()
+    mutable FunctionStats *stats = nullptr; // Set on first call with statistics enabled
+
     ~FunctionInfo();
 
     const FunctionInfo *Ref() const;
     void Unref() const;
 };
 
+// Blocks for big strings and objects, reused across calls instead of calling malloc/free each time
+struct HeapCache {
+    struct SizeClass {
+        HeapArray<void *> blocks;
+        Size used = 0; // Lent to running calls
+        Size peak = 0; // Highest use since last trim
+    };
+
+    SizeClass classes[MaxHeapClass - MinHeapClass + 1];
+    Size size = 0;
+    Size releases = 0;
+
+    int64_t hits = 0;
+    int64_t misses = 0;
+
+    ~HeapCache();
+
+    void *Borrow(int cls);
+    void Return(void *ptr, int cls, Size max_size);
+    void Trim();
+};
+
 struct InstanceMemory {
     ~InstanceMemory();
 
@@ -239,12 +360,15 @@ struct TrampolineInfo {
     int32_t generation;
 };
 
+struct OwnedPointer;
+
 struct InstanceData {
     ~InstanceData();
 
     BucketArray<TypeInfo> types;
     HashMap<const char *, const TypeInfo *> types_map;
     BucketArray<FunctionInfo> callbacks;
+    HashMap<const char *, const TypeInfo *> resolved_strings; // Type specifiers already seen by ResolveType()
 
     bool debug;
     uint64_t tag_lower;
@@ -259,11 +383,38 @@ struct InstanceData {
     uint32_t registered_trampolines = 0;
 
     BlockAllocator str_alloc;
+    HashMap<const char *, const char *> str_interned;
+
+    HeapArray<TypeInfo *> free_types;
+    Size retired_types = 0;
+    Size next_type_id = 0;
+    Size unpinned_types = 0;
+    napi_async_work collect_work = nullptr;
+    bool exiting = false; // No collection once the environment shuts down
+    Size reclaimed_types = 0;
+
+    Size parsed_headers = 0;
+    Size shared_headers = 0; // Built from a header parsed by another thread
+
+    Size frozen_objects = 0;
+    bool soa_objects = false; // Set once koffi.soa() gets used
+
+    HeapCache heap_cache;
+
+    HashSet<const void *> owned_pointers; // Released by GC, see koffi.own()
+    Size owned_memory = 0;
+    HeapArray<OwnedPointer *> pending_disposals; // JS dispose callbacks run from the event loop
+    napi_async_work dispose_work = nullptr;
+    HashMap<const void *, int> managed_pointers; // Arena and output buffer memory, cannot be owned
+
+    bool collect_stats = false;
+    BucketArray<FunctionStats> call_stats;
 
     Size sync_stack_size = DefaultSyncStackSize;
     Size sync_heap_size = DefaultSyncHeapSize;
     Size async_stack_size = DefaultAsyncStackSize;
     Size async_heap_size = DefaultAsyncHeapSize;
+    Size heap_cache_size = DefaultHeapCacheSize;
     int resident_async_pools = DefaultResidentAsyncPools;
     int max_temporaries = DefaultMaxAsyncCalls - DefaultResidentAsyncPools;
 };
@@ -12,6 +12,7 @@
 // along with this program. If not, see https://www.gnu.org/licenses/.
 
 #include "vendor/libcc/libcc.hh"
+#include "call.hh"
 #include "ffi.hh"
 #include "parser.hh"
 
@@ -19,30 +20,141 @@
 
 namespace RG {
 
+HeaderDeclarations::~HeaderDeclarations()
+{
+    for (FunctionInfo *func: funcs) {
+        func->Unref();
+    }
+}
+
+void RollbackHeader(InstanceData *instance, const HeaderDeclarations &decls, Size first_type, Size first_callback)
+{
+    for (TypeInfo *type: decls.completed) {
+        type->primitive = PrimitiveKind::Void;
+        type->size = 0;
+        type->align = 0;
+        type->members.Clear();
+    }
+
+    // Named pointer types are registered by MakePointerType(), so decls.types is not enough
+    HeapArray<const char *> names;
+    for (const auto &bucket: instance->types_map.table) {
+        if (bucket.value->id >= first_type) {
+            names.Append(bucket.key);
+        }
+    }
+    names.Append(decls.types);
+    for (const char *name: names) {
+        instance->types_map.Remove(name);
+    }
+
+    for (TypeInfo &type: instance->types) {
+        if (type.id >= first_type) {
+            ReleaseType(instance, &type);
+        }
+    }
+    instance->callbacks.RemoveLast(instance->callbacks.len - first_callback);
+}
+
 bool PrototypeParser::Parse(const char *str, FunctionInfo *out_func)
+{
+    tokens.RemoveFrom(0);
+    offset = 0;
+    valid = true;
+    decls = nullptr;
+
+    Tokenize(str);
+
+    ParseFunction(out_func);
+
+    Match(";");
+    if (offset < tokens.len) {
+        MarkError("Unexpected token '%1' after prototype", tokens[offset]);
+    }
+
+    return valid;
+}
+
+bool PrototypeParser::ParseMany(Span<const char *const> strings, Span<FunctionInfo *const> out_funcs)
+{
+    RG_ASSERT(strings.len == out_funcs.len);
+
+    share_lookups = true;
+    RG_DEFER {
+        share_lookups = false;
+        lookups.Clear();
+    };
+
+    for (Size i = 0; i < strings.len; i++) {
+        if (!Parse(strings[i], out_funcs[i]))
+            return false;
+    }
+
+    return true;
+}
+
+bool PrototypeParser::ParseHeader(const char *str, HeaderDeclarations *out_decls)
 {
     tokens.Clear();
     offset = 0;
     valid = true;
+    constants.Clear();
+    decls = out_decls;
 
     Tokenize(str);
 
-    out_func->ret.type = ParseType();
-    if (!CanReturnType(out_func->ret.type)) {
-        MarkError("You are not allowed to directly return %1 values (maybe try %1 *)", out_func->ret.type->name);
-        return false;
+    int linkage_blocks = 0;
+
+    while (valid && offset < tokens.len) {
+        if (Match(";"))
+            continue;
+
+        // Skip linkage specifications, such as extern "C" { ... }
+        if (Match("extern")) {
+            if (offset < tokens.len && tokens[offset][0] == '"') {
+                offset++;
+                linkage_blocks += Match("{");
+            }
+            continue;
+        }
+        if (linkage_blocks && Match("}")) {
+            linkage_blocks--;
+            continue;
+        }
+
+        if (Match("typedef")) {
+            ParseTypedef();
+        } else if (IsSpecifier() && (Peek("{", 1) || Peek("{", 2) || Peek(";", 2))) {
+            ParseSpecifier();
+        } else {
+            FunctionInfo *func = new FunctionInfo();
+            decls->funcs.Append(func);
+
+            func->convention = CallConvention::Cdecl;
+            ParseFunction(func);
+        }
+
+        Consume(";");
     }
-    if (Match("__cdecl")) {
-        out_func->convention = CallConvention::Cdecl;
-    } else if (Match("__stdcall")) {
-        out_func->convention = CallConvention::Stdcall;
-    } else if (Match("__fastcall")) {
-        out_func->convention = CallConvention::Fastcall;
-    } else if (Match("__thiscall")) {
-        out_func->convention = CallConvention::Thiscall;
+
+    return valid;
+}
+
+void PrototypeParser::ParseFunction(FunctionInfo *func)
+{
+    func->ret.type = ParseType();
+    if (!CanReturnType(func->ret.type)) {
+        MarkError("You are not allowed to directly return %1 values (maybe try %1 *)", func->ret.type->name);
+        return;
     }
-    out_func->name = ParseIdentifier();
+    func->convention = ParseConvention(func->convention);
+    func->name = ParseIdentifier();
+
+    ParseParameters(func);
+}
 
+void PrototypeParser::ParseParameters(FunctionInfo *func)
+{
     Consume("(");
     offset += (offset + 1 < tokens.len && tokens[offset] == "void" && tokens[offset + 1] == ")");
     if (offset < tokens.len && tokens[offset] != ")") {
@@ -50,7 +162,7 @@ bool PrototypeParser::Parse(const char *str, FunctionInfo *out_func)
             ParameterInfo param = {};
 
             if (Match("...")) {
-                out_func->variadic = true;
+                func->variadic = true;
                 break;
             }
 
@@ -67,28 +179,28 @@ bool PrototypeParser::Parse(const char *str, FunctionInfo *out_func)
             param.type = ParseType();
             if (!CanPassType(param.type)) {
                 MarkError("Type %1 cannot be used as a parameter (maybe try %1 *)", param.type->name);
-                return false;
+                return;
             }
 
             if ((param.directions & 2) && param.type->primitive != PrimitiveKind::Pointer) {
                 MarkError("Only pointers can be used for output parameters");
-                return false;
+                return;
             }
 
             offset += (offset < tokens.len && IsIdentifier(tokens[offset]));
 
-            if (out_func->parameters.len >= MaxParameters) {
+            if (func->parameters.len >= MaxParameters) {
                 MarkError("Functions cannot have more than %1 parameters", MaxParameters);
-                return false;
+                return;
             }
-            if ((param.directions & 2) && ++out_func->out_parameters >= MaxOutParameters) {
+            if ((param.directions & 2) && ++func->out_parameters >= MaxOutParameters) {
                 MarkError("Functions cannot have more than out %1 parameters", MaxOutParameters);
-                return false;
+                return;
             }
 
-            param.offset = (int8_t)out_func->parameters.len;
+            param.offset = (int8_t)func->parameters.len;
 
-            out_func->parameters.Append(param);
+            func->parameters.Append(param);
 
             if (offset >= tokens.len || tokens[offset] != ",")
                 break;
@@ -96,22 +208,413 @@ bool PrototypeParser::Parse(const char *str, FunctionInfo *out_func)
         }
     }
     Consume(")");
+}
 
-    Match(";");
-    if (offset < tokens.len) {
-        MarkError("Unexpected token '%1' after prototype", tokens[offset]);
+CallConvention PrototypeParser::ParseConvention(CallConvention convention)
+{
+    if (Match("__cdecl")) {
+        convention = CallConvention::Cdecl;
+    } else if (Match("__stdcall")) {
+        convention = CallConvention::Stdcall;
+    } else if (Match("__fastcall")) {
+        convention = CallConvention::Fastcall;
+    } else if (Match("__thiscall")) {
+        convention = CallConvention::Thiscall;
     }
 
-    return valid;
+    return convention;
+}
+
+void PrototypeParser::ParseTypedef()
+{
+    bool specifier = IsSpecifier();
+    const TypeInfo *base = specifier ? ParseSpecifier() : ParseBaseType();
+
+    if (!valid)
+        return;
+
+    Size start = offset;
+    int indirect = 0;
+    while (Match("*")) {
+        indirect++;
+    }
+
+    // Function and function pointer types, such as: typedef int (*Name)(int a, int b)
+    {
+        const char *name = nullptr;
+        CallConvention convention = CallConvention::Cdecl;
+        bool pointer = false;
+
+        if (Match("(")) {
+            convention = ParseConvention(convention);
+            Consume("*");
+            name = ParseIdentifier();
+            Consume(")");
+
+            pointer = true;
+        } else if (offset < tokens.len && IsIdentifier(tokens[offset]) && Peek("(", 1)) {
+            name = ParseIdentifier();
+        }
+
+        if (name) {
+            const TypeInfo *ret = indirect ? MakePointerType(instance, base, indirect) : base;
+
+            if (!valid)
+                return;
+
+            const FunctionInfo *proto = ParseCallback(name, ret, convention);
+            if (!proto)
+                return;
+
+            TypeInfo *type = AllocateType(instance);
+
+            type->name = proto->name;
+
+            type->primitive = pointer ? PrimitiveKind::Callback : PrimitiveKind::Prototype;
+            type->align = alignof(void *);
+            type->size = RG_SIZE(void *);
+            type->ref.proto = proto;
+
+            RegisterType(type->name, type);
+
+            return;
+        }
+    }
+    offset = start;
+
+    do {
+        const char *name;
+        const TypeInfo *type = ParseDeclarator(base, &name);
+
+        if (!valid)
+            return;
+
+        // Anonymous structs and unions take the name of the typedef
+        if (specifier && type == base && TestStr(type->name, "<anonymous>")) {
+            ((TypeInfo *)type)->name = name;
+        }
+
+        if (!RegisterType(name, type))
+            return;
+    } while (Match(","));
+}
+
+const TypeInfo *PrototypeParser::ParseSpecifier()
+{
+    RG_ASSERT(IsSpecifier());
+
+    if (Peek("enum")) {
+        return ParseEnum();
+    } else {
+        return ParseRecord();
+    }
+}
+
+const TypeInfo *PrototypeParser::ParseRecord()
+{
+    bool is_union = Match("union");
+    if (!is_union) {
+        Consume("struct");
+    }
+
+    const char *tag = (offset < tokens.len && IsIdentifier(tokens[offset])) ? ParseIdentifier() : nullptr;
+    TypeInfo *type = tag ? (TypeInfo *)instance->types_map.FindValue(tag, nullptr) : nullptr;
+
+    // Forward declaration or reference to known type
+    if (!Peek("{")) {
+        if (!tag) {
+            Consume("{");
+            return instance->void_type;
+        }
+
+        if (!type) {
+            type = AllocateType(instance);
+
+            type->name = tag;
+            type->primitive = PrimitiveKind::Void;
+
+            RegisterType(type->name, type);
+        }
+
+        return type;
+    }
+    offset++;
+
+    // Opaque types (including forward declarations) can be completed later
+    bool opaque = false;
+
+    if (type) {
+        opaque = (type->primitive == PrimitiveKind::Void && type != instance->void_type);
+
+        if (!opaque) {
+            MarkError("Duplicate type name '%1'", tag);
+            return instance->void_type;
+        }
+    } else {
+        type = AllocateType(instance);
+
+        type->name = tag ? tag : "<anonymous>";
+        type->primitive = PrimitiveKind::Void;
+
+        if (tag) {
+            RegisterType(type->name, type);
+        }
+    }
+
+    // Koffi does not support unions yet, so they stay opaque
+    if (is_union) {
+        for (int depth = 1; depth;) {
+            if (offset >= tokens.len) {
+                MarkError("Unexpected end of prototype, expected '}'");
+                return type;
+            }
+
+            depth += (tokens[offset] == "{") - (tokens[offset] == "}");
+            offset++;
+        }
+
+        return type;
+    }
+
+    // The size stays at 0 until the end, which prevents recursive use by value
+    int64_t size = 0;
+    int32_t align = 1;
+
+    type->primitive = PrimitiveKind::Record;
+    RG_DEFER_N(err_guard) {
+        type->primitive = PrimitiveKind::Void;
+        type->members.Clear();
+    };
+
+    HashSet<const char *> members;
+
+    while (valid && !Match("}")) {
+        const TypeInfo *base = IsSpecifier() ? ParseSpecifier() : ParseBaseType();
+
+        do {
+            RecordMember member = {};
+
+            member.type = ParseDeclarator(base, &member.name);
+            if (!valid)
+                return type;
+
+            if (Peek(":")) {
+                MarkError("Bit fields are not supported");
+                return type;
+            }
+            if (!CanStoreType(member.type)) {
+                MarkError("Type %1 cannot be used as a member (maybe try %1 *)", member.type->name);
+                return type;
+            }
+            if (!member.type->size) {
+                MarkError("Member '%1' of struct '%2' has incomplete type", member.name, type->name);
+                return type;
+            }
+
+            int64_t start = AlignLen(size, member.type->align);
+            int64_t end = start + member.type->size;
+
+            if (end > INT32_MAX) {
+                MarkError("Struct '%1' is too big (max = %2)", type->name, FmtMemSize(INT32_MAX));
+                return type;
+            }
+
+            member.offset = (int32_t)start;
+
+            size = end;
+            align = std::max(align, member.type->align);
+
+            if (!members.TrySet(member.name).second) {
+                MarkError("Duplicate member '%1' in struct '%2'", member.name, type->name);
+                return type;
+            }
+
+            type->members.Append(member);
+        } while (Match(","));
+
+        Consume(";");
+    }
+    if (!valid)
+        return type;
+
+    if (!size) {
+        MarkError("Empty struct '%1' is not allowed in C", type->name);
+        return type;
+    }
+    if (AlignLen(size, align) > INT32_MAX) {
+        MarkError("Struct '%1' is too big (max = %2)", type->name, FmtMemSize(INT32_MAX));
+        return type;
+    }
+
+    type->size = (int32_t)AlignLen(size, align);
+    type->align = align;
+    err_guard.Disable();
+
+    if (opaque && decls) {
+        decls->completed.Append(type);
+    }
+
+    return type;
+}
+
+const TypeInfo *PrototypeParser::ParseEnum()
+{
+    Consume("enum");
+
+    const char *tag = (offset < tokens.len && IsIdentifier(tokens[offset])) ? ParseIdentifier() : nullptr;
+    const TypeInfo *type = instance->types_map.FindValue("int", nullptr);
+
+    if (Match("{")) {
+        int64_t value = 0;
+
+        while (valid && !Peek("}")) {
+            const char *name = ParseIdentifier();
+
+            if (Match("=")) {
+                value = ParseExpression();
+            }
+            if (!valid)
+                return type;
+
+            if (!constants.TrySet(name, value).second) {
+                MarkError("Duplicate constant '%1'", name);
+                return type;
+            }
+            decls->constants.Append({ name, value });
+
+            value++;
+
+            if (!Match(","))
+                break;
+        }
+
+        Consume("}");
+    }
+
+    if (tag) {
+        RegisterType(tag, type);
+    }
+
+    return type;
+}
+
+const TypeInfo *PrototypeParser::ParseDeclarator(const TypeInfo *base, const char **out_name)
+{
+    const TypeInfo *type = base;
+
+    int indirect = 0;
+    while (Match("*")) {
+        Match("const");
+        indirect++;
+    }
+    if (indirect) {
+        type = MakePointerType(instance, type, indirect);
+    }
+
+    *out_name = ParseIdentifier();
+
+    LocalArray<int64_t, 8> dimensions;
+    while (Match("[")) {
+        if (!dimensions.Available()) {
+            MarkError("Too many array dimensions");
+            return type;
+        }
+
+        int64_t len = ParseExpression();
+        Consume("]");
+
+        dimensions.Append(len);
+    }
+    if (!valid)
+        return type;
+
+    for (Size i = dimensions.len - 1; i >= 0; i--) {
+        int64_t len = dimensions[i];
+
+        if (!type->size) {
+            MarkError("Cannot create array of incomplete type %1", type->name);
+            return type;
+        }
+        if (len <= 0) {
+            MarkError("Array length must be positive and non-zero");
+            return type;
+        }
+        if (len > INT32_MAX / type->size) {
+            MarkError("Array length is too high (max = %1)", INT32_MAX / type->size);
+            return type;
+        }
+
+        type = MakeArrayType(instance, type, len);
+    }
+
+    return type;
+}
+
+const FunctionInfo *PrototypeParser::ParseCallback(const char *name, const TypeInfo *ret, CallConvention convention)
+{
+    if (instance->types_map.Find(name)) {
+        MarkError("Duplicate type name '%1'", name);
+        return nullptr;
+    }
+    if (!CanReturnType(ret)) {
+        MarkError("You are not allowed to directly return %1 values (maybe try %1 *)", ret->name);
+        return nullptr;
+    }
+
+    FunctionInfo *func = instance->callbacks.AppendDefault();
+    RG_DEFER_N(err_guard) { instance->callbacks.RemoveLast(1); };
+
+    func->name = name;
+    func->ret.type = ret;
+    func->convention = convention;
+
+    ParseParameters(func);
+    if (!valid)
+        return nullptr;
+
+    if (func->variadic) {
+        MarkError("Variadic callbacks are not supported");
+        return nullptr;
+    }
+
+    if (!AnalyseFunction(env, instance, func)) {
+        valid = false;
+        return nullptr;
+    }
+    err_guard.Disable();
+
+    return func;
 }
 
 void PrototypeParser::Tokenize(const char *str)
 {
+    bool line_start = true;
+
     for (Size i = 0; str[i]; i++) {
         char c = str[i];
 
-        if (IsAsciiWhite(c)) {
+        if (c == '\n') {
+            line_start = true;
+            continue;
+        } else if (IsAsciiWhite(c)) {
             continue;
+        } else if (c == '#' && line_start) {
+            // Skip preprocessor directives, including continuation lines
+            while (str[i + 1] && (str[i + 1] != '\n' || str[i] == '\\')) {
+                i++;
+            }
+            continue;
+        }
+
+        line_start = false;
+
+        if (c == '/' && str[i + 1] == '/') {
+            while (str[i + 1] && str[i + 1] != '\n') {
+                i++;
+            }
+        } else if (c == '/' && str[i + 1] == '*') {
+            const char *end = strstr(str + i + 2, "*/");
+            i = end ? (end - str) + 1 : (Size)strlen(str) - 1;
         } else if (IsAsciiAlpha(c) || c == '_') {
             Size j = i;
             while (str[++j] && (IsAsciiAlphaOrDigit(str[j]) || str[j] == '_'));
@@ -121,11 +624,20 @@ void PrototypeParser::Tokenize(const char *str)
 
             i = j - 1;
         } else if (IsAsciiDigit(c)) {
+            // Include suffixes and hexadecimal digits, the value is validated when used
             Size j = i;
-            while (str[++j] && IsAsciiDigit(str[j]));
-            if (str[j] == '.') {
-                while (str[++j] && IsAsciiDigit(str[j]));
+            while (str[++j] && (IsAsciiAlphaOrDigit(str[j]) || str[j] == '.'));
+
+            Span<const char> tok = MakeSpan(str + i, j - i);
+            tokens.Append(tok);
+
+            i = j - 1;
+        } else if (c == '"') {
+            Size j = i;
+            while (str[++j] && str[j] != '"') {
+                j += (str[j] == '\\' && str[j + 1]);
             }
+            j += !!str[j];
 
             Span<const char> tok = MakeSpan(str + i, j - i);
             tokens.Append(tok);
@@ -161,7 +673,7 @@ const TypeInfo *PrototypeParser::ParseType()
 
     while (offset >= start) {
         Span<const char> str = MakeSpan(tokens[start].ptr, tokens[offset].end() - tokens[start].ptr);
-        const TypeInfo *type = ResolveType(instance, str);
+        const TypeInfo *type = LookupType(str);
 
         if (type) {
             offset++;
@@ -176,6 +688,50 @@ const TypeInfo *PrototypeParser::ParseType()
     return instance->types_map.FindValue("void", nullptr);
 }
 
+const TypeInfo *PrototypeParser::ParseBaseType()
+{
+    Size start = offset;
+    const TypeInfo *type = ParseType();
+
+    if (!valid)
+        return type;
+
+    // Leave pointer declarators to ParseDeclarator(), to support things such as 'int *a, b'
+    Size end = offset;
+    while (end > start + 1 && tokens[end - 1] == "*") {
+        end--;
+    }
+
+    if (end < offset) {
+        Span<const char> str = MakeSpan(tokens[start].ptr, tokens[end - 1].end() - tokens[start].ptr);
+
+        type = LookupType(str);
+        offset = end;
+
+        if (!type) {
+            MarkError("Unknown or invalid type name '%1'", str);
+            return instance->void_type;
+        }
+    }
+
+    return type;
+}
+
+const TypeInfo *PrototypeParser::LookupType(Span<const char> str)
+{
+    if (!share_lookups)
+        return ResolveType(instance, str);
+
+    // Misses are kept too, ParseType() tries the parameter name as part of the type first
+    std::pair<const TypeInfo **, bool> ret = lookups.TrySetDefault(str);
+
+    if (ret.second) {
+        *ret.first = ResolveType(instance, str);
+    }
+
+    return *ret.first;
+}
+
 const char *PrototypeParser::ParseIdentifier()
 {
     if (offset >= tokens.len) {
@@ -188,11 +744,141 @@ const char *PrototypeParser::ParseIdentifier()
     }
 
     Span<const char> tok = tokens[offset++];
-    const char *ident = DuplicateString(tok, &instance->str_alloc).ptr;
+    const char *ident = InternString(instance, tok);
 
     return ident;
 }
 
+int64_t PrototypeParser::ParseExpression(int min_prec)
+{
+    int64_t value = ParseValue();
+
+    while (valid && offset < tokens.len) {
+        Span<const char> tok = tokens[offset];
+        char op = (tok.len == 1) ? tok[0] : 0;
+        bool shift = (op == '<' || op == '>') && offset + 1 < tokens.len && tokens[offset + 1] == tok;
+
+        int prec;
+        switch (op) {
+            case '|': { prec = 1; } break;
+            case '^': { prec = 2; } break;
+            case '&': { prec = 3; } break;
+            case '<':
+            case '>': { prec = shift ? 4 : 0; } break;
+            case '+':
+            case '-': { prec = 5; } break;
+            case '*':
+            case '/':
+            case '%': { prec = 6; } break;
+
+            default: { prec = 0; } break;
+        }
+        if (prec <= min_prec)
+            break;
+        offset += 1 + shift;
+
+        int64_t right = ParseExpression(prec);
+
+        if ((op == '/' || op == '%') && !right) {
+            MarkError("Division by zero in constant expression");
+            return 0;
+        }
+        if (shift && (right < 0 || right >= 64)) {
+            MarkError("Invalid shift count %1 in constant expression", right);
+            return 0;
+        }
+
+        // Use unsigned arithmetic to wrap around instead of overflowing
+        switch (op) {
+            case '|': { value |= right; } break;
+            case '^': { value ^= right; } break;
+            case '&': { value &= right; } break;
+            case '<': { value = (int64_t)((uint64_t)value << right); } break;
+            case '>': { value >>= right; } break;
+            case '+': { value = (int64_t)((uint64_t)value + (uint64_t)right); } break;
+            case '-': { value = (int64_t)((uint64_t)value - (uint64_t)right); } break;
+            case '*': { value = (int64_t)((uint64_t)value * (uint64_t)right); } break;
+            case '/': { value = (right == -1) ? (int64_t)(0 - (uint64_t)value) : value / right; } break;
+            case '%': { value = (right == -1) ? 0 : value % right; } break;
+        }
+    }
+
+    return value;
+}
+
+int64_t PrototypeParser::ParseValue()
+{
+    if (Match("-"))
+        return (int64_t)(0 - (uint64_t)ParseValue());
+    if (Match("+"))
+        return ParseValue();
+    if (Match("~"))
+        return ~ParseValue();
+    if (Match("(")) {
+        int64_t value = ParseExpression();
+        Consume(")");
+
+        return value;
+    }
+
+    if (offset >= tokens.len) {
+        MarkError("Unexpected end of prototype, expected value");
+        return 0;
+    }
+
+    Span<const char> tok = tokens[offset++];
+
+    if (IsAsciiDigit(tok[0])) {
+        char buf[64];
+        char *end = nullptr;
+        uint64_t value = 0;
+
+        if (CopyString(tok, buf)) {
+            errno = 0;
+            value = strtoull(buf, &end, 0);
+
+            while (*end == 'u' || *end == 'U' || *end == 'l' || *end == 'L') {
+                end++;
+            }
+        }
+
+        if (!end || *end || errno == ERANGE) {
+            MarkError("Invalid integer literal '%1'", tok);
+            return 0;
+        }
+
+        return (int64_t)value;
+    } else if (IsIdentifier(tok)) {
+        const int64_t *ptr = constants.Find(tok);
+
+        if (!ptr) {
+            MarkError("Unknown constant '%1'", tok);
+            return 0;
+        }
+
+        return *ptr;
+    } else {
+        MarkError("Unexpected token '%1', expected value", tok);
+        return 0;
+    }
+}
+
+bool PrototypeParser::RegisterType(const char *name, const TypeInfo *type)
+{
+    std::pair<const TypeInfo **, bool> ret = instance->types_map.TrySet(name, type);
+
+    if (!ret.second && *ret.first != type) {
+        MarkError("Duplicate type name '%1'", name);
+        return false;
+    }
+
+    if (ret.second && decls) {
+        decls->types.Append(name);
+    }
+
+    return true;
+}
+
 bool PrototypeParser::Consume(const char *expect)
 {
     if (offset >= tokens.len) {
@@ -218,12 +904,24 @@ bool PrototypeParser::Match(const char *expect)
     }
 }
 
+bool PrototypeParser::Peek(const char *expect, Size delta) const
+{
+    bool match = (offset + delta < tokens.len && tokens[offset + delta] == expect);
+    return match;
+}
+
 bool PrototypeParser::IsIdentifier(Span<const char> tok) const
 {
     RG_ASSERT(tok.len);
     return IsAsciiAlpha(tok[0]) || tok[0] == '_';
 }
 
+bool PrototypeParser::IsSpecifier() const
+{
+    bool specifier = Peek("struct") || Peek("union") || Peek("enum");
+    return specifier;
+}
+
 bool ParsePrototype(Napi::Env env, const char *str, FunctionInfo *out_func)
 {
     PrototypeParser parser(env);
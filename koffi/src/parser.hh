@@ -23,6 +23,24 @@ namespace RG {
 struct InstanceData;
 struct TypeInfo;
 struct FunctionInfo;
+enum class CallConvention;
+
+struct HeaderConstant {
+    const char *name;
+    int64_t value;
+};
+
+struct HeaderDeclarations {
+    HeapArray<FunctionInfo *> funcs;
+    HeapArray<HeaderConstant> constants;
+    HeapArray<const char *> types; // Names registered by the header
+    HeapArray<TypeInfo *> completed; // Opaque types completed by the header
+
+    ~HeaderDeclarations();
+};
+
+// Undo everything a header did after a failure, no JS object may refer to its types yet
+void RollbackHeader(InstanceData *instance, const HeaderDeclarations &decls, Size first_type, Size first_callback);
 
 class PrototypeParser {
     Napi::Env env;
@@ -32,22 +50,52 @@ class PrototypeParser {
     HeapArray<Span<const char>> tokens;
     Size offset;
     bool valid;
+    HashMap<const char *, int64_t> constants;
+    HeaderDeclarations *decls;
+
+    // Used by ParseMany() only, keys point into the prototype strings
+    bool share_lookups = false;
+    HashMap<Span<const char>, const TypeInfo *> lookups;
 
 public:
     PrototypeParser(Napi::Env env) : env(env), instance(env.GetInstanceData<InstanceData>()) {}
 
     bool Parse(const char *str, FunctionInfo *out_func);
 
+    // Type lookups are shared between prototypes, no type may be registered until it returns
+    bool ParseMany(Span<const char *const> strings, Span<FunctionInfo *const> out_funcs);
+
+    bool ParseHeader(const char *str, HeaderDeclarations *out_decls);
+
 private:
     void Tokenize(const char *str);
 
+    void ParseFunction(FunctionInfo *func);
+    void ParseParameters(FunctionInfo *func);
+    CallConvention ParseConvention(CallConvention convention);
+
+    void ParseTypedef();
+    const TypeInfo *ParseSpecifier();
+    const TypeInfo *ParseRecord();
+    const TypeInfo *ParseEnum();
+    const TypeInfo *ParseDeclarator(const TypeInfo *base, const char **out_name);
+    const FunctionInfo *ParseCallback(const char *name, const TypeInfo *ret, CallConvention convention);
+
     const TypeInfo *ParseType();
+    const TypeInfo *ParseBaseType();
+    const TypeInfo *LookupType(Span<const char> str);
     const char *ParseIdentifier();
+    int64_t ParseExpression(int min_prec = 0);
+    int64_t ParseValue();
+
+    bool RegisterType(const char *name, const TypeInfo *type);
 
     bool Consume(const char *expect);
     bool Match(const char *expect);
+    bool Peek(const char *expect, Size delta = 0) const;
 
     bool IsIdentifier(Span<const char> tok) const;
+    bool IsSpecifier() const;
 
     template <typename... Args>
     void MarkError(const char *fmt, Args... args)
@@ -0,0 +1,1352 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#include "vendor/libcc/libcc.hh"
+#include "call.hh"
+#include "ffi.hh"
+#include "record.hh"
+#include "util.hh"
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+#else
+    #include <dlfcn.h>
+#endif
+
+#include <napi.h>
+
+namespace RG {
+
+// Bump this each time the layout of the file changes
+static const uint32_t RecordVersion = 2;
+static const uint8_t RecordMagic[8] = { 'K', 'O', 'F', 'F', 'I', 'R', 'E', 'C' };
+
+// Recorded calls are buffered, and written once they take more than this
+static const Size RecordFlushThreshold = Mebibytes(1);
+
+// Deeper JS values are recorded as unsupported
+static const int MaxRecordDepth = 16;
+
+enum class RecordChunk: uint8_t {
+    Function = 1,
+    Call = 2
+};
+
+enum class RecordFlag {
+    Async = 1 << 0,
+    Trampolines = 1 << 1, // JS callbacks cannot be replayed natively
+    HeapFallbacks = 1 << 2, // Big values live outside of the recorded call memory
+    ForeignPointers = 1 << 3 // Pointers that are not call memory or handles returned by recorded calls
+};
+
+enum class RecordValue: uint8_t {
+    Undefined,
+    Null,
+    False,
+    True,
+    Number,
+    BigInt,
+    String,
+    Pointer,
+    TypedArray,
+    Array,
+    Object,
+    Unsupported // Functions, types, casts, frozen objects...
+};
+
+struct RecordedFunction {
+    uint32_t id;
+    HeapArray<uint8_t> descriptor;
+};
+
+std::atomic_bool record_enabled {false};
+
+static std::mutex record_mutex;
+static FILE *record_fp = nullptr;
+static HeapArray<char> record_filename;
+static HeapArray<uint8_t> record_buf;
+
+// Descriptors are compared on each call, because FunctionInfo addresses can be reused
+static BucketArray<RecordedFunction> record_functions;
+static HashMap<const void *, RecordedFunction *> record_functions_map;
+
+// Pointers returned by recorded calls (directly or through output parameters), replay maps them
+static HashSet<uint64_t> record_handles;
+
+template <typename T>
+static void AppendRecordValue(HeapArray<uint8_t> *out_buf, T value)
+{
+    out_buf->Append(MakeSpan((const uint8_t *)&value, RG_SIZE(T)));
+}
+
+static void AppendRecordBytes(HeapArray<uint8_t> *out_buf, Span<const uint8_t> bytes)
+{
+    AppendRecordValue(out_buf, (uint32_t)bytes.len);
+    out_buf->Append(bytes);
+}
+
+static void AppendRecordString(HeapArray<uint8_t> *out_buf, Span<const char> str)
+{
+    AppendRecordBytes(out_buf, str.As<const uint8_t>());
+}
+
+static void FlushRecord()
+{
+    if (record_buf.len && fwrite(record_buf.ptr, 1, (size_t)record_buf.len, record_fp) != (size_t)record_buf.len) {
+        LogError("Failed to write calls to '%1': %2", record_filename.ptr, strerror(errno));
+    }
+
+    record_buf.RemoveFrom(0);
+}
+
+static void StopRecordAtExit()
+{
+    StopRecord();
+}
+
+void InitRecord()
+{
+    static std::once_flag flag;
+
+    std::call_once(flag, []() {
+        const char *filename = getenv("KOFFI_RECORD");
+
+        if (filename && filename[0] && StartRecord(filename)) {
+            atexit(StopRecordAtExit);
+        }
+    });
+}
+
+bool StartRecord(const char *filename)
+{
+    StopRecord();
+
+    std::lock_guard<std::mutex> lock(record_mutex);
+
+    record_fp = OpenFile(filename, (int)OpenFlag::Write);
+    if (!record_fp)
+        return false;
+
+    record_filename.RemoveFrom(0);
+    record_filename.Append(filename);
+    record_filename.Append(0);
+
+    record_buf.Append(MakeSpan(RecordMagic, RG_SIZE(RecordMagic)));
+    AppendRecordValue(&record_buf, RecordVersion);
+    AppendRecordString(&record_buf, AbiName);
+
+    record_enabled = true;
+
+    return true;
+}
+
+bool StopRecord()
+{
+    record_enabled = false;
+
+    std::lock_guard<std::mutex> lock(record_mutex);
+
+    if (!record_fp)
+        return true;
+
+    FlushRecord();
+
+    bool success = FlushFile(record_fp, record_filename.ptr);
+    fclose(record_fp);
+    record_fp = nullptr;
+
+    record_functions.Clear();
+    record_functions_map.Clear();
+    record_handles.Clear();
+
+    return success;
+}
+
+static void GetModulePath(const void *addr, HeapArray<char> *out_path)
+{
+#ifdef _WIN32
+    HMODULE module;
+    if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                            (LPCWSTR)addr, &module))
+        return;
+
+    wchar_t path_w[4096];
+    DWORD len = GetModuleFileNameW(module, path_w, RG_LEN(path_w));
+    if (!len || len >= RG_LEN(path_w))
+        return;
+
+    char path[16384];
+    if (ConvertWin32WideToUtf8(path_w, path) < 0)
+        return;
+
+    out_path->Append(path);
+#else
+    Dl_info info;
+    if (!dladdr(addr, &info) || !info.dli_fname)
+        return;
+
+    out_path->Append(info.dli_fname);
+#endif
+}
+
+// Only the ABI-specific part of the return value matters, the type is rebuilt when the record
+// is read. Fields are stored one by one so that ReadReturnInfo() can check each of them.
+static void EncodeReturnInfo(const ParameterInfo &ret, HeapArray<uint8_t> *out_buf)
+{
+#if defined(_M_X64)
+    AppendRecordValue(out_buf, (uint8_t)ret.regular);
+#elif defined(__x86_64__)
+    AppendRecordValue(out_buf, (uint8_t)ret.use_memory);
+    AppendRecordValue(out_buf, ret.gpr_count);
+    AppendRecordValue(out_buf, ret.xmm_count);
+    AppendRecordValue(out_buf, (uint8_t)ret.gpr_first);
+#elif defined(__arm__) || defined(__aarch64__) || defined(_M_ARM64)
+    AppendRecordValue(out_buf, (uint8_t)ret.use_memory);
+    AppendRecordValue(out_buf, ret.gpr_count);
+    AppendRecordValue(out_buf, ret.vec_count);
+#elif defined(__i386__) || defined(_M_IX86)
+    AppendRecordValue(out_buf, (uint8_t)ret.trivial);
+    AppendRecordValue(out_buf, (uint8_t)ret.fast);
+#elif __riscv_xlen == 64
+    AppendRecordValue(out_buf, (uint8_t)ret.use_memory);
+    AppendRecordValue(out_buf, ret.gpr_count);
+    AppendRecordValue(out_buf, ret.vec_count);
+    AppendRecordValue(out_buf, (uint8_t)ret.gpr_first);
+#endif
+}
+
+static void EncodeDescriptor(const FunctionInfo *func, HeapArray<uint8_t> *out_buf)
+{
+    AppendRecordString(out_buf, func->name);
+    AppendRecordString(out_buf, func->decorated_name ? func->decorated_name : "");
+    AppendRecordValue(out_buf, (uint64_t)(uintptr_t)func->func);
+    AppendRecordValue(out_buf, (uint8_t)func->convention);
+
+    AppendRecordValue(out_buf, (uint8_t)func->ret.type->primitive);
+    AppendRecordValue(out_buf, func->ret.type->size);
+    AppendRecordValue(out_buf, func->ret.type->align);
+    EncodeReturnInfo(func->ret, out_buf);
+
+    AppendRecordValue(out_buf, (int64_t)func->args_size);
+#if defined(__i386__) || defined(_M_IX86)
+    AppendRecordValue(out_buf, (uint8_t)func->fast);
+#else
+    AppendRecordValue(out_buf, (uint8_t)func->forward_fp);
+#endif
+
+    AppendRecordValue(out_buf, (uint16_t)func->parameters.len);
+    for (const ParameterInfo &param: func->parameters) {
+        AppendRecordValue(out_buf, (int8_t)param.directions);
+        AppendRecordValue(out_buf, param.offset);
+    }
+}
+
+// Call with record_mutex locked
+static uint32_t MapRecordedFunction(const FunctionInfo *func)
+{
+    HeapArray<uint8_t> descriptor;
+    EncodeDescriptor(func, &descriptor);
+
+    RecordedFunction *recorded = record_functions_map.FindValue(func, nullptr);
+
+    if (!recorded || recorded->descriptor.As() != descriptor.As()) {
+        recorded = record_functions.AppendDefault();
+
+        recorded->id = (uint32_t)(record_functions.len - 1);
+        std::swap(recorded->descriptor, descriptor);
+
+        record_functions_map.Set(func, recorded);
+
+        HeapArray<char> module;
+        GetModulePath(func->func, &module);
+
+        AppendRecordValue(&record_buf, RecordChunk::Function);
+        AppendRecordValue(&record_buf, recorded->id);
+        AppendRecordString(&record_buf, module);
+        record_buf.Append(recorded->descriptor);
+    }
+
+    return recorded->id;
+}
+
+// Native replay can only use pointers that it knows how to relocate, other addresses (pointers
+// allocated by Koffi or decoded from structs, output buffers, encoded strings) are meaningless
+// in another process. Arguments are walked once without record_mutex (getters can call FFI
+// functions), and the pointers found are checked against record_handles afterwards.
+struct RecordPointers {
+    HeapArray<uint64_t> addresses;
+    bool foreign = false;
+};
+
+static void EncodeRecordValue(InstanceData *instance, Napi::Value value, int depth, HeapArray<uint8_t> *out_buf,
+                              RecordPointers *out_pointers = nullptr)
+{
+    if (value.IsEmpty()) {
+        AppendRecordValue(out_buf, RecordValue::Undefined);
+        return;
+    }
+
+    switch (value.Type()) {
+        case napi_undefined: { AppendRecordValue(out_buf, RecordValue::Undefined); } break;
+        case napi_null: { AppendRecordValue(out_buf, RecordValue::Null); } break;
+        case napi_boolean: {
+            bool b = value.As<Napi::Boolean>();
+            AppendRecordValue(out_buf, b ? RecordValue::True : RecordValue::False);
+        } break;
+        case napi_number: {
+            AppendRecordValue(out_buf, RecordValue::Number);
+            AppendRecordValue(out_buf, value.As<Napi::Number>().DoubleValue());
+        } break;
+        case napi_bigint: {
+            bool lossless;
+            int64_t i64 = value.As<Napi::BigInt>().Int64Value(&lossless);
+
+            AppendRecordValue(out_buf, RecordValue::BigInt);
+            AppendRecordValue(out_buf, i64);
+        } break;
+        case napi_string: {
+            std::string str = value.As<Napi::String>();
+
+            AppendRecordValue(out_buf, RecordValue::String);
+            AppendRecordString(out_buf, MakeSpan(str.c_str(), (Size)str.length()));
+        } break;
+
+        case napi_external: {
+            if (CheckValueTag(instance, value, &EncodedStringMarker)) {
+                const char *str = value.As<Napi::External<char>>().Data();
+
+                AppendRecordValue(out_buf, RecordValue::String);
+                AppendRecordString(out_buf, str);
+
+                if (out_pointers) {
+                    out_pointers->foreign = true;
+                }
+            } else if (CheckValueTag(instance, value, &EncodedString16Marker)) {
+                const char16_t *str16 = value.As<Napi::External<char16_t>>().Data();
+                std::string str = Napi::String::New(value.Env(), str16);
+
+                AppendRecordValue(out_buf, RecordValue::String);
+                AppendRecordString(out_buf, MakeSpan(str.c_str(), (Size)str.length()));
+
+                if (out_pointers) {
+                    out_pointers->foreign = true;
+                }
+            } else if (CheckValueTag(instance, value, &CastMarker)) {
+                AppendRecordValue(out_buf, RecordValue::Unsupported);
+
+                if (out_pointers) {
+                    ValueCast *cast = value.As<Napi::External<ValueCast>>().Data();
+
+                    HeapArray<uint8_t> ignore;
+                    EncodeRecordValue(instance, cast->ref.Value(), depth, &ignore, out_pointers);
+                }
+            } else if (CheckValueTag(instance, value, &TypeInfoMarker)) {
+                AppendRecordValue(out_buf, RecordValue::Unsupported);
+            } else {
+                void *ptr = value.As<Napi::External<void>>().Data();
+
+                AppendRecordValue(out_buf, RecordValue::Pointer);
+                AppendRecordValue(out_buf, (uint64_t)(uintptr_t)ptr);
+
+                if (out_pointers && ptr) {
+                    out_pointers->addresses.Append((uint64_t)(uintptr_t)ptr);
+                }
+            }
+        } break;
+
+        case napi_object: {
+            if (depth >= MaxRecordDepth) {
+                AppendRecordValue(out_buf, RecordValue::Unsupported);
+                break;
+            }
+            if (CheckValueTag(instance, value, &OutBufferMarker)) {
+                AppendRecordValue(out_buf, RecordValue::Unsupported);
+
+                if (out_pointers) {
+                    out_pointers->foreign = true;
+                }
+                break;
+            }
+            if (CheckValueTag(instance, value, &FrozenMarker)) {
+                AppendRecordValue(out_buf, RecordValue::Unsupported);
+
+                // Frozen objects can still hold pointers
+                if (out_pointers) {
+                    HeapArray<uint8_t> ignore;
+                    Napi::Object obj = value.As<Napi::Object>();
+                    Napi::Array keys = obj.GetPropertyNames();
+
+                    for (uint32_t i = 0; i < keys.Length(); i++) {
+                        EncodeRecordValue(instance, obj.Get(keys.Get(i)), depth + 1, &ignore, out_pointers);
+                    }
+                }
+                break;
+            }
+
+            if (value.IsTypedArray()) {
+                Napi::TypedArray array = value.As<Napi::TypedArray>();
+                const uint8_t *ptr = (const uint8_t *)array.ArrayBuffer().Data() + array.ByteOffset();
+
+                AppendRecordValue(out_buf, RecordValue::TypedArray);
+                AppendRecordValue(out_buf, (int8_t)array.TypedArrayType());
+                AppendRecordBytes(out_buf, MakeSpan(ptr, (Size)array.ByteLength()));
+            } else if (value.IsArray()) {
+                Napi::Array array = value.As<Napi::Array>();
+                uint32_t len = array.Length();
+
+                AppendRecordValue(out_buf, RecordValue::Array);
+                AppendRecordValue(out_buf, len);
+                for (uint32_t i = 0; i < len; i++) {
+                    EncodeRecordValue(instance, array.Get(i), depth + 1, out_buf, out_pointers);
+                }
+            } else if (!value.IsArrayBuffer()) {
+                Napi::Object obj = value.As<Napi::Object>();
+                Napi::Array keys = obj.GetPropertyNames();
+                uint32_t len = keys.Length();
+
+                AppendRecordValue(out_buf, RecordValue::Object);
+                AppendRecordValue(out_buf, len);
+                for (uint32_t i = 0; i < len; i++) {
+                    std::string key = keys.Get(i).ToString();
+
+                    AppendRecordString(out_buf, MakeSpan(key.c_str(), (Size)key.length()));
+                    EncodeRecordValue(instance, obj.Get(key), depth + 1, out_buf, out_pointers);
+                }
+            } else {
+                AppendRecordValue(out_buf, RecordValue::Unsupported);
+            }
+        } break;
+
+        default: { AppendRecordValue(out_buf, RecordValue::Unsupported); } break;
+    }
+}
+
+static Size CountArguments(const FunctionInfo *func)
+{
+    // Variadic calls take two JS arguments (type and value) for each variadic parameter
+    Size count = 0;
+    for (const ParameterInfo &param: func->parameters) {
+        count = std::max(count, (Size)param.offset + 1);
+    }
+    return count;
+}
+
+void CallRecord::Begin(Napi::Env env, InstanceData *instance, const FunctionInfo *func, const CallData &call,
+                       const napi_value *argv, bool async)
+{
+    Span<const uint8_t> stack = call.GetStackMemory();
+
+    this->func = func;
+    this->heap = call.GetHeapMemory();
+
+    int flags = 0;
+    flags |= async ? (int)RecordFlag::Async : 0;
+    flags |= call.GetUsedTrampolines() ? (int)RecordFlag::Trampolines : 0;
+    flags |= call.GetHeapFallbacks() ? (int)RecordFlag::HeapFallbacks : 0;
+
+    Size argc = CountArguments(func);
+
+    buf.RemoveFrom(0);
+
+    AppendRecordValue(&buf, (uint8_t)0); // Flags, set below
+    AppendRecordValue(&buf, (uint64_t)(uintptr_t)stack.end());
+    AppendRecordValue(&buf, (uint64_t)(uintptr_t)heap.ptr);
+    AppendRecordBytes(&buf, stack);
+    heap_offset = buf.len + RG_SIZE(uint32_t);
+    AppendRecordBytes(&buf, heap);
+
+    // Foreign pointers only matter when nothing else prevents native replay
+    RecordPointers pointers;
+
+    AppendRecordValue(&buf, (uint8_t)argc);
+    for (Size i = 0; i < argc; i++) {
+        Napi::Value value(env, argv[i]);
+        EncodeRecordValue(instance, value, 0, &buf, flags ? nullptr : &pointers);
+    }
+
+    if (!flags) {
+        if (pointers.foreign) {
+            flags |= (int)RecordFlag::ForeignPointers;
+        } else if (pointers.addresses.len) {
+            std::lock_guard<std::mutex> lock(record_mutex);
+
+            for (uint64_t ptr: pointers.addresses) {
+                if (!record_handles.Find(ptr)) {
+                    flags |= (int)RecordFlag::ForeignPointers;
+                    break;
+                }
+            }
+        }
+    }
+
+    buf[0] = (uint8_t)flags;
+}
+
+void CallRecord::End(InstanceData *instance, const CallData &call, Napi::Value ret, const napi_value *argv)
+{
+    RG_ASSERT(func);
+
+    // Output parameters (and pointers returned by the function) are used to map handles during replay
+    AppendRecordBytes(&buf, heap);
+    AppendRecordBytes(&buf, call.GetResult());
+    EncodeRecordValue(instance, ret, 0, &buf);
+
+    if (argv) {
+        Size count = 0;
+        for (const ParameterInfo &param: func->parameters) {
+            count += !!(param.directions & 2);
+        }
+
+        AppendRecordValue(&buf, (uint8_t)count);
+        for (const ParameterInfo &param: func->parameters) {
+            if (param.directions & 2) {
+                Napi::Value value(ret.Env(), argv[param.offset]);
+
+                AppendRecordValue(&buf, param.offset);
+                EncodeRecordValue(instance, value, 0, &buf);
+            }
+        }
+    } else {
+        AppendRecordValue(&buf, (uint8_t)0);
+    }
+
+    std::lock_guard<std::mutex> lock(record_mutex);
+
+    // Recording may have stopped in the meantime
+    if (!record_fp)
+        return;
+
+    // Same logic as ReplayNativeCall(), which maps these pointers to the replayed ones
+    {
+        Span<const uint8_t> result = call.GetResult();
+        PrimitiveKind primitive = func->ret.type->primitive;
+
+        if (primitive == PrimitiveKind::Pointer || primitive == PrimitiveKind::String ||
+            primitive == PrimitiveKind::String16 || primitive == PrimitiveKind::Callback) {
+            uint64_t ptr = 0;
+            memcpy(&ptr, result.ptr, RG_SIZE(void *));
+
+            if (ptr) {
+                record_handles.Set(ptr);
+            }
+        }
+
+        Size skip = (Size)((RG_SIZE(void *) - (uintptr_t)heap.ptr % RG_SIZE(void *)) % RG_SIZE(void *));
+
+        for (Size i = skip; i + RG_SIZE(void *) <= heap.len; i += RG_SIZE(void *)) {
+            uintptr_t before;
+            uintptr_t after;
+            memcpy(&before, buf.ptr + heap_offset + i, RG_SIZE(before));
+            memcpy(&after, heap.ptr + i, RG_SIZE(after));
+
+            if (after != before && after) {
+                record_handles.Set((uint64_t)after);
+            }
+        }
+    }
+
+    uint32_t id = MapRecordedFunction(func);
+
+    AppendRecordValue(&record_buf, RecordChunk::Call);
+    AppendRecordValue(&record_buf, id);
+    record_buf.Append(buf);
+
+    if (record_buf.len >= RecordFlushThreshold) {
+        FlushRecord();
+    }
+}
+
+class RecordReader {
+    Span<const uint8_t> buf;
+    Size offset = 0;
+
+public:
+    bool valid = true;
+
+    RecordReader(Span<const uint8_t> buf) : buf(buf) {}
+
+    bool IsEnd() const { return offset >= buf.len; }
+
+    template <typename T>
+    T Read()
+    {
+        T value = {};
+
+        if (RG_UNLIKELY(buf.len - offset < RG_SIZE(T))) {
+            valid = false;
+            return value;
+        }
+
+        memcpy((void *)&value, buf.ptr + offset, RG_SIZE(T));
+        offset += RG_SIZE(T);
+
+        return value;
+    }
+
+    Span<const uint8_t> ReadRaw(Size len)
+    {
+        if (RG_UNLIKELY(!valid || len > buf.len - offset)) {
+            valid = false;
+            return {};
+        }
+
+        Span<const uint8_t> bytes = MakeSpan(buf.ptr + offset, len);
+        offset += len;
+
+        return bytes;
+    }
+
+    Span<const uint8_t> ReadBytes()
+    {
+        uint32_t len = Read<uint32_t>();
+        return valid ? ReadRaw((Size)len) : Span<const uint8_t>();
+    }
+
+    Span<const char> ReadString() { return ReadBytes().As<const char>(); }
+
+    bool ReadBool()
+    {
+        uint8_t value = Read<uint8_t>();
+        valid &= (value <= 1);
+        return value;
+    }
+    int8_t ReadCount(int8_t max)
+    {
+        int8_t value = Read<int8_t>();
+        valid &= (value >= 0 && value <= max);
+        return value;
+    }
+
+    void SkipValue(int depth = 0);
+    Napi::Value ReadValue(Napi::Env env, InstanceData *instance, const HashMap<uint64_t, uint64_t> &handles,
+                          int depth, bool *out_supported);
+    void MatchValue(Napi::Value actual, int depth, HashMap<uint64_t, uint64_t> *out_handles);
+};
+
+void RecordReader::SkipValue(int depth)
+{
+    if (RG_UNLIKELY(depth > MaxRecordDepth)) {
+        valid = false;
+        return;
+    }
+
+    RecordValue tag = Read<RecordValue>();
+
+    switch (tag) {
+        case RecordValue::Undefined:
+        case RecordValue::Null:
+        case RecordValue::False:
+        case RecordValue::True:
+        case RecordValue::Unsupported: {} break;
+        case RecordValue::Number: { Read<double>(); } break;
+        case RecordValue::BigInt: { Read<int64_t>(); } break;
+        case RecordValue::String: { ReadString(); } break;
+        case RecordValue::Pointer: { Read<uint64_t>(); } break;
+        case RecordValue::TypedArray: {
+            Read<int8_t>();
+            ReadBytes();
+        } break;
+        case RecordValue::Array: {
+            uint32_t len = Read<uint32_t>();
+            for (uint32_t i = 0; valid && i < len; i++) {
+                SkipValue(depth + 1);
+            }
+        } break;
+        case RecordValue::Object: {
+            uint32_t len = Read<uint32_t>();
+            for (uint32_t i = 0; valid && i < len; i++) {
+                ReadString();
+                SkipValue(depth + 1);
+            }
+        } break;
+
+        default: { valid = false; } break;
+    }
+}
+
+Napi::Value RecordReader::ReadValue(Napi::Env env, InstanceData *instance, const HashMap<uint64_t, uint64_t> &handles,
+                                    int depth, bool *out_supported)
+{
+    if (RG_UNLIKELY(depth > MaxRecordDepth)) {
+        valid = false;
+        return env.Undefined();
+    }
+
+    RecordValue tag = Read<RecordValue>();
+
+    switch (tag) {
+        case RecordValue::Undefined: return env.Undefined();
+        case RecordValue::Null: return env.Null();
+        case RecordValue::False: return Napi::Boolean::New(env, false);
+        case RecordValue::True: return Napi::Boolean::New(env, true);
+        case RecordValue::Number: return Napi::Number::New(env, Read<double>());
+        case RecordValue::BigInt: return Napi::BigInt::New(env, Read<int64_t>());
+        case RecordValue::String: {
+            Span<const char> str = ReadString();
+            return Napi::String::New(env, str.ptr, (size_t)str.len);
+        } break;
+        case RecordValue::Pointer: {
+            uint64_t addr = Read<uint64_t>();
+            addr = handles.FindValue(addr, addr);
+
+            Napi::External<void> external = Napi::External<void>::New(env, (void *)(uintptr_t)addr);
+            SetValueTag(instance, external, instance->void_type);
+
+            return external;
+        } break;
+        case RecordValue::TypedArray: {
+            napi_typedarray_type type = (napi_typedarray_type)Read<int8_t>();
+            Span<const uint8_t> bytes = ReadBytes();
+
+            Size size = 1;
+            switch (type) {
+                case napi_int8_array:
+                case napi_uint8_array:
+                case napi_uint8_clamped_array: { size = 1; } break;
+                case napi_int16_array:
+                case napi_uint16_array: { size = 2; } break;
+                case napi_int32_array:
+                case napi_uint32_array:
+                case napi_float32_array: { size = 4; } break;
+                case napi_float64_array:
+                case napi_bigint64_array:
+                case napi_biguint64_array: { size = 8; } break;
+
+                default: {
+                    valid = false;
+                    return env.Undefined();
+                } break;
+            }
+
+            if (RG_UNLIKELY(bytes.len % size)) {
+                valid = false;
+                return env.Undefined();
+            }
+
+            Napi::ArrayBuffer buffer = Napi::ArrayBuffer::New(env, (size_t)bytes.len);
+            memcpy_safe(buffer.Data(), bytes.ptr, (size_t)bytes.len);
+
+            return Napi::TypedArray::From(env, Napi::TypedArrayOf<uint8_t>::New(env, (size_t)(bytes.len / size), buffer, 0, type));
+        } break;
+        case RecordValue::Array: {
+            uint32_t len = Read<uint32_t>();
+            Napi::Array array = Napi::Array::New(env);
+
+            for (uint32_t i = 0; valid && i < len; i++) {
+                Napi::Value value = ReadValue(env, instance, handles, depth + 1, out_supported);
+                array.Set(i, value);
+            }
+
+            return array;
+        } break;
+        case RecordValue::Object: {
+            uint32_t len = Read<uint32_t>();
+            Napi::Object obj = Napi::Object::New(env);
+
+            for (uint32_t i = 0; valid && i < len; i++) {
+                Span<const char> key = ReadString();
+                Napi::Value value = ReadValue(env, instance, handles, depth + 1, out_supported);
+
+                obj.Set(Napi::String::New(env, key.ptr, (size_t)key.len), value);
+            }
+
+            return obj;
+        } break;
+        case RecordValue::Unsupported: {
+            *out_supported = false;
+            return env.Undefined();
+        } break;
+    }
+
+    valid = false;
+    return env.Undefined();
+}
+
+void RecordReader::MatchValue(Napi::Value actual, int depth, HashMap<uint64_t, uint64_t> *out_handles)
+{
+    if (RG_UNLIKELY(depth > MaxRecordDepth)) {
+        valid = false;
+        return;
+    }
+
+    Size start = offset;
+    RecordValue tag = Read<RecordValue>();
+
+    switch (tag) {
+        case RecordValue::Pointer: {
+            uint64_t addr = Read<uint64_t>();
+
+            if (addr && actual.IsExternal()) {
+                void *ptr = actual.As<Napi::External<void>>().Data();
+                out_handles->Set(addr, (uint64_t)(uintptr_t)ptr);
+            }
+        } break;
+        case RecordValue::Array: {
+            uint32_t len = Read<uint32_t>();
+            Napi::Array array = actual.IsArray() ? actual.As<Napi::Array>() : Napi::Array();
+
+            for (uint32_t i = 0; valid && i < len; i++) {
+                if (!array.IsEmpty() && i < array.Length()) {
+                    MatchValue(array.Get(i), depth + 1, out_handles);
+                } else {
+                    SkipValue(depth + 1);
+                }
+            }
+        } break;
+        case RecordValue::Object: {
+            uint32_t len = Read<uint32_t>();
+            Napi::Object obj = IsObject(actual) ? actual.As<Napi::Object>() : Napi::Object();
+
+            for (uint32_t i = 0; valid && i < len; i++) {
+                Span<const char> key = ReadString();
+
+                if (!obj.IsEmpty()) {
+                    Napi::Value value = obj.Get(Napi::String::New(actual.Env(), key.ptr, (size_t)key.len));
+                    MatchValue(value, depth + 1, out_handles);
+                } else {
+                    SkipValue(depth + 1);
+                }
+            }
+        } break;
+
+        default: {
+            offset = start;
+            SkipValue(depth);
+        } break;
+    }
+}
+
+struct ReplayFunction {
+    const char *name;
+
+    // Native mode only, enough to let CallData::Execute() do its job
+    TypeInfo ret_type;
+    FunctionInfo func;
+
+    int64_t calls = 0;
+    int64_t skipped = 0;
+    int64_t time = 0;
+};
+
+struct ReplayCall {
+    int flags;
+
+    uint64_t stack_start;
+    uint64_t heap_start;
+    Span<const uint8_t> stack;
+    Span<const uint8_t> heap;
+
+    Span<const uint8_t> heap_after;
+    Span<const uint8_t> result;
+};
+
+static void ReadReturnInfo(RecordReader *reader, ParameterInfo *out_ret)
+{
+#if defined(_M_X64)
+    out_ret->regular = reader->ReadBool();
+#elif defined(__x86_64__)
+    out_ret->use_memory = reader->ReadBool();
+    out_ret->gpr_count = reader->ReadCount(2);
+    out_ret->xmm_count = reader->ReadCount(2);
+    out_ret->gpr_first = reader->ReadBool();
+#elif defined(__arm__) || defined(__aarch64__) || defined(_M_ARM64)
+    out_ret->use_memory = reader->ReadBool();
+    out_ret->gpr_count = reader->ReadCount(4);
+    out_ret->vec_count = reader->ReadCount(4);
+#elif defined(__i386__) || defined(_M_IX86)
+    out_ret->trivial = reader->ReadBool();
+    out_ret->fast = reader->ReadBool();
+#elif __riscv_xlen == 64
+    out_ret->use_memory = reader->ReadBool();
+    out_ret->gpr_count = reader->ReadCount(2);
+    out_ret->vec_count = reader->ReadCount(2);
+    out_ret->gpr_first = reader->ReadBool();
+#endif
+}
+
+static bool IsScalarType(PrimitiveKind primitive);
+
+// Recorded return types are checked like the binding cache does, because CallData::Execute()
+// and the result comparison trust them
+static bool CheckReturnType(const TypeInfo &type)
+{
+    if (type.primitive == PrimitiveKind::Void)
+        return !type.size;
+    if (type.align < 1 || type.align > 64 || (type.align & (type.align - 1)))
+        return false;
+
+    switch (type.primitive) {
+        case PrimitiveKind::Void: { RG_UNREACHABLE(); } break;
+
+        case PrimitiveKind::String:
+        case PrimitiveKind::String16:
+        case PrimitiveKind::Pointer:
+        case PrimitiveKind::Callback: return type.size == RG_SIZE(void *);
+
+        case PrimitiveKind::Record: return type.size >= 0;
+
+        case PrimitiveKind::Array:
+        case PrimitiveKind::Prototype: return false;
+
+        default: {
+            RG_ASSERT(IsScalarType(type.primitive));
+            return type.size == 1 || type.size == 2 || type.size == 4 || type.size == 8;
+        } break;
+    }
+
+    RG_UNREACHABLE();
+}
+
+static bool ResolveReplayFunction(Napi::Env env, Span<const char> module, const char *decorated_name,
+                                  ReplayFunction *fn, HeapArray<void *> *out_modules)
+{
+    FunctionInfo *func = &fn->func;
+
+    func->func = nullptr;
+
+#ifdef _WIN32
+    HMODULE handle = nullptr;
+
+    if (module.len) {
+        wchar_t path_w[4096];
+
+        if (ConvertUtf8ToWin32Wide(module, path_w) >= 0) {
+            handle = LoadLibraryW(path_w);
+        }
+    }
+    if (!handle) {
+        handle = GetModuleHandle(nullptr);
+    } else {
+        out_modules->Append((void *)handle);
+    }
+
+    if (decorated_name) {
+        func->func = (void *)GetProcAddress(handle, decorated_name);
+    }
+    if (!func->func) {
+        func->func = (void *)GetProcAddress(handle, func->name);
+    }
+#else
+    void *handle = nullptr;
+
+    if (module.len) {
+        char path[4096];
+
+        if (CopyString(module, path)) {
+            handle = dlopen(path, RTLD_NOW);
+        }
+    }
+    if (!handle) {
+        // Symbols of the main program (or of an unknown module) are searched globally
+        handle = RTLD_DEFAULT;
+    } else {
+        out_modules->Append(handle);
+    }
+
+    if (decorated_name) {
+        func->func = dlsym(handle, decorated_name);
+    }
+    if (!func->func) {
+        func->func = dlsym(handle, func->name);
+    }
+#endif
+
+    if (!func->func) {
+        ThrowError<Napi::Error>(env, "Cannot find function '%1' in '%2'", func->name, module);
+        return false;
+    }
+
+    return true;
+}
+
+// Relocate pointers to the recorded call memory, and replace pointers returned by previous calls
+static void RelocatePointers(Span<uint8_t> bytes, uint64_t origin, const ReplayCall &call,
+                             Span<uint8_t> stack, Span<uint8_t> heap, const HashMap<uint64_t, uint64_t> &handles)
+{
+    uint64_t stack_end = call.stack_start + call.stack.len;
+    uint64_t heap_end = call.heap_start + call.heap.len;
+    uint64_t stack_delta = (uint64_t)(uintptr_t)stack.ptr - call.stack_start;
+    uint64_t heap_delta = (uint64_t)(uintptr_t)heap.ptr - call.heap_start;
+
+    Size skip = (Size)((RG_SIZE(void *) - origin % RG_SIZE(void *)) % RG_SIZE(void *));
+
+    for (Size i = skip; i + RG_SIZE(void *) <= bytes.len; i += RG_SIZE(void *)) {
+        uintptr_t value;
+        memcpy(&value, bytes.ptr + i, RG_SIZE(value));
+
+        if (value >= call.stack_start && value < stack_end) {
+            value = (uintptr_t)(value + stack_delta);
+        } else if (value >= call.heap_start && value < heap_end) {
+            value = (uintptr_t)(value + heap_delta);
+        } else if (value) {
+            value = (uintptr_t)handles.FindValue(value, value);
+        }
+
+        memcpy(bytes.ptr + i, &value, RG_SIZE(value));
+    }
+}
+
+static bool IsScalarType(PrimitiveKind primitive)
+{
+    switch (primitive) {
+        case PrimitiveKind::Bool:
+        case PrimitiveKind::Int8:
+        case PrimitiveKind::UInt8:
+        case PrimitiveKind::Int16:
+        case PrimitiveKind::Int16S:
+        case PrimitiveKind::UInt16:
+        case PrimitiveKind::UInt16S:
+        case PrimitiveKind::Int32:
+        case PrimitiveKind::Int32S:
+        case PrimitiveKind::UInt32:
+        case PrimitiveKind::UInt32S:
+        case PrimitiveKind::Int64:
+        case PrimitiveKind::Int64S:
+        case PrimitiveKind::UInt64:
+        case PrimitiveKind::UInt64S:
+        case PrimitiveKind::Float32:
+        case PrimitiveKind::Float64: return true;
+
+        default: return false;
+    }
+}
+
+static bool ReplayNativeCall(Napi::Env env, InstanceData *instance, ReplayFunction *fn, const ReplayCall &rec,
+                             HashMap<uint64_t, uint64_t> *handles, int64_t *out_time, bool *out_match)
+{
+    InstanceMemory *mem = instance->memories[0];
+    CallData call(env, instance, &fn->func, mem);
+
+    Span<uint8_t> stack;
+    Span<uint8_t> heap;
+    if (!call.Restore(rec.stack.len, rec.heap.len, (Size)(rec.heap_start % 16), &stack, &heap))
+        return false;
+
+    memcpy_safe(stack.ptr, rec.stack.ptr, (size_t)rec.stack.len);
+    memcpy_safe(heap.ptr, rec.heap.ptr, (size_t)rec.heap.len);
+    RelocatePointers(stack, rec.stack_start, rec, stack, heap, *handles);
+    RelocatePointers(heap, rec.heap_start, rec, stack, heap, *handles);
+
+    int64_t start = GetCallClock();
+    call.Execute();
+    *out_time = GetCallClock() - start;
+
+    Span<const uint8_t> result = call.GetResult();
+    PrimitiveKind primitive = fn->ret_type.primitive;
+
+    *out_match = true;
+
+    if (IsScalarType(primitive)) {
+        *out_match = !memcmp(result.ptr, rec.result.ptr, (size_t)fn->ret_type.size);
+    } else if (primitive == PrimitiveKind::Pointer || primitive == PrimitiveKind::String ||
+               primitive == PrimitiveKind::String16 || primitive == PrimitiveKind::Callback) {
+        void *recorded;
+        void *actual;
+        memcpy(&recorded, rec.result.ptr, RG_SIZE(recorded));
+        memcpy(&actual, result.ptr, RG_SIZE(actual));
+
+        if (recorded) {
+            handles->Set((uint64_t)(uintptr_t)recorded, (uint64_t)(uintptr_t)actual);
+        }
+    }
+
+    // Map pointers written by the function to output parameters, such as sqlite3_open(&db)
+    if (rec.heap_after.len == rec.heap.len) {
+        Size skip = (Size)((RG_SIZE(void *) - rec.heap_start % RG_SIZE(void *)) % RG_SIZE(void *));
+
+        for (Size i = skip; i + RG_SIZE(void *) <= rec.heap.len; i += RG_SIZE(void *)) {
+            uintptr_t before;
+            uintptr_t after;
+            uintptr_t actual;
+            memcpy(&before, rec.heap.ptr + i, RG_SIZE(before));
+            memcpy(&after, rec.heap_after.ptr + i, RG_SIZE(after));
+            memcpy(&actual, heap.ptr + i, RG_SIZE(actual));
+
+            if (after != before && after) {
+                handles->Set((uint64_t)after, (uint64_t)actual);
+            }
+        }
+    }
+
+    return true;
+}
+
+Napi::Value ReplayRecord(Napi::Env env, InstanceData *instance, const char *filename, Napi::Object functions)
+{
+    bool native = !functions.GetPropertyNames().Length();
+
+    HeapArray<uint8_t> file;
+    if (ReadFile(filename, Mebibytes(512), &file) < 0) {
+        ThrowError<Napi::Error>(env, "Failed to read call record '%1'", filename);
+        return env.Null();
+    }
+
+    RecordReader reader(file);
+
+    // Check header
+    if (reader.ReadRaw(RG_SIZE(RecordMagic)) != MakeSpan(RecordMagic, RG_SIZE(RecordMagic))) {
+        ThrowError<Napi::Error>(env, "File '%1' is not a call record", filename);
+        return env.Null();
+    }
+    if (reader.Read<uint32_t>() != RecordVersion) {
+        ThrowError<Napi::Error>(env, "Call record '%1' was made by another version of Koffi", filename);
+        return env.Null();
+    }
+    if (reader.ReadString() != AbiName) {
+        ThrowError<Napi::Error>(env, "Call record '%1' was made on another platform", filename);
+        return env.Null();
+    }
+
+    BlockAllocator str_alloc;
+    BucketArray<ReplayFunction> replay_functions;
+    HeapArray<void *> modules;
+    HashMap<uint64_t, uint64_t> handles;
+
+    RG_DEFER {
+        for (void *module: modules) {
+#ifdef _WIN32
+            FreeLibrary((HMODULE)module);
+#else
+            dlclose(module);
+#endif
+        }
+    };
+
+    int64_t calls = 0;
+    int64_t replayed = 0;
+    int64_t skipped = 0;
+    int64_t errors = 0;
+    int64_t mismatches = 0;
+    int64_t time = 0;
+
+    while (reader.valid && !reader.IsEnd()) {
+        RecordChunk chunk = reader.Read<RecordChunk>();
+
+        if (chunk == RecordChunk::Function) {
+            uint32_t id = reader.Read<uint32_t>();
+            Span<const char> module = reader.ReadString();
+            Span<const char> name = reader.ReadString();
+            Span<const char> decorated_name = reader.ReadString();
+            reader.Read<uint64_t>(); // Address in the recording process
+
+            if (RG_UNLIKELY(!reader.valid || id != (uint32_t)replay_functions.len)) {
+                reader.valid = false;
+                break;
+            }
+
+            ReplayFunction *fn = replay_functions.AppendDefault();
+            FunctionInfo *func = &fn->func;
+
+            fn->name = DuplicateString(name, &str_alloc).ptr;
+
+            func->name = fn->name;
+            func->decorated_name = decorated_name.len ? DuplicateString(decorated_name, &str_alloc).ptr : nullptr;
+            func->convention = (CallConvention)reader.Read<uint8_t>();
+
+            fn->ret_type.name = "Return";
+            fn->ret_type.primitive = (PrimitiveKind)reader.Read<uint8_t>();
+            fn->ret_type.size = reader.Read<int32_t>();
+            fn->ret_type.align = reader.Read<int32_t>();
+
+            func->ret.type = &fn->ret_type;
+            ReadReturnInfo(&reader, &func->ret);
+
+            func->args_size = (Size)reader.Read<int64_t>();
+#if defined(__i386__) || defined(_M_IX86)
+            func->fast = reader.ReadBool();
+#else
+            func->forward_fp = reader.ReadBool();
+#endif
+
+            if (RG_UNLIKELY((int)func->convention >= RG_LEN(CallConventionNames) ||
+                            (int)fn->ret_type.primitive >= RG_LEN(PrimitiveKindNames) ||
+                            !CheckReturnType(fn->ret_type) || func->args_size < 0)) {
+                reader.valid = false;
+                break;
+            }
+
+            // Parameters are only described for tools, the recorded memory is all we need
+            uint16_t parameters = reader.Read<uint16_t>();
+            reader.ReadRaw(2 * (Size)parameters);
+
+            if (native && reader.valid && !ResolveReplayFunction(env, module, func->decorated_name, fn, &modules))
+                return env.Null();
+        } else if (chunk == RecordChunk::Call) {
+            uint32_t id = reader.Read<uint32_t>();
+
+            if (RG_UNLIKELY(!reader.valid || id >= (uint32_t)replay_functions.len)) {
+                reader.valid = false;
+                break;
+            }
+
+            ReplayFunction *fn = &replay_functions[id];
+            ReplayCall rec = {};
+
+            rec.flags = reader.Read<uint8_t>();
+            uint64_t stack_end = reader.Read<uint64_t>();
+            rec.heap_start = reader.Read<uint64_t>();
+            rec.stack = reader.ReadBytes();
+            rec.heap = reader.ReadBytes();
+            rec.stack_start = stack_end - (uint64_t)rec.stack.len;
+
+            calls++;
+
+            if (native) {
+                Size argc = reader.Read<uint8_t>();
+                for (Size i = 0; i < argc; i++) {
+                    reader.SkipValue();
+                }
+
+                rec.heap_after = reader.ReadBytes();
+                rec.result = reader.ReadBytes();
+                reader.SkipValue();
+
+                Size outputs = reader.Read<uint8_t>();
+                for (Size i = 0; i < outputs; i++) {
+                    reader.Read<int8_t>();
+                    reader.SkipValue();
+                }
+
+                if (RG_UNLIKELY(rec.result.len < RG_SIZE(uint64_t) || fn->func.args_size > rec.stack.len)) {
+                    reader.valid = false;
+                    break;
+                }
+                if (RG_UNLIKELY(IsScalarType(fn->ret_type.primitive) && fn->ret_type.size > rec.result.len)) {
+                    reader.valid = false;
+                    break;
+                }
+
+                if (rec.flags & ((int)RecordFlag::Trampolines | (int)RecordFlag::HeapFallbacks |
+                                  (int)RecordFlag::ForeignPointers)) {
+                    fn->skipped++;
+                    skipped++;
+
+                    continue;
+                }
+
+                int64_t elapsed;
+                bool match;
+                if (!ReplayNativeCall(env, instance, fn, rec, &handles, &elapsed, &match))
+                    return env.Null();
+
+                fn->calls++;
+                fn->time += elapsed;
+                replayed++;
+                mismatches += !match;
+                time += elapsed;
+            } else {
+                Napi::HandleScope scope(env);
+
+                Napi::Value value = functions.Get(fn->name);
+                bool supported = value.IsFunction();
+
+                napi_value args[256];
+                Size argc = reader.Read<uint8_t>();
+                for (Size i = 0; i < argc; i++) {
+                    args[i] = reader.ReadValue(env, instance, handles, 0, &supported);
+                }
+
+                rec.heap_after = reader.ReadBytes();
+                rec.result = reader.ReadBytes();
+
+                if (RG_UNLIKELY(!reader.valid))
+                    break;
+
+                if (!supported) {
+                    reader.SkipValue();
+
+                    Size outputs = reader.Read<uint8_t>();
+                    for (Size i = 0; i < outputs; i++) {
+                        reader.Read<int8_t>();
+                        reader.SkipValue();
+                    }
+
+                    fn->skipped++;
+                    skipped++;
+
+                    continue;
+                }
+
+                napi_value ret;
+
+                int64_t start = GetCallClock();
+                napi_status status = napi_call_function(env, env.Undefined(), value, (size_t)argc, args, &ret);
+                int64_t elapsed = GetCallClock() - start;
+
+                if (status != napi_ok) {
+                    env.GetAndClearPendingException();
+
+                    ret = env.Undefined();
+                    errors++;
+                }
+
+                reader.MatchValue(Napi::Value(env, ret), 0, &handles);
+
+                Size outputs = reader.Read<uint8_t>();
+                for (Size i = 0; i < outputs; i++) {
+                    Size idx = reader.Read<int8_t>();
+
+                    if (idx >= 0 && idx < argc) {
+                        reader.MatchValue(Napi::Value(env, args[idx]), 0, &handles);
+                    } else {
+                        reader.SkipValue();
+                    }
+                }
+
+                fn->calls++;
+                fn->time += elapsed;
+                replayed++;
+                time += elapsed;
+            }
+        } else {
+            reader.valid = false;
+        }
+    }
+
+    if (!reader.valid) {
+        ThrowError<Napi::Error>(env, "Call record '%1' is truncated or corrupt", filename);
+        return env.Null();
+    }
+
+    Napi::Object obj = Napi::Object::New(env);
+    Napi::Array list = Napi::Array::New(env);
+
+    obj.Set("calls", Napi::Number::New(env, (double)calls));
+    obj.Set("replayed", Napi::Number::New(env, (double)replayed));
+    obj.Set("skipped", Napi::Number::New(env, (double)skipped));
+    obj.Set("errors", Napi::Number::New(env, (double)errors));
+    obj.Set("mismatches", Napi::Number::New(env, (double)mismatches));
+    obj.Set("time", Napi::Number::New(env, (double)time));
+
+    for (const ReplayFunction &fn: replay_functions) {
+        Napi::Object item = Napi::Object::New(env);
+
+        item.Set("name", fn.name);
+        item.Set("calls", Napi::Number::New(env, (double)fn.calls));
+        item.Set("skipped", Napi::Number::New(env, (double)fn.skipped));
+        item.Set("time", Napi::Number::New(env, (double)fn.time));
+
+        list.Set(list.Length(), item);
+    }
+    obj.Set("functions", list);
+
+    return obj;
+}
+
+}
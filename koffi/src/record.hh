@@ -0,0 +1,54 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#pragma once
+
+#include "vendor/libcc/libcc.hh"
+
+#include <napi.h>
+
+namespace RG {
+
+struct InstanceData;
+struct FunctionInfo;
+class CallData;
+
+extern std::atomic_bool record_enabled;
+
+static inline bool IsRecording() { return record_enabled.load(std::memory_order_relaxed); }
+
+// Starts recording if KOFFI_RECORD is set, the file is completed at exit
+void InitRecord();
+
+// Recording is process-wide, calls from all threads go to the same file
+bool StartRecord(const char *filename);
+bool StopRecord();
+
+// Each call is captured in two steps: Begin() after Prepare(), and End() after
+// Complete(). The call memory (stack and heap) must not be released in between.
+class CallRecord {
+    HeapArray<uint8_t> buf;
+    const FunctionInfo *func = nullptr;
+    Span<const uint8_t> heap = {};
+    Size heap_offset = 0; // Copy of the heap in buf, before the call
+
+public:
+    void Begin(Napi::Env env, InstanceData *instance, const FunctionInfo *func, const CallData &call,
+               const napi_value *argv, bool async);
+    void End(InstanceData *instance, const CallData &call, Napi::Value ret, const napi_value *argv = nullptr);
+};
+
+// Functions are called by name in the functions object (JS mode), or directly (native mode) when it is empty
+Napi::Value ReplayRecord(Napi::Env env, InstanceData *instance, const char *filename, Napi::Object functions);
+
+}
@@ -0,0 +1,371 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#include "vendor/libcc/libcc.hh"
+#include "ffi.hh"
+#include "trace.hh"
+#include "util.hh"
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+#else
+    #include <unistd.h>
+    #include <pthread.h>
+    #if defined(__linux__)
+        #include <sys/syscall.h>
+    #endif
+#endif
+
+namespace RG {
+
+static const Size TraceBufferSize = 8192;
+
+struct TraceEntry {
+    int64_t start;
+    int64_t executed; // Async only
+    int64_t end;
+    const void *id; // Async only
+    Size size;
+
+    TraceKind kind;
+    bool async;
+    char name[46];
+};
+
+struct TraceBuffer {
+    int64_t tid;
+
+    // Written by the owner thread only, see DumpTrace() for the reading side
+    std::atomic<int64_t> count {0};
+    TraceEntry entries[TraceBufferSize];
+};
+
+// Entries kept from threads that have exited, once their ring buffer is gone
+struct RetiredTrace {
+    int64_t tid;
+    HeapArray<TraceEntry> entries;
+};
+
+// Releases the ring buffer of the thread when it exits, RG_THREAD_LOCAL may not support destructors
+struct ThreadTraceGuard {
+    TraceBuffer *buf = nullptr;
+
+    ~ThreadTraceGuard();
+};
+
+std::atomic_bool trace_enabled {false};
+
+static std::mutex trace_mutex;
+static int64_t trace_start = 0;
+static HeapArray<TraceBuffer *> trace_buffers; // Owned by live threads
+static BucketArray<RetiredTrace> retired_traces;
+static Size retired_entries = 0;
+
+static const Size MaxRetiredEntries = 2 * TraceBufferSize;
+
+static RG_THREAD_LOCAL TraceBuffer *thread_buffer;
+static thread_local ThreadTraceGuard thread_guard;
+
+static const char *const TraceKindNames[] = {
+    "call",
+    "execute",
+    "complete",
+    "callback"
+};
+
+// Use the same thread IDs as Node trace events
+static int64_t GetThreadID()
+{
+#if defined(_WIN32)
+    return (int64_t)GetCurrentThreadId();
+#elif defined(__linux__)
+    return (int64_t)syscall(SYS_gettid);
+#elif defined(__APPLE__)
+    uint64_t tid = 0;
+    pthread_threadid_np(nullptr, &tid);
+    return (int64_t)tid;
+#else
+    static std::atomic<int64_t> next_tid {1};
+    return next_tid++;
+#endif
+}
+
+static int64_t GetProcessID()
+{
+#ifdef _WIN32
+    return (int64_t)GetCurrentProcessId();
+#else
+    return (int64_t)getpid();
+#endif
+}
+
+static void WriteTraceAtExit()
+{
+    const char *filename = getenv("KOFFI_TRACE");
+
+    if (filename && filename[0]) {
+        HeapArray<char> json;
+        DumpTrace(&json);
+
+        WriteFile(json, filename);
+    }
+}
+
+void InitTrace()
+{
+    static std::once_flag flag;
+
+    std::call_once(flag, []() {
+        const char *filename = getenv("KOFFI_TRACE");
+
+        if (filename && filename[0]) {
+            StartTrace();
+            atexit(WriteTraceAtExit);
+        }
+    });
+}
+
+void StartTrace()
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    trace_start = GetCallClock();
+    trace_enabled = true;
+
+    // Older events are ignored anyway
+    retired_traces.Clear();
+    retired_entries = 0;
+}
+
+void StopTrace()
+{
+    trace_enabled = false;
+}
+
+static TraceEntry *AppendEntry(TraceBuffer **out_buf)
+{
+    TraceBuffer *buf = thread_buffer;
+
+    if (RG_UNLIKELY(!buf)) {
+        buf = new TraceBuffer;
+        buf->tid = GetThreadID();
+
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        trace_buffers.Append(buf);
+
+        thread_buffer = buf;
+        thread_guard.buf = buf;
+    }
+
+    int64_t count = buf->count.load(std::memory_order_relaxed);
+    TraceEntry *entry = &buf->entries[count % TraceBufferSize];
+
+    *out_buf = buf;
+    return entry;
+}
+
+ThreadTraceGuard::~ThreadTraceGuard()
+{
+    if (!buf)
+        return;
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    Size j = 0;
+    for (Size i = 0; i < trace_buffers.len; i++) {
+        trace_buffers[j] = trace_buffers[i];
+        j += (trace_buffers[i] != buf);
+    }
+    trace_buffers.RemoveFrom(j);
+
+    // Keep the recent events of the thread, but not the whole ring buffer
+    int64_t count = buf->count.load(std::memory_order_relaxed);
+    int64_t first = std::max(count - (int64_t)TraceBufferSize, (int64_t)0);
+
+    RetiredTrace *retired = retired_traces.AppendDefault();
+    retired->tid = buf->tid;
+
+    for (int64_t i = first; i < count; i++) {
+        const TraceEntry &entry = buf->entries[i % TraceBufferSize];
+
+        if (entry.start >= trace_start) {
+            retired->entries.Append(entry);
+        }
+    }
+    retired->entries.Trim();
+    retired_entries += retired->entries.len;
+
+    if (!retired->entries.len) {
+        retired_traces.RemoveLast(1);
+    }
+
+    thread_buffer = nullptr;
+    delete buf;
+    buf = nullptr;
+
+    // Bound memory use when many short-lived threads come and go, oldest threads go first
+    Size drop = 0;
+    while (retired_entries > MaxRetiredEntries && drop < retired_traces.len - 1) {
+        retired_entries -= retired_traces[drop].entries.len;
+        drop++;
+    }
+    retired_traces.RemoveFirst(drop);
+}
+
+static void CopyName(const char *name, TraceEntry *out_entry)
+{
+    Size len = std::min((Size)strlen(name), RG_SIZE(out_entry->name) - 1);
+
+    memcpy(out_entry->name, name, (size_t)len);
+    out_entry->name[len] = 0;
+}
+
+void RecordTrace(TraceKind kind, const char *name, int64_t start, int64_t end, Size size)
+{
+    TraceBuffer *buf;
+    TraceEntry *entry = AppendEntry(&buf);
+
+    entry->start = start;
+    entry->end = end;
+    entry->size = size;
+    entry->kind = kind;
+    entry->async = false;
+    CopyName(name, entry);
+
+    buf->count.fetch_add(1, std::memory_order_release);
+}
+
+void RecordAsyncTrace(const char *name, const void *id, int64_t queued, int64_t executed, int64_t end)
+{
+    TraceBuffer *buf;
+    TraceEntry *entry = AppendEntry(&buf);
+
+    entry->start = queued;
+    entry->executed = executed;
+    entry->end = end;
+    entry->id = id;
+    entry->size = -1;
+    entry->async = true;
+    CopyName(name, entry);
+
+    buf->count.fetch_add(1, std::memory_order_release);
+}
+
+static void FormatTimestamp(int64_t time, HeapArray<char> *out_json)
+{
+    // Trace timestamps are in microseconds
+    Fmt(out_json, "%1.%2", time / 1000, FmtArg(time % 1000).Pad0(-3));
+}
+
+static void FormatName(const char *name, HeapArray<char> *out_json)
+{
+    out_json->Append('"');
+    for (Size i = 0; name[i]; i++) {
+        char c = name[i];
+
+        if (c == '"' || c == '\\') {
+            out_json->Append('\\');
+            out_json->Append(c);
+        } else if ((uint8_t)c < 32) {
+            Fmt(out_json, "\\u%1", FmtHex((uint8_t)c).Pad0(-4));
+        } else {
+            out_json->Append(c);
+        }
+    }
+    out_json->Append('"');
+}
+
+static void FormatEvent(const char *name, const char *cat, char ph, int64_t ts, int64_t pid, int64_t tid,
+                        HeapArray<char> *out_json)
+{
+    if (out_json->ptr[out_json->len - 1] != '[') {
+        Fmt(out_json, ",\n");
+    }
+
+    Fmt(out_json, "{\"name\": ");
+    FormatName(name, out_json);
+    Fmt(out_json, ", \"cat\": \"koffi,%1\", \"ph\": \"%2\", \"ts\": ", cat, ph);
+    FormatTimestamp(ts, out_json);
+    Fmt(out_json, ", \"pid\": %1, \"tid\": %2", pid, tid);
+}
+
+static void DumpEntries(Span<const TraceEntry> entries, int64_t pid, int64_t tid, HeapArray<char> *out_json)
+{
+    for (const TraceEntry &entry: entries) {
+        if (entry.start < trace_start)
+            continue;
+
+        if (entry.async) {
+            FormatEvent(entry.name, "async", 'b', entry.start, pid, tid, out_json);
+            Fmt(out_json, ", \"id\": \"0x%1\"}", FmtArg(entry.id));
+            FormatEvent("queued", "async", 'b', entry.start, pid, tid, out_json);
+            Fmt(out_json, ", \"id\": \"0x%1\"}", FmtArg(entry.id));
+            FormatEvent("queued", "async", 'e', entry.executed, pid, tid, out_json);
+            Fmt(out_json, ", \"id\": \"0x%1\"}", FmtArg(entry.id));
+            FormatEvent(entry.name, "async", 'e', entry.end, pid, tid, out_json);
+            Fmt(out_json, ", \"id\": \"0x%1\"}", FmtArg(entry.id));
+        } else {
+            const char *cat = TraceKindNames[(int)entry.kind];
+
+            FormatEvent(entry.name, cat, 'X', entry.start, pid, tid, out_json);
+            Fmt(out_json, ", \"dur\": ");
+            FormatTimestamp(entry.end - entry.start, out_json);
+            if (entry.size >= 0) {
+                Fmt(out_json, ", \"args\": {\"size\": %1}", entry.size);
+            }
+            out_json->Append('}');
+        }
+    }
+}
+
+void DumpTrace(HeapArray<char> *out_json)
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    int64_t pid = GetProcessID();
+
+    HeapArray<TraceEntry> entries;
+
+    Fmt(out_json, "{\"traceEvents\": [");
+
+    for (TraceBuffer *buf: trace_buffers) {
+        int64_t count = buf->count.load(std::memory_order_acquire);
+        int64_t first = std::max(count - (int64_t)TraceBufferSize, (int64_t)0);
+
+        entries.RemoveFrom(0);
+        for (int64_t i = first; i < count; i++) {
+            entries.Append(buf->entries[i % TraceBufferSize]);
+        }
+
+        // The owner thread may have overwritten the oldest entries while we were copying them
+        std::atomic_thread_fence(std::memory_order_acquire);
+        int64_t overwritten = buf->count.load(std::memory_order_relaxed) - (int64_t)TraceBufferSize + 1;
+        Size skip = std::min((Size)std::max(overwritten - first, (int64_t)0), entries.len);
+
+        DumpEntries(entries.Take(skip, entries.len - skip), pid, buf->tid, out_json);
+    }
+
+    for (const RetiredTrace &retired: retired_traces) {
+        DumpEntries(retired.entries, pid, retired.tid, out_json);
+    }
+
+    Fmt(out_json, "], \"displayTimeUnit\": \"ns\"}\n");
+}
+
+}
@@ -0,0 +1,47 @@
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see https://www.gnu.org/licenses/.
+
+#pragma once
+
+#include "vendor/libcc/libcc.hh"
+
+namespace RG {
+
+enum class TraceKind {
+    Call, // Synchronous call, from Prepare() to Complete()
+    Execute, // Native part of asynchronous calls, on a worker thread
+    Complete, // Result conversion of asynchronous calls
+    Callback // JS callback called from native code
+};
+
+extern std::atomic_bool trace_enabled;
+
+static inline bool IsTracing() { return trace_enabled.load(std::memory_order_relaxed); }
+
+// Starts tracing if KOFFI_TRACE is set, the trace is written to this file at exit
+void InitTrace();
+
+// Tracing is process-wide, events recorded before the last StartTrace() are ignored
+void StartTrace();
+void StopTrace();
+
+// Each thread records events in its own ring buffer, older events get overwritten when it is full.
+// The buffer is released when the thread exits, and only its most recent events are kept.
+// Timestamps come from GetCallClock(), which uses the same monotonic clock as Node trace events.
+void RecordTrace(TraceKind kind, const char *name, int64_t start, int64_t end, Size size = -1);
+void RecordAsyncTrace(const char *name, const void *id, int64_t queued, int64_t executed, int64_t end);
+
+// Chrome trace JSON, which can be opened in chrome://tracing and Perfetto
+void DumpTrace(HeapArray<char> *out_json);
+
+}
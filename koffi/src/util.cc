@@ -26,6 +26,37 @@ const TypeInfo *ResolveType(Napi::Value value, int *out_directions)
     InstanceData *instance = env.GetInstanceData<InstanceData>();
 
     if (value.IsString()) {
+        // Most type strings are short, avoid the std::string allocation and reuse previous results
+        char buf[256];
+        size_t len = 0;
+        napi_status status = napi_get_value_string_utf8(env, value, buf, RG_SIZE(buf), &len);
+        RG_ASSERT(status == napi_ok);
+
+        if (RG_LIKELY(len < RG_SIZE(buf) - 1)) {
+            Span<const char> str = MakeSpan(buf, (Size)len);
+            const TypeInfo *type = instance->resolved_strings.FindValue(str, nullptr);
+
+            if (!type) {
+                type = ResolveType(instance, str, nullptr);
+
+                if (!type) {
+                    ThrowError<Napi::TypeError>(env, "Unknown or invalid type name '%1'", str);
+                    return nullptr;
+                }
+
+                // Type names cannot be redefined, so a successful resolution never goes stale
+                if (instance->resolved_strings.table.count < MaxResolvedStrings) {
+                    const char *key = DuplicateString(str, &instance->str_alloc).ptr;
+                    instance->resolved_strings.Set(key, type);
+                }
+            }
+
+            if (out_directions) {
+                *out_directions = 1;
+            }
+            return type;
+        }
+
         std::string str = value.As<Napi::String>();
         const TypeInfo *type = ResolveType(instance, str.c_str(), out_directions);
 
@@ -64,6 +95,15 @@ const TypeInfo *ResolveType(InstanceData *instance, Span<const char> str, int *o
         remain = remain.Take(6, remain.len - 6);
         remain = TrimStr(remain);
     }
+    for (const char *keyword: { "struct", "union", "enum" }) {
+        Size len = strlen(keyword);
+
+        if (remain.len > len && StartsWith(remain, keyword) && IsAsciiWhite(remain[len])) {
+            remain = remain.Take(len + 1, remain.len - len - 1);
+            remain = TrimStr(remain);
+            break;
+        }
+    }
     if (remain.len && remain[remain.len - 1] == '!') {
         dispose = true;
 
@@ -118,11 +158,9 @@ const TypeInfo *ResolveType(InstanceData *instance, Span<const char> str, int *o
                 indirect != 1)
             return nullptr;
 
-        TypeInfo *copy = instance->types.AppendDefault();
+        TypeInfo *copy = CopyType(instance, type);
 
-        memcpy((void *)copy, (const void *)type, RG_SIZE(*type));
         copy->name = "<anonymous>";
-        copy->members.allocator = GetNullAllocator();
         copy->dispose = [](Napi::Env, const TypeInfo *, const void *ptr) { free((void *)ptr); };
 
         type = copy;
@@ -142,18 +180,22 @@ const TypeInfo *MakePointerType(InstanceData *instance, const TypeInfo *ref, int
         char name_buf[256];
         Fmt(name_buf, "%1%2*", ref->name, EndsWith(ref->name, "*") ? "" : " ");
 
-        TypeInfo *type = (TypeInfo *)instance->types_map.FindValue(name_buf, nullptr);
+        // Anonymous types share the same name, so pointers to them cannot be registered
+        bool named = (instance->types_map.FindValue(ref->name, nullptr) == ref);
+        TypeInfo *type = named ? (TypeInfo *)instance->types_map.FindValue(name_buf, nullptr) : nullptr;
 
         if (!type) {
-            type = instance->types.AppendDefault();
+            type = AllocateType(instance);
 
-            type->name = DuplicateString(name_buf, &instance->str_alloc).ptr;
+            type->name = InternString(instance, name_buf);
 
             if (ref->primitive != PrimitiveKind::Prototype) {
                 type->primitive = PrimitiveKind::Pointer;
                 type->size = RG_SIZE(void *);
                 type->align = RG_SIZE(void *);
                 type->ref.type = ref;
+
+                ref->pointee = true;
             } else {
                 type->primitive = PrimitiveKind::Callback;
                 type->size = RG_SIZE(void *);
@@ -161,7 +203,9 @@ const TypeInfo *MakePointerType(InstanceData *instance, const TypeInfo *ref, int
                 type->ref.proto = ref->ref.proto;
             }
 
-            instance->types_map.Set(type->name, type);
+            if (named) {
+                instance->types_map.Set(type->name, type);
+            }
         }
 
         ref = type;
@@ -170,6 +214,232 @@ const TypeInfo *MakePointerType(InstanceData *instance, const TypeInfo *ref, int
     return ref;
 }
 
+const TypeInfo *MakeArrayType(InstanceData *instance, const TypeInfo *ref, Size len)
+{
+    TypeInfo::ArrayHint hint;
+
+    if (TestStr(ref->name, "char") || TestStr(ref->name, "char16") ||
+                                      TestStr(ref->name, "char16_t")) {
+        hint = TypeInfo::ArrayHint::String;
+    } else {
+        hint = TypeInfo::ArrayHint::TypedArray;
+    }
+
+    return MakeArrayType(instance, ref, len, hint);
+}
+
+const TypeInfo *MakeArrayType(InstanceData *instance, const TypeInfo *ref, Size len, TypeInfo::ArrayHint hint)
+{
+    RG_ASSERT(len > 0);
+    RG_ASSERT(len <= INT32_MAX / ref->size);
+
+    TypeInfo *type = AllocateType(instance);
+
+    char name_buf[256];
+    type->name = InternString(instance, Fmt(name_buf, "%1[%2]", ref->name, len));
+
+    type->primitive = PrimitiveKind::Array;
+    type->align = ref->align;
+    type->size = (int32_t)(len * ref->size);
+    type->ref.type = ref;
+    type->hint = hint;
+
+    return type;
+}
+
+TypeInfo *AllocateType(InstanceData *instance)
+{
+    TypeInfo *type;
+
+    if (instance->free_types.len) {
+        type = instance->free_types[instance->free_types.len - 1];
+        instance->free_types.RemoveLast(1);
+    } else {
+        type = instance->types.AppendDefault();
+    }
+
+    type->id = instance->next_type_id++;
+
+    return type;
+}
+
+TypeInfo *CopyType(InstanceData *instance, const TypeInfo *src)
+{
+    RG_ASSERT(!src->members.len);
+
+    TypeInfo *type = AllocateType(instance);
+
+    type->name = src->name;
+    type->primitive = src->primitive;
+    type->size = src->size;
+    type->align = src->align;
+    type->dispose = src->dispose;
+    type->ref = src->ref;
+    type->hint = src->hint;
+
+    return type;
+}
+
+void ReleaseType(InstanceData *instance, TypeInfo *type)
+{
+    bool pointee = type->pointee;
+
+    type->~TypeInfo();
+    new (type) TypeInfo();
+
+    // Pointer values decoded from C can outlive their type, and they are tagged with its
+    // address. Never reuse the slot, or these values would pass for another type.
+    if (pointee) {
+        instance->retired_types++;
+        return;
+    }
+
+    instance->free_types.Append(type);
+}
+
+const char *InternString(InstanceData *instance, Span<const char> str)
+{
+    const char *copy = instance->str_interned.FindValue(str, nullptr);
+
+    if (!copy) {
+        copy = DuplicateString(str, &instance->str_alloc).ptr;
+        instance->str_interned.Set(copy, copy);
+    }
+
+    return copy;
+}
+
+FunctionStats *GetFunctionStats(InstanceData *instance, const FunctionInfo *func)
+{
+    if (!func->stats) {
+        FunctionStats *stats = instance->call_stats.AppendDefault();
+
+        stats->name = InternString(instance, func->name);
+        func->stats = stats;
+    }
+
+    return func->stats;
+}
+
+static void QueueCollection(Napi::Env env, InstanceData *instance)
+{
+    if (instance->collect_work || instance->exiting)
+        return;
+
+    // Collect from the event loop, where no type can be in construction or in use by a sync call
+    const auto execute = [](napi_env, void *) {};
+    const auto complete = [](napi_env env, napi_status, void *udata) {
+        InstanceData *instance = (InstanceData *)udata;
+
+        napi_delete_async_work(env, instance->collect_work);
+        instance->collect_work = nullptr;
+
+        CollectTypes(instance);
+    };
+
+    napi_value name = Napi::String::New(env, "koffi.collect");
+
+    if (napi_create_async_work(env, nullptr, name, execute, complete, instance, &instance->collect_work) != napi_ok)
+        return;
+    if (napi_queue_async_work(env, instance->collect_work) != napi_ok) {
+        napi_delete_async_work(env, instance->collect_work);
+        instance->collect_work = nullptr;
+    }
+}
+
+Napi::External<TypeInfo> WrapType(Napi::Env env, InstanceData *instance, const TypeInfo *type)
+{
+    // Pointers can be marked with a direction, see EncodePointerDirection()
+    const TypeInfo *base = AlignDown(type, 4);
+    base->pins++;
+
+    Napi::External<TypeInfo> external = Napi::External<TypeInfo>::New(env, (TypeInfo *)type, [](Napi::Env env, TypeInfo *type) {
+        InstanceData *instance = env.GetInstanceData<InstanceData>();
+        UnpinType(env, instance, AlignDown(type, 4));
+    });
+    SetValueTag(instance, external, &TypeInfoMarker);
+
+    return external;
+}
+
+void UnpinType(Napi::Env env, InstanceData *instance, const TypeInfo *type)
+{
+    RG_ASSERT(type->pins > 0);
+
+    if (!--type->pins && ++instance->unpinned_types >= CollectTypesThreshold) {
+        QueueCollection(env, instance);
+    }
+}
+
+void CollectTypes(InstanceData *instance)
+{
+    HashSet<const void *> marked;
+    HeapArray<const TypeInfo *> pending;
+
+    const auto mark = [&](const TypeInfo *type) {
+        if (type && marked.TrySet(type).second) {
+            pending.Append(type);
+        }
+    };
+    const auto mark_function = [&](const FunctionInfo *func) {
+        mark(func->ret.type);
+        for (const ParameterInfo &param: func->parameters) {
+            mark(param.type);
+        }
+    };
+
+    // Named types can be used by name at any time, and prototypes are kept
+    // forever because trampolines and registered callbacks refer to them.
+    for (const auto &bucket: instance->types_map.table) {
+        mark(bucket.value);
+    }
+    for (const auto &bucket: instance->resolved_strings.table) {
+        mark(bucket.value);
+    }
+    for (const FunctionInfo &proto: instance->callbacks) {
+        mark_function(&proto);
+    }
+
+    // Lazy objects refer to the members of their type
+    for (const TypeInfo &type: instance->types) {
+        if (type.name && (type.pins || !type.construct.IsEmpty())) {
+            mark(&type);
+        }
+    }
+
+    while (pending.len) {
+        const TypeInfo *type = pending[pending.len - 1];
+        pending.RemoveLast(1);
+
+        switch (type->primitive) {
+            case PrimitiveKind::String:
+            case PrimitiveKind::String16:
+            case PrimitiveKind::Pointer:
+            case PrimitiveKind::Array: { mark(type->ref.type); } break;
+
+            case PrimitiveKind::Record: {
+                for (const RecordMember &member: type->members) {
+                    mark(member.type);
+                }
+            } break;
+
+            case PrimitiveKind::Prototype:
+            case PrimitiveKind::Callback: { mark_function(type->ref.proto); } break;
+
+            default: {} break;
+        }
+    }
+
+    for (TypeInfo &type: instance->types) {
+        if (type.name && !marked.Find(&type)) {
+            ReleaseType(instance, &type);
+            instance->reclaimed_types++;
+        }
+    }
+
+    instance->unpinned_types = 0;
+}
+
 bool CanPassType(const TypeInfo *type)
 {
     if (type->primitive == PrimitiveKind::Void)
@@ -280,6 +550,42 @@ bool CheckValueTag(const InstanceData *instance, Napi::Value value, const void *
     return match;
 }
 
+bool CanCacheEncoding(const TypeInfo *type)
+{
+    switch (type->primitive) {
+        case PrimitiveKind::String:
+        case PrimitiveKind::String16:
+        case PrimitiveKind::Pointer:
+        case PrimitiveKind::Callback: return false;
+
+        case PrimitiveKind::Record: {
+            for (const RecordMember &member: type->members) {
+                if (!CanCacheEncoding(member.type))
+                    return false;
+            }
+            return true;
+        } break;
+        case PrimitiveKind::Array: return CanCacheEncoding(type->ref.type);
+
+        default: return true;
+    }
+
+    RG_UNREACHABLE();
+}
+
+bool IsFlatRecord(const TypeInfo *type)
+{
+    RG_ASSERT(type->primitive == PrimitiveKind::Record);
+
+    for (const RecordMember &member: type->members) {
+        if (member.type->primitive == PrimitiveKind::Record ||
+                member.type->primitive == PrimitiveKind::Array)
+            return false;
+    }
+
+    return true;
+}
+
 int GetTypedArrayType(const TypeInfo *type)
 {
     switch (type->primitive) {
@@ -298,6 +604,21 @@ int GetTypedArrayType(const TypeInfo *type)
     RG_UNREACHABLE();
 }
 
+bool CanUseStructOfArrays(const TypeInfo *type)
+{
+    if (type->primitive != PrimitiveKind::Record)
+        return false;
+    if (!type->members.len)
+        return false;
+
+    for (const RecordMember &member: type->members) {
+        if (GetTypedArrayType(member.type) < 0)
+            return false;
+    }
+
+    return true;
+}
+
 static int AnalyseFlatRec(const TypeInfo *type, int offset, int count, FunctionRef<void(const TypeInfo *type, int offset, int count)> func)
 {
     if (type->primitive == PrimitiveKind::Record) {
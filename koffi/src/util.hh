@@ -15,6 +15,7 @@
 
 #include "vendor/libcc/libcc.hh"
 
+#include <chrono>
 #include <napi.h>
 
 namespace RG {
@@ -22,6 +23,7 @@ namespace RG {
 struct InstanceData;
 struct TypeInfo;
 struct FunctionInfo;
+struct FunctionStats;
 
 template <typename T, typename... Args>
 void ThrowError(Napi::Env env, const char *msg, Args... args)
@@ -56,11 +58,39 @@ static inline bool IsRegularSize(Size size, Size max)
 const TypeInfo *ResolveType(Napi::Value value, int *out_directions = nullptr);
 const TypeInfo *ResolveType(InstanceData *instance, Span<const char> str, int *out_directions = nullptr);
 const TypeInfo *MakePointerType(InstanceData *instance, const TypeInfo *type, int count = 1);
+const TypeInfo *MakeArrayType(InstanceData *instance, const TypeInfo *ref, Size len);
+const TypeInfo *MakeArrayType(InstanceData *instance, const TypeInfo *ref, Size len, TypeInfo::ArrayHint hint);
+
+// Types live in a registry with reusable slots, released types must not be referenced anymore
+TypeInfo *AllocateType(InstanceData *instance);
+TypeInfo *CopyType(InstanceData *instance, const TypeInfo *src);
+void ReleaseType(InstanceData *instance, TypeInfo *type);
+
+const char *InternString(InstanceData *instance, Span<const char> str);
+
+// Each wrapper pins the type, unreferenced anonymous types are eventually reclaimed by CollectTypes()
+Napi::External<TypeInfo> WrapType(Napi::Env env, InstanceData *instance, const TypeInfo *type);
+void UnpinType(Napi::Env env, InstanceData *instance, const TypeInfo *type);
+void CollectTypes(InstanceData *instance);
+
+// GetClockCounter() serializes rdtsc with cpuid, which is very slow in virtual machines
+static inline int64_t GetCallClock()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+// Call statistics live as long as the instance, even after the function is released
+FunctionStats *GetFunctionStats(InstanceData *instance, const FunctionInfo *func);
 
 bool CanPassType(const TypeInfo *type);
 bool CanReturnType(const TypeInfo *type);
 bool CanStoreType(const TypeInfo *type);
 
+// Encoded strings, pointers and callbacks only live as long as the call
+bool CanCacheEncoding(const TypeInfo *type);
+bool IsFlatRecord(const TypeInfo *type);
+
 // Can be slow, only use for error messages
 const char *GetValueType(const InstanceData *instance, Napi::Value value);
 
@@ -78,6 +108,7 @@ static inline bool IsObject(Napi::Value value)
 }
 
 int GetTypedArrayType(const TypeInfo *type);
+bool CanUseStructOfArrays(const TypeInfo *type);
 
 template <typename T>
 T CopyNumber(Napi::Value value)
@@ -15,6 +15,8 @@
 
 const koffi = require('./build/koffi.node');
 const assert = require('assert');
+const v8 = require('v8');
+const vm = require('vm');
 
 const PackedBFG = koffi.pack('PackedBFG', {
     a: 'int8_t',
@@ -46,6 +48,8 @@ async function test() {
 
     const ConcatenateToInt1 = lib.func('ConcatenateToInt1', 'int64_t', Array(12).fill('int8_t'));
     const MakePackedBFG = lib.func('PackedBFG __fastcall MakePackedBFG(int x, double y, _Out_ PackedBFG *p, const char *str)');
+    const FillRangeLater = lib.func('void FillRangeLater(int us, int init, int step, _Out_ int *out, int len)');
+    const StrLenLater = lib.func('size_t StrLenLater(int us, const char *str)');
 
     let promises = [];
 
@@ -87,5 +91,63 @@ async function test() {
         promises.push(p);
     }
 
+    // Output buffers stay alive until the call is complete
+    {
+        v8.setFlagsFromString('--expose-gc');
+        const gc = vm.runInNewContext('gc');
+
+        let weak = null;
+        let p = new Promise((resolve, reject) => {
+            let out = koffi.outbuf(koffi.array('int', 64));
+            weak = new WeakRef(out);
+
+            FillRangeLater.async(100000, 3, 2, out, 64, (err, res) => {
+                try {
+                    assert.equal(err, null);
+
+                    let values = weak.deref().value;
+                    assert.equal(values[0], 3);
+                    assert.equal(values[63], 129);
+
+                    resolve();
+                } catch (err) {
+                    reject(err);
+                }
+            });
+        });
+
+        // Let the WeakRef go stale, and try to collect the buffer while the call runs
+        await new Promise(resolve => setTimeout(resolve, 10));
+        gc();
+
+        promises.push(p);
+    }
+
+    // Bound arguments stay alive until the call is complete
+    {
+        v8.setFlagsFromString('--expose-gc');
+        const gc = vm.runInNewContext('gc');
+
+        let p = new Promise((resolve, reject) => {
+            let str = 'x'.repeat(1024 * 1024);
+
+            StrLenLater.bind(null, 100000, str).async((err, res) => {
+                try {
+                    assert.equal(err, null);
+                    assert.equal(res, str.length);
+
+                    resolve();
+                } catch (err) {
+                    reject(err);
+                }
+            });
+        });
+
+        await new Promise(resolve => setTimeout(resolve, 10));
+        gc();
+
+        promises.push(p);
+    }
+
     await Promise.all(promises);
 }
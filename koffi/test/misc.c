@@ -16,6 +16,12 @@
 #include <inttypes.h>
 #include <string.h>
 #include <stdarg.h>
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
 #if __has_include(<uchar.h>)
     #include <uchar.h>
 #else
@@ -62,6 +68,9 @@ typedef struct Float3 {
     float a;
     float b[2];
 } Float3;
+typedef struct Float4 {
+    float v[4];
+} Float4;
 
 typedef struct Double2 {
     double a;
@@ -158,6 +167,22 @@ typedef struct EndianInts {
     uint64_t u64be;
 } EndianInts;
 
+typedef struct BigText {
+    char text[40000];
+} BigText;
+
+typedef struct BigSamples {
+    int count;
+    int16_t samples[32768];
+} BigSamples;
+
+typedef struct Particle {
+    float x;
+    float y;
+    double mass;
+    int8_t kind;
+} Particle;
+
 EXPORT int8_t GetMinusOne1(void)
 {
     return -1;
@@ -277,6 +302,11 @@ EXPORT Float3 ThroughFloat3(Float3 f3)
     return f3;
 }
 
+EXPORT Float4 ThroughFloat4(Float4 f4)
+{
+    return f4;
+}
+
 EXPORT Double2 PackDouble2(double a, double b, Double2 *out)
 {
     Double2 ret;
@@ -696,3 +726,90 @@ EXPORT void CopyEndianInts2(int16_t i16le, int16_t i16be, uint16_t u16le, uint16
 EXPORT uint16_t ReturnEndianInt2(uint16_t v) { return v; }
 EXPORT uint32_t ReturnEndianInt4(uint32_t v) { return v; }
 EXPORT uint64_t ReturnEndianInt8(uint64_t v) { return v; }
+
+EXPORT double MoveParticles(Particle *particles, int len, float dx, float dy)
+{
+    double total = 0.0;
+
+    for (int i = 0; i < len; i++) {
+        particles[i].x += dx;
+        particles[i].y += dy;
+
+        total += particles[i].mass * particles[i].kind;
+    }
+
+    return total;
+}
+
+EXPORT BigText MakeBigText(char c)
+{
+    BigText text;
+
+    memset(text.text, c, sizeof(text.text) - 1);
+    text.text[sizeof(text.text) - 1] = 0;
+
+    return text;
+}
+
+EXPORT size_t BigTextLength(BigText text)
+{
+    return strlen(text.text);
+}
+
+EXPORT BigSamples MakeBigSamples(int count, int16_t step)
+{
+    BigSamples samples;
+
+    samples.count = count;
+    for (int i = 0; i < 32768; i++) {
+        samples.samples[i] = (int16_t)(i * step);
+    }
+
+    return samples;
+}
+
+EXPORT void SleepFor(int us)
+{
+#ifdef _WIN32
+    Sleep((DWORD)((us + 999) / 1000));
+#else
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+#endif
+}
+
+EXPORT void FillRangeLater(int us, int init, int step, int *out, int len)
+{
+    SleepFor(us);
+    FillRange(init, step, out, len);
+}
+
+EXPORT size_t StrLenLater(int us, const char *str)
+{
+    SleepFor(us);
+    return strlen(str);
+}
+
+static int64_t GetMonotonicNs(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq;
+    LARGE_INTEGER counter;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+
+    return (int64_t)((double)counter.QuadPart * 1000000000.0 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+EXPORT void SpinFor(int us)
+{
+    int64_t end = GetMonotonicNs() + (int64_t)us * 1000;
+    while (GetMonotonicNs() < end);
+}
@@ -108,6 +108,20 @@ async function test() {
         if (sqlite3_step(stmt) != SQLITE_DONE)
             throw new Error('Unexpected end of statement');
         sqlite3_finalize(stmt);
+
+        // Reuse the same output buffer for many statements
+        let out = koffi.outbuf(koffi.pointer(sqlite3_stmt));
+        for (let i = 0; i < 10; i++) {
+            if (sqlite3_prepare_v2(db, `SELECT COUNT(*) FROM foo WHERE value = ${i % 7}`, -1, out, null) != 0)
+                throw new Error('Failed to prepare count statement for table foo');
+            stmt = out.value;
+
+            if (sqlite3_step(stmt) != SQLITE_ROW)
+                throw new Error('Missing row');
+            if (sqlite3_column_int(stmt, 0) != expected.filter(it => it[1] == i % 7).length)
+                throw new Error('Invalid data');
+            sqlite3_finalize(stmt);
+        }
     } finally {
         sqlite3_close_v2(db);
         fs.unlinkSync(filename);
@@ -15,6 +15,13 @@
 
 const koffi = require('./build/koffi.node');
 const assert = require('assert');
+const child_process = require('child_process');
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const v8 = require('v8');
+const vm = require('vm');
+const worker_threads = require('worker_threads');
 
 const Pack1 = koffi.struct('Pack1', {
     a: 'int'
@@ -38,6 +45,10 @@ const Float3 = koffi.struct('Float3', {
     b: koffi.array('float', 2)
 });
 
+const Float4 = koffi.struct('Float4', {
+    v: koffi.array('float', 4)
+});
+
 const Double2 = koffi.struct('Double2', {
     a: 'double',
     b: 'double'
@@ -82,6 +93,7 @@ const PackedBFG = koffi.pack('PackedBFG', {
     })
 });
 const AliasBFG = koffi.alias('AliasBFG', PackedBFG);
+const LazyBFG = koffi.lazy('LazyBFG', BFG);
 
 const FixedString = koffi.struct('FixedString', {
     buf: koffi.array('int8', 64)
@@ -129,6 +141,23 @@ const EndianInts = koffi.struct('EndianInts', {
     u64be: 'uint64_be_t'
 });
 
+const BigText = koffi.struct('BigText', {
+    text: koffi.array('char', 40000)
+});
+
+const BigSamples = koffi.struct('BigSamples', {
+    count: 'int',
+    samples: koffi.array('int16_t', 32768)
+});
+const LazyBigSamples = koffi.lazy('LazyBigSamples', BigSamples);
+
+const Particle = koffi.struct('Particle', {
+    x: 'float',
+    y: 'float',
+    mass: 'double',
+    kind: 'int8_t'
+});
+
 main();
 
 async function main() {
@@ -162,6 +191,7 @@ async function test() {
     const ThroughFloat2 = lib.func('Float2 ThroughFloat2(Float2 f2)');
     const PackFloat3 = lib.func('Float3 PackFloat3(float a, float b, float c, _Out_ Float3 *out)');
     const ThroughFloat3 = lib.func('Float3 ThroughFloat3(Float3 f3)');
+    const ThroughFloat4 = lib.func('Float4 ThroughFloat4(Float4 f4)');
     const PackDouble2 = lib.func('Double2 PackDouble2(double a, double b, _Out_ Double2 *out)');
     const PackDouble3 = lib.func('Double3 PackDouble3(double a, double b, double c, _Out_ Double3 *out)');
     const ReverseFloatInt = lib.func('IntFloat ReverseFloatInt(FloatInt sfi)');
@@ -173,6 +203,7 @@ async function test() {
     const ConcatenateToStr4 = lib.func('ConcatenateToStr4', 'str', [...Array(8).fill('int32_t'), koffi.pointer(koffi.struct('IJK4', {i: 'int32_t', j: 'int32_t', k: 'int32_t'})), 'int32_t']);
     const ConcatenateToStr8 = lib.func('ConcatenateToStr8', 'str', [...Array(8).fill('int64_t'), koffi.struct('IJK8', {i: 'int64_t', j: 'int64_t', k: 'int64_t'}), 'int64_t']);
     const MakeBFG = lib.func('BFG __stdcall MakeBFG(_Out_ BFG *p, int x, double y, const char *str)');
+    const MakeLazyBFG = lib.func('LazyBFG __stdcall MakeBFG(_Out_ BFG *p, int x, double y, const char *str)');
     const MakePackedBFG = lib.func('AliasBFG __fastcall MakePackedBFG(int x, double y, _Out_ PackedBFG *p, const char *str)');
     const MakePolymorphBFG = lib.func('void MakePolymorphBFG(int type, int x, double y, const char *str, _Out_ void *p)');
     const ReturnBigString = process.platform == 'win32' ?
@@ -219,6 +250,10 @@ async function test() {
     const ReturnEndianInt8SB = lib.func('int64_be_t ReturnEndianInt8(int64_le_t v)');
     const ReturnEndianInt8UL = lib.func('uint64_le_t ReturnEndianInt8(uint64_be_t v)');
     const ReturnEndianInt8UB = lib.func('uint64_be_t ReturnEndianInt8(uint64_le_t v)');
+    const MakeBigText = lib.func('BigText MakeBigText(char c)');
+    const BigTextLength = lib.func('size_t BigTextLength(BigText text)');
+    const MakeBigSamples = lib.func('LazyBigSamples MakeBigSamples(int count, int16_t step)');
+    const MoveParticles = lib.func('double MoveParticles(_Inout_ Particle *particles, int len, float dx, float dy)');
 
     // Simple signed value returns
     assert.equal(GetMinusOne1(), -1);
@@ -320,6 +355,59 @@ async function test() {
         assert.deepEqual(out, bfg);
     }
 
+    // Lazy struct decoding
+    {
+        let out = {};
+        let bfg = MakeLazyBFG(out, 2, 7, '__Hello123456789++++foobarFOOBAR!__');
+
+        assert.deepEqual(Object.keys(bfg), []);
+        assert.equal(bfg.e, 54);
+        assert.deepEqual(Object.keys(bfg), ['e']);
+        assert.deepEqual(bfg.inner, { f: 14, g: 5 });
+        assert.equal(bfg.d, 'X/__Hello123456789++++foobarFOOBAR!__/X');
+
+        bfg.a = 42;
+        assert.equal(bfg.a, 42);
+        assert.equal(bfg.b, 4);
+        assert.equal(bfg.c, -25);
+        assert.deepEqual(JSON.parse(JSON.stringify(bfg)), { a: 42, b: 4, c: -25, d: 'X/__Hello123456789++++foobarFOOBAR!__/X', e: 54, inner: { f: 14, g: 5 } });
+
+        assert.deepEqual(out, { a: 2, b: 4, c: -25, d: 'X/__Hello123456789++++foobarFOOBAR!__/X', e: 54, inner: { f: 14, g: 5 } });
+        assert.throws(() => koffi.lazy(koffi.types.int), { message: /expected struct type/ });
+    }
+
+    // Frozen objects
+    {
+        let f2 = koffi.freeze({ a: 1.5, b: -2 });
+        let f3 = koffi.freeze({ a: 1, b: [2, 3] });
+
+        assert.ok(Object.isFrozen(f2));
+        assert.ok(Object.isFrozen(f3.b));
+
+        for (let i = 0; i < 3; i++) {
+            assert.deepEqual(ThroughFloat2(f2), { a: 1.5, b: -2 });
+            assert.deepEqual(ThroughFloat3(f3), { a: 1, b: Float32Array.from([2, 3]) });
+            assert.equal(ThroughStr({ str: 'foo', str16: null }), 'foo');
+        }
+
+        // Homogeneous float aggregates with array members use realigned registers on ARM64
+        let f4 = koffi.freeze({ v: [1, 2, 3, 4] });
+        let through4 = ThroughFloat4.bind(null, { v: [5, 6, 7, 8] });
+
+        for (let i = 0; i < 3; i++) {
+            assert.deepEqual(ThroughFloat4(f4), { v: Float32Array.from([1, 2, 3, 4]) });
+            assert.deepEqual(through4(), { v: Float32Array.from([5, 6, 7, 8]) });
+        }
+
+        let s = koffi.freeze({ str: 'Hello', str16: 'World' });
+        assert.equal(ThroughStr(s), 'Hello');
+        assert.equal(ThroughStr16(s), 'World');
+        assert.equal(ThroughStr(s), 'Hello');
+
+        assert.throws(() => koffi.freeze({ a: 1, b: Float32Array.from([2, 3]) }), TypeError);
+        assert.throws(() => koffi.freeze(42), { message: /expected object/ });
+    }
+
     // Packed struct
     {
         let out = {};
@@ -499,4 +587,862 @@ async function test() {
         assert.equal(ReturnEndianInt8UL(0x0123456789ABCD3Fn), 0x3FCDAB8967452301n);
         assert.equal(ReturnEndianInt8UB(0x0123456789ABCD3Fn), 0x3FCDAB8967452301n);
     }
+
+    // Struct of arrays for record pointers
+    {
+        let particles = [
+            { x: 1, y: 2, mass: 0.5, kind: 2 },
+            { x: -1, y: 4, mass: 2, kind: -1 },
+            { x: 8, y: 0, mass: 1.5, kind: 4 }
+        ];
+        let soa = koffi.soa({
+            x: Float32Array.from(particles.map(p => p.x)),
+            y: Float32Array.from(particles.map(p => p.y)),
+            mass: Float64Array.from(particles.map(p => p.mass)),
+            kind: Int8Array.from(particles.map(p => p.kind))
+        });
+
+        assert.equal(MoveParticles(particles, particles.length, 1, -1), 5);
+        assert.equal(MoveParticles(soa, 3, 1, -1), 5);
+
+        assert.deepEqual(soa.x, Float32Array.from(particles.map(p => p.x)));
+        assert.deepEqual(soa.y, Float32Array.from(particles.map(p => p.y)));
+        assert.deepEqual(soa.mass, Float64Array.from([0.5, 2, 1.5]));
+        assert.deepEqual(soa.kind, Int8Array.from([2, -1, 4]));
+
+        let empty = koffi.soa({ x: new Float32Array(0), y: new Float32Array(0), mass: new Float64Array(0), kind: new Int8Array(0) });
+        assert.equal(MoveParticles(empty, 0, 1, 1), 0);
+
+        let wrong = koffi.soa({ x: new Float32Array(2), y: new Float32Array(3), mass: new Float64Array(3), kind: new Int8Array(3) });
+        assert.throws(() => MoveParticles(wrong, 3, 1, 1), { message: /Expected array of length 2 for member 'y'/ });
+        wrong = koffi.soa({ x: new Float32Array(3), y: new Float64Array(3), mass: new Float64Array(3), kind: new Int8Array(3) });
+        assert.throws(() => MoveParticles(wrong, 3, 1, 1), { message: /member 'y'/ });
+        wrong = koffi.soa({ x: [1, 2, 3], y: new Float32Array(3), mass: new Float64Array(3), kind: new Int8Array(3) });
+        assert.throws(() => MoveParticles(wrong, 3, 1, 1), { message: /Unexpected Array value for member 'x'/ });
+
+        // Objects that are not marked are normal structs
+        let plain = { x: Float32Array.from([1]), y: Float32Array.from([2]), mass: Float64Array.from([1]), kind: Int8Array.from([1]) };
+        assert.throws(() => MoveParticles(plain, 1, 1, 1), { message: /expected number/ });
+
+        assert.equal(koffi.soa(soa), soa);
+        assert.throws(() => koffi.soa(koffi.freeze({ x: 1 })), { message: /Cannot use this object/ });
+        assert.throws(() => koffi.soa([]), { message: /expected object/ });
+        assert.throws(() => PackFloat3(1, 2, 3, koffi.soa({ a: new Float32Array(1), b: new Float32Array(1) })),
+                      { message: /Cannot use struct of arrays for Float3/ });
+    }
+
+    // Struct of arrays for array results
+    {
+        const ParticleArray = koffi.array(Particle, 3, 'soa');
+        const ParticleBatch = koffi.struct('ParticleBatch', { particles: ParticleArray });
+        const MoveParticleArray = lib.func('MoveParticles', 'double', [koffi.inout(koffi.pointer(ParticleArray)), 'int', 'float', 'float']);
+        const MoveParticleBatch = lib.func('MoveParticles', 'double', [koffi.inout(koffi.pointer(ParticleBatch)), 'int', 'float', 'float']);
+
+        let soa = {
+            x: Float32Array.from([1, -1, 8]),
+            y: Float32Array.from([2, 4, 0]),
+            mass: Float64Array.from([0.5, 2, 1.5]),
+            kind: Int8Array.from([2, -1, 4])
+        };
+        let batch = { particles: soa };
+
+        assert.equal(MoveParticleBatch(batch, 3, 1, -1), 5);
+        assert.notEqual(batch.particles, soa);
+        assert.deepEqual(batch.particles, {
+            x: Float32Array.from([2, 0, 9]),
+            y: Float32Array.from([1, 3, -1]),
+            mass: Float64Array.from([0.5, 2, 1.5]),
+            kind: Int8Array.from([2, -1, 4])
+        });
+
+        assert.equal(MoveParticleArray(soa, 3, 1, -1), 5);
+        assert.deepEqual(soa.x, Float32Array.from([2, 0, 9]));
+        assert.deepEqual(soa.y, Float32Array.from([1, 3, -1]));
+
+        const Named = koffi.struct({ name: 'const char *' });
+        assert.throws(() => koffi.array(Named, 2, 'soa'), { message: /Array hint 'soa'/ });
+    }
+
+    // Bound functions
+    {
+        let concat = ConcatenateToStr4.bind(null, 5, 6, 1, 2, 3, 9, 4, 4, {i: 0, j: 6, k: 8});
+        assert.equal(concat(7), '561239440687');
+        assert.equal(concat(1), '561239440681');
+
+        let through = ThroughFloat2.bind(null, { a: 2, b: 3 });
+        assert.deepEqual(through(), { a: 2, b: 3 });
+        assert.deepEqual(through(), { a: 2, b: 3 });
+
+        let hello = Concat16.bind(null, 'Hello ');
+        assert.equal(hello('World!'), 'Hello World!');
+        assert.equal(hello('Koffi!'), 'Hello Koffi!');
+
+        let str = ThroughStr.bind(null, { str: 'foo', str16: 'bar' });
+        assert.equal(str(), 'foo');
+
+        let big = ReturnBigString.bind(null, 'Big string');
+        assert.equal(big(), 'Big string');
+
+        let out = {};
+        let pack = PackFloat2.bind(undefined, 1.5);
+        assert.deepEqual(pack(2, out), { a: 1.5, b: 2 });
+        assert.deepEqual(out, { a: 1.5, b: 2 });
+
+        let ret = await new Promise((resolve, reject) => {
+            concat.async(3, (err, res) => err ? reject(err) : resolve(res));
+        });
+        assert.equal(ret, '561239440683');
+
+        assert.throws(() => ThroughFloat2.bind(null, { a: 1, b: 2 }, 3), { message: /Cannot bind 2 arguments/ });
+        assert.throws(() => concat(), { message: /Expected 1 arguments, got 0/ });
+    }
+
+    // Big structs (more than 32 kiB)
+    {
+        let text = MakeBigText('x'.charCodeAt(0));
+
+        assert.equal(koffi.sizeof(BigText), 40000);
+        assert.equal(text.text.length, 39999);
+        assert.equal(text.text, 'x'.repeat(39999));
+        assert.equal(BigTextLength(text), 39999);
+        assert.equal(BigTextLength({ text: 'Hello' }), 5);
+
+        assert.equal(koffi.sizeof(koffi.array('int', 100000)), 400000);
+
+        // Number arrays of lazy structs are views over the struct copy
+        let samples = MakeBigSamples(12, 3);
+
+        assert.equal(samples.count, 12);
+        assert.ok(samples.samples instanceof Int16Array);
+        assert.equal(samples.samples.length, 32768);
+        assert.equal(samples.samples.byteOffset, 4);
+        assert.equal(samples.samples.buffer.byteLength, koffi.sizeof(BigSamples));
+        assert.equal(samples.samples[0], 0);
+        assert.equal(samples.samples[1000], 3000);
+        assert.equal(samples.samples[20000], (20000 * 3) << 16 >> 16);
+        assert.equal(samples.samples, samples.samples);
+    }
+
+    // Declare many functions at once
+    {
+        let funcs = lib.declare({
+            pack: 'Float2 PackFloat2(float a, float b, _Out_ Float2 *out)',
+            concat: 'const char *ConcatenateToStr8(int64_t i1, int64_t i2, int64_t i3, int64_t i4, int64_t i5, int64_t i6, int64_t i7, int64_t i8, IJK8 ijk, int64_t i9)'
+        });
+        let { ReturnBigString, Concat16 } = lib.declare([
+            'const char * __stdcall ReturnBigString(const char *str)',
+            'const char16_t *! Concat16(const char16_t *str1, const char16_t *str2)'
+        ]);
+
+        assert.deepEqual(Object.keys(funcs), ['pack', 'concat']);
+        assert.equal(typeof funcs.pack.async, 'function');
+        assert.equal(ReturnBigString('Big string'), 'Big string');
+        assert.equal(Concat16('Hello ', 'World!'), 'Hello World!');
+        assert.equal(funcs.concat(5, 6, 1, 2, 3, 9, 4, 4, {i: 0, j: 6, k: 8}, 7), '561239440687');
+
+        assert.throws(() => lib.declare(['int DoesNotExist(int x)']), { message: /Cannot find function 'DoesNotExist'/ });
+        assert.throws(() => lib.declare({ foo: 42 }), { message: /expected string/ });
+        assert.throws(() => lib.declare(42), { message: /expected string, object or array/ });
+    }
+
+    // Declare types and functions from C header
+    {
+        let header = lib.declare(`
+            #include <stdint.h>
+            #define UNUSED(Var) \
+                (void)(Var)
+
+            typedef struct HdrBFG {
+                int8_t a;
+                char _pad1[7]; short e;
+                int64_t b;
+                int8_t c;
+                const char *d;
+                struct {
+                    float f;
+                    double g;
+                } inner;
+            } HdrBFG;
+
+            // Forward declaration, completed later
+            typedef struct HdrNode HdrNode;
+            struct HdrNode {
+                HdrNode *next;
+                int values[2 * 4], len;
+            };
+
+            typedef union { int i; float f; } HdrUnion;
+
+            enum HdrColor { HDR_RED, HDR_GREEN = 0x10, HDR_BLUE, HDR_MASK = (HDR_GREEN | 1) << 2, HDR_NEG = -3, };
+            typedef enum { HDR_SMALL = 1, HDR_BIG } HdrSize;
+
+            typedef int HdrIntCallback(int x);
+            typedef int (*HdrIntPointer)(int x);
+            typedef struct HdrCallbacks {
+                HdrIntCallback *first, *second;
+                HdrIntPointer third;
+            } HdrCallbacks;
+
+            #ifdef __cplusplus
+            extern "C" {
+            #endif
+
+            /* Koffi extensions such as _Out_ and disposable strings (!)
+               are supported in header prototypes */
+            HdrBFG __stdcall MakeBFG(_Out_ HdrBFG *p, int x, double y, const char *str);
+            const char16_t *! Concat16(const char16_t *str1, const char16_t *str2);
+            int ApplyStruct(int x, struct HdrCallbacks callbacks);
+
+            #ifdef __cplusplus
+            }
+            #endif
+        `);
+
+        assert.equal(koffi.sizeof('HdrBFG'), koffi.sizeof(BFG));
+        assert.equal(koffi.sizeof('HdrNode'), koffi.sizeof('void *') == 8 ? 48 : 40);
+        assert.equal(koffi.introspect('HdrUnion').primitive, 'Void');
+        assert.equal(koffi.introspect('HdrColor').name, 'int');
+        assert.equal(koffi.introspect('HdrIntPointer').primitive, 'Callback');
+        assert.equal(koffi.introspect('struct HdrNode *').primitive, 'Pointer');
+        assert.equal(koffi.introspect(koffi.introspect('HdrNode').members.values).length, 8);
+
+        assert.equal(header.HDR_RED, 0);
+        assert.equal(header.HDR_BLUE, 17);
+        assert.equal(header.HDR_MASK, 68);
+        assert.equal(header.HDR_NEG, -3);
+        assert.equal(header.HDR_BIG, 2);
+
+        let out = {};
+        let bfg = header.MakeBFG(out, 2, 7, '__Hello123456789++++foobarFOOBAR!__');
+        assert.deepEqual(bfg, out);
+        assert.equal(bfg.d, 'X/__Hello123456789++++foobarFOOBAR!__/X');
+        assert.equal(header.Concat16('Hello ', 'World!'), 'Hello World!');
+        assert.equal(header.ApplyStruct(27, { first: x => -x, second: x => x * 5, third: x => x - 42 }), -177);
+
+        assert.throws(() => lib.declare('struct HdrBad { int x : 3; };'), { message: /Bit fields are not supported/ });
+        assert.throws(() => lib.declare('struct HdrLoop { int x; struct HdrLoop loop; };'), { message: /incomplete type/ });
+        assert.throws(() => lib.declare('struct HdrBFG { int x; };'), { message: /Duplicate type name 'HdrBFG'/ });
+        assert.throws(() => lib.declare('enum { HDR_ONE = 1 / 0 };'), { message: /Division by zero/ });
+        assert.throws(() => lib.declare('int Unknown(HdrFoo *foo);'), { message: /Unknown or invalid type name/ });
+
+        // Failed headers leave nothing behind
+        assert.throws(() => lib.declare('typedef struct RetryS { int a; } RetryS; int DoesNotExist(RetryS *s);'),
+                      { message: /Cannot find function 'DoesNotExist'/ });
+        assert.throws(() => koffi.introspect('RetryS'), { message: /Unknown or invalid type name/ });
+        assert.throws(() => koffi.introspect('RetryS *'), { message: /Unknown or invalid type name/ });
+        lib.declare(`
+            typedef struct RetryS { int a; double b; } RetryS;
+            const char16_t *! Concat16(const char16_t *str1, const char16_t *str2);
+        `);
+        assert.equal(koffi.sizeof('RetryS'), 16);
+        lib.declare('struct HdrBad { int x; };');
+        assert.equal(koffi.sizeof('HdrBad'), 4);
+
+        koffi.opaque('HdrOpaque');
+        assert.throws(() => lib.declare('struct HdrOpaque { int x; }; int DoesNotExist(void);'),
+                      { message: /Cannot find function 'DoesNotExist'/ });
+        assert.equal(koffi.introspect('HdrOpaque').primitive, 'Void');
+        lib.declare('struct HdrOpaque { int64_t x; };');
+        assert.equal(koffi.sizeof('HdrOpaque'), 8);
+    }
+
+    // Lazy symbol resolution
+    {
+        let lazy = koffi.load(lib_filename, { lazy: true });
+
+        let missing = lazy.func('int DoesNotExist(int x)');
+        let concat = lazy.func('const char16_t *! Concat16(const char16_t *str1, const char16_t *str2)');
+
+        assert.throws(() => missing(42), { message: /Cannot find function 'DoesNotExist'/ });
+        assert.equal(concat('Hello ', 'World!'), 'Hello World!');
+
+        assert.equal(typeof Object.getOwnPropertyDescriptor(concat, 'async').get, 'function');
+        let ret = await new Promise((resolve, reject) => {
+            concat.async('Foo', 'Bar', (err, res) => err ? reject(err) : resolve(res));
+        });
+        assert.equal(ret, 'FooBar');
+        assert.equal(Object.getOwnPropertyDescriptor(concat, 'async').value, concat.async);
+
+        concat.bind = null;
+        assert.equal(concat.bind, null);
+
+        assert.throws(() => koffi.load(lib_filename, 42), { message: /expected object/ });
+    }
+
+    // Cache bindings parsed from C header
+    {
+        let cache_filename = path.join(os.tmpdir(), `koffi_cache_${process.pid}.bin`);
+
+        // Types are registered by name, so each run needs a fresh process
+        let script = `
+            const koffi = require(${JSON.stringify(__dirname + '/build/koffi.node')});
+            const lib = koffi.load(${JSON.stringify(lib_filename)});
+
+            const header = lib.declare(\`
+                typedef struct CacheBFG {
+                    int8_t a;
+                    char _pad1[7]; short e;
+                    int64_t b;
+                    int8_t c;
+                    const char *d;
+                    struct { float f; double g; } inner;
+                } CacheBFG;
+
+                typedef int CacheIntCallback(int x);
+                typedef struct CacheCallbacks {
+                    CacheIntCallback *first, *second;
+                    CacheIntCallback *third;
+                } CacheCallbacks;
+
+                enum { CACHE_FOO = 3, CACHE_BAR = CACHE_FOO * 7 };
+
+                CacheBFG __stdcall MakeBFG(_Out_ CacheBFG *p, int x, double y, const char *str);
+                const char16_t *! Concat16(const char16_t *str1, const char16_t *str2);
+                int ApplyStruct(int x, CacheCallbacks callbacks);
+            \`, { cache: ${JSON.stringify(cache_filename)} });
+
+            let out = {};
+            let bfg = header.MakeBFG(out, 2, 7, '__Hello123456789++');
+            let ret = header.ApplyStruct(header.CACHE_BAR, {
+                first: x => x + 1,
+                second: x => x * 2,
+                third: x => x - 3
+            });
+
+            console.log(JSON.stringify({
+                bfg: bfg, out: out, ret: ret,
+                concat: header.Concat16('Foo', 'Bar'),
+                inner: koffi.introspect('CacheBFG').members.inner.offset
+            }));
+        `;
+
+        let run = () => JSON.parse(child_process.execFileSync(process.execPath, ['-e', script], { encoding: 'utf-8' }));
+
+        try {
+            let first = run();
+            assert.ok(fs.existsSync(cache_filename));
+            let ino = fs.statSync(cache_filename).ino;
+
+            // Second run should use the cache and leave the file alone
+            let second = run();
+            assert.deepEqual(second, first);
+            assert.equal(fs.statSync(cache_filename).ino, ino);
+
+            assert.deepEqual(first.out, first.bfg);
+            assert.equal(first.bfg.b, 4);
+            assert.equal(first.bfg.d, 'X/__Hello123456789++/X');
+            assert.equal(first.ret, 41);
+            assert.equal(first.concat, 'FooBar');
+
+            // Broken caches are ignored and replaced
+            fs.writeFileSync(cache_filename, 'KOFFIBC\0garbage');
+            assert.deepEqual(run(), first);
+            assert.notEqual(fs.statSync(cache_filename).size, 16);
+
+            // Well-formed caches with out-of-bounds members are rejected too
+            {
+                let buf = fs.readFileSync(cache_filename);
+                let pos = buf.indexOf('\x05\0\0\0inner');
+
+                assert.ok(pos >= 0);
+                buf.writeInt32LE(0x7FFFFFF0, pos + 4 + 5 + 4);
+                fs.writeFileSync(cache_filename, buf);
+
+                assert.deepEqual(run(), first);
+                assert.notDeepEqual(fs.readFileSync(cache_filename), buf);
+            }
+        } finally {
+            if (fs.existsSync(cache_filename))
+                fs.unlinkSync(cache_filename);
+        }
+    }
+
+    // Share parsed headers with worker threads
+    {
+        let script = `
+            const koffi = require(${JSON.stringify(__dirname + '/build/koffi.node')});
+            const { parentPort } = require('worker_threads');
+
+            const lib = koffi.load(${JSON.stringify(lib_filename)});
+            const header = lib.declare(\`
+                typedef struct WorkerPack3 { int a; int b; int c; } WorkerPack3;
+                enum { WORKER_VALUE = 21 };
+                WorkerPack3 RetPack3(int a, int b, int c);
+            \`);
+
+            let stats = koffi.stats();
+
+            parentPort.postMessage({
+                pack: header.RetPack3(header.WORKER_VALUE, 2, 3),
+                size: koffi.sizeof('WorkerPack3'),
+                parsed: stats.parsed_headers,
+                shared: stats.shared_headers
+            });
+        `;
+
+        let run = () => new Promise((resolve, reject) => {
+            let worker = new worker_threads.Worker(script, { eval: true });
+
+            worker.on('message', resolve);
+            worker.on('error', reject);
+        });
+
+        // Only the first worker needs to parse the header
+        let first = await run();
+        let results = await Promise.all(Array.from({ length: 4 }, run));
+
+        assert.deepEqual(first, { pack: { a: 21, b: 2, c: 3 }, size: 12, parsed: 1, shared: 0 });
+        for (let result of results)
+            assert.deepEqual(result, { pack: { a: 21, b: 2, c: 3 }, size: 12, parsed: 0, shared: 1 });
+    }
+
+    // Reclaim unused anonymous types
+    {
+        v8.setFlagsFromString('--expose-gc');
+        const gc = vm.runInNewContext('gc');
+
+        let before = koffi.stats();
+
+        let RetAnonymous = (() => {
+            for (let i = 0; i < 1000; i++) {
+                let type = koffi.struct({ x: 'int', y: koffi.array('double', 4) });
+                koffi.pointer(type);
+            }
+
+            // The struct type is only referenced by the function after this
+            let type = koffi.struct({ a: 'int', b: 'int', c: 'int' });
+            return lib.func('RetPack3', type, ['int', 'int', 'int']);
+        })();
+
+        assert.ok(koffi.stats().types >= before.types + 3000);
+
+        for (let i = 0; i < 50 && koffi.stats().reclaimed_types < before.reclaimed_types + 3000; i++) {
+            gc();
+            await new Promise(resolve => setTimeout(resolve, 10));
+        }
+
+        let after = koffi.stats();
+
+        assert.ok(after.reclaimed_types >= before.reclaimed_types + 3000);
+        assert.ok(after.types < before.types + 100);
+        assert.equal(after.named_types, before.named_types);
+
+        assert.deepEqual(RetAnonymous(1, 2, 3), { a: 1, b: 2, c: 3 });
+        assert.equal(koffi.sizeof(koffi.struct({ x: 'int', y: koffi.array('double', 4) })), 40);
+    }
+
+    // Dropped functions release their types
+    {
+        const gc = vm.runInNewContext('gc');
+
+        let before = koffi.stats();
+
+        // Each disposable string type is anonymous, and only used by its function
+        (() => {
+            for (let i = 0; i < 200; i++)
+                lib.func('const char *! ReturnBigString(const char *str)');
+        })();
+
+        for (let i = 0; i < 50 && koffi.stats().reclaimed_types < before.reclaimed_types + 200; i++) {
+            gc();
+            await new Promise(resolve => setTimeout(resolve, 10));
+        }
+
+        assert.ok(koffi.stats().reclaimed_types >= before.reclaimed_types + 200);
+    }
+
+    // Pointers decoded from C do not pass for newer types after theirs is reclaimed
+    {
+        const gc = vm.runInNewContext('gc');
+
+        let before = koffi.stats();
+
+        let ptrs = (() => {
+            let ptrs = [];
+            for (let i = 0; i < 100; i++) {
+                let ReturnPtr = lib.func('ReturnBigString', koffi.pointer(koffi.struct({ x: 'int' })), ['const char *']);
+                ptrs.push(ReturnPtr('foo'));
+            }
+            return ptrs;
+        })();
+
+        for (let i = 0; i < 50 && koffi.stats().reclaimed_types < before.reclaimed_types + 200; i++) {
+            gc();
+            await new Promise(resolve => setTimeout(resolve, 10));
+        }
+        assert.ok(koffi.stats().reclaimed_types >= before.reclaimed_types + 200);
+
+        let accepted = 0;
+        for (let i = 0; i < 100; i++) {
+            let TakePtr = lib.func('ReturnBigString', 'const char *', [koffi.pointer(koffi.struct({ y: 'int' }))]);
+
+            for (let ptr of ptrs) {
+                try {
+                    TakePtr(ptr);
+                    accepted++;
+                } catch (err) {
+                    assert.match(err.message, /Unexpected/);
+                }
+            }
+        }
+        assert.equal(accepted, 0);
+    }
+
+    // Owned pointers are disposed by the garbage collector
+    {
+        const gc = vm.runInNewContext('gc');
+        const PrintFmtPtr = lib.func('void *PrintFmt(const char *fmt, ...)');
+
+        let before = koffi.stats();
+        let disposed = 0;
+
+        (() => {
+            for (let i = 0; i < 100; i++) {
+                let ptr = PrintFmtPtr('%d', 'int', i);
+
+                if (i % 2) {
+                    assert.strictEqual(koffi.own(ptr, ptr => { disposed++; koffi.free(ptr); }, 4096), ptr);
+                } else {
+                    assert.strictEqual(koffi.own(ptr, null, 4096), ptr);
+                }
+            }
+
+            let ptr = PrintFmtPtr('Hello');
+
+            koffi.own(ptr);
+            assert.throws(() => koffi.own(ptr), { message: /already owned/ });
+            assert.throws(() => koffi.free(ptr), { message: /Cannot free owned pointer/ });
+            assert.throws(() => koffi.own(ptr, 42), { message: /expected function/ });
+            assert.throws(() => koffi.own(null), { message: /expected external/ });
+
+            let stats = koffi.stats();
+            assert.equal(stats.owned_pointers, before.owned_pointers + 101);
+            assert.equal(stats.owned_memory, before.owned_memory + 100 * 4096);
+        })();
+
+        for (let i = 0; i < 50 && koffi.stats().owned_pointers > before.owned_pointers; i++) {
+            gc();
+            await new Promise(resolve => setTimeout(resolve, 10));
+        }
+
+        let after = koffi.stats();
+
+        assert.equal(after.owned_pointers, before.owned_pointers);
+        assert.equal(after.owned_memory, before.owned_memory);
+        assert.equal(disposed, 50);
+    }
+
+    // Owned pointer disposal runs outside of GC finalizers, and errors are reported
+    {
+        const gc = vm.runInNewContext('gc');
+        const PrintFmtPtr = lib.func('void *PrintFmt(const char *fmt, ...)');
+
+        let before = koffi.stats();
+        let errors = [];
+        let disposed = 0;
+
+        const handler = err => errors.push(err);
+        process.on('uncaughtException', handler);
+
+        try {
+            (() => {
+                for (let i = 0; i < 4; i++) {
+                    let ptr = PrintFmtPtr('%d', 'int', i);
+
+                    koffi.own(ptr, ptr => {
+                        disposed++;
+                        koffi.free(ptr);
+
+                        throw new Error('Dispose failure');
+                    });
+                }
+            })();
+
+            for (let i = 0; i < 50 && koffi.stats().owned_pointers > before.owned_pointers; i++) {
+                gc();
+                await new Promise(resolve => setTimeout(resolve, 10));
+            }
+        } finally {
+            process.off('uncaughtException', handler);
+        }
+
+        assert.equal(koffi.stats().owned_pointers, before.owned_pointers);
+        assert.equal(disposed, 4);
+        assert.ok(errors.length >= 1 && errors.every(err => err.message == 'Dispose failure'));
+
+        let arena = koffi.arena();
+        let ints = arena.alloc('int', 4);
+
+        assert.throws(() => koffi.own(ints), { message: /managed by Koffi/ });
+        assert.throws(() => koffi.free(ints), { message: /managed by Koffi/ });
+    }
+
+    // Arena allocations
+    {
+        let arena = koffi.arena(64);
+
+        let ints = arena.alloc('int', 4);
+        FillRange(3, 2, ints, 4);
+        assert.deepEqual(Array.from(ArrayToStruct(ints, 4).values.slice(0, 5)), [3, 5, 7, 9, 0]);
+
+        let ijk = arena.alloc('IJK4');
+        assert.equal(ConcatenateToStr4(5, 6, 1, 2, 3, 9, 4, 4, ijk, 7), '561239440007');
+
+        assert.throws(() => FillPack3(1, 2, 3, ijk), { message: /Unexpected IJK4 \* value/ });
+        assert.throws(() => arena.alloc('void'), { message: /zero-sized type/ });
+        assert.throws(() => arena.alloc('int', 0), { message: /Count must be/ });
+        assert.throws(() => koffi.arena(-1), { message: /Arena size must be/ });
+
+        // Overflowing allocations make the arena bigger on reset
+        arena.alloc('double', 64);
+        assert.deepEqual(arena.usage(), { size: 64, used: 28 + 512 + 8 });
+
+        arena.reset();
+        assert.deepEqual(arena.usage(), { size: 4096, used: 0 });
+
+        let ints2 = arena.alloc('int', 4);
+        assert.deepEqual(Array.from(ArrayToStruct(ints2, 4).values.slice(0, 4)), [0, 0, 0, 0]);
+        assert.deepEqual(arena.usage(), { size: 4096, used: 16 });
+    }
+
+    // Arena allocations keep their arena and their type alive
+    {
+        const gc = vm.runInNewContext('gc');
+
+        let churn = async () => {
+            let before = koffi.stats().reclaimed_types;
+
+            for (let i = 0; i < 50 && koffi.stats().reclaimed_types < before + 1000; i++) {
+                for (let j = 0; j < 100; j++)
+                    koffi.struct({ x: 'int' });
+                FillRange(-1, -1, koffi.arena(64).alloc('int', 4), 4);
+
+                gc();
+                await new Promise(resolve => setTimeout(resolve, 10));
+            }
+        };
+
+        let [ints, structs] = (() => {
+            let ints = koffi.arena(64).alloc('int', 4);
+            let structs = Array.from({ length: 100 }, () => koffi.arena(64).alloc(koffi.struct({ a: 'int', b: 'double' })));
+
+            FillRange(3, 2, ints, 4);
+
+            return [ints, structs];
+        })();
+
+        await churn();
+        assert.deepEqual(Array.from(ArrayToStruct(ints, 4).values.slice(0, 4)), [3, 5, 7, 9]);
+
+        // Types are only reclaimed once the allocations are gone
+        let types = koffi.stats().types;
+        structs = null;
+        await churn();
+        await churn();
+        assert.ok(koffi.stats().types <= types - 100);
+    }
+
+    // Reusable output buffers
+    {
+        let out = koffi.outbuf(Pack3);
+
+        FillPack3(1, 2, 3, out);
+        let pack = out.value;
+        assert.deepEqual(pack, { a: 1, b: 2, c: 3 });
+        assert.equal(out.value, pack);
+
+        // Records are updated in place
+        FillPack3(4, 5, 6, out);
+        assert.equal(out.value, pack);
+        assert.deepEqual(pack, { a: 4, b: 5, c: 6 });
+
+        AddPack3(1, 1, 1, out);
+        assert.deepEqual(out.value, { a: 5, b: 6, c: 7 });
+
+        let ints = koffi.outbuf(koffi.array('int', 4));
+        FillRange(3, 2, ints, 4);
+        assert.deepEqual(Array.from(ints.value), [3, 5, 7, 9]);
+        assert.deepEqual(Object.keys(ints), []);
+
+        assert.throws(() => FillPack2(1, 2, out), { message: /Cannot use Pack3 output buffer/ });
+        assert.throws(() => koffi.outbuf('void'), { message: /zero-sized type/ });
+    }
+
+    // Recycled heap blocks for big values
+    {
+        let big = Array.from(Array(2000).keys());
+        let str = 'fooBAR!'.repeat(320 * 1024); // Bigger than the sync heap
+
+        let before = koffi.stats();
+
+        for (let i = 0; i < 10; i++) {
+            assert.equal(ArrayToStruct(big, 3).len, 3);
+            assert.equal(ReturnBigString(str), str);
+        }
+
+        let after = koffi.stats();
+
+        assert.ok(after.heap_cache_hits >= before.heap_cache_hits + 18);
+        assert.ok(after.heap_cache_misses <= before.heap_cache_misses + 2);
+        assert.ok(after.heap_cache > 0 && after.heap_cache <= koffi.config().heap_cache_size);
+    }
+
+    // Per-function call statistics
+    {
+        assert.deepEqual(koffi.stats().functions, []);
+
+        koffi.stats(true);
+
+        let big = Array.from(Array(2000).keys());
+
+        for (let i = 0; i < 3; i++)
+            assert.equal(ArrayToStruct(big, 3).len, 3);
+        assert.equal(PrintFmt('%d', 'int', 42), '42');
+        await new Promise((resolve, reject) => {
+            ArrayToStruct.async([1, 2], 2, (err, res) => err ? reject(err) : resolve(res));
+        });
+
+        let stats = koffi.stats(false);
+
+        let array_to_struct = stats.functions.find(func => func.name == 'ArrayToStruct');
+        let print_fmt = stats.functions.find(func => func.name == 'PrintFmt');
+
+        assert.equal(stats.functions.length, 2);
+        assert.equal(array_to_struct.sync_calls, 3);
+        assert.equal(array_to_struct.async_calls, 1);
+        assert.equal(array_to_struct.heap_fallbacks, 3);
+        assert.ok(array_to_struct.prepare_time > 0 && array_to_struct.execute_time > 0);
+        assert.equal(print_fmt.sync_calls, 1);
+        assert.equal(print_fmt.trampolines, 0);
+
+        ArrayToStruct(big, 3);
+        assert.equal(koffi.stats().functions.find(func => func.name == 'ArrayToStruct').sync_calls, 3);
+        assert.deepEqual(koffi.stats(true).functions, []);
+        koffi.stats(false);
+    }
+
+    // Chrome trace events
+    {
+        koffi.trace(true);
+
+        assert.equal(ArrayToStruct([1, 2], 2).len, 2);
+        await new Promise((resolve, reject) => {
+            ArrayToStruct.async([1, 2], 2, (err, res) => err ? reject(err) : resolve(res));
+        });
+
+        let trace = JSON.parse(koffi.trace(false));
+        let events = trace.traceEvents.filter(evt => evt.name == 'ArrayToStruct');
+
+        assert.deepEqual(events.map(evt => evt.cat + ':' + evt.ph).sort(),
+                         ['koffi,async:b', 'koffi,async:e', 'koffi,call:X', 'koffi,complete:X', 'koffi,execute:X']);
+        assert.ok(events.every(evt => evt.pid == process.pid && evt.ts > 0));
+        assert.ok(events.find(evt => evt.cat == 'koffi,call').args.size > 0);
+
+        assert.equal(ArrayToStruct([1, 2], 2).len, 2);
+        assert.equal(JSON.parse(koffi.trace()).traceEvents.length, trace.traceEvents.length);
+
+        // Events from threads that have exited are kept
+        koffi.trace(true);
+
+        let script = `
+            const koffi = require(${JSON.stringify(__dirname + '/build/koffi.node')});
+
+            const lib = koffi.load(${JSON.stringify(lib_filename)});
+            const ThroughInt64II = lib.func('int64_t ThroughInt64II(int64_t v)');
+
+            for (let i = 0; i < 3; i++)
+                ThroughInt64II(i);
+        `;
+
+        await Promise.all(Array.from({ length: 4 }, () => new Promise((resolve, reject) => {
+            let worker = new worker_threads.Worker(script, { eval: true });
+
+            worker.on('exit', resolve);
+            worker.on('error', reject);
+        })));
+
+        let workers = JSON.parse(koffi.trace(false)).traceEvents.filter(evt => evt.name == 'ThroughInt64II');
+
+        assert.equal(workers.length, 12);
+    }
+
+    // Record and replay calls
+    {
+        let record_filename = path.join(os.tmpdir(), `koffi_record_${process.pid}.bin`);
+
+        try {
+            koffi.record(record_filename);
+
+            assert.equal(ThroughInt64II(-42), -42);
+            assert.equal(ConcatenateToInt1(5, 6, 1, 2, 3, 9, 4, 4, 0, 6, 8, 7), 561239440687n);
+            assert.equal(ArrayToStruct([1, 2, 3], 3).len, 3);
+            assert.equal(ConcatenateToStr1(1, 2, 3, 4, 5, 6, 7, 8, { i: 9, j: 0, k: 1 }, 2), '123456789012');
+            await new Promise((resolve, reject) => {
+                ArrayToStruct.async([4, 5], 2, (err, res) => err ? reject(err) : resolve(res));
+            });
+
+            // Native replay cannot use memory from this process
+            FillRange(1, 1, koffi.outbuf(koffi.array('int', 4)), 4);
+            FillRange(1, 1, koffi.arena().alloc('int', 4), 4);
+
+            koffi.record();
+            assert.equal(ThroughInt64II(1), 1);
+
+            let native = koffi.replay(record_filename);
+
+            assert.equal(native.calls, 7);
+            assert.equal(native.replayed, 5);
+            assert.equal(native.skipped, 2);
+            assert.equal(native.mismatches, 0);
+            assert.deepEqual(native.functions.map(func => func.name).sort(),
+                             ['ArrayToStruct', 'ConcatenateToInt1', 'ConcatenateToStr1', 'FillRange', 'ThroughInt64II']);
+
+            let js = koffi.replay(record_filename, {
+                ThroughInt64II: ThroughInt64II,
+                ConcatenateToInt1: ConcatenateToInt1,
+                ArrayToStruct: ArrayToStruct
+            });
+
+            assert.equal(js.calls, 7);
+            assert.equal(js.replayed, 4);
+            assert.equal(js.skipped, 3);
+            assert.equal(js.errors, 0);
+
+            assert.throws(() => koffi.replay(__filename), { message: /not a call record/ });
+
+            // Getters run once and can call other functions while recording
+            koffi.record(record_filename);
+            let getters = 0;
+            let ijk = { i: 9, get j() { getters++; return ThroughInt64II(0); }, k: 1 };
+            assert.equal(ConcatenateToStr1(1, 2, 3, 4, 5, 6, 7, 8, ijk, 2), '123456789012');
+            koffi.record();
+
+            assert.equal(getters, 2);
+            assert.equal(koffi.replay(record_filename).calls, 3);
+
+            // Corrupt return types must be rejected
+            let record = fs.readFileSync(record_filename);
+            let offset = 8 + 4;
+            let skip = () => { offset += 4 + record.readUInt32LE(offset); };
+
+            skip(); // ABI
+            assert.equal(record[offset], 1);
+            offset += 1 + 4;
+            skip(); skip(); skip(); // Module and names
+            offset += 8 + 1;
+
+            let corrupt = Buffer.from(record);
+            corrupt[offset] = 200;
+            fs.writeFileSync(record_filename, corrupt);
+            assert.throws(() => koffi.replay(record_filename), { message: /truncated or corrupt/ });
+
+            corrupt = Buffer.from(record);
+            corrupt.writeInt32LE(0x7FFFFFF0, offset + 1);
+            fs.writeFileSync(record_filename, corrupt);
+            assert.throws(() => koffi.replay(record_filename), { message: /truncated or corrupt/ });
+        } finally {
+            koffi.record();
+            fs.rmSync(record_filename, { force: true });
+        }
+    }
 }